@@ -28,6 +28,11 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdint.h>
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
 
 #include <event.h>
 
@@ -43,6 +48,17 @@
 # include "avio_evbuffer.h"
 #endif
 #include "artwork.h"
+#include "artwork_cache.h"
+
+
+/* Largest reduction of the box prefilter, and of the JPEG decoder (1/2^3) */
+#define ART_BOX_MAX     16
+#define ART_LOWRES_MAX  3
+/* Existing artwork files tried when the recorded one can't be used */
+#define ART_CANDIDATES_MAX  8
+
+/* Rounds up, as libavcodec does for lowres and chroma dimensions */
+#define ART_RSHIFT(a, b)  (-((-(a)) >> (b)))
 
 
 static const char *cover_extension[] =
@@ -95,6 +111,190 @@ artwork_read(char *filename, struct evbuffer *evbuf)
   return -1;
 }
 
+/* Adds a row of pixels to the column sums of the box prefilter */
+static void
+artwork_box_accumulate(uint16_t *acc, const uint8_t *src, int n)
+{
+  int i;
+#ifdef __SSE2__
+  __m128i zero;
+  __m128i v;
+#endif
+
+  i = 0;
+
+#ifdef __SSE2__
+  zero = _mm_setzero_si128();
+
+  for (; i + 16 <= n; i += 16)
+    {
+      v = _mm_loadu_si128((const __m128i *)(src + i));
+
+      _mm_storeu_si128((__m128i *)(acc + i),
+		       _mm_add_epi16(_mm_loadu_si128((const __m128i *)(acc + i)), _mm_unpacklo_epi8(v, zero)));
+      _mm_storeu_si128((__m128i *)(acc + i + 8),
+		       _mm_add_epi16(_mm_loadu_si128((const __m128i *)(acc + i + 8)), _mm_unpackhi_epi8(v, zero)));
+    }
+#endif
+
+  for (; i < n; i++)
+    acc[i] += src[i];
+}
+
+/* Averages f x f blocks of a plane of w x h pixels, bpp interleaved bytes
+ * each; blocks on the right and bottom edges may be partial.
+ * At most 16 x 16 sums of 8 bit values, so 16 bits for the column sums.
+ */
+static void
+artwork_box_plane(const uint8_t *src, int src_stride, int w, int h, int bpp, int f, uint8_t *dst, int dst_stride, uint16_t *acc)
+{
+  const uint16_t *col;
+  uint8_t *out;
+  uint32_t recip;
+  uint32_t sum;
+  int out_w;
+  int out_h;
+  int rows;
+  int cols;
+  int n;
+  int x;
+  int y;
+  int c;
+  int k;
+
+  out_w = (w + f - 1) / f;
+  out_h = (h + f - 1) / f;
+
+  /* 16.16 reciprocal for full blocks, saves a division per sample */
+  recip = ((1 << 16) + (f * f) / 2) / (f * f);
+
+  for (y = 0; y < out_h; y++)
+    {
+      rows = h - y * f;
+      if (rows > f)
+	rows = f;
+
+      memset(acc, 0, w * bpp * sizeof(uint16_t));
+
+      for (k = 0; k < rows; k++)
+	artwork_box_accumulate(acc, src + (y * f + k) * src_stride, w * bpp);
+
+      out = dst + y * dst_stride;
+
+      for (x = 0; x < out_w; x++)
+	{
+	  cols = w - x * f;
+	  if (cols > f)
+	    cols = f;
+
+	  n = rows * cols;
+
+	  for (c = 0; c < bpp; c++)
+	    {
+	      col = acc + x * f * bpp + c;
+
+	      sum = 0;
+	      for (k = 0; k < cols; k++)
+		sum += col[k * bpp];
+
+	      if (n == f * f)
+		out[x * bpp + c] = (sum * recip + 0x8000) >> 16;
+	      else
+		out[x * bpp + c] = (sum + n / 2) / n;
+	    }
+	}
+    }
+}
+
+/* Shrinks a decoded picture by f with a box filter before it goes to
+ * swscale, which then only has to resample a picture at most twice the
+ * output size. Returns the buffer backing pic, NULL if the pixel format
+ * isn't handled here or on error.
+ */
+static uint8_t *
+artwork_box_prefilter(AVFrame *in, enum PixelFormat pix_fmt, int w, int h, int f, AVPicture *pic)
+{
+  uint8_t *buf;
+  uint16_t *acc;
+  int planes;
+  int bpp;
+  int h_shift;
+  int v_shift;
+  int i;
+  int ret;
+
+  h_shift = 0;
+  v_shift = 0;
+
+  switch (pix_fmt)
+    {
+      case PIX_FMT_YUV420P:
+      case PIX_FMT_YUVJ420P:
+      case PIX_FMT_YUV422P:
+      case PIX_FMT_YUVJ422P:
+      case PIX_FMT_YUV444P:
+      case PIX_FMT_YUVJ444P:
+	avcodec_get_chroma_sub_sample(pix_fmt, &h_shift, &v_shift);
+	planes = 3;
+	bpp = 1;
+	break;
+
+      case PIX_FMT_GRAY8:
+	planes = 1;
+	bpp = 1;
+	break;
+
+      case PIX_FMT_RGB24:
+      case PIX_FMT_BGR24:
+	planes = 1;
+	bpp = 3;
+	break;
+
+      case PIX_FMT_RGBA:
+      case PIX_FMT_BGRA:
+      case PIX_FMT_ARGB:
+      case PIX_FMT_ABGR:
+	planes = 1;
+	bpp = 4;
+	break;
+
+      default:
+	return NULL;
+    }
+
+  ret = avpicture_get_size(pix_fmt, (w + f - 1) / f, (h + f - 1) / f);
+  if (ret < 0)
+    return NULL;
+
+  buf = (uint8_t *)av_malloc(ret);
+  acc = (uint16_t *)malloc(w * bpp * sizeof(uint16_t));
+  if (!buf || !acc)
+    {
+      DPRINTF(E_LOG, L_ART, "Out of memory for artwork prefilter\n");
+
+      if (buf)
+	av_free(buf);
+      if (acc)
+	free(acc);
+
+      return NULL;
+    }
+
+  avpicture_fill(pic, buf, pix_fmt, (w + f - 1) / f, (h + f - 1) / f);
+
+  artwork_box_plane(in->data[0], in->linesize[0], w, h, bpp, f, pic->data[0], pic->linesize[0], acc);
+
+  /* ceil(ceil(w / f) / 2^shift) == ceil(ceil(w / 2^shift) / f), so the
+   * chroma planes come out the size avpicture_fill() expects
+   */
+  for (i = 1; i < planes; i++)
+    artwork_box_plane(in->data[i], in->linesize[i], ART_RSHIFT(w, h_shift), ART_RSHIFT(h, v_shift), bpp, f, pic->data[i], pic->linesize[i], acc);
+
+  free(acc);
+
+  return buf;
+}
+
 static int
 artwork_rescale(AVFormatContext *src_ctx, int s, int out_w, int out_h, int format, struct evbuffer *evbuf)
 {
@@ -117,6 +317,15 @@ artwork_rescale(AVFormatContext *src_ctx, int s, int out_w, int out_h, int forma
   AVFrame *i_frame;
   AVFrame *o_frame;
 
+  AVPicture p_pic;
+  uint8_t *p_buf;
+  const uint8_t * const *in_data;
+  const int *in_linesize;
+  int in_w;
+  int in_h;
+  int lowres;
+  int f;
+
   struct SwsContext *swsctx;
 
   AVPacket pkt;
@@ -136,6 +345,23 @@ artwork_rescale(AVFormatContext *src_ctx, int s, int out_w, int out_h, int forma
       return -1;
     }
 
+  /* The JPEG decoder can skip DCT coefficients and decode straight to 1/2,
+   * 1/4 or 1/8 of the size; pick the largest reduction that doesn't go
+   * below the output size
+   */
+  lowres = 0;
+  if (src->codec_id == CODEC_ID_MJPEG)
+    {
+      while ((lowres < img_decoder->max_lowres) && (lowres < ART_LOWRES_MAX)
+	     && (ART_RSHIFT(src->width, lowres + 1) >= out_w) && (ART_RSHIFT(src->height, lowres + 1) >= out_h))
+	lowres++;
+
+      if (lowres > 0)
+	DPRINTF(E_DBG, L_ART, "Decoding artwork %dx%d at 1/%d size\n", src->width, src->height, 1 << lowres);
+    }
+
+  src->lowres = lowres;
+
 #if LIBAVCODEC_VERSION_MAJOR >= 54 || (LIBAVCODEC_VERSION_MAJOR == 53 && LIBAVCODEC_VERSION_MINOR >= 6)
   ret = avcodec_open2(src, img_decoder, NULL);
 #else
@@ -306,7 +532,7 @@ artwork_rescale(AVFormatContext *src_ctx, int s, int out_w, int out_h, int forma
       goto out_free_frames;
     }
 
-  ret = avpicture_get_size(dst->pix_fmt, src->width, src->height);
+  ret = avpicture_get_size(dst->pix_fmt, dst->width, dst->height);
 
   DPRINTF(E_DBG, L_ART, "Artwork buffer size: %d\n", ret);
 
@@ -319,20 +545,13 @@ artwork_rescale(AVFormatContext *src_ctx, int s, int out_w, int out_h, int forma
       goto out_free_frames;
     }
 
-  avpicture_fill((AVPicture *)o_frame, buf, dst->pix_fmt, src->width, src->height);
-
-  swsctx = sws_getContext(src->width, src->height, src->pix_fmt,
-			  dst->width, dst->height, dst->pix_fmt,
-			  SWS_BICUBIC, NULL, NULL, NULL);
-  if (!swsctx)
-    {
-      DPRINTF(E_LOG, L_ART, "Could not get SWS context\n");
-
-      ret = -1;
-      goto out_free_buf;
-    }
+  avpicture_fill((AVPicture *)o_frame, buf, dst->pix_fmt, dst->width, dst->height);
 
   /* Get frame */
+  av_init_packet(&pkt);
+  pkt.data = NULL;
+  pkt.size = 0;
+
   have_frame = 0;
   while (av_read_frame(src_ctx, &pkt) == 0)
     {
@@ -352,12 +571,81 @@ artwork_rescale(AVFormatContext *src_ctx, int s, int out_w, int out_h, int forma
       break;
     }
 
+  /* Not all JPEGs decode at a reduced size (progressive, lossless with
+   * some decoder versions); go again at full size
+   */
+  if (!have_frame && (lowres > 0) && pkt.data)
+    {
+      DPRINTF(E_DBG, L_ART, "Reduced size decoding failed for %s, retrying at full size\n", src_ctx->filename);
+
+      avcodec_close(src);
+      src->lowres = 0;
+
+#if LIBAVCODEC_VERSION_MAJOR >= 54 || (LIBAVCODEC_VERSION_MAJOR == 53 && LIBAVCODEC_VERSION_MINOR >= 6)
+      ret = avcodec_open2(src, img_decoder, NULL);
+#else
+      ret = avcodec_open(src, img_decoder);
+#endif
+      if (ret == 0)
+	{
+#if LIBAVCODEC_VERSION_MAJOR >= 53 || (LIBAVCODEC_VERSION_MAJOR == 52 && LIBAVCODEC_VERSION_MINOR >= 32)
+	  avcodec_decode_video2(src, i_frame, &have_frame, &pkt);
+#else
+	  avcodec_decode_video(src, i_frame, &have_frame, pkt.data, pkt.size);
+#endif
+	}
+    }
+
   if (!have_frame)
     {
       DPRINTF(E_LOG, L_ART, "Could not decode artwork\n");
 
       av_free_packet(&pkt);
-      sws_freeContext(swsctx);
+
+      ret = -1;
+      goto out_free_buf;
+    }
+
+  /* The decoder updated the dimensions if it decoded at a reduced size */
+  in_data = (const uint8_t * const *)i_frame->data;
+  in_linesize = i_frame->linesize;
+  in_w = src->width;
+  in_h = src->height;
+
+  /* Bicubic scaling by large factors is slow and aliases; average the
+   * picture down to between 2x and 4x the output size first
+   */
+  f = in_w / (2 * out_w);
+  if (in_h / (2 * out_h) < f)
+    f = in_h / (2 * out_h);
+  if (f > ART_BOX_MAX)
+    f = ART_BOX_MAX;
+
+  p_buf = NULL;
+  if (f >= 2)
+    {
+      p_buf = artwork_box_prefilter(i_frame, src->pix_fmt, in_w, in_h, f, &p_pic);
+      if (p_buf)
+	{
+	  DPRINTF(E_DBG, L_ART, "Box prefilter %dx%d by 1/%d\n", in_w, in_h, f);
+
+	  in_data = (const uint8_t * const *)p_pic.data;
+	  in_linesize = p_pic.linesize;
+	  in_w = (in_w + f - 1) / f;
+	  in_h = (in_h + f - 1) / f;
+	}
+    }
+
+  swsctx = sws_getContext(in_w, in_h, src->pix_fmt,
+			  dst->width, dst->height, dst->pix_fmt,
+			  SWS_BICUBIC, NULL, NULL, NULL);
+  if (!swsctx)
+    {
+      DPRINTF(E_LOG, L_ART, "Could not get SWS context\n");
+
+      if (p_buf)
+	av_free(p_buf);
+      av_free_packet(&pkt);
 
       ret = -1;
       goto out_free_buf;
@@ -366,12 +654,14 @@ artwork_rescale(AVFormatContext *src_ctx, int s, int out_w, int out_h, int forma
   /* Scale */
 #if LIBSWSCALE_VERSION_MAJOR >= 1 || (LIBSWSCALE_VERSION_MAJOR == 0 && LIBSWSCALE_VERSION_MINOR >= 9)
   /* FFmpeg 0.6, libav 0.6+ */
-  sws_scale(swsctx, (const uint8_t * const *)i_frame->data, i_frame->linesize, 0, src->height, o_frame->data, o_frame->linesize);
+  sws_scale(swsctx, in_data, in_linesize, 0, in_h, o_frame->data, o_frame->linesize);
 #else
-  sws_scale(swsctx, i_frame->data, i_frame->linesize, 0, src->height, o_frame->data, o_frame->linesize);
+  sws_scale(swsctx, (uint8_t **)in_data, (int *)in_linesize, 0, in_h, o_frame->data, o_frame->linesize);
 #endif
 
   sws_freeContext(swsctx);
+  if (p_buf)
+    av_free(p_buf);
   av_free_packet(&pkt);
 
   /* Open output file */
@@ -517,7 +807,7 @@ artwork_rescale(AVFormatContext *src_ctx, int s, int out_w, int out_h, int forma
 }
 
 static int
-artwork_get(char *filename, int max_w, int max_h, int format, struct evbuffer *evbuf)
+artwork_render(char *filename, int max_w, int max_h, int format, struct evbuffer *evbuf)
 {
   AVFormatContext *src_ctx;
   AVCodecContext *src;
@@ -528,8 +818,6 @@ artwork_get(char *filename, int max_w, int max_h, int format, struct evbuffer *e
   int format_ok;
   int ret;
 
-  DPRINTF(E_DBG, L_ART, "Artwork request parameters: max w = %d, max h = %d\n", max_w, max_h);
-
   src_ctx = NULL;
 
 #if LIBAVFORMAT_VERSION_MAJOR >= 53 || (LIBAVFORMAT_VERSION_MAJOR == 53 && LIBAVFORMAT_VERSION_MINOR >= 3)
@@ -656,18 +944,47 @@ artwork_get(char *filename, int max_w, int max_h, int format, struct evbuffer *e
   return ret;
 }
 
+static int
+artwork_get(char *filename, int max_w, int max_h, int format, struct evbuffer *evbuf)
+{
+  struct stat sb;
+  int ret;
+
+  DPRINTF(E_DBG, L_ART, "Artwork request parameters: max w = %d, max h = %d\n", max_w, max_h);
+
+  ret = stat(filename, &sb);
+  if (ret < 0)
+    {
+      DPRINTF(E_WARN, L_ART, "Could not stat() artwork file '%s': %s\n", filename, strerror(errno));
+
+      return -1;
+    }
+
+  ret = artwork_cache_get(filename, &sb, max_w, max_h, format, evbuf);
+  if (ret > 0)
+    return ret;
+
+  ret = artwork_render(filename, max_w, max_h, format, evbuf);
+  if (ret > 0)
+    artwork_cache_add(filename, &sb, max_w, max_h, format, ret, 0, evbuf);
+
+  return ret;
+}
+
 
+/* Artwork sources; artwork must be PATH_MAX long. The first *skip
+ * existing files are passed over, and *skip is decremented for each.
+ */
 static int
-artwork_get_own_image(char *path, int max_w, int max_h, int format, struct evbuffer *evbuf)
+artwork_find_own_image(char *path, int *skip, char *artwork)
 {
-  char artwork[PATH_MAX];
   char *ptr;
   int len;
   int i;
   int ret;
 
-  ret = snprintf(artwork, sizeof(artwork), "%s", path);
-  if ((ret < 0) || (ret >= sizeof(artwork)))
+  ret = snprintf(artwork, PATH_MAX, "%s", path);
+  if ((ret < 0) || (ret >= PATH_MAX))
     {
       DPRINTF(E_INFO, L_ART, "Artwork path exceeds PATH_MAX\n");
 
@@ -682,8 +999,8 @@ artwork_get_own_image(char *path, int max_w, int max_h, int format, struct evbuf
 
   for (i = 0; i < (sizeof(cover_extension) / sizeof(cover_extension[0])); i++)
     {
-      ret = snprintf(artwork + len, sizeof(artwork) - len, ".%s", cover_extension[i]);
-      if ((ret < 0) || (ret >= sizeof(artwork) - len))
+      ret = snprintf(artwork + len, PATH_MAX - len, ".%s", cover_extension[i]);
+      if ((ret < 0) || (ret >= PATH_MAX - len))
 	{
 	  DPRINTF(E_INFO, L_ART, "Artwork path exceeds PATH_MAX (ext %s)\n", cover_extension[i]);
 
@@ -696,19 +1013,24 @@ artwork_get_own_image(char *path, int max_w, int max_h, int format, struct evbuf
       if (ret < 0)
 	continue;
 
+      if (*skip > 0)
+	{
+	  (*skip)--;
+	  continue;
+	}
+
       break;
     }
 
   if (i == (sizeof(cover_extension) / sizeof(cover_extension[0])))
     return -1;
 
-  return artwork_get(artwork, max_w, max_h, format, evbuf);
+  return 0;
 }
 
 static int
-artwork_get_dir_image(char *path, int isdir, int max_w, int max_h, int format, struct evbuffer *evbuf)
+artwork_find_dir_image(char *path, int isdir, int *skip, char *artwork)
 {
-  char artwork[PATH_MAX];
   char *ptr;
   int i;
   int j;
@@ -717,8 +1039,8 @@ artwork_get_dir_image(char *path, int isdir, int max_w, int max_h, int format, s
   cfg_t *lib;
   int nbasenames;
 
-  ret = snprintf(artwork, sizeof(artwork), "%s", path);
-  if ((ret < 0) || (ret >= sizeof(artwork)))
+  ret = snprintf(artwork, PATH_MAX, "%s", path);
+  if ((ret < 0) || (ret >= PATH_MAX))
     {
       DPRINTF(E_INFO, L_ART, "Artwork path exceeds PATH_MAX\n");
 
@@ -744,8 +1066,8 @@ artwork_get_dir_image(char *path, int isdir, int max_w, int max_h, int format, s
     {
       for (j = 0; j < (sizeof(cover_extension) / sizeof(cover_extension[0])); j++)
 	{
-	  ret = snprintf(artwork + len, sizeof(artwork) - len, "/%s.%s", cfg_getnstr(lib, "artwork_basenames", i), cover_extension[j]);
-	  if ((ret < 0) || (ret >= sizeof(artwork) - len))
+	  ret = snprintf(artwork + len, PATH_MAX - len, "/%s.%s", cfg_getnstr(lib, "artwork_basenames", i), cover_extension[j]);
+	  if ((ret < 0) || (ret >= PATH_MAX - len))
 	    {
 	      DPRINTF(E_INFO, L_ART, "Artwork path exceeds PATH_MAX (%s.%s)\n", cfg_getnstr(lib, "artwork_basenames", i), cover_extension[j]);
 
@@ -758,6 +1080,12 @@ artwork_get_dir_image(char *path, int isdir, int max_w, int max_h, int format, s
 	  if (ret < 0)
 	    continue;
 
+	  if (*skip > 0)
+	    {
+	      (*skip)--;
+	      continue;
+	    }
+
 	  break;
 	}
 
@@ -768,21 +1096,20 @@ artwork_get_dir_image(char *path, int isdir, int max_w, int max_h, int format, s
   if (i == nbasenames)
     return -1;
 
-  return artwork_get(artwork, max_w, max_h, format, evbuf);
+  return 0;
 }
 
 static int
-artwork_get_parentdir_image(char *path, int isdir, int max_w, int max_h, int format, struct evbuffer *evbuf)
+artwork_find_parentdir_image(char *path, int isdir, int *skip, char *artwork)
 {
-  char artwork[PATH_MAX];
   char parentdir[PATH_MAX];
   char *ptr;
   int len;
   int i;
   int ret;
 
-  ret = snprintf(artwork, sizeof(artwork), "%s", path);
-  if ((ret < 0) || (ret >= sizeof(artwork)))
+  ret = snprintf(artwork, PATH_MAX, "%s", path);
+  if ((ret < 0) || (ret >= PATH_MAX))
     {
       DPRINTF(E_INFO, L_ART, "Artwork path exceeds PATH_MAX\n");
 
@@ -805,8 +1132,8 @@ artwork_get_parentdir_image(char *path, int isdir, int max_w, int max_h, int for
 
   for (i = 0; i < (sizeof(cover_extension) / sizeof(cover_extension[0])); i++)
     {
-      ret = snprintf(artwork + len, sizeof(artwork) - len, "/%s.%s", parentdir, cover_extension[i]);
-      if ((ret < 0) || (ret >= sizeof(artwork) - len))
+      ret = snprintf(artwork + len, PATH_MAX - len, "/%s.%s", parentdir, cover_extension[i]);
+      if ((ret < 0) || (ret >= PATH_MAX - len))
 	{
 	  DPRINTF(E_INFO, L_ART, "Artwork path exceeds PATH_MAX (%s.%s)\n", parentdir, cover_extension[i]);
 
@@ -819,74 +1146,62 @@ artwork_get_parentdir_image(char *path, int isdir, int max_w, int max_h, int for
       if (ret < 0)
 	continue;
 
+      if (*skip > 0)
+	{
+	  (*skip)--;
+	  continue;
+	}
+
       break;
     }
 
   if (i == (sizeof(cover_extension) / sizeof(cover_extension[0])))
     return -1;
 
-  return artwork_get(artwork, max_w, max_h, format, evbuf);
+  return 0;
 }
 
 
-
+/* Finds the artwork file for a media file, skipping the first skip
+ * candidates that exist; returns 0 if found
+ */
 int
-artwork_get_item_filename(char *filename, int max_w, int max_h, int format, struct evbuffer *evbuf)
+artwork_find_item(char *filename, int skip, char *artwork)
 {
   int ret;
 
   /* FUTURE: look at embedded artwork */
 
   /* Look for basename(filename).{png,jpg} */
-  ret = artwork_get_own_image(filename, max_w, max_h, format, evbuf);
-  if (ret > 0)
-    return ret;
+  ret = artwork_find_own_image(filename, &skip, artwork);
+  if (ret == 0)
+    return 0;
 
   /* Look for basedir(filename)/{artwork,cover}.{png,jpg} */
-  ret = artwork_get_dir_image(filename, 0, max_w, max_h, format, evbuf);
-  if (ret > 0)
-    return ret;
+  ret = artwork_find_dir_image(filename, 0, &skip, artwork);
+  if (ret == 0)
+    return 0;
 
   /* Look for parentdir(filename).{png,jpg} */
-  ret = artwork_get_parentdir_image(filename, 0, max_w, max_h, format, evbuf);
-  if (ret > 0)
-    return ret;
+  ret = artwork_find_parentdir_image(filename, 0, &skip, artwork);
+  if (ret == 0)
+    return 0;
 
   return -1;
 }
 
+/* Finds the artwork file for an album group, skipping the first skip
+ * candidates that exist; returns 0 if found
+ */
 int
-artwork_get_item(int id, int max_w, int max_h, int format, struct evbuffer *evbuf)
-{
-  char *filename;
-  int ret;
-
-  DPRINTF(E_DBG, L_ART, "Artwork request for item %d\n", id);
-
-  filename = db_file_path_byid(id);
-  if (!filename)
-    return -1;
-
-  ret = artwork_get_item_filename(filename, max_w, max_h, format, evbuf);
-  if (ret < 0)
-    DPRINTF(E_DBG, L_ART, "No artwork found for item id %d\n", id);
-
-  free(filename);
-
-  return ret;
-}
-
-int
-artwork_get_group(int id, int max_w, int max_h, int format, struct evbuffer *evbuf)
+artwork_find_group(int id, int skip, char *artwork)
 {
   struct query_params qp;
   struct db_media_file_info dbmfi;
   char *dir;
-  int got_art;
+  int found;
   int ret;
 
-  DPRINTF(E_DBG, L_ART, "Artwork request for group %d\n", id);
-
   /* Try directory artwork first */
   memset(&qp, 0, sizeof(struct query_params));
 
@@ -902,20 +1217,20 @@ artwork_get_group(int id, int max_w, int max_h, int format, struct evbuffer *evb
       goto files_art;
     }
 
-  got_art = -1;
-  while ((got_art < 0) && ((ret = db_query_fetch_string(&qp, &dir)) == 0) && (dir))
+  found = -1;
+  while ((found < 0) && ((ret = db_query_fetch_string(&qp, &dir)) == 0) && (dir))
     {
-      got_art = artwork_get_dir_image(dir, 1, max_w, max_h, format, evbuf);
-      if (got_art < 0)
-        got_art = artwork_get_parentdir_image(dir, 1, max_w, max_h, format, evbuf);
+      found = artwork_find_dir_image(dir, 1, &skip, artwork);
+      if (found < 0)
+        found = artwork_find_parentdir_image(dir, 1, &skip, artwork);
     }
 
   db_query_end(&qp);
 
   if (ret < 0)
     DPRINTF(E_LOG, L_ART, "Error fetching Q_GROUP_DIRS results\n");
-  else if (got_art > 0)
-    return got_art;
+  else if (found == 0)
+    return 0;
 
 
   /* Then try individual files */
@@ -933,18 +1248,195 @@ artwork_get_group(int id, int max_w, int max_h, int format, struct evbuffer *evb
       return -1;
     }
 
-  got_art = -1;
-  while ((got_art < 0) && ((ret = db_query_fetch_file(&qp, &dbmfi)) == 0) && (dbmfi.id))
+  found = -1;
+  while ((found < 0) && ((ret = db_query_fetch_file(&qp, &dbmfi)) == 0) && (dbmfi.id))
     {
-      got_art = artwork_get_own_image(dbmfi.path, max_w, max_h, format, evbuf);
+      found = artwork_find_own_image(dbmfi.path, &skip, artwork);
     }
 
   db_query_end(&qp);
 
   if (ret < 0)
     DPRINTF(E_LOG, L_ART, "Error fetching Q_GROUP_ITEMS results\n");
-  else if (got_art > 0)
-    return got_art;
+  else if (found == 0)
+    return 0;
 
   return -1;
 }
+
+/* Looks up the artwork file of an item or group on disk */
+static int
+artwork_find(enum artwork_source type, int id, int skip, char *artwork)
+{
+  char *path;
+  int ret;
+
+  if (type == ART_SOURCE_GROUP)
+    return artwork_find_group(id, skip, artwork);
+
+  path = db_file_path_byid(id);
+  if (!path)
+    return -1;
+
+  ret = artwork_find_item(path, skip, artwork);
+  free(path);
+
+  return ret;
+}
+
+/* The artwork file of an item or group, as found by the scanner if it's
+ * been there, otherwise (or to refresh a stale entry) looked up and recorded
+ */
+static int
+artwork_source(enum artwork_source type, int id, int refresh, char *artwork)
+{
+  char *path;
+  int ret;
+
+  if (!refresh)
+    {
+      ret = db_artwork_source_get(type, id, &path);
+      if (ret == 0)
+	{
+	  /* Known not to have any */
+	  if (!path)
+	    return -1;
+
+	  ret = snprintf(artwork, PATH_MAX, "%s", path);
+	  free(path);
+
+	  if ((ret > 0) && (ret < PATH_MAX))
+	    return 0;
+	}
+    }
+
+  ret = artwork_find(type, id, 0, artwork);
+
+  db_artwork_source_set(type, id, (ret == 0) ? artwork : NULL);
+
+  return ret;
+}
+
+static int
+artwork_get_source(enum artwork_source type, int id, int max_w, int max_h, int format, struct evbuffer *evbuf)
+{
+  char artwork[PATH_MAX];
+  char candidate[PATH_MAX];
+  int skip;
+  int ret;
+
+  ret = artwork_source(type, id, 0, artwork);
+  if (ret < 0)
+    return -1;
+
+  ret = artwork_get(artwork, max_w, max_h, format, evbuf);
+  if (ret > 0)
+    return ret;
+
+  /* The index may be stale, or the file may not decode: go through the
+   * files that exist, in order of preference, until one renders
+   */
+  for (skip = 0; skip < ART_CANDIDATES_MAX; skip++)
+    {
+      ret = artwork_find(type, id, skip, candidate);
+      if (ret < 0)
+	break;
+
+      if (strcmp(candidate, artwork) == 0)
+	continue;
+
+      ret = artwork_get(candidate, max_w, max_h, format, evbuf);
+      if (ret <= 0)
+	continue;
+
+      DPRINTF(E_DBG, L_ART, "Artwork source of %s %d changed to %s\n", (type == ART_SOURCE_GROUP) ? "group" : "item", id, candidate);
+
+      db_artwork_source_set(type, id, candidate);
+
+      return ret;
+    }
+
+  /* Nothing renders; remember it until the directory changes, as for items
+   * without any image, so later requests don't go through it all again
+   */
+  DPRINTF(E_DBG, L_ART, "No usable artwork left for %s %d\n", (type == ART_SOURCE_GROUP) ? "group" : "item", id);
+
+  db_artwork_source_set(type, id, NULL);
+
+  return -1;
+}
+
+
+int
+artwork_get_item_filename(char *filename, int max_w, int max_h, int format, struct evbuffer *evbuf)
+{
+  char artwork[PATH_MAX];
+  int ret;
+
+  ret = artwork_find_item(filename, 0, artwork);
+  if (ret < 0)
+    return -1;
+
+  return artwork_get(artwork, max_w, max_h, format, evbuf);
+}
+
+int
+artwork_get_item(int id, int max_w, int max_h, int format, struct evbuffer *evbuf)
+{
+  int ret;
+
+  DPRINTF(E_DBG, L_ART, "Artwork request for item %d\n", id);
+
+  ret = artwork_get_source(ART_SOURCE_ITEM, id, max_w, max_h, format, evbuf);
+  if (ret < 0)
+    DPRINTF(E_DBG, L_ART, "No artwork found for item id %d\n", id);
+
+  return ret;
+}
+
+int
+artwork_get_group(int id, int max_w, int max_h, int format, struct evbuffer *evbuf)
+{
+  DPRINTF(E_DBG, L_ART, "Artwork request for group %d\n", id);
+
+  return artwork_get_source(ART_SOURCE_GROUP, id, max_w, max_h, format, evbuf);
+}
+
+/* Renders the artwork of a group into the disk cache, unless it's there
+ * already; returns 0 if the group has artwork
+ */
+int
+artwork_prerender_group(int id, int max_w, int max_h, int format)
+{
+  char artwork[PATH_MAX];
+  struct evbuffer *evbuf;
+  struct stat sb;
+  int ret;
+
+  ret = artwork_source(ART_SOURCE_GROUP, id, 0, artwork);
+  if (ret < 0)
+    return -1;
+
+  ret = stat(artwork, &sb);
+  if (ret < 0)
+    return -1;
+
+  if (artwork_cache_stored(artwork, &sb, max_w, max_h, format))
+    return 0;
+
+  evbuf = evbuffer_new();
+  if (!evbuf)
+    {
+      DPRINTF(E_LOG, L_ART, "Out of memory for artwork evbuffer\n");
+
+      return -1;
+    }
+
+  ret = artwork_render(artwork, max_w, max_h, format, evbuf);
+  if (ret > 0)
+    artwork_cache_add(artwork, &sb, max_w, max_h, format, ret, ART_CACHE_DISK_ONLY, evbuf);
+
+  evbuffer_free(evbuf);
+
+  return (ret > 0) ? 0 : -1;
+}
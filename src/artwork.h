@@ -9,6 +9,12 @@
 #define ART_FMT_JPEG    2
 
 
+int
+artwork_find_item(char *filename, int skip, char *artwork);
+
+int
+artwork_find_group(int id, int skip, char *artwork);
+
 int
 artwork_get_item_filename(char *filename, int max_w, int max_h, int format, struct evbuffer *evbuf);
 
@@ -18,4 +24,7 @@ artwork_get_item(int id, int max_w, int max_h, int format, struct evbuffer *evbu
 int
 artwork_get_group(int id, int max_w, int max_h, int format, struct evbuffer *evbuf);
 
+int
+artwork_prerender_group(int id, int max_w, int max_h, int format);
+
 #endif /* !__ARTWORK_H__ */
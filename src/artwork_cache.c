@@ -0,0 +1,1163 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Cache of rendered artwork
+ *
+ * Artwork is rendered (probed, decoded, scaled and encoded) for a source
+ * image and the maximum size and formats asked for by the client. The
+ * result is kept in memory, least recently used first out once over
+ * artwork_cache_memory MB, and written to artwork_cache_dir, which is
+ * trimmed to artwork_cache_size MB the same way.
+ *
+ * Entries are keyed on the source path, its modification time and size,
+ * and the request parameters, so a changed image never hits a stale
+ * entry. Entries are reference counted and handed out as evbuffer
+ * references; serving a cached image doesn't copy it.
+ *
+ * Files in the disk tier are named after the hash of the key and start
+ * with the full key, checked on load, so a hash collision is a miss. They
+ * are written, and the directory trimmed, by the artwork cache thread.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <event.h>
+
+#include "logger.h"
+#include "conffile.h"
+#include "artwork.h"
+#include "artwork_cache.h"
+
+
+#define ART_CACHE_BUCKETS  256
+
+/* Entries waiting for the disk; more are not stored */
+#define ART_DISK_QUEUE_MAX  64
+
+/* Disk file header: magic, then mtime and size (64 bits), max_w, max_h,
+ * format, fmt and the length of the path (32 bits), all little endian,
+ * then the path and the image
+ */
+#define ART_DISK_MAGIC      "FAC1"
+#define ART_DISK_HEADER     (4 + 2 * 8 + 5 * 4)
+
+struct artwork_entry {
+  uint64_t hash;
+
+  /* Key */
+  char *path;
+  time_t mtime;
+  off_t size;
+  int max_w;
+  int max_h;
+  int format;
+
+  /* Rendered image, ART_FMT_* */
+  int fmt;
+  uint8_t *data;
+  size_t len;
+
+  /* One for the cache, one per evbuffer holding the data */
+  int refcount;
+
+  struct artwork_entry *hnext;
+
+  /* Queue to the disk */
+  struct artwork_entry *qnext;
+
+  /* LRU list, most recent first */
+  struct artwork_entry *prev;
+  struct artwork_entry *next;
+};
+
+struct cache_file {
+  char name[NAME_MAX + 1];
+  time_t mtime;
+  off_t size;
+};
+
+
+static pthread_mutex_t cache_lck = PTHREAD_MUTEX_INITIALIZER;
+static struct artwork_entry *buckets[ART_CACHE_BUCKETS];
+static struct artwork_entry *lru_head;
+static struct artwork_entry *lru_tail;
+static size_t mem_size;
+static size_t mem_max_size;
+
+static char *cache_dir;
+static off_t disk_max_size;
+/* Only used by the artwork cache thread */
+static off_t disk_size;
+
+static pthread_t tid_disk;
+static pthread_mutex_t disk_lck = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t disk_cond = PTHREAD_COND_INITIALIZER;
+static struct artwork_entry *disk_queue;
+static struct artwork_entry *disk_queue_tail;
+static int disk_queued;
+static int disk_trim_pending;
+static int disk_exit;
+
+static int cache_enabled;
+
+
+/* FNV-1a */
+static uint64_t
+hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+  const uint8_t *p;
+  size_t i;
+
+  p = (const uint8_t *)data;
+  for (i = 0; i < len; i++)
+    {
+      hash ^= p[i];
+      hash *= 0x100000001b3ULL;
+    }
+
+  return hash;
+}
+
+static uint64_t
+key_hash(char *path, struct stat *sb, int max_w, int max_h, int format)
+{
+  uint64_t hash;
+  int64_t val;
+
+  hash = hash_bytes(0xcbf29ce484222325ULL, path, strlen(path));
+
+  val = sb->st_mtime;
+  hash = hash_bytes(hash, &val, sizeof(val));
+  val = sb->st_size;
+  hash = hash_bytes(hash, &val, sizeof(val));
+  val = ((int64_t)max_w << 32) | ((int64_t)max_h << 8) | format;
+  hash = hash_bytes(hash, &val, sizeof(val));
+
+  return hash;
+}
+
+static int
+key_match(struct artwork_entry *e, uint64_t hash, char *path, struct stat *sb, int max_w, int max_h, int format)
+{
+  return ((e->hash == hash)
+	  && (e->mtime == sb->st_mtime)
+	  && (e->size == sb->st_size)
+	  && (e->max_w == max_w)
+	  && (e->max_h == max_h)
+	  && (e->format == format)
+	  && (strcmp(e->path, path) == 0));
+}
+
+/* Disk file header */
+
+static void
+put_le32(uint8_t *dst, uint32_t val)
+{
+  dst[0] = val & 0xff;
+  dst[1] = (val >> 8) & 0xff;
+  dst[2] = (val >> 16) & 0xff;
+  dst[3] = (val >> 24) & 0xff;
+}
+
+static uint32_t
+get_le32(const uint8_t *src)
+{
+  return (uint32_t)src[0] | ((uint32_t)src[1] << 8) | ((uint32_t)src[2] << 16) | ((uint32_t)src[3] << 24);
+}
+
+static void
+put_le64(uint8_t *dst, uint64_t val)
+{
+  put_le32(dst, val & 0xffffffff);
+  put_le32(dst + 4, val >> 32);
+}
+
+static uint64_t
+get_le64(const uint8_t *src)
+{
+  return (uint64_t)get_le32(src) | ((uint64_t)get_le32(src + 4) << 32);
+}
+
+/* Fills in the header for e, which is ART_DISK_HEADER plus the path long */
+static void
+disk_header_make(struct artwork_entry *e, uint8_t *hdr)
+{
+  size_t plen;
+
+  plen = strlen(e->path);
+
+  memcpy(hdr, ART_DISK_MAGIC, 4);
+  put_le64(hdr + 4, (int64_t)e->mtime);
+  put_le64(hdr + 12, (int64_t)e->size);
+  put_le32(hdr + 20, e->max_w);
+  put_le32(hdr + 24, e->max_h);
+  put_le32(hdr + 28, e->format);
+  put_le32(hdr + 32, e->fmt);
+  put_le32(hdr + 36, plen);
+  memcpy(hdr + ART_DISK_HEADER, e->path, plen);
+}
+
+/* Checks the header in data against the key; returns the length of the
+ * header with the image format in fmt, 0 if it's for another key (hash
+ * collision) or -1 if the file is invalid
+ */
+static int
+disk_header_check(uint8_t *data, size_t len, char *path, struct stat *sb, int max_w, int max_h, int format, int *fmt)
+{
+  size_t plen;
+
+  if ((len < ART_DISK_HEADER) || (memcmp(data, ART_DISK_MAGIC, 4) != 0))
+    return -1;
+
+  plen = get_le32(data + 36);
+  if (len < ART_DISK_HEADER + plen)
+    return -1;
+
+  *fmt = (int)get_le32(data + 32);
+  if ((*fmt != ART_FMT_PNG) && (*fmt != ART_FMT_JPEG))
+    return -1;
+
+  if (((int64_t)get_le64(data + 4) != (int64_t)sb->st_mtime)
+      || ((int64_t)get_le64(data + 12) != (int64_t)sb->st_size)
+      || ((int)get_le32(data + 20) != max_w)
+      || ((int)get_le32(data + 24) != max_h)
+      || ((int)get_le32(data + 28) != format)
+      || (plen != strlen(path))
+      || (memcmp(data + ART_DISK_HEADER, path, plen) != 0))
+    return 0;
+
+  return ART_DISK_HEADER + plen;
+}
+
+static struct artwork_entry *
+entry_new(uint64_t hash, char *path, struct stat *sb, int max_w, int max_h, int format, int fmt, uint8_t *data, size_t len)
+{
+  struct artwork_entry *e;
+
+  e = (struct artwork_entry *)malloc(sizeof(struct artwork_entry));
+  if (!e)
+    {
+      DPRINTF(E_LOG, L_ART, "Out of memory for artwork cache entry\n");
+
+      return NULL;
+    }
+
+  memset(e, 0, sizeof(struct artwork_entry));
+
+  e->path = strdup(path);
+  if (!e->path)
+    {
+      DPRINTF(E_LOG, L_ART, "Out of memory for artwork cache entry\n");
+
+      free(e);
+      return NULL;
+    }
+
+  e->hash = hash;
+  e->mtime = sb->st_mtime;
+  e->size = sb->st_size;
+  e->max_w = max_w;
+  e->max_h = max_h;
+  e->format = format;
+
+  e->fmt = fmt;
+  e->data = data;
+  e->len = len;
+
+  e->refcount = 1;
+
+  return e;
+}
+
+/* Lock held */
+static void
+entry_unref(struct artwork_entry *e)
+{
+  e->refcount--;
+  if (e->refcount > 0)
+    return;
+
+  free(e->data);
+  free(e->path);
+  free(e);
+}
+
+/* Thread: any (whoever frees the evbuffer) */
+static void
+entry_cleanup_cb(const void *data, size_t datalen, void *extra)
+{
+  pthread_mutex_lock(&cache_lck);
+
+  entry_unref((struct artwork_entry *)extra);
+
+  pthread_mutex_unlock(&cache_lck);
+}
+
+/* Lock held */
+static void
+mem_unlink(struct artwork_entry *e)
+{
+  struct artwork_entry *h;
+  struct artwork_entry **pe;
+
+  pe = &buckets[e->hash % ART_CACHE_BUCKETS];
+  for (h = *pe; h; pe = &h->hnext, h = h->hnext)
+    {
+      if (h == e)
+	{
+	  *pe = e->hnext;
+	  break;
+	}
+    }
+
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    lru_head = e->next;
+
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    lru_tail = e->prev;
+
+  e->hnext = NULL;
+  e->prev = NULL;
+  e->next = NULL;
+
+  mem_size -= e->len;
+
+  entry_unref(e);
+}
+
+/* Lock held */
+static void
+mem_touch(struct artwork_entry *e)
+{
+  if (e == lru_head)
+    return;
+
+  e->prev->next = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    lru_tail = e->prev;
+
+  e->prev = NULL;
+  e->next = lru_head;
+  lru_head->prev = e;
+  lru_head = e;
+}
+
+/* Lock held; returns a new reference */
+static struct artwork_entry *
+mem_lookup(uint64_t hash, char *path, struct stat *sb, int max_w, int max_h, int format)
+{
+  struct artwork_entry *e;
+
+  for (e = buckets[hash % ART_CACHE_BUCKETS]; e; e = e->hnext)
+    {
+      if (key_match(e, hash, path, sb, max_w, max_h, format))
+	break;
+    }
+
+  if (!e)
+    return NULL;
+
+  mem_touch(e);
+
+  e->refcount++;
+
+  return e;
+}
+
+/* Lock held; the cache takes a reference of its own */
+static void
+mem_insert(struct artwork_entry *e)
+{
+  struct artwork_entry *old;
+  struct artwork_entry *h;
+  int bucket;
+
+  bucket = e->hash % ART_CACHE_BUCKETS;
+
+  /* Rendered concurrently by someone else */
+  old = NULL;
+  for (h = buckets[bucket]; h; h = h->hnext)
+    {
+      if ((h->hash == e->hash) && (h->mtime == e->mtime) && (h->size == e->size)
+	  && (h->max_w == e->max_w) && (h->max_h == e->max_h) && (h->format == e->format)
+	  && (strcmp(h->path, e->path) == 0))
+	{
+	  old = h;
+	  break;
+	}
+    }
+
+  if (old)
+    mem_unlink(old);
+
+  e->refcount++;
+
+  e->hnext = buckets[bucket];
+  buckets[bucket] = e;
+
+  e->prev = NULL;
+  e->next = lru_head;
+  if (lru_head)
+    lru_head->prev = e;
+  else
+    lru_tail = e;
+  lru_head = e;
+
+  mem_size += e->len;
+
+  /* Entries still being sent are freed once they're out */
+  while (lru_tail && (mem_size > mem_max_size))
+    mem_unlink(lru_tail);
+}
+
+/* Hands the caller's reference on e over to evbuf */
+static int
+entry_send(struct artwork_entry *e, struct evbuffer *evbuf)
+{
+  int ret;
+
+  ret = evbuffer_add_reference(evbuf, e->data, e->len, entry_cleanup_cb, e);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_ART, "Could not add cached artwork to evbuffer\n");
+
+      pthread_mutex_lock(&cache_lck);
+
+      entry_unref(e);
+
+      pthread_mutex_unlock(&cache_lck);
+
+      return -1;
+    }
+
+  return e->fmt;
+}
+
+
+static int
+disk_path(uint64_t hash, const char *ext, char *path, size_t len)
+{
+  int ret;
+
+  ret = snprintf(path, len, "%s/%016" PRIx64 ".%s", cache_dir, hash, ext);
+  if ((ret < 0) || (ret >= len))
+    {
+      DPRINTF(E_LOG, L_ART, "Artwork cache path exceeds PATH_MAX\n");
+
+      return -1;
+    }
+
+  return 0;
+}
+
+static int
+cache_file_compare(const void *aa, const void *bb)
+{
+  const struct cache_file *a = (const struct cache_file *)aa;
+  const struct cache_file *b = (const struct cache_file *)bb;
+
+  if (a->mtime < b->mtime)
+    return -1;
+
+  if (a->mtime > b->mtime)
+    return 1;
+
+  return 0;
+}
+
+/* Thread: artwork cache */
+/* Drops the least recently used entries until within target, returns what's left */
+static off_t
+disk_trim(off_t target)
+{
+  struct cache_file *files;
+  struct cache_file *tmp;
+  struct dirent *de;
+  struct stat sb;
+  DIR *dir;
+  char path[PATH_MAX];
+  off_t total;
+  size_t len;
+  int nfiles;
+  int maxfiles;
+  int i;
+  int ret;
+
+  dir = opendir(cache_dir);
+  if (!dir)
+    {
+      DPRINTF(E_LOG, L_ART, "Could not open artwork cache directory %s: %s\n", cache_dir, strerror(errno));
+
+      return 0;
+    }
+
+  files = NULL;
+  nfiles = 0;
+  maxfiles = 0;
+  total = 0;
+
+  while ((de = readdir(dir)))
+    {
+      len = strlen(de->d_name);
+      if ((len < 4) || (strcmp(de->d_name + len - 4, ".art") != 0))
+	continue;
+
+      ret = snprintf(path, sizeof(path), "%s/%s", cache_dir, de->d_name);
+      if ((ret < 0) || (ret >= sizeof(path)))
+	continue;
+
+      ret = stat(path, &sb);
+      if (ret < 0)
+	continue;
+
+      if (nfiles == maxfiles)
+	{
+	  maxfiles = (maxfiles) ? 2 * maxfiles : 256;
+
+	  tmp = (struct cache_file *)realloc(files, maxfiles * sizeof(struct cache_file));
+	  if (!tmp)
+	    {
+	      DPRINTF(E_LOG, L_ART, "Out of memory for artwork cache listing\n");
+
+	      goto out;
+	    }
+
+	  files = tmp;
+	}
+
+      strcpy(files[nfiles].name, de->d_name);
+      files[nfiles].mtime = sb.st_mtime;
+      files[nfiles].size = sb.st_size;
+
+      total += sb.st_size;
+      nfiles++;
+    }
+
+  if (total <= target)
+    goto out;
+
+  qsort(files, nfiles, sizeof(struct cache_file), cache_file_compare);
+
+  for (i = 0; (i < nfiles) && (total > target); i++)
+    {
+      ret = snprintf(path, sizeof(path), "%s/%s", cache_dir, files[i].name);
+      if ((ret < 0) || (ret >= sizeof(path)))
+	continue;
+
+      ret = unlink(path);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_ART, "Could not remove %s: %s\n", path, strerror(errno));
+
+	  continue;
+	}
+
+      total -= files[i].size;
+    }
+
+ out:
+  closedir(dir);
+
+  if (files)
+    free(files);
+
+  return total;
+}
+
+/* Returns a new entry read from the disk tier, or NULL */
+static struct artwork_entry *
+disk_lookup(uint64_t hash, char *path, struct stat *sb, int max_w, int max_h, int format)
+{
+  struct artwork_entry *e;
+  struct stat fsb;
+  char cpath[PATH_MAX];
+  uint8_t *data;
+  ssize_t got;
+  size_t len;
+  int fmt;
+  int fd;
+  int ret;
+
+  ret = disk_path(hash, "art", cpath, sizeof(cpath));
+  if (ret < 0)
+    return NULL;
+
+  fd = open(cpath, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  ret = fstat(fd, &fsb);
+  if ((ret < 0) || (fsb.st_size <= 0))
+    {
+      close(fd);
+      return NULL;
+    }
+
+  data = (uint8_t *)malloc(fsb.st_size);
+  if (!data)
+    {
+      DPRINTF(E_LOG, L_ART, "Out of memory for cached artwork\n");
+
+      close(fd);
+      return NULL;
+    }
+
+  len = 0;
+  while (len < fsb.st_size)
+    {
+      got = read(fd, data + len, fsb.st_size - len);
+      if (got < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+
+	  break;
+	}
+      else if (got == 0)
+	break;
+
+      len += got;
+    }
+
+  close(fd);
+
+  ret = -1;
+  if (len == fsb.st_size)
+    ret = disk_header_check(data, len, path, sb, max_w, max_h, format, &fmt);
+
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_ART, "Invalid artwork cache file %s, removing\n", cpath);
+
+      unlink(cpath);
+      free(data);
+      return NULL;
+    }
+  else if ((ret == 0) || (ret == len))
+    {
+      /* Another key with the same hash, or no image */
+      free(data);
+      return NULL;
+    }
+
+  len -= ret;
+  memmove(data, data + ret, len);
+
+  /* Mark as recently used */
+  utimes(cpath, NULL);
+
+  e = entry_new(hash, path, sb, max_w, max_h, format, fmt, data, len);
+  if (!e)
+    free(data);
+
+  return e;
+}
+
+static int
+disk_write(int fd, uint8_t *data, size_t len)
+{
+  ssize_t ret;
+
+  while (len > 0)
+    {
+      ret = write(fd, data, len);
+      if (ret < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+
+	  return -1;
+	}
+
+      data += ret;
+      len -= ret;
+    }
+
+  return 0;
+}
+
+/* Thread: artwork cache */
+static void
+disk_store(struct artwork_entry *e)
+{
+  char cpath[PATH_MAX];
+  char tmp_path[PATH_MAX];
+  uint8_t *hdr;
+  size_t hdr_len;
+  int fd;
+  int ret;
+
+  ret = disk_path(e->hash, "art", cpath, sizeof(cpath));
+  if (ret < 0)
+    return;
+
+  ret = disk_path(e->hash, "tmp", tmp_path, sizeof(tmp_path));
+  if (ret < 0)
+    return;
+
+  hdr_len = ART_DISK_HEADER + strlen(e->path);
+  hdr = (uint8_t *)malloc(hdr_len);
+  if (!hdr)
+    {
+      DPRINTF(E_LOG, L_ART, "Out of memory for artwork cache header\n");
+
+      return;
+    }
+
+  disk_header_make(e, hdr);
+
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    {
+      DPRINTF(E_LOG, L_ART, "Could not create %s: %s\n", tmp_path, strerror(errno));
+
+      free(hdr);
+      return;
+    }
+
+  ret = disk_write(fd, hdr, hdr_len);
+  if (ret == 0)
+    ret = disk_write(fd, e->data, e->len);
+  if (ret < 0)
+    goto fail;
+
+  ret = close(fd);
+  fd = -1;
+  if (ret < 0)
+    goto fail;
+
+  ret = rename(tmp_path, cpath);
+  if (ret < 0)
+    goto fail;
+
+  free(hdr);
+
+  /* Trim with some slack so we don't rescan the directory on every store */
+  disk_size += hdr_len + e->len;
+  if (disk_size > disk_max_size)
+    disk_size = disk_trim(disk_max_size - disk_max_size / 10);
+
+  return;
+
+ fail:
+  DPRINTF(E_LOG, L_ART, "Could not write %s to the artwork cache: %s\n", cpath, strerror(errno));
+
+  if (fd >= 0)
+    close(fd);
+
+  unlink(tmp_path);
+  free(hdr);
+}
+
+/* Thread: artwork cache */
+static void *
+disk_writer(void *arg)
+{
+  struct artwork_entry *e;
+  int trim;
+
+  pthread_mutex_lock(&disk_lck);
+
+  for (;;)
+    {
+      while (!disk_queue && !disk_trim_pending && !disk_exit)
+	pthread_cond_wait(&disk_cond, &disk_lck);
+
+      trim = disk_trim_pending;
+      disk_trim_pending = 0;
+
+      /* Left at the head of the queue until stored, for artwork_cache_stored();
+       * pending stores are written before exiting
+       */
+      e = disk_queue;
+      if (!e && !trim)
+	break;
+
+      pthread_mutex_unlock(&disk_lck);
+
+      if (trim)
+	disk_size = disk_trim(disk_max_size);
+
+      if (e)
+	disk_store(e);
+
+      pthread_mutex_lock(&disk_lck);
+
+      if (!e)
+	continue;
+
+      disk_queue = e->qnext;
+      if (!disk_queue)
+	disk_queue_tail = NULL;
+
+      disk_queued--;
+
+      pthread_mutex_unlock(&disk_lck);
+
+      pthread_mutex_lock(&cache_lck);
+
+      entry_unref(e);
+
+      pthread_mutex_unlock(&cache_lck);
+
+      pthread_mutex_lock(&disk_lck);
+    }
+
+  pthread_mutex_unlock(&disk_lck);
+
+  pthread_exit(NULL);
+}
+
+/* Hands e over to the artwork cache thread, with a reference of its own */
+static void
+disk_queue_add(struct artwork_entry *e)
+{
+  int queued;
+
+  pthread_mutex_lock(&cache_lck);
+
+  e->refcount++;
+
+  pthread_mutex_unlock(&cache_lck);
+
+  pthread_mutex_lock(&disk_lck);
+
+  queued = (disk_queued < ART_DISK_QUEUE_MAX);
+  if (queued)
+    {
+      e->qnext = NULL;
+      if (disk_queue_tail)
+	disk_queue_tail->qnext = e;
+      else
+	disk_queue = e;
+      disk_queue_tail = e;
+
+      disk_queued++;
+
+      pthread_cond_signal(&disk_cond);
+    }
+
+  pthread_mutex_unlock(&disk_lck);
+
+  if (queued)
+    return;
+
+  DPRINTF(E_DBG, L_ART, "Artwork cache disk queue full, not storing %s\n", e->path);
+
+  pthread_mutex_lock(&cache_lck);
+
+  entry_unref(e);
+
+  pthread_mutex_unlock(&cache_lck);
+}
+
+/* Returns ART_FMT_* with the cached image added to evbuf, or -1 */
+int
+artwork_cache_get(char *path, struct stat *sb, int max_w, int max_h, int format, struct evbuffer *evbuf)
+{
+  struct artwork_entry *e;
+  uint64_t hash;
+
+  if (!cache_enabled)
+    return -1;
+
+  hash = key_hash(path, sb, max_w, max_h, format);
+
+  pthread_mutex_lock(&cache_lck);
+
+  e = mem_lookup(hash, path, sb, max_w, max_h, format);
+
+  pthread_mutex_unlock(&cache_lck);
+
+  if (e)
+    {
+      DPRINTF(E_DBG, L_ART, "Artwork cache hit for %s (%dx%d)\n", path, max_w, max_h);
+
+      return entry_send(e, evbuf);
+    }
+
+  if (!cache_dir)
+    return -1;
+
+  e = disk_lookup(hash, path, sb, max_w, max_h, format);
+  if (!e)
+    return -1;
+
+  DPRINTF(E_DBG, L_ART, "Artwork cache hit on disk for %s (%dx%d)\n", path, max_w, max_h);
+
+  pthread_mutex_lock(&cache_lck);
+
+  mem_insert(e);
+
+  pthread_mutex_unlock(&cache_lck);
+
+  return entry_send(e, evbuf);
+}
+
+/* Whether the disk tier has, or is about to have, an image for these parameters */
+int
+artwork_cache_stored(char *path, struct stat *sb, int max_w, int max_h, int format)
+{
+  struct artwork_entry *e;
+  char cpath[PATH_MAX];
+  uint8_t hdr[ART_DISK_HEADER + PATH_MAX];
+  uint64_t hash;
+  size_t hdr_len;
+  ssize_t got;
+  int fmt;
+  int fd;
+  int ret;
+
+  if (!cache_dir)
+    return 0;
+
+  hdr_len = ART_DISK_HEADER + strlen(path);
+  if (hdr_len > sizeof(hdr))
+    return 0;
+
+  hash = key_hash(path, sb, max_w, max_h, format);
+
+  pthread_mutex_lock(&disk_lck);
+
+  for (e = disk_queue; e; e = e->qnext)
+    {
+      if (key_match(e, hash, path, sb, max_w, max_h, format))
+	break;
+    }
+
+  pthread_mutex_unlock(&disk_lck);
+
+  if (e)
+    return 1;
+
+  ret = disk_path(hash, "art", cpath, sizeof(cpath));
+  if (ret < 0)
+    return 0;
+
+  fd = open(cpath, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  got = read(fd, hdr, hdr_len);
+
+  close(fd);
+
+  if (got != hdr_len)
+    return 0;
+
+  return (disk_header_check(hdr, hdr_len, path, sb, max_w, max_h, format, &fmt) > 0);
+}
+
+/* Caches the image rendered in evbuf, which is left untouched; with
+ * ART_CACHE_DISK_ONLY, the memory tier is left alone
+ */
+void
+artwork_cache_add(char *path, struct stat *sb, int max_w, int max_h, int format, int fmt, int flags, struct evbuffer *evbuf)
+{
+  struct artwork_entry *e;
+  uint8_t *data;
+  size_t len;
+
+  if (!cache_enabled)
+    return;
+
+  if ((flags & ART_CACHE_DISK_ONLY) && !cache_dir)
+    return;
+
+  len = EVBUFFER_LENGTH(evbuf);
+  if (len == 0)
+    return;
+
+  data = (uint8_t *)malloc(len);
+  if (!data)
+    {
+      DPRINTF(E_LOG, L_ART, "Out of memory for cached artwork\n");
+
+      return;
+    }
+
+  memcpy(data, EVBUFFER_DATA(evbuf), len);
+
+  e = entry_new(key_hash(path, sb, max_w, max_h, format), path, sb, max_w, max_h, format, fmt, data, len);
+  if (!e)
+    {
+      free(data);
+      return;
+    }
+
+  if (cache_dir)
+    disk_queue_add(e);
+
+  pthread_mutex_lock(&cache_lck);
+
+  if (!(flags & ART_CACHE_DISK_ONLY))
+    mem_insert(e);
+  entry_unref(e);
+
+  pthread_mutex_unlock(&cache_lck);
+}
+
+int
+artwork_cache_init(void)
+{
+  cfg_t *lib;
+  char *dir;
+  struct dirent *de;
+  DIR *d;
+  char path[PATH_MAX];
+  size_t len;
+  int ret;
+
+  lib = cfg_getsec(cfg, "library");
+
+  cache_dir = NULL;
+  mem_max_size = (size_t)cfg_getint(lib, "artwork_cache_memory") * 1024 * 1024;
+  disk_max_size = (off_t)cfg_getint(lib, "artwork_cache_size") * 1024 * 1024;
+
+  cache_enabled = 0;
+  ret = 0;
+
+  dir = cfg_getstr(lib, "artwork_cache_dir");
+  if (!dir || (disk_max_size <= 0))
+    {
+      DPRINTF(E_INFO, L_ART, "Artwork disk cache disabled\n");
+
+      goto out;
+    }
+
+  ret = mkdir(dir, 0755);
+  if ((ret < 0) && (errno != EEXIST))
+    {
+      DPRINTF(E_LOG, L_ART, "Could not create artwork cache directory %s: %s\n", dir, strerror(errno));
+
+      ret = -1;
+      goto out;
+    }
+
+  cache_dir = strdup(dir);
+  if (!cache_dir)
+    {
+      DPRINTF(E_LOG, L_ART, "Out of memory for artwork cache directory\n");
+
+      ret = -1;
+      goto out;
+    }
+
+  /* Leftovers from stores interrupted by a shutdown */
+  d = opendir(cache_dir);
+  if (d)
+    {
+      while ((de = readdir(d)))
+	{
+	  len = strlen(de->d_name);
+	  if ((len < 4) || (strcmp(de->d_name + len - 4, ".tmp") != 0))
+	    continue;
+
+	  ret = snprintf(path, sizeof(path), "%s/%s", cache_dir, de->d_name);
+	  if ((ret < 0) || (ret >= sizeof(path)))
+	    continue;
+
+	  unlink(path);
+	}
+
+      closedir(d);
+    }
+
+  disk_queue = NULL;
+  disk_queue_tail = NULL;
+  disk_queued = 0;
+  disk_exit = 0;
+
+  /* Size the cache and trim it in the background */
+  disk_trim_pending = 1;
+
+  ret = pthread_create(&tid_disk, NULL, disk_writer, NULL);
+  if (ret != 0)
+    {
+      DPRINTF(E_LOG, L_ART, "Could not spawn artwork cache thread: %s\n", strerror(ret));
+
+      free(cache_dir);
+      cache_dir = NULL;
+
+      ret = -1;
+      goto out;
+    }
+
+  ret = 0;
+
+ out:
+  cache_enabled = (cache_dir || (mem_max_size > 0));
+
+  return ret;
+}
+
+void
+artwork_cache_deinit(void)
+{
+  int ret;
+
+  if (cache_dir)
+    {
+      pthread_mutex_lock(&disk_lck);
+
+      disk_exit = 1;
+      pthread_cond_signal(&disk_cond);
+
+      pthread_mutex_unlock(&disk_lck);
+
+      ret = pthread_join(tid_disk, NULL);
+      if (ret != 0)
+	DPRINTF(E_LOG, L_ART, "Could not join artwork cache thread: %s\n", strerror(ret));
+    }
+
+  pthread_mutex_lock(&cache_lck);
+
+  cache_enabled = 0;
+
+  while (lru_head)
+    mem_unlink(lru_head);
+
+  pthread_mutex_unlock(&cache_lck);
+
+  if (cache_dir)
+    free(cache_dir);
+
+  cache_dir = NULL;
+}
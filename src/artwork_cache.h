@@ -0,0 +1,26 @@
+
+#ifndef __ARTWORK_CACHE_H__
+#define __ARTWORK_CACHE_H__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <event.h>
+
+#define ART_CACHE_DISK_ONLY  (1 << 0)
+
+int
+artwork_cache_get(char *path, struct stat *sb, int max_w, int max_h, int format, struct evbuffer *evbuf);
+
+int
+artwork_cache_stored(char *path, struct stat *sb, int max_w, int max_h, int format);
+
+void
+artwork_cache_add(char *path, struct stat *sb, int max_w, int max_h, int format, int fmt, int flags, struct evbuffer *evbuf);
+
+int
+artwork_cache_init(void);
+
+void
+artwork_cache_deinit(void);
+
+#endif /* !__ARTWORK_CACHE_H__ */
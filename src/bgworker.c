@@ -0,0 +1,177 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Low-priority background workers
+ *
+ * The scanner hands its follow-up work (sample analysis, artwork
+ * pre-rendering) to threads of their own, which wait for a kick, run
+ * their job against the DB and go back to sleep.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#if defined(__linux__)
+# include <unistd.h>
+# include <sys/syscall.h>
+#endif
+
+#include "logger.h"
+#include "db.h"
+#include "bgworker.h"
+
+
+/* Thread: any, lowers the priority of the calling thread */
+void
+bgworker_lower_priority(int domain, int nice, const char *name)
+{
+#if defined(__linux__)
+  int ret;
+
+  /* Linux applies the nice value to the calling thread only */
+  ret = setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice);
+  if (ret < 0)
+    DPRINTF(E_WARN, domain, "Could not lower %s priority: %s\n", name, strerror(errno));
+#endif
+}
+
+/* Thread: worker */
+static void *
+bgworker(void *arg)
+{
+  struct bgworker *w;
+  int ret;
+
+  w = (struct bgworker *)arg;
+
+  ret = db_perthread_init();
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, w->domain, "Error: DB init failed (%s)\n", w->name);
+
+      pthread_exit(NULL);
+    }
+
+  bgworker_lower_priority(w->domain, w->nice, w->name);
+
+  for (;;)
+    {
+      pthread_mutex_lock(&w->lck);
+
+      while (!w->pending && !w->exit)
+	pthread_cond_wait(&w->cond, &w->lck);
+
+      w->pending = 0;
+
+      pthread_mutex_unlock(&w->lck);
+
+      if (w->exit)
+	break;
+
+      w->run();
+    }
+
+  db_perthread_deinit();
+
+  pthread_exit(NULL);
+}
+
+/* Thread: main */
+int
+bgworker_start(struct bgworker *w)
+{
+  int ret;
+
+  w->running = 0;
+  w->pending = 0;
+  w->exit = 0;
+
+  pthread_mutex_init(&w->lck, NULL);
+  pthread_cond_init(&w->cond, NULL);
+
+  ret = pthread_create(&w->tid, NULL, bgworker, w);
+  if (ret != 0)
+    {
+      DPRINTF(E_LOG, w->domain, "Could not spawn %s thread: %s\n", w->name, strerror(ret));
+
+      pthread_cond_destroy(&w->cond);
+      pthread_mutex_destroy(&w->lck);
+      return -1;
+    }
+
+  w->running = 1;
+
+  return 0;
+}
+
+/* Thread: any */
+void
+bgworker_kick(struct bgworker *w)
+{
+  if (!w->running)
+    return;
+
+  pthread_mutex_lock(&w->lck);
+
+  w->pending = 1;
+  pthread_cond_signal(&w->cond);
+
+  pthread_mutex_unlock(&w->lck);
+}
+
+/* Thread: worker */
+int
+bgworker_exiting(struct bgworker *w)
+{
+  return w->exit;
+}
+
+/* Thread: main */
+void
+bgworker_stop(struct bgworker *w)
+{
+  int ret;
+
+  if (!w->running)
+    return;
+
+  pthread_mutex_lock(&w->lck);
+
+  w->exit = 1;
+  pthread_cond_signal(&w->cond);
+
+  pthread_mutex_unlock(&w->lck);
+
+  ret = pthread_join(w->tid, NULL);
+  if (ret != 0)
+    DPRINTF(E_LOG, w->domain, "Could not join %s thread: %s\n", w->name, strerror(ret));
+
+  pthread_cond_destroy(&w->cond);
+  pthread_mutex_destroy(&w->lck);
+
+  w->running = 0;
+}
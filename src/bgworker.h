@@ -0,0 +1,40 @@
+
+#ifndef __BGWORKER_H__
+#define __BGWORKER_H__
+
+#include <pthread.h>
+
+/* A low-priority thread that runs a job whenever kicked; kicks coming in
+ * while the job runs are folded into one more run
+ */
+struct bgworker {
+  const char *name;
+  int domain;
+  int nice;
+  /* Runs with a DB connection of its own; checks bgworker_exiting() */
+  void (*run)(void);
+
+  pthread_t tid;
+  pthread_mutex_t lck;
+  pthread_cond_t cond;
+  int running;
+  int pending;
+  volatile int exit;
+};
+
+void
+bgworker_lower_priority(int domain, int nice, const char *name);
+
+int
+bgworker_start(struct bgworker *w);
+
+void
+bgworker_kick(struct bgworker *w);
+
+int
+bgworker_exiting(struct bgworker *w);
+
+void
+bgworker_stop(struct bgworker *w);
+
+#endif /* !__BGWORKER_H__ */
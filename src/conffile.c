@@ -68,6 +68,18 @@ static cfg_opt_t sec_library[] =
     CFG_BOOL("itunes_overrides", cfg_false, CFGF_NONE),
     CFG_STR_LIST("no_transcode", NULL, CFGF_NONE),
     CFG_STR_LIST("force_transcode", NULL, CFGF_NONE),
+    CFG_BOOL("transcode_alac", cfg_true, CFGF_NONE),
+    CFG_BOOL("analyze_samples", cfg_true, CFGF_NONE),
+    CFG_INT("stream_lowat", 128, CFGF_NONE),
+    CFG_INT("stream_hiwat", 512, CFGF_NONE),
+    CFG_INT("prefetch_seconds", 30, CFGF_NONE),
+    CFG_STR("transcode_cache_dir", NULL, CFGF_NONE),
+    CFG_INT("transcode_cache_size", 1024, CFGF_NONE),
+    CFG_STR("artwork_cache_dir", STATEDIR "/cache/" PACKAGE "/artwork", CFGF_NONE),
+    CFG_INT("artwork_cache_size", 64, CFGF_NONE),
+    CFG_INT("artwork_cache_memory", 8, CFGF_NONE),
+    CFG_BOOL("artwork_prerender", cfg_false, CFGF_NONE),
+    CFG_INT_LIST("artwork_prerender_sizes", "{128, 256, 600}", CFGF_NONE),
     CFG_END()
   };
 
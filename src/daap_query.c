@@ -34,8 +34,14 @@
 #include "DAAP2SQL.h"
 
 
-char *
-daap_query_parse_sql(const char *daap_query)
+/* Number of query to SQL translations to keep around */
+#define DAAP_QUERY_CACHE_SIZE 64
+
+static struct lru_cache daap_query_cache = LRU_CACHE_INITIALIZER(DAAP_QUERY_CACHE_SIZE);
+
+
+static char *
+daap_query_antlr(const char *daap_query)
 {
   /* Input DAAP query, fed to the lexer */
   pANTLR3_INPUT_STREAM query;
@@ -149,3 +155,29 @@ daap_query_parse_sql(const char *daap_query)
 
   return ret;
 }
+
+char *
+daap_query_parse_sql(const char *daap_query)
+{
+  char *ret;
+
+  ret = lru_cache_get(&daap_query_cache, daap_query);
+  if (ret)
+    {
+      DPRINTF(E_DBG, L_DAAP, "DAAP query cache hit -%s-\n", daap_query);
+
+      return ret;
+    }
+
+  ret = daap_query_antlr(daap_query);
+  if (ret)
+    lru_cache_add(&daap_query_cache, daap_query, ret);
+
+  return ret;
+}
+
+void
+daap_query_deinit(void)
+{
+  lru_cache_clear(&daap_query_cache);
+}
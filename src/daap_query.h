@@ -9,4 +9,7 @@
 char *
 daap_query_parse_sql(const char *daap_query);
 
+void
+daap_query_deinit(void);
+
 #endif /* !__DAAP_QUERY_H__ */
@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <limits.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <errno.h>
@@ -604,12 +605,14 @@ db_purge_cruft(time_t ref)
   char *errmsg;
   int i;
   int ret;
-  char *queries[3] = { NULL, NULL, NULL };
-  char *queries_tmpl[3] =
+  char *queries[5] = { NULL, NULL, NULL, NULL, NULL };
+  char *queries_tmpl[5] =
     {
       "DELETE FROM playlistitems WHERE playlistid IN (SELECT id FROM playlists p WHERE p.type <> 1 AND p.db_timestamp < %" PRIi64 ");",
       "DELETE FROM playlists WHERE type <> 1 AND db_timestamp < %" PRIi64 ";",
-      "DELETE FROM files WHERE db_timestamp < %" PRIi64 ";"
+      "DELETE FROM files WHERE db_timestamp < %" PRIi64 ";",
+      "DELETE FROM pcm_samples WHERE id NOT IN (SELECT id FROM files);",
+      "DELETE FROM artwork_sources WHERE type = 1 AND id NOT IN (SELECT id FROM files);"
     };
 
   if (sizeof(queries) != sizeof(queries_tmpl))
@@ -1557,6 +1560,108 @@ db_query_fetch_string_sort(struct query_params *qp, char **string, char **sortst
   return 0;
 }
 
+/* Counts items per sort header bucket for an items query sorted by name.
+ * title_sort is NFD-normalized at scan time, so its first character is
+ * the bucket; this saves normalizing every row when building sort headers.
+ * Bucket 0 is for non-ASCII-letter titles, 1-26 for A-Z.
+ * Returns -1 if the list is not ordered by title_sort.
+ */
+int
+db_query_sort_headers(struct query_params *qp, uint32_t *buckets)
+{
+  struct query_params hqp;
+  struct playlist_info *pli;
+  sqlite3_stmt *stmt;
+  const char *fl;
+  char *query;
+  char *hquery;
+  size_t len;
+  int ret;
+
+  memset(buckets, 0, DB_SORT_BUCKETS * sizeof(uint32_t));
+
+  if (qp->sort != S_NAME)
+    return -1;
+
+  memcpy(&hqp, qp, sizeof(struct query_params));
+  hqp.stmt = NULL;
+
+  switch (qp->type)
+    {
+      case Q_ITEMS:
+	ret = db_build_query_items(&hqp, &query);
+	break;
+
+      case Q_PLITEMS:
+	pli = db_pl_fetch_byid(qp->id);
+	if (!pli)
+	  return -1;
+
+	/* Plain playlists are returned in playlist order */
+	if (pli->type == PL_SMART)
+	  ret = db_build_query_plitems_smart(&hqp, pli->query, &query);
+	else
+	  ret = -1;
+
+	free_pli(pli, 0);
+	break;
+
+      default:
+	return -1;
+    }
+
+  if (ret < 0)
+    return -1;
+
+  /* Use the items query as a subquery */
+  len = strlen(query);
+  if ((len > 0) && (query[len - 1] == ';'))
+    query[len - 1] = '\0';
+
+  hquery = sqlite3_mprintf("SELECT UPPER(SUBSTR(q.title_sort, 1, 1)) AS fl, COUNT(*) FROM (%s) q GROUP BY fl;", query);
+  sqlite3_free(query);
+  if (!hquery)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for sort headers query string\n");
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", hquery);
+
+  ret = db_blocking_prepare_v2(hquery, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+
+      sqlite3_free(hquery);
+      return -1;
+    }
+
+  sqlite3_free(hquery);
+
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+    {
+      fl = (const char *)sqlite3_column_text(stmt, 0);
+
+      if (fl && (fl[0] >= 'A') && (fl[0] <= 'Z') && (fl[1] == '\0'))
+	buckets[fl[0] - 'A' + 1] += sqlite3_column_int(stmt, 1);
+      else
+	buckets[0] += sqlite3_column_int(stmt, 1);
+    }
+
+  if (ret != SQLITE_DONE)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+      sqlite3_finalize(stmt);
+      return -1;
+    }
+
+  sqlite3_finalize(stmt);
+
+  return 0;
+}
+
 
 /* Files */
 int
@@ -3078,6 +3183,59 @@ db_group_type_byid(int id)
 #undef Q_TMPL
 }
 
+/* Fills ids with up to max album group ids greater than after, in order;
+ * returns the number of ids, -1 on error
+ */
+int
+db_group_albums_fetch(int after, int *ids, int max)
+{
+#define Q_TMPL "SELECT g.id FROM groups g WHERE g.type = %d AND g.id > %d ORDER BY g.id LIMIT %d;"
+  sqlite3_stmt *stmt;
+  char *query;
+  int n;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, G_ALBUMS, after, max);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+
+      sqlite3_free(query);
+      return -1;
+    }
+
+  n = 0;
+  while ((n < max) && ((ret = db_blocking_step(stmt)) == SQLITE_ROW))
+    {
+      ids[n] = sqlite3_column_int(stmt, 0);
+      n++;
+    }
+
+  if ((n < max) && (ret != SQLITE_DONE))
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+      n = -1;
+    }
+
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
+
+  return n;
+
+#undef Q_TMPL
+}
+
 /* Remotes */
 static int
 db_pairing_delete_byremote(char *remote_id)
@@ -3321,6 +3479,438 @@ db_speaker_clear_all(void)
 }
 
 
+/* Sample counts */
+/* Exact number of 44.1 kHz stereo samples a file decodes to, as found by
+ * the analysis pass of the scanner; valid as long as the file keeps the
+ * same mtime and size. Files that could not be decoded are stored with -1.
+ */
+int
+db_pcm_samples_save(int id, uint32_t time_modified, int64_t file_size, int64_t samples)
+{
+#define Q_TMPL "INSERT OR REPLACE INTO pcm_samples (id, time_modified, file_size, samples) VALUES (%d, %" PRIi64 ", %" PRIi64 ", %" PRIi64 ");"
+  char *query;
+  char *errmsg;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, id, (int64_t)time_modified, file_size, samples);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  errmsg = NULL;
+  ret = db_exec(query, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Error saving sample count: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      sqlite3_free(query);
+      return -1;
+    }
+
+  sqlite3_free(query);
+
+  return 0;
+
+#undef Q_TMPL
+}
+
+int
+db_pcm_samples_get(int id, uint32_t time_modified, int64_t file_size, int64_t *samples)
+{
+#define Q_TMPL "SELECT p.samples FROM pcm_samples p WHERE p.id = %d AND p.time_modified = %" PRIi64 " AND p.file_size = %" PRIi64 ";"
+  sqlite3_stmt *stmt;
+  char *query;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, id, (int64_t)time_modified, file_size);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+
+      ret = -1;
+      goto out;
+    }
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      if (ret != SQLITE_DONE)
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+      sqlite3_finalize(stmt);
+
+      ret = -1;
+      goto out;
+    }
+
+  *samples = sqlite3_column_int64(stmt, 0);
+
+#ifdef DB_PROFILE
+  while (db_blocking_step(stmt) == SQLITE_ROW)
+    ; /* EMPTY */
+#endif
+
+  sqlite3_finalize(stmt);
+
+  ret = (*samples > 0) ? 0 : -1;
+
+ out:
+  sqlite3_free(query);
+  return ret;
+
+#undef Q_TMPL
+}
+
+/* Fills ids with up to max audio files with ids greater than after that
+ * have no sample count yet, or an outdated one, in order; returns the
+ * number of ids, -1 on error
+ */
+int
+db_pcm_samples_pending(int after, int *ids, int max)
+{
+#define Q_TMPL "SELECT f.id FROM files f LEFT JOIN pcm_samples p ON p.id = f.id" \
+               " WHERE f.id > %d AND f.disabled = 0 AND f.data_kind = 0 AND f.has_video = 0" \
+               " AND (p.id IS NULL OR p.time_modified <> f.time_modified OR p.file_size <> f.file_size)" \
+               " ORDER BY f.id LIMIT %d;"
+  sqlite3_stmt *stmt;
+  char *query;
+  int n;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, after, max);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+
+      sqlite3_free(query);
+      return -1;
+    }
+
+  n = 0;
+  while ((n < max) && ((ret = db_blocking_step(stmt)) == SQLITE_ROW))
+    {
+      ids[n] = sqlite3_column_int(stmt, 0);
+      n++;
+    }
+
+  if ((n < max) && (ret != SQLITE_DONE))
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+      n = -1;
+    }
+
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
+
+  return n;
+
+#undef Q_TMPL
+}
+
+/* Artwork sources */
+/* The artwork file the scanner found for an item or an album group, or a
+ * NULL path if there's none; valid until something changes in one of the
+ * directories of the item or group.
+ */
+int
+db_artwork_source_set(enum artwork_source type, int id, char *path)
+{
+#define Q_TMPL "INSERT OR REPLACE INTO artwork_sources (type, id, path) VALUES (%d, %d, %Q);"
+  char *query;
+  char *errmsg;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, type, id, path);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  errmsg = NULL;
+  ret = db_exec(query, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Error saving artwork source: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      sqlite3_free(query);
+      return -1;
+    }
+
+  sqlite3_free(query);
+
+  return 0;
+
+#undef Q_TMPL
+}
+
+/* Returns 0 if the source is known, with path set to NULL if there is no
+ * artwork, -1 otherwise; path must be freed by the caller
+ */
+int
+db_artwork_source_get(enum artwork_source type, int id, char **path)
+{
+#define Q_TMPL "SELECT a.path FROM artwork_sources a WHERE a.type = %d AND a.id = %d;"
+  sqlite3_stmt *stmt;
+  char *query;
+  const char *res;
+  int ret;
+
+  *path = NULL;
+
+  query = sqlite3_mprintf(Q_TMPL, type, id);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+
+      ret = -1;
+      goto out;
+    }
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      if (ret != SQLITE_DONE)
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+      sqlite3_finalize(stmt);
+
+      ret = -1;
+      goto out;
+    }
+
+  ret = 0;
+
+  res = (const char *)sqlite3_column_text(stmt, 0);
+  if (res)
+    {
+      *path = strdup(res);
+      if (!*path)
+	{
+	  DPRINTF(E_LOG, L_DB, "Out of memory for artwork source\n");
+
+	  ret = -1;
+	}
+    }
+
+#ifdef DB_PROFILE
+  while (db_blocking_step(stmt) == SQLITE_ROW)
+    ; /* EMPTY */
+#endif
+
+  sqlite3_finalize(stmt);
+
+ out:
+  sqlite3_free(query);
+  return ret;
+
+#undef Q_TMPL
+}
+
+/* Fills ids with up to max items or album groups without a known artwork
+ * source; returns the number of ids, -1 on error
+ */
+int
+db_artwork_source_pending(enum artwork_source type, int *ids, int max)
+{
+#define Q_ITEMS "SELECT f.id FROM files f LEFT JOIN artwork_sources a ON a.type = %d AND a.id = f.id" \
+                " WHERE f.disabled = 0 AND f.data_kind = 0 AND a.id IS NULL LIMIT %d;"
+#define Q_GROUPS "SELECT g.id FROM groups g LEFT JOIN artwork_sources a ON a.type = %d AND a.id = g.id" \
+                 " WHERE g.type = %d AND a.id IS NULL LIMIT %d;"
+  sqlite3_stmt *stmt;
+  char *query;
+  int n;
+  int ret;
+
+  if (type == ART_SOURCE_GROUP)
+    query = sqlite3_mprintf(Q_GROUPS, type, G_ALBUMS, max);
+  else
+    query = sqlite3_mprintf(Q_ITEMS, type, max);
+
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+
+      sqlite3_free(query);
+      return -1;
+    }
+
+  n = 0;
+  while ((n < max) && ((ret = db_blocking_step(stmt)) == SQLITE_ROW))
+    {
+      ids[n] = sqlite3_column_int(stmt, 0);
+      n++;
+    }
+
+  if ((n < max) && (ret != SQLITE_DONE))
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+      n = -1;
+    }
+
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
+
+  return n;
+
+#undef Q_ITEMS
+#undef Q_GROUPS
+}
+
+/* Forgets the sources that a change in dir may affect, found or not: those
+ * of the items in dir, of the items in its subdirectories (whose parent
+ * directory image lives in dir), of the groups of all these items, and
+ * any source that is a file in dir.
+ *
+ * Paths under dir are matched on a range, 'dir/' <= path < 'dir0' ('0'
+ * follows '/'), which the path indexes can serve, and the depth below dir
+ * on the number of slashes. The rows are collected by rowid so that each
+ * branch gets its own index.
+ */
+int
+db_artwork_source_purge_dir(char *dir)
+{
+#define Q_DEPTH(col) "LENGTH(" col ") - LENGTH(REPLACE(" col ", '/', ''))"
+#define Q_TMPL "DELETE FROM artwork_sources WHERE rowid IN (" \
+               " SELECT rowid FROM artwork_sources" \
+               "  WHERE path >= '%q/' AND path < '%q0' AND " Q_DEPTH("path") " = %d" \
+               " UNION ALL SELECT a.rowid FROM files f JOIN artwork_sources a ON a.type = %d AND a.id = f.id" \
+               "  WHERE f.path >= '%q/' AND f.path < '%q0' AND " Q_DEPTH("f.path") " <= %d" \
+               " UNION ALL SELECT a.rowid FROM files f JOIN groups g ON f.songalbumid = g.persistentid" \
+               "  JOIN artwork_sources a ON a.type = %d AND a.id = g.id" \
+               "  WHERE f.path >= '%q/' AND f.path < '%q0' AND " Q_DEPTH("f.path") " <= %d);"
+  char path[PATH_MAX];
+  char *query;
+  char *errmsg;
+  char *ptr;
+  size_t len;
+  int depth;
+  int ret;
+
+  len = strlen(dir);
+  while ((len > 1) && (dir[len - 1] == '/'))
+    len--;
+
+  if ((len == 0) || (len >= sizeof(path)))
+    return -1;
+
+  memcpy(path, dir, len);
+  path[len] = '\0';
+
+  /* Slashes in paths directly in dir */
+  depth = 1;
+  for (ptr = path; *ptr; ptr++)
+    {
+      if (*ptr == '/')
+	depth++;
+    }
+
+  query = sqlite3_mprintf(Q_TMPL,
+			  path, path, depth,
+			  ART_SOURCE_ITEM, path, path, depth + 1,
+			  ART_SOURCE_GROUP, path, path, depth + 1);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  errmsg = NULL;
+  ret = db_exec(query, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Error purging artwork sources: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      sqlite3_free(query);
+      return -1;
+    }
+
+  sqlite3_free(query);
+
+  return 0;
+
+#undef Q_TMPL
+#undef Q_DEPTH
+}
+
+int
+db_artwork_source_clear(void)
+{
+  char *query = "DELETE FROM artwork_sources;";
+  char *errmsg;
+  int ret;
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_exec(query, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      return -1;
+    }
+
+  return 0;
+}
+
+
 /* Inotify */
 int
 db_watch_clear(void)
@@ -4051,9 +4641,28 @@ db_perthread_deinit(void)
   "   path        VARCHAR(4096) NOT NULL"		\
   ");"
 
+#define T_PCM_SAMPLES					\
+  "CREATE TABLE IF NOT EXISTS pcm_samples ("		\
+  "   id             INTEGER PRIMARY KEY NOT NULL,"	\
+  "   time_modified  INTEGER NOT NULL,"			\
+  "   file_size      INTEGER NOT NULL,"			\
+  "   samples        INTEGER NOT NULL"			\
+  ");"
+
+#define T_ARTWORK_SOURCES				\
+  "CREATE TABLE IF NOT EXISTS artwork_sources ("		\
+  "   type           INTEGER NOT NULL,"			\
+  "   id             INTEGER NOT NULL,"			\
+  "   path           VARCHAR(4096) DEFAULT NULL,"		\
+  "   PRIMARY KEY (type, id)"				\
+  ");"
+
 #define I_RESCAN				\
   "CREATE INDEX IF NOT EXISTS idx_rescan ON files(path, db_timestamp);"
 
+#define I_ARTWORK_PATH				\
+  "CREATE INDEX IF NOT EXISTS idx_artwork_path ON artwork_sources(path);"
+
 #define I_SONGALBUMID				\
   "CREATE INDEX IF NOT EXISTS idx_sai ON files(songalbumid);"
 
@@ -4133,9 +4742,9 @@ db_perthread_deinit(void)
   " VALUES(8, 'Purchased', 0, 'media_kind = 1024', 0, '', 0, 8);"
  */
 
-#define SCHEMA_VERSION 13
+#define SCHEMA_VERSION 15
 #define Q_SCVER					\
-  "INSERT INTO admin (key, value) VALUES ('schema_version', '13');"
+  "INSERT INTO admin (key, value) VALUES ('schema_version', '15');"
 
 struct db_init_query {
   char *query;
@@ -4152,10 +4761,13 @@ static const struct db_init_query db_init_queries[] =
     { T_PAIRINGS,  "create table pairings" },
     { T_SPEAKERS,  "create table speakers" },
     { T_INOTIFY,   "create table inotify" },
+    { T_PCM_SAMPLES, "create table pcm_samples" },
+    { T_ARTWORK_SOURCES, "create table artwork_sources" },
 
     { I_RESCAN,    "create rescan index" },
     { I_SONGALBUMID, "create songalbumid index" },
     { I_STATEMKINDSAI, "create state/mkind/sai index" },
+    { I_ARTWORK_PATH, "create artwork source path index" },
 
     { I_ARTIST,    "create artist index" },
     { I_ALBUMARTIST, "create album_artist index" },
@@ -4799,6 +5411,52 @@ static const struct db_init_query db_upgrade_v13_queries[] =
     { U_V13_SCVER,    "set schema_version to 13" },
   };
 
+
+/* Upgrade from schema v13 to v14 */
+
+#define U_V14_PCM_SAMPLES				\
+  "CREATE TABLE IF NOT EXISTS pcm_samples ("		\
+  "   id             INTEGER PRIMARY KEY NOT NULL,"	\
+  "   time_modified  INTEGER NOT NULL,"			\
+  "   file_size      INTEGER NOT NULL,"			\
+  "   samples        INTEGER NOT NULL"			\
+  ");"
+
+#define U_V14_SCVER				\
+  "UPDATE admin SET value = '14' WHERE key = 'schema_version';"
+
+static const struct db_init_query db_upgrade_v14_queries[] =
+  {
+    { U_V14_PCM_SAMPLES, "create table pcm_samples" },
+
+    { U_V14_SCVER,    "set schema_version to 14" },
+  };
+
+
+/* Upgrade from schema v14 to v15 */
+
+#define U_V15_ARTWORK_SOURCES				\
+  "CREATE TABLE IF NOT EXISTS artwork_sources ("		\
+  "   type           INTEGER NOT NULL,"			\
+  "   id             INTEGER NOT NULL,"			\
+  "   path           VARCHAR(4096) DEFAULT NULL,"		\
+  "   PRIMARY KEY (type, id)"				\
+  ");"
+
+#define U_V15_ARTWORK_PATH			\
+  "CREATE INDEX IF NOT EXISTS idx_artwork_path ON artwork_sources(path);"
+
+#define U_V15_SCVER				\
+  "UPDATE admin SET value = '15' WHERE key = 'schema_version';"
+
+static const struct db_init_query db_upgrade_v15_queries[] =
+  {
+    { U_V15_ARTWORK_SOURCES, "create table artwork_sources" },
+    { U_V15_ARTWORK_PATH, "create artwork source path index" },
+
+    { U_V15_SCVER,    "set schema_version to 15" },
+  };
+
 static int
 db_check_version(void)
 {
@@ -4870,6 +5528,20 @@ db_check_version(void)
 	    if (ret < 0)
 	      return -1;
 
+	    /* FALLTHROUGH */
+
+	  case 13:
+	    ret = db_generic_upgrade(db_upgrade_v14_queries, sizeof(db_upgrade_v14_queries) / sizeof(db_upgrade_v14_queries[0]));
+	    if (ret < 0)
+	      return -1;
+
+	    /* FALLTHROUGH */
+
+	  case 14:
+	    ret = db_generic_upgrade(db_upgrade_v15_queries, sizeof(db_upgrade_v15_queries) / sizeof(db_upgrade_v15_queries[0]));
+	    if (ret < 0)
+	      return -1;
+
 	    break;
 
 	  default:
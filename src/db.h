@@ -25,6 +25,9 @@ enum sort_type {
 
 #define Q_F_BROWSE (1 << 15)
 
+/* Sort header buckets: misc + A-Z */
+#define DB_SORT_BUCKETS 27
+
 enum query_type {
   Q_ITEMS            = (1 << 0),
   Q_PL               = (1 << 1),
@@ -146,6 +149,11 @@ enum pl_type {
   PL_MAX
 };
 
+enum artwork_source {
+  ART_SOURCE_ITEM = 1,
+  ART_SOURCE_GROUP = 2,
+};
+
 struct playlist_info {
   uint32_t id;           /* integer id (miid) */
   char *title;           /* playlist name as displayed in iTunes (minm) */
@@ -317,6 +325,9 @@ db_query_fetch_string(struct query_params *qp, char **string);
 int
 db_query_fetch_string_sort(struct query_params *qp, char **string, char **sortstring);
 
+int
+db_query_sort_headers(struct query_params *qp, uint32_t *buckets);
+
 /* Files */
 int
 db_files_get_count(void);
@@ -422,6 +433,9 @@ db_groups_clear(void);
 enum group_type
 db_group_type_byid(int id);
 
+int
+db_group_albums_fetch(int after, int *ids, int max);
+
 /* Remotes */
 int
 db_pairing_add(struct pairing_info *pi);
@@ -439,6 +453,32 @@ db_speaker_get(uint64_t id, int *selected, int *volume);
 void
 db_speaker_clear_all(void);
 
+/* Sample counts */
+int
+db_pcm_samples_save(int id, uint32_t time_modified, int64_t file_size, int64_t samples);
+
+int
+db_pcm_samples_get(int id, uint32_t time_modified, int64_t file_size, int64_t *samples);
+
+int
+db_pcm_samples_pending(int after, int *ids, int max);
+
+/* Artwork sources */
+int
+db_artwork_source_set(enum artwork_source type, int id, char *path);
+
+int
+db_artwork_source_get(enum artwork_source type, int id, char **path);
+
+int
+db_artwork_source_pending(enum artwork_source type, int *ids, int max);
+
+int
+db_artwork_source_purge_dir(char *dir);
+
+int
+db_artwork_source_clear(void);
+
 /* Inotify */
 int
 db_watch_clear(void);
@@ -29,6 +29,7 @@
 #include "db.h"
 #include "misc.h"
 #include "logger.h"
+#include "transcode.h"
 #include "dmap_common.h"
 
 
@@ -369,7 +370,7 @@ dmap_send_error(struct evhttp_request *req, char *container, char *errmsg)
 
 
 int
-dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags, int force_wav)
+dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags, int xcode)
 {
   const struct dmap_field_map *dfm;
   const struct dmap_field *df;
@@ -437,18 +438,21 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
       /* Here's one exception ... codectype (ascd) is actually an integer */
       if (dfm == &dfm_dmap_ascd)
 	{
-	  dmap_add_literal(song, df->tag, *strval, 4);
+	  if (xcode == XCODE_ALAC)
+	    dmap_add_literal(song, df->tag, "alac", 4);
+	  else
+	    dmap_add_literal(song, df->tag, *strval, 4);
 	  continue;
 	}
 
       val = 0;
 
-      if (force_wav)
+      if (xcode)
 	{
 	  switch (dfm->mfi_offset)
 	    {
 	      case dbmfi_offsetof(type):
-		ptr = "wav";
+		ptr = (xcode == XCODE_ALAC) ? "m4a" : "wav";
 		strval = &ptr;
 		break;
 
@@ -465,7 +469,7 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
 		break;
 
 	      case dbmfi_offsetof(description):
-		ptr = "wav audio file";
+		ptr = (xcode == XCODE_ALAC) ? "Apple Lossless audio file" : "wav audio file";
 		strval = &ptr;
 		break;
 
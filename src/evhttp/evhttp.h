@@ -105,6 +105,20 @@ int evhttp_bind_socket(struct evhttp *http, const char *address, u_short port);
  */
 int evhttp_accept_socket(struct evhttp *http, int fd);
 
+/**
+ * Makes an HTTP server accept connections on all the sockets another
+ * HTTP server is bound to.
+ *
+ * The sockets remain owned by the other server and are not closed by
+ * evhttp_free() on this one; free this server first.
+ *
+ * @param http a pointer to an evhttp object
+ * @param from a pointer to an evhttp object with bound sockets
+ * @return 0 on success, -1 on failure.
+ * @see evhttp_accept_socket()
+ */
+int evhttp_accept_sockets_of(struct evhttp *http, struct evhttp *from);
+
 /**
  * Free the previously created HTTP server.
  *
@@ -162,6 +176,43 @@ void evhttp_send_reply(struct evhttp_request *req, int code,
 void evhttp_send_reply_start(struct evhttp_request *, int, const char *);
 void evhttp_send_reply_chunk_with_cb(struct evhttp_request *, struct evbuffer *,
 				     void (*cb)(struct evhttp_connection *, void *), void *arg);
+
+/**
+ * Send a range of a file as the next chunk of a streamed reply.
+ *
+ * The data goes straight from the file to the socket with sendfile(),
+ * once the pending output has been written; the callback is invoked
+ * when the whole range has been sent. The file descriptor must remain
+ * open until then.
+ *
+ * @param req a request object
+ * @param fd the file to send from
+ * @param offset the offset in the file to start from
+ * @param len the number of bytes to send
+ * @return 0 on success, -1 if zero-copy sending is not supported or the
+ *   connection is gone; cb is not called then
+ * @see evhttp_can_send_file()
+ */
+int evhttp_send_reply_file_with_cb(struct evhttp_request *req, int fd,
+    off_t offset, size_t len,
+    void (*cb)(struct evhttp_connection *, void *), void *arg);
+
+/** Returns 1 if evhttp_send_reply_file_with_cb() is supported */
+int evhttp_can_send_file(void);
+
+/**
+ * Sets the low watermark for streamed replies on this connection.
+ *
+ * The callback passed to evhttp_send_reply_chunk_with_cb() is then
+ * invoked as soon as no more than lowat bytes are left to write,
+ * instead of once the output is fully drained, so the producer can
+ * keep data in flight. 0 restores the default.
+ */
+void evhttp_connection_set_lowat(struct evhttp_connection *evcon,
+    size_t lowat);
+
+/** Returns the number of bytes waiting to be written on the connection */
+size_t evhttp_connection_get_output_length(struct evhttp_connection *evcon);
 void evhttp_send_reply_chunk(struct evhttp_request *, struct evbuffer *);
 void evhttp_send_reply_end(struct evhttp_request *);
 
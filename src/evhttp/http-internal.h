@@ -89,6 +89,16 @@ struct evhttp_connection {
 	void (*closecb)(struct evhttp_connection *, void *);
 	void *closecb_arg;
 
+	/* file range sent with sendfile() once output_buffer is drained */
+	int file_fd;
+	off_t file_offset;
+	size_t file_left;
+	int file_chunked;		/* chunk trailer still to be sent */
+
+	/* call back early once the output drains to lowat bytes */
+	size_t lowat;
+	int lowat_armed;
+
 	struct event_base *base;
 };
 
@@ -109,6 +119,7 @@ struct evhttp_bound_socket {
 	TAILQ_ENTRY(evhttp_bound_socket) (next);
 
 	struct event  bind_ev;
+	int shared;	/* socket owned by another evhttp, do not close */
 };
 
 struct evhttp {
@@ -77,6 +77,10 @@
 #ifdef _EVENT_HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
+#if defined(__linux__)
+#define USE_SENDFILE
+#include <sys/sendfile.h>
+#endif
 
 #undef timeout_pending
 #undef timeout_initialized
@@ -344,6 +348,7 @@ evhttp_write_buffer(struct evhttp_connection *evcon,
 	/* Set call back */
 	evcon->cb = cb;
 	evcon->cb_arg = arg;
+	evcon->lowat_armed = 0;
 
 	/* check if the event is already pending */
 	if (event_pending(&evcon->ev, EV_WRITE|EV_TIMEOUT, NULL))
@@ -697,21 +702,71 @@ evhttp_write(int fd, short what, void *arg)
 		return;
 	}
 
-	n = evbuffer_write(evcon->output_buffer, fd);
-	if (n == -1) {
-		event_debug(("%s: evbuffer_write", __func__));
-		evhttp_connection_fail(evcon, EVCON_HTTP_EOF);
-		return;
+	if (EVBUFFER_LENGTH(evcon->output_buffer) != 0) {
+		n = evbuffer_write(evcon->output_buffer, fd);
+		if (n == -1) {
+			event_debug(("%s: evbuffer_write", __func__));
+			evhttp_connection_fail(evcon, EVCON_HTTP_EOF);
+			return;
+		}
+
+		if (n == 0) {
+			event_debug(("%s: write nothing", __func__));
+			evhttp_connection_fail(evcon, EVCON_HTTP_EOF);
+			return;
+		}
+
+		if (EVBUFFER_LENGTH(evcon->output_buffer) != 0) {
+			evhttp_add_event(&evcon->ev, 
+			    evcon->timeout, HTTP_WRITE_TIMEOUT);
+
+			/* ask the producer for more before we run dry */
+			if (evcon->lowat_armed && evcon->cb != NULL &&
+			    EVBUFFER_LENGTH(evcon->output_buffer) <= evcon->lowat) {
+				void (*cb)(struct evhttp_connection *, void *);
+
+				cb = evcon->cb;
+				evcon->cb = NULL;
+				evcon->lowat_armed = 0;
+				(*cb)(evcon, evcon->cb_arg);
+			}
+			return;
+		}
 	}
 
-	if (n == 0) {
-		event_debug(("%s: write nothing", __func__));
-		evhttp_connection_fail(evcon, EVCON_HTTP_EOF);
-		return;
+#ifdef USE_SENDFILE
+	if (evcon->file_left > 0) {
+		ssize_t sent;
+
+		sent = sendfile(fd, evcon->file_fd, &evcon->file_offset,
+		    evcon->file_left);
+		if (sent == -1 && (errno == EAGAIN || errno == EINTR)) {
+			evhttp_add_event(&evcon->ev,
+			    evcon->timeout, HTTP_WRITE_TIMEOUT);
+			return;
+		}
+
+		/* 0 means the file got shorter under us */
+		if (sent <= 0) {
+			event_debug(("%s: sendfile", __func__));
+			evcon->file_left = 0;
+			evhttp_connection_fail(evcon, EVCON_HTTP_EOF);
+			return;
+		}
+
+		evcon->file_left -= sent;
+		if (evcon->file_left > 0) {
+			evhttp_add_event(&evcon->ev,
+			    evcon->timeout, HTTP_WRITE_TIMEOUT);
+			return;
+		}
 	}
+#endif
 
-	if (EVBUFFER_LENGTH(evcon->output_buffer) != 0) {
-		evhttp_add_event(&evcon->ev, 
+	if (evcon->file_chunked) {
+		evcon->file_chunked = 0;
+		evbuffer_add(evcon->output_buffer, "\r\n", 2);
+		evhttp_add_event(&evcon->ev,
 		    evcon->timeout, HTTP_WRITE_TIMEOUT);
 		return;
 	}
@@ -1103,6 +1158,9 @@ evhttp_connection_reset(struct evhttp_connection *evcon)
 	}
 	evcon->state = EVCON_DISCONNECTED;
 
+	evcon->file_left = 0;
+	evcon->file_chunked = 0;
+
 	evbuffer_drain(evcon->input_buffer,
 	    EVBUFFER_LENGTH(evcon->input_buffer));
 	evbuffer_drain(evcon->output_buffer,
@@ -1743,6 +1801,7 @@ evhttp_connection_new(const char *address, unsigned short port)
 	}
 
 	evcon->fd = -1;
+	evcon->file_fd = -1;
 	evcon->port = port;
 
 	evcon->timeout = -1;
@@ -2042,6 +2101,64 @@ evhttp_send_reply_chunk_with_cb(struct evhttp_request *req, struct evbuffer *dat
 		evbuffer_add(evcon->output_buffer, "\r\n", 2);
 	}
 	evhttp_write_buffer(evcon, cb, arg);
+	evcon->lowat_armed = (evcon->lowat > 0);
+}
+
+void
+evhttp_connection_set_lowat(struct evhttp_connection *evcon, size_t lowat)
+{
+	evcon->lowat = lowat;
+}
+
+size_t
+evhttp_connection_get_output_length(struct evhttp_connection *evcon)
+{
+	return (EVBUFFER_LENGTH(evcon->output_buffer));
+}
+
+int
+evhttp_can_send_file(void)
+{
+#ifdef USE_SENDFILE
+	return (1);
+#else
+	return (0);
+#endif
+}
+
+int
+evhttp_send_reply_file_with_cb(struct evhttp_request *req, int fd,
+    off_t offset, size_t len,
+    void (*cb)(struct evhttp_connection *, void *), void *arg)
+{
+#ifdef USE_SENDFILE
+	struct evhttp_connection *evcon = req->evcon;
+
+	/* The callback will never run, let the caller clean up */
+	if (evcon == NULL)
+		return (-1);
+
+	if (len == 0) {
+		evhttp_write_buffer(evcon, cb, arg);
+		return (0);
+	}
+
+	if (req->chunked) {
+		evbuffer_add_printf(evcon->output_buffer, "%x\r\n",
+				    (unsigned)len);
+		evcon->file_chunked = 1;
+	}
+
+	evcon->file_fd = fd;
+	evcon->file_offset = offset;
+	evcon->file_left = len;
+
+	evhttp_write_buffer(evcon, cb, arg);
+
+	return (0);
+#else
+	return (-1);
+#endif
 }
 
 void
@@ -2062,6 +2179,7 @@ evhttp_send_reply_end(struct evhttp_request *req)
 
 	/* we expect no more calls form the user on this request */
 	req->userdone = 1;
+	evcon->lowat_armed = 0;
 
 	if (req->chunked) {
 		evbuffer_add(req->evcon->output_buffer, "0\r\n\r\n", 5);
@@ -2382,8 +2500,8 @@ evhttp_bind_socket(struct evhttp *http, const char *address, u_short port)
 	return (res);
 }
 
-int
-evhttp_accept_socket(struct evhttp *http, int fd)
+static int
+evhttp_accept_socket_internal(struct evhttp *http, int fd, int shared)
 {
 	struct evhttp_bound_socket *bound;
 	struct event *ev;
@@ -2393,6 +2511,8 @@ evhttp_accept_socket(struct evhttp *http, int fd)
 	if (bound == NULL)
 		return (-1);
 
+	bound->shared = shared;
+
 	ev = &bound->bind_ev;
 
 	/* Schedule the socket for accepting */
@@ -2411,6 +2531,26 @@ evhttp_accept_socket(struct evhttp *http, int fd)
 	return (0);
 }
 
+int
+evhttp_accept_socket(struct evhttp *http, int fd)
+{
+	return (evhttp_accept_socket_internal(http, fd, 0));
+}
+
+int
+evhttp_accept_sockets_of(struct evhttp *http, struct evhttp *from)
+{
+	struct evhttp_bound_socket *bound;
+
+	TAILQ_FOREACH(bound, &from->sockets, next) {
+		if (evhttp_accept_socket_internal(http,
+			bound->bind_ev.ev_fd, 1) == -1)
+			return (-1);
+	}
+
+	return (0);
+}
+
 static struct evhttp*
 evhttp_new_object(void)
 {
@@ -2471,7 +2611,8 @@ evhttp_free(struct evhttp* http)
 
 		fd = bound->bind_ev.ev_fd;
 		event_del(&bound->bind_ev);
-		EVUTIL_CLOSESOCKET(fd);
+		if (!bound->shared)
+			EVUTIL_CLOSESOCKET(fd);
 
 		free(bound);
 	}
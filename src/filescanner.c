@@ -59,11 +59,14 @@
 #include "conffile.h"
 #include "misc.h"
 #include "remote_pairing.h"
+#include "artwork.h"
 
 
 #define F_SCAN_BULK    (1 << 0)
 #define F_SCAN_RESCAN  (1 << 1)
 
+#define ARTWORK_INDEX_BATCH  64
+
 struct deferred_pl {
   char *path;
   time_t mtime;
@@ -857,6 +860,66 @@ bulk_scan(void)
   DPRINTF(E_LOG, L_SCAN, "Bulk library scan complete\n");
 }
 
+/* Resolves the artwork source of the items and album groups that don't
+ * have one yet, so artwork requests go straight to the right file
+ */
+/* Thread: scan */
+static void
+index_artwork(void)
+{
+  enum artwork_source types[2] = { ART_SOURCE_ITEM, ART_SOURCE_GROUP };
+  char artwork[PATH_MAX];
+  char *path;
+  int ids[ARTWORK_INDEX_BATCH];
+  int done;
+  int n;
+  int i;
+  int t;
+  int ret;
+
+  done = 0;
+  for (t = 0; t < (sizeof(types) / sizeof(types[0])); t++)
+    {
+      while (!scan_exit)
+	{
+	  n = db_artwork_source_pending(types[t], ids, ARTWORK_INDEX_BATCH);
+	  if (n <= 0)
+	    break;
+
+	  for (i = 0; (i < n) && !scan_exit; i++)
+	    {
+	      if (types[t] == ART_SOURCE_GROUP)
+		ret = artwork_find_group(ids[i], 0, artwork);
+	      else
+		{
+		  path = db_file_path_byid(ids[i]);
+		  if (path)
+		    {
+		      ret = artwork_find_item(path, 0, artwork);
+		      free(path);
+		    }
+		  else
+		    ret = -1;
+		}
+
+	      /* Negative results are recorded as well */
+	      ret = db_artwork_source_set(types[t], ids[i], (ret == 0) ? artwork : NULL);
+	      if (ret < 0)
+		{
+		  DPRINTF(E_LOG, L_SCAN, "Could not record artwork sources, giving up\n");
+
+		  return;
+		}
+
+	      done++;
+	    }
+	}
+    }
+
+  if (done > 0)
+    DPRINTF(E_INFO, L_SCAN, "Indexed artwork for %d items and groups\n", done);
+}
+
 
 /* Thread: scan */
 static void *
@@ -888,6 +951,11 @@ filescanner(void *arg)
       pthread_exit(NULL);
     }
 
+  /* Group ids change, and artwork may have changed while we weren't watching */
+  ret = db_artwork_source_clear();
+  if (ret < 0)
+    DPRINTF(E_LOG, L_SCAN, "Could not clear old artwork sources from DB\n");
+
   /* Recompute all songalbumids, in case the SQLite DB got transferred
    * to a different host; the hash is not portable.
    * It will also rebuild the groups we just cleared.
@@ -900,6 +968,11 @@ filescanner(void *arg)
 
   if (!scan_exit)
     {
+      analyze_kick();
+
+      index_artwork();
+      prerender_kick();
+
       /* Enable inotify */
       event_add(&inoev, NULL);
 
@@ -1223,11 +1296,20 @@ inotify_cb(int fd, short event, void *arg)
       else
 	process_inotify_file(&wi, path, ie);
 
+      /* Artwork may have come or gone */
+      if ((ie->len > 0) && (ie->mask & (IN_CREATE | IN_DELETE | IN_MOVE | IN_CLOSE_WRITE)))
+	db_artwork_source_purge_dir(wi.path);
+
       free(wi.path);
     }
 
   free(buf);
 
+  analyze_kick();
+
+  index_artwork();
+  prerender_kick();
+
   event_add(&inoev, NULL);
 }
 #endif /* __linux__ */
@@ -1403,6 +1485,8 @@ kqueue_cb(int fd, short event, void *arg)
 
   while ((path = pop_dir(&rescan)))
     {
+      db_artwork_source_purge_dir(path);
+
       process_directories(path, 0);
 
       free(path);
@@ -1411,6 +1495,11 @@ kqueue_cb(int fd, short event, void *arg)
 	DPRINTF(E_LOG, L_SCAN, "WARNING: unhandled leftover directories\n");
     }
 
+  analyze_kick();
+
+  index_artwork();
+  prerender_kick();
+
   event_add(&inoev, NULL);
 }
 #endif /* __FreeBSD__ || __FreeBSD_kernel__ */
@@ -1498,6 +1587,15 @@ filescanner_init(void)
   event_base_set(evbase_scan, &exitev);
   event_add(&exitev, NULL);
 
+  /* Not fatal, transcodings only lose their exact sizes */
+  ret = analyze_init();
+  if (ret < 0)
+    DPRINTF(E_LOG, L_SCAN, "Could not start sample count analysis\n");
+
+  ret = prerender_init();
+  if (ret < 0)
+    DPRINTF(E_LOG, L_SCAN, "Could not start artwork pre-rendering\n");
+
   ret = pthread_create(&tid_scan, NULL, filescanner, NULL);
   if (ret != 0)
     {
@@ -1509,6 +1607,8 @@ filescanner_init(void)
   return 0;
 
  thread_fail:
+  prerender_deinit();
+  analyze_deinit();
   close(inofd);
  ino_fail:
 #ifdef USE_EVENTFD
@@ -1557,6 +1657,9 @@ filescanner_deinit(void)
       return;
     }
 
+  prerender_deinit();
+  analyze_deinit();
+
   event_del(&inoev);
 
 #ifdef USE_EVENTFD
@@ -24,6 +24,25 @@ struct extinf_ctx
 void
 process_media_file(char *file, time_t mtime, off_t size, int type, struct extinf_ctx *extinf);
 
+/* Background analysis */
+int
+analyze_init(void);
+
+void
+analyze_deinit(void);
+
+void
+analyze_kick(void);
+
+int
+prerender_init(void);
+
+void
+prerender_deinit(void);
+
+void
+prerender_kick(void);
+
 /* Actual scanners */
 int
 scan_metadata_ffmpeg(char *file, struct media_file_info *mfi);
@@ -0,0 +1,210 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Background analysis of scanned files
+ *
+ * Decodes every audio file in the library once, the same way a WAV stream
+ * of it would be, and records the exact number of samples at 44.1 kHz in
+ * the DB. Transcoded streams then get an exact size instead of one guessed
+ * from the duration, so they can be sent with a Content-Length and byte
+ * ranges map to samples.
+ *
+ * The analysis runs in a thread of its own at a low priority, after the
+ * bulk scan and whenever the scanner picks up changes. Files are taken from
+ * the DB in batches; a file that changed since its analysis is analysed
+ * again.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/types.h>
+
+#include <event.h>
+
+#include "logger.h"
+#include "db.h"
+#include "conffile.h"
+#include "filescanner.h"
+#include "transcode.h"
+#include "bgworker.h"
+
+
+#define ANALYZE_BATCH  32
+#define ANALYZE_CHUNK  (256 * 1024)
+#define ANALYZE_NICE   10
+
+
+static void
+analyze_run(void);
+
+static struct bgworker analyze_worker =
+  {
+    .name = "analyzer",
+    .domain = L_SCAN,
+    .nice = ANALYZE_NICE,
+    .run = analyze_run,
+  };
+
+
+/* Returns the number of samples, -1 if the file can't be decoded and
+ * -2 if interrupted
+ */
+static int64_t
+analyze_file(struct media_file_info *mfi)
+{
+  struct transcode_ctx *ctx;
+  struct evbuffer *evbuf;
+  int64_t bytes;
+  int ret;
+
+  evbuf = evbuffer_new();
+  if (!evbuf)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Out of memory for analysis buffer\n");
+
+      return -2;
+    }
+
+  ctx = transcode_setup(mfi, NULL, XCODE_PCM16_NOHEADER);
+  if (!ctx)
+    {
+      evbuffer_free(evbuf);
+
+      return -1;
+    }
+
+  bytes = 0;
+  do
+    {
+      ret = transcode(ctx, evbuf, ANALYZE_CHUNK);
+      if (ret > 0)
+	{
+	  bytes += ret;
+	  evbuffer_drain(evbuf, ret);
+	}
+    }
+  while ((ret > 0) && !bgworker_exiting(&analyze_worker));
+
+  transcode_cleanup(ctx);
+  evbuffer_free(evbuf);
+
+  if (bgworker_exiting(&analyze_worker))
+    return -2;
+
+  if (ret < 0)
+    return -1;
+
+  return bytes / (2 * 2);
+}
+
+/* Thread: analyze */
+static void
+analyze_run(void)
+{
+  struct media_file_info *mfi;
+  int ids[ANALYZE_BATCH];
+  int64_t samples;
+  int after;
+  int done;
+  int n;
+  int i;
+
+  /* Walks the ids in order, so the files left pending (gone meanwhile,
+   * or failing to save) are not taken again until the next run
+   */
+  done = 0;
+  after = 0;
+  while (!bgworker_exiting(&analyze_worker))
+    {
+      n = db_pcm_samples_pending(after, ids, ANALYZE_BATCH);
+      if (n <= 0)
+	break;
+
+      after = ids[n - 1];
+
+      for (i = 0; (i < n) && !bgworker_exiting(&analyze_worker); i++)
+	{
+	  mfi = db_file_fetch_byid(ids[i]);
+	  if (!mfi)
+	    {
+	      DPRINTF(E_LOG, L_SCAN, "Could not fetch file id %d for analysis, skipping\n", ids[i]);
+
+	      continue;
+	    }
+
+	  samples = analyze_file(mfi);
+	  if (samples == -2)
+	    {
+	      free_mfi(mfi, 0);
+	      break;
+	    }
+
+	  if (samples < 0)
+	    DPRINTF(E_INFO, L_SCAN, "Could not analyze %s, no exact size for its transcodings\n", mfi->path);
+	  else
+	    DPRINTF(E_DBG, L_SCAN, "Analyzed %s: %" PRIi64 " samples\n", mfi->path, samples);
+
+	  /* Failures are stored as well, not to retry them until the file changes */
+	  db_pcm_samples_save(mfi->id, mfi->time_modified, mfi->file_size, samples);
+
+	  free_mfi(mfi, 0);
+	  done++;
+	}
+    }
+
+  if (done > 0)
+    DPRINTF(E_LOG, L_SCAN, "Analyzed %d files\n", done);
+}
+
+/* Thread: scan */
+void
+analyze_kick(void)
+{
+  bgworker_kick(&analyze_worker);
+}
+
+/* Thread: main */
+int
+analyze_init(void)
+{
+  cfg_t *lib;
+
+  lib = cfg_getsec(cfg, "library");
+  if (!cfg_getbool(lib, "analyze_samples"))
+    {
+      DPRINTF(E_INFO, L_SCAN, "Sample count analysis disabled\n");
+
+      return 0;
+    }
+
+  return bgworker_start(&analyze_worker);
+}
+
+/* Thread: main */
+void
+analyze_deinit(void)
+{
+  bgworker_stop(&analyze_worker);
+}
@@ -0,0 +1,163 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Background pre-rendering of album artwork
+ *
+ * Renders the artwork of every album group at the sizes listed in
+ * artwork_prerender_sizes into the disk tier of the artwork cache, so the
+ * first browse of the library doesn't have to wait for it. Runs in a
+ * thread of its own at a low priority, after the bulk scan and whenever
+ * the scanner picks up changes; artwork already in the cache is skipped.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <event.h>
+
+#include "logger.h"
+#include "db.h"
+#include "conffile.h"
+#include "filescanner.h"
+#include "artwork.h"
+#include "bgworker.h"
+
+
+#define PRERENDER_BATCH      32
+#define PRERENDER_MAX_SIZES  8
+#define PRERENDER_NICE       15
+
+
+static void
+prerender_run(void);
+
+static struct bgworker prerender_worker =
+  {
+    .name = "artwork prerender",
+    .domain = L_SCAN,
+    .nice = PRERENDER_NICE,
+    .run = prerender_run,
+  };
+
+static int prerender_sizes[PRERENDER_MAX_SIZES];
+static int prerender_nsizes;
+
+
+/* Thread: prerender */
+static void
+prerender_run(void)
+{
+  int ids[PRERENDER_BATCH];
+  int after;
+  int groups;
+  int n;
+  int i;
+  int j;
+  int ret;
+
+  groups = 0;
+  after = 0;
+  while (!bgworker_exiting(&prerender_worker))
+    {
+      n = db_group_albums_fetch(after, ids, PRERENDER_BATCH);
+      if (n <= 0)
+	break;
+
+      for (i = 0; (i < n) && !bgworker_exiting(&prerender_worker); i++)
+	{
+	  for (j = 0; (j < prerender_nsizes) && !bgworker_exiting(&prerender_worker); j++)
+	    {
+	      ret = artwork_prerender_group(ids[i], prerender_sizes[j], prerender_sizes[j], ART_CAN_PNG | ART_CAN_JPEG);
+
+	      /* No artwork for this one */
+	      if (ret < 0)
+		break;
+	    }
+
+	  if (j == prerender_nsizes)
+	    groups++;
+	}
+
+      after = ids[n - 1];
+    }
+
+  if (!bgworker_exiting(&prerender_worker))
+    DPRINTF(E_INFO, L_SCAN, "Artwork of %d albums pre-rendered\n", groups);
+}
+
+/* Thread: scan */
+void
+prerender_kick(void)
+{
+  bgworker_kick(&prerender_worker);
+}
+
+/* Thread: main */
+int
+prerender_init(void)
+{
+  cfg_t *lib;
+  int size;
+  int n;
+  int i;
+
+  lib = cfg_getsec(cfg, "library");
+  if (!cfg_getbool(lib, "artwork_prerender"))
+    return 0;
+
+  if (!cfg_getstr(lib, "artwork_cache_dir") || (cfg_getint(lib, "artwork_cache_size") <= 0))
+    {
+      DPRINTF(E_LOG, L_SCAN, "Artwork pre-rendering needs the artwork disk cache, disabled\n");
+
+      return 0;
+    }
+
+  prerender_nsizes = 0;
+
+  n = cfg_size(lib, "artwork_prerender_sizes");
+  for (i = 0; (i < n) && (prerender_nsizes < PRERENDER_MAX_SIZES); i++)
+    {
+      size = cfg_getnint(lib, "artwork_prerender_sizes", i);
+      if (size <= 0)
+	{
+	  DPRINTF(E_LOG, L_SCAN, "Ignoring invalid artwork pre-rendering size %d\n", size);
+
+	  continue;
+	}
+
+      prerender_sizes[prerender_nsizes] = size;
+      prerender_nsizes++;
+    }
+
+  if (prerender_nsizes == 0)
+    return 0;
+
+  return bgworker_start(&prerender_worker);
+}
+
+/* Thread: main */
+void
+prerender_deinit(void)
+{
+  bgworker_stop(&prerender_worker);
+}
@@ -54,6 +54,9 @@
 #include "httpd_daap.h"
 #include "httpd_dacp.h"
 #include "transcode.h"
+#include "prefetch.h"
+#include "transcode_cache.h"
+#include "transcode_pool.h"
 
 
 /*
@@ -76,6 +79,15 @@
 
 
 #define STREAM_CHUNK_SIZE (64 * 1024)
+/* Raw files are sent with sendfile() in chunks of this size */
+#define STREAM_SENDFILE_CHUNK (1024 * 1024)
+#define GZIP_CHUNK_SIZE (64 * 1024)
+/* Replies smaller than this are compressed inline */
+#define GZIP_INLINE_MAX (64 * 1024)
+#define GZIP_MAX_WORKERS 4
+#define HTTPD_MAX_THREADS 8
+#define GZIP_CACHE_ENTRIES 8
+#define GZIP_CACHE_SIZE (16 * 1024 * 1024)
 #define WEBFACE_ROOT   DATADIR "/webface/"
 
 struct content_type_map {
@@ -96,7 +108,69 @@ struct stream_ctx {
   off_t start_offset;
   off_t end_offset;
   int marked;
+  int prefetch_id;
   struct transcode_ctx *xcode;
+  int xcode_format;
+  /* size is the exact length of the transcoded output */
+  int exact;
+  /* Transcoding done by the worker pool, which then owns the transcode_ctx */
+  struct transcode_stream *pool;
+  /* Output being added to the transcode cache */
+  struct transcode_cache_writer *cache;
+
+  /* Queues the next chunk, see stream_fill() */
+  int (*chunk)(struct stream_ctx *st);
+};
+
+struct gzip_job {
+  /* NULL if the connection went away */
+  struct evhttp_request *req;
+  /* Completion fd of the httpd thread owning req */
+  int done_fd;
+  int code;
+  char *reason;
+  int level;
+  int ret;
+
+  struct evbuffer *in;
+  struct evbuffer *out;
+
+  struct gzip_job *next;
+};
+
+struct gzip_cache_entry {
+  uint64_t hash;
+
+  /* Uncompressed body, compared on lookup; the hash only narrows it down */
+  uint8_t *in;
+  size_t in_len;
+
+  uint8_t *data;
+  size_t len;
+
+  struct gzip_cache_entry *next;
+};
+
+struct httpd_thread {
+  pthread_t tid;
+  struct event_base *evbase;
+  struct evhttp *evhttp;
+
+#ifdef USE_EVENTFD
+  int exit_efd;
+#else
+  int exit_pipe[2];
+#endif
+  struct event exitev;
+  int exit;
+
+  /* gzip job completion */
+  int gzip_pipe[2];
+  struct event gzipev;
+
+  /* Transcoded data available */
+  int xcode_pipe[2];
+  struct event xcodeev;
 };
 
 
@@ -113,34 +187,62 @@ static const struct content_type_map ext2ctype[] =
     { NULL, NULL }
   };
 
-struct event_base *evbase_httpd;
+/* Event base of the current httpd thread */
+__thread struct event_base *evbase_httpd;
 
-#ifdef USE_EVENTFD
-static int exit_efd;
-#else
-static int exit_pipe[2];
-#endif
-static int httpd_exit;
-static struct event exitev;
-static struct evhttp *evhttpd;
-static pthread_t tid_httpd;
+static struct httpd_thread httpd_threads[HTTPD_MAX_THREADS];
+static int httpd_nthreads;
+static __thread struct httpd_thread *httpd_self;
+
+/* gzip worker pool */
+static pthread_t tid_gzip[GZIP_MAX_WORKERS];
+static int gzip_nworkers;
+static pthread_mutex_t gzip_lck = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gzip_cond = PTHREAD_COND_INITIALIZER;
+static struct gzip_job *gzip_queue;
+static int gzip_pending;
+static int gzip_exit;
+
+static pthread_mutex_t gzip_cache_lck = PTHREAD_MUTEX_INITIALIZER;
+static struct gzip_cache_entry *gzip_cache;
+static size_t gzip_cache_size;
+static int gzip_cache_entries;
+
+/* Streaming output watermarks, in bytes */
+static size_t stream_lowat;
+static size_t stream_hiwat;
 
 
 static void
 stream_end(struct stream_ctx *st, int failed)
 {
+  /* Ending from the lowat or pool notification path, the one-shot may be pending */
+  event_del(&st->ev);
+
   if (st->req->evcon)
-    evhttp_connection_set_closecb(st->req->evcon, NULL, NULL);
+    {
+      evhttp_connection_set_closecb(st->req->evcon, NULL, NULL);
+      evhttp_connection_set_lowat(st->req->evcon, 0);
+    }
 
   if (!failed)
     evhttp_send_reply_end(st->req);
 
   evbuffer_free(st->evbuf);
 
-  if (st->xcode)
+  /* Incomplete transcoding, don't cache it */
+  if (st->cache)
+    transcode_cache_writer_abort(st->cache);
+
+  if (st->pool)
+    transcode_pool_stop(st->pool);
+  else if (st->xcode)
     transcode_cleanup(st->xcode);
-  else
+  /* Not set if falling back from shared transcoding failed */
+  else if (st->fd >= 0)
     {
+      prefetch_stop(st->prefetch_id);
+
       free(st->buf);
       close(st->fd);
     }
@@ -160,45 +262,140 @@ stream_up_playcount(struct stream_ctx *st)
     }
 }
 
+/* Queue chunks until the output reaches the high watermark; evhttp calls
+ * us back through stream_lowat_cb once it has drained to the low watermark,
+ * so an idle client costs nothing and several chunks stay in flight
+ */
 static void
-stream_chunk_resched_cb(struct evhttp_connection *evcon, void *arg)
+stream_fill(struct stream_ctx *st)
 {
-  struct stream_ctx *st;
   struct timeval tv;
   int ret;
 
-  st = (struct stream_ctx *)arg;
+  /* Only one path drives the stream: entered from the lowat or pool
+   * notification path, this run takes over from a pending one-shot
+   */
+  event_del(&st->ev);
 
-  evutil_timerclear(&tv);
-  ret = event_add(&st->ev, &tv);
-  if (ret < 0)
+  do
     {
-      DPRINTF(E_LOG, L_HTTPD, "Could not re-add one-shot event for streaming\n");
+      ret = st->chunk(st);
+      if (ret < 0)
+	return; /* Streaming ended, st is gone */
 
-      stream_end(st, 0);
+      if (ret == 2)
+	return; /* Waiting for the transcode pool, see xcode_notify_cb() */
+
+      if (ret == 0)
+	{
+	  /* Nothing queued (consuming up to start_offset); yield to the event loop */
+	  evutil_timerclear(&tv);
+	  ret = event_add(&st->ev, &tv);
+	  if (ret < 0)
+	    {
+	      DPRINTF(E_LOG, L_HTTPD, "Could not re-add one-shot event for streaming\n");
+
+	      stream_end(st, 0);
+	    }
+
+	  return;
+	}
     }
+  while (evhttp_connection_get_output_length(st->req->evcon) < stream_hiwat);
 }
 
 static void
-stream_chunk_xcode_cb(int fd, short event, void *arg)
+stream_lowat_cb(struct evhttp_connection *evcon, void *arg)
+{
+  stream_fill((struct stream_ctx *)arg);
+}
+
+static void
+stream_fill_cb(int fd, short event, void *arg)
+{
+  stream_fill((struct stream_ctx *)arg);
+}
+
+/* Pads a stream of exact size with silence when decoding ends short of it,
+ * as it can after a seek; returns the number of bytes added
+ */
+static int
+stream_pad(struct stream_ctx *st)
+{
+  static const uint8_t silence[4096];
+  off_t len;
+  off_t n;
+
+  len = st->size - st->offset;
+  if (len > STREAM_CHUNK_SIZE)
+    len = STREAM_CHUNK_SIZE;
+
+  DPRINTF(E_DBG, L_HTTPD, "Padding transcoded file id %d with %d bytes of silence\n", st->id, (int)len);
+
+  for (n = len; n > 0; n -= sizeof(silence))
+    evbuffer_add(st->evbuf, silence, (n < sizeof(silence)) ? n : sizeof(silence));
+
+  return len;
+}
+
+/* Drops the output past len bytes in the stream buffer */
+static void
+stream_trim(struct stream_ctx *st, size_t len)
+{
+  struct evbuffer *keep;
+
+  keep = evbuffer_new();
+  if (!keep)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Out of memory for stream buffer\n");
+
+      return;
+    }
+
+  evbuffer_remove_buffer(st->evbuf, keep, len);
+  evbuffer_drain(st->evbuf, EVBUFFER_LENGTH(st->evbuf));
+  evbuffer_add_buffer(st->evbuf, keep);
+
+  evbuffer_free(keep);
+}
+
+/* Returns 1 if a chunk was queued, 0 if data was consumed without queueing
+ * anything, 2 if waiting for the transcode pool and -1 if streaming ended
+ */
+static int
+stream_chunk_xcoded(struct stream_ctx *st, int xcoded)
 {
-  struct stream_ctx *st;
-  struct timeval tv;
-  int xcoded;
   int ret;
 
-  st = (struct stream_ctx *)arg;
+  if (st->exact)
+    {
+      /* Everything the client was promised has been sent */
+      if ((xcoded > 0) && (st->offset >= st->size))
+	{
+	  evbuffer_drain(st->evbuf, EVBUFFER_LENGTH(st->evbuf));
+	  xcoded = 0;
+	}
+      else if ((xcoded == 0) && (st->offset < st->size))
+	xcoded = stream_pad(st);
+    }
 
-  xcoded = transcode(st->xcode, st->evbuf, STREAM_CHUNK_SIZE);
   if (xcoded <= 0)
     {
       if (xcoded == 0)
-	DPRINTF(E_LOG, L_HTTPD, "Done streaming transcoded file id %d\n", st->id);
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Done streaming transcoded file id %d\n", st->id);
+
+	  if (st->cache)
+	    {
+	      transcode_cache_writer_commit(st->cache);
+	      st->cache = NULL;
+	    }
+	}
       else
 	DPRINTF(E_LOG, L_HTTPD, "Transcoding error, file id %d\n", st->id);
 
       stream_end(st, 0);
-      return;
+      return -1;
     }
 
   DPRINTF(E_DBG, L_HTTPD, "Got %d bytes from transcode; streaming file id %d\n", xcoded, st->id);
@@ -220,45 +417,153 @@ stream_chunk_xcode_cb(int fd, short event, void *arg)
 	  evbuffer_drain(st->evbuf, xcoded);
 	  st->offset += xcoded;
 
-	  goto consume;
+	  return 0;
 	}
     }
   else
     ret = xcoded;
 
-  evhttp_send_reply_chunk_with_cb(st->req, st->evbuf, stream_chunk_resched_cb, st);
+  if (st->exact && (st->offset + ret > st->size))
+    {
+      ret = st->size - st->offset;
+      stream_trim(st, ret);
+    }
+
+  if (st->cache)
+    {
+      if (transcode_cache_write(st->cache, st->evbuf) < 0)
+	{
+	  transcode_cache_writer_abort(st->cache);
+	  st->cache = NULL;
+	}
+    }
+
+  evhttp_send_reply_chunk_with_cb(st->req, st->evbuf, stream_lowat_cb, st);
 
   st->offset += ret;
 
   stream_up_playcount(st);
 
-  return;
+  return 1;
+}
 
- consume: /* reschedule immediately - consume up to start_offset */
-  evutil_timerclear(&tv);
-  ret = event_add(&st->ev, &tv);
-  if (ret < 0)
+static int
+stream_chunk_xcode(struct stream_ctx *st)
+{
+  return stream_chunk_xcoded(st, transcode(st->xcode, st->evbuf, STREAM_CHUNK_SIZE));
+}
+
+/* The stream fell out of the window of a shared transcoding; carry on
+ * with a decoder of its own from where it is
+ */
+static int
+stream_pool_fallback(struct stream_ctx *st)
+{
+  struct media_file_info *mfi;
+  struct transcode_ctx *xcode;
+  off_t size;
+  off_t pos;
+
+  DPRINTF(E_INFO, L_HTTPD, "Stream of file id %d fell behind shared transcoding, decoding on its own\n", st->id);
+
+  transcode_pool_stop(st->pool);
+  st->pool = NULL;
+
+  mfi = db_file_fetch_byid(st->id);
+  if (!mfi)
     {
-      DPRINTF(E_LOG, L_HTTPD, "Could not re-add one-shot event for streaming (xcode)\n");
+      DPRINTF(E_LOG, L_HTTPD, "Item %d not found\n", st->id);
 
-      stream_end(st, 0);
-      return;
+      return -1;
     }
+
+  xcode = transcode_setup(mfi, &size, st->xcode_format);
+  free_mfi(mfi, 0);
+  if (!xcode)
+    {
+      DPRINTF(E_WARN, L_HTTPD, "Transcoding setup failed, file id %d\n", st->id);
+
+      return -1;
+    }
+
+  pos = transcode_seek_bytes(xcode, st->offset);
+  if (pos < 0)
+    pos = 0;
+
+  /* Consume up to where we were */
+  st->start_offset = st->offset;
+  st->offset = pos;
+
+  st->pool = transcode_pool_start(xcode, 0, st->xcode_format, pos, size, httpd_self->xcode_pipe[1], st);
+  if (!st->pool)
+    {
+      st->xcode = xcode;
+      st->chunk = stream_chunk_xcode;
+    }
+
+  return 0;
+}
+
+static int
+stream_chunk_pool(struct stream_ctx *st)
+{
+  int xcoded;
+  int ret;
+
+  xcoded = transcode_pool_read(st->pool, st->evbuf, STREAM_CHUNK_SIZE);
+  if (xcoded == TRANSCODE_POOL_AGAIN)
+    return 2;
+
+  if (xcoded == TRANSCODE_POOL_BEHIND)
+    {
+      ret = stream_pool_fallback(st);
+      if (ret == 0)
+	return 0;
+
+      xcoded = -1;
+    }
+
+  return stream_chunk_xcoded(st, xcoded);
 }
 
+/* Thread: httpd */
 static void
-stream_chunk_raw_cb(int fd, short event, void *arg)
+xcode_notify_cb(int fd, short event, void *arg)
 {
+  struct httpd_thread *t;
+  struct transcode_stream *ts;
   struct stream_ctx *st;
-  size_t chunk_size;
   int ret;
 
-  st = (struct stream_ctx *)arg;
+  t = (struct httpd_thread *)arg;
+
+  ret = read(fd, &ts, sizeof(ts));
+  if (ret != sizeof(ts))
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not read transcode notification! (read %d): %s\n", ret, (ret < 0) ? strerror(errno) : "-no error-");
+
+      goto readd;
+    }
+
+  /* NULL if the stream ended in the meantime */
+  st = (struct stream_ctx *)transcode_pool_notified(ts);
+  if (st)
+    stream_fill(st);
+
+ readd:
+  event_add(&t->xcodeev, NULL);
+}
+
+static int
+stream_chunk_raw(struct stream_ctx *st)
+{
+  size_t chunk_size;
+  int ret;
 
   if (st->end_offset && (st->offset > st->end_offset))
     {
       stream_end(st, 0);
-      return;
+      return -1;
     }
 
   if (st->end_offset && ((st->offset + STREAM_CHUNK_SIZE) > (st->end_offset + 1)))
@@ -275,20 +580,85 @@ stream_chunk_raw_cb(int fd, short event, void *arg)
 	DPRINTF(E_LOG, L_HTTPD, "Streaming error, file id %d\n", st->id);
 
       stream_end(st, 0);
-      return;
+      return -1;
     }
 
   DPRINTF(E_DBG, L_HTTPD, "Read %d bytes; streaming file id %d\n", ret, st->id);
 
   evbuffer_add(st->evbuf, st->buf, ret);
 
-  evhttp_send_reply_chunk_with_cb(st->req, st->evbuf, stream_chunk_resched_cb, st);
+  evhttp_send_reply_chunk_with_cb(st->req, st->evbuf, stream_lowat_cb, st);
 
   st->offset += ret;
 
+  prefetch_update(st->prefetch_id, st->offset);
+
+  stream_up_playcount(st);
+
+  return 1;
+}
+
+/* Zero-copy raw streaming; called again by evhttp once each chunk is out */
+static void
+stream_chunk_sendfile_cb(struct evhttp_connection *evcon, void *arg)
+{
+  struct stream_ctx *st;
+  off_t end;
+  size_t chunk_size;
+  int ret;
+
+  st = (struct stream_ctx *)arg;
+
+  end = (st->end_offset) ? st->end_offset + 1 : st->size;
+
+  if (st->offset >= end)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Done streaming file id %d\n", st->id);
+
+      stream_end(st, 0);
+      return;
+    }
+
+  if (end - st->offset > STREAM_SENDFILE_CHUNK)
+    chunk_size = STREAM_SENDFILE_CHUNK;
+  else
+    chunk_size = end - st->offset;
+
+  ret = evhttp_send_reply_file_with_cb(st->req, st->fd, st->offset, chunk_size, stream_chunk_sendfile_cb, st);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not send file id %d\n", st->id);
+
+      stream_end(st, 0);
+      return;
+    }
+
+  DPRINTF(E_SPAM, L_HTTPD, "Queued %zu bytes; streaming file id %d\n", chunk_size, st->id);
+
+  st->offset += chunk_size;
+
+  prefetch_update(st->prefetch_id, st->offset);
+
   stream_up_playcount(st);
 }
 
+static void
+stream_chunk_sendfile_start_cb(int fd, short event, void *arg)
+{
+  struct stream_ctx *st;
+
+  st = (struct stream_ctx *)arg;
+
+  /* evhttp can't do zero-copy on this platform, copy the data through st->buf */
+  if (!evhttp_can_send_file())
+    {
+      stream_fill(st);
+      return;
+    }
+
+  stream_chunk_sendfile_cb(NULL, st);
+}
+
 static void
 stream_fail_cb(struct evhttp_connection *evcon, void *arg)
 {
@@ -299,8 +669,6 @@ stream_fail_cb(struct evhttp_connection *evcon, void *arg)
   DPRINTF(E_LOG, L_HTTPD, "Connection failed; stopping streaming of file ID %d\n", st->id);
 
   /* Stop streaming */
-  event_del(&st->ev);
-
   stream_end(st, 1);
 }
 
@@ -320,7 +688,9 @@ httpd_stream_file(struct evhttp_request *req, int id)
   int64_t offset;
   int64_t end_offset;
   off_t pos;
+  off_t cached_size;
   int transcode;
+  int cached;
   int ret;
 
   offset = 0;
@@ -389,29 +759,85 @@ httpd_stream_file(struct evhttp_request *req, int id)
 
   transcode = transcode_needed(req->input_headers, mfi->codectype);
 
+  /* Serve a previous transcoding of this file as a regular file */
+  cached = 0;
+  if (transcode == XCODE_PCM16_HEADER)
+    {
+      st->fd = transcode_cache_open(mfi, &cached_size);
+      if (st->fd >= 0)
+	{
+	  transcode = 0;
+	  cached = 1;
+	}
+    }
+
+  /* The size of the MP4 output is only a guess and the encoder can't start
+   * mid-stream, so there's no honest way to answer a range; send it all
+   */
+  if ((transcode == XCODE_ALAC) && ((offset > 0) || (end_offset > 0)))
+    {
+      DPRINTF(E_DBG, L_HTTPD, "Ignoring Range header for ALAC transcoding of %s\n", mfi->path);
+
+      offset = 0;
+      end_offset = 0;
+    }
+
   if (transcode)
     {
-      DPRINTF(E_INFO, L_HTTPD, "Preparing to transcode %s\n", mfi->path);
+      DPRINTF(E_INFO, L_HTTPD, "Preparing to transcode %s to %s\n", mfi->path, (transcode == XCODE_ALAC) ? "ALAC" : "WAV");
 
-      stream_cb = stream_chunk_xcode_cb;
+      stream_cb = stream_fill_cb;
+      st->chunk = stream_chunk_xcode;
+      st->xcode_format = transcode;
 
-      st->xcode = transcode_setup(mfi, &st->size, 1);
-      if (!st->xcode)
+      /* Share the decoding of another stream of this item, if we can */
+      st->pool = transcode_pool_join(mfi->id, transcode, offset, &st->size, httpd_self->xcode_pipe[1], st);
+      if (st->pool)
 	{
-	  DPRINTF(E_WARN, L_HTTPD, "Transcoding setup failed, aborting streaming\n");
+	  DPRINTF(E_DBG, L_HTTPD, "Sharing transcoding of %s with another stream\n", mfi->path);
 
-	  evhttp_send_error(req, HTTP_SERVUNAVAIL, "Internal Server Error");
+	  st->chunk = stream_chunk_pool;
+	  st->offset = offset;
+	}
+      else
+	{
+	  st->xcode = transcode_setup(mfi, &st->size, transcode);
+	  if (!st->xcode)
+	    {
+	      DPRINTF(E_WARN, L_HTTPD, "Transcoding setup failed, aborting streaming\n");
 
-	  goto out_free_st;
+	      evhttp_send_error(req, HTTP_SERVUNAVAIL, "Internal Server Error");
+
+	      goto out_free_st;
+	    }
 	}
 
       if (!evhttp_find_header(req->output_headers, "Content-Type"))
-	evhttp_add_header(req->output_headers, "Content-Type", "audio/wav");
+	evhttp_add_header(req->output_headers, "Content-Type", (transcode == XCODE_ALAC) ? "audio/mp4" : "audio/wav");
+
+      /* Map the requested byte offset to a sample and seek there; the few
+       * bytes up to the exact offset are then consumed by stream_chunk_xcode()
+       */
+      if (!st->pool && (offset > 0))
+	{
+	  pos = transcode_seek_bytes(st->xcode, offset);
+	  if (pos < 0)
+	    DPRINTF(E_WARN, L_HTTPD, "Could not seek into transcoded stream, will decode from the start\n");
+	  else
+	    st->offset = pos;
+	}
+
+      /* Whole file, keep the output for the next time */
+      if ((offset == 0) && (transcode == XCODE_PCM16_HEADER))
+	st->cache = transcode_cache_writer_new(mfi);
     }
   else
     {
       /* Stream the raw file */
-      DPRINTF(E_INFO, L_HTTPD, "Preparing to stream %s\n", mfi->path);
+      if (cached)
+	DPRINTF(E_INFO, L_HTTPD, "Preparing to stream cached transcoding of %s\n", mfi->path);
+      else
+	DPRINTF(E_INFO, L_HTTPD, "Preparing to stream %s\n", mfi->path);
 
       st->buf = (uint8_t *)malloc(STREAM_CHUNK_SIZE);
       if (!st->buf)
@@ -420,31 +846,37 @@ httpd_stream_file(struct evhttp_request *req, int id)
 
 	  evhttp_send_error(req, HTTP_SERVUNAVAIL, "Internal Server Error");
 
-	  goto out_free_st;
+	  goto out_cleanup;
 	}
 
-      stream_cb = stream_chunk_raw_cb;
+      stream_cb = stream_chunk_sendfile_start_cb;
+      st->chunk = stream_chunk_raw;
 
-      st->fd = open(mfi->path, O_RDONLY);
-      if (st->fd < 0)
+      if (cached)
+	st->size = cached_size;
+      else
 	{
-	  DPRINTF(E_LOG, L_HTTPD, "Could not open %s: %s\n", mfi->path, strerror(errno));
+	  st->fd = open(mfi->path, O_RDONLY);
+	  if (st->fd < 0)
+	    {
+	      DPRINTF(E_LOG, L_HTTPD, "Could not open %s: %s\n", mfi->path, strerror(errno));
 
-	  evhttp_send_error(req, HTTP_NOTFOUND, "Not Found");
+	      evhttp_send_error(req, HTTP_NOTFOUND, "Not Found");
 
-	  goto out_cleanup;
-	}
+	      goto out_cleanup;
+	    }
 
-      ret = stat(mfi->path, &sb);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_HTTPD, "Could not stat() %s: %s\n", mfi->path, strerror(errno));
+	  ret = stat(mfi->path, &sb);
+	  if (ret < 0)
+	    {
+	      DPRINTF(E_LOG, L_HTTPD, "Could not stat() %s: %s\n", mfi->path, strerror(errno));
 
-	  evhttp_send_error(req, HTTP_NOTFOUND, "Not Found");
+	      evhttp_send_error(req, HTTP_NOTFOUND, "Not Found");
 
-	  goto out_cleanup;
+	      goto out_cleanup;
+	    }
+	  st->size = sb.st_size;
 	}
-      st->size = sb.st_size;
 
       pos = lseek(st->fd, offset, SEEK_SET);
       if (pos == (off_t) -1)
@@ -458,11 +890,16 @@ httpd_stream_file(struct evhttp_request *req, int id)
       st->offset = offset;
       st->end_offset = end_offset;
 
+      if (cached)
+	{
+	  if (!evhttp_find_header(req->output_headers, "Content-Type"))
+	    evhttp_add_header(req->output_headers, "Content-Type", "audio/wav");
+	}
       /* Content-Type for video files is different than for audio files
        * and overrides whatever may have been set previously, like
        * application/x-dmap-tagged when we're speaking DAAP.
        */
-      if (mfi->has_video)
+      else if (mfi->has_video)
 	{
 	  /* Front Row and others expect video/<type> */
 	  ret = snprintf(buf, sizeof(buf), "video/%s", mfi->type);
@@ -529,13 +966,18 @@ httpd_stream_file(struct evhttp_request *req, int id)
   st->stream_size = st->size;
   st->req = req;
 
+  /* The scanner analysis gives the exact size of WAV transcodings */
+  if (transcode && (transcode_exact_size(mfi, transcode) == st->size))
+    st->exact = 1;
+
   if ((offset == 0) && (end_offset == 0))
     {
       /* If we are not decoding, send the Content-Length. We don't do
        * that if we are decoding because we can only guesstimate the
-       * size in this case and the error margin is unknown and variable.
+       * size in this case and the error margin is unknown and variable,
+       * unless the exact size is known.
        */
-      if (!transcode)
+      if (!transcode || st->exact)
 	{
 	  ret = snprintf(buf, sizeof(buf), "%" PRIi64, (int64_t)st->size);
 	  if ((ret < 0) || (ret >= sizeof(buf)))
@@ -581,7 +1023,25 @@ httpd_stream_file(struct evhttp_request *req, int id)
     }
 #endif
 
+  /* Keep the next seconds of the file resident ahead of the client */
+  if (!transcode && !cached)
+    st->prefetch_id = prefetch_start(mfi->path, st->offset, mfi->bitrate);
+
   evhttp_connection_set_closecb(req->evcon, stream_fail_cb, st);
+  evhttp_connection_set_lowat(req->evcon, stream_lowat);
+
+  /* Hand the transcoding over to the worker pool, if any; it starts
+   * filling the ring buffer while the headers go out
+   */
+  if (st->xcode)
+    {
+      st->pool = transcode_pool_start(st->xcode, st->id, st->xcode_format, st->offset, st->size, httpd_self->xcode_pipe[1], st);
+      if (st->pool)
+	{
+	  st->xcode = NULL;
+	  st->chunk = stream_chunk_pool;
+	}
+    }
 
   DPRINTF(E_INFO, L_HTTPD, "Kicking off streaming for %s\n", mfi->path);
 
@@ -592,6 +1052,10 @@ httpd_stream_file(struct evhttp_request *req, int id)
  out_cleanup:
   if (st->evbuf)
     evbuffer_free(st->evbuf);
+  if (st->cache)
+    transcode_cache_writer_abort(st->cache);
+  if (st->pool)
+    transcode_pool_stop(st->pool);
   if (st->xcode)
     transcode_cleanup(st->xcode);
   if (st->buf)
@@ -604,16 +1068,563 @@ httpd_stream_file(struct evhttp_request *req, int id)
   free_mfi(mfi, 0);
 }
 
+/* Deflate the whole of in as a gzip stream, appended to out; in is left untouched */
+static int
+httpd_gzip(struct evbuffer *in, struct evbuffer *out, int level)
+{
+  unsigned char *outbuf;
+  z_stream strm;
+  int flush;
+  int zret;
+  int ret;
+
+  outbuf = (unsigned char *)malloc(GZIP_CHUNK_SIZE);
+  if (!outbuf)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Out of memory for gzip buffer\n");
+
+      return -1;
+    }
+
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+
+  /* Set up a gzip stream (the "+ 16" in 15 + 16), instead of a zlib stream (default) */
+  zret = deflateInit2(&strm, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+  if (zret != Z_OK)
+    {
+      DPRINTF(E_DBG, L_HTTPD, "zlib setup failed: %s\n", zError(zret));
+
+      free(outbuf);
+      return -1;
+    }
+
+  strm.next_in = EVBUFFER_DATA(in);
+  strm.avail_in = EVBUFFER_LENGTH(in);
+
+  flush = Z_NO_FLUSH;
+
+  /* 2 iterations: Z_NO_FLUSH until input is consumed, then Z_FINISH */
+  for (;;)
+    {
+      do
+	{
+	  strm.next_out = outbuf;
+	  strm.avail_out = GZIP_CHUNK_SIZE;
+
+	  zret = deflate(&strm, flush);
+	  if (zret == Z_STREAM_ERROR)
+	    {
+	      DPRINTF(E_LOG, L_HTTPD, "Could not deflate data: %s\n", strm.msg);
+
+	      goto out_fail;
+	    }
+
+	  ret = evbuffer_add(out, outbuf, GZIP_CHUNK_SIZE - strm.avail_out);
+	  if (ret < 0)
+	    {
+	      DPRINTF(E_LOG, L_HTTPD, "Out of memory adding gzipped data to evbuffer\n");
+
+	      goto out_fail;
+	    }
+	}
+      while (strm.avail_out == 0);
+
+      if (flush == Z_FINISH)
+	break;
+
+      flush = Z_FINISH;
+    }
+
+  if (zret != Z_STREAM_END)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Compressed data not finalized!\n");
+
+      goto out_fail;
+    }
+
+  deflateEnd(&strm);
+  free(outbuf);
+
+  return 0;
+
+ out_fail:
+  deflateEnd(&strm);
+  free(outbuf);
+
+  return -1;
+}
+
+/* Big payloads get a faster compression level, as do all payloads
+ * when the workers are falling behind.
+ */
+static int
+gzip_level(size_t len, int pending)
+{
+  if (pending >= gzip_nworkers)
+    return 1;
+
+  if (len >= (4 * 1024 * 1024))
+    return 1;
+  else if (len >= (512 * 1024))
+    return 3;
+
+  return Z_DEFAULT_COMPRESSION;
+}
+
+
+/* Cache of compressed bodies, keyed by the uncompressed body */
+static void
+gzip_cache_entry_free(struct gzip_cache_entry *e)
+{
+  free(e->in);
+  free(e->data);
+  free(e);
+}
+
+/* Thread: gzip worker */
+static int
+gzip_cache_get(uint64_t hash, struct evbuffer *in, struct evbuffer *out)
+{
+  struct gzip_cache_entry *e;
+  struct gzip_cache_entry *prev;
+  size_t in_len;
+  int ret;
+
+  in_len = EVBUFFER_LENGTH(in);
+
+  pthread_mutex_lock(&gzip_cache_lck);
+
+  prev = NULL;
+  for (e = gzip_cache; e; e = e->next)
+    {
+      if ((e->hash == hash) && (e->in_len == in_len)
+	  && (memcmp(e->in, EVBUFFER_DATA(in), in_len) == 0))
+	break;
+
+      prev = e;
+    }
+
+  if (!e)
+    {
+      pthread_mutex_unlock(&gzip_cache_lck);
+
+      return -1;
+    }
+
+  /* Move to front */
+  if (prev)
+    {
+      prev->next = e->next;
+      e->next = gzip_cache;
+      gzip_cache = e;
+    }
+
+  ret = evbuffer_add(out, e->data, e->len);
+
+  pthread_mutex_unlock(&gzip_cache_lck);
+
+  return ret;
+}
+
+/* Thread: gzip worker */
+static void
+gzip_cache_add(uint64_t hash, struct evbuffer *in, struct evbuffer *out)
+{
+  struct gzip_cache_entry *e;
+  struct gzip_cache_entry *prev;
+
+  /* Both bodies count against the budget */
+  if (EVBUFFER_LENGTH(in) + EVBUFFER_LENGTH(out) > GZIP_CACHE_SIZE / 4)
+    return;
+
+  e = (struct gzip_cache_entry *)malloc(sizeof(struct gzip_cache_entry));
+  if (!e)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Out of memory for gzip cache entry\n");
+
+      return;
+    }
+
+  e->in = (uint8_t *)malloc(EVBUFFER_LENGTH(in));
+  e->data = (uint8_t *)malloc(EVBUFFER_LENGTH(out));
+  if (!e->in || !e->data)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Out of memory for gzip cache data\n");
+
+      if (e->in)
+	free(e->in);
+      if (e->data)
+	free(e->data);
+      free(e);
+      return;
+    }
+
+  memcpy(e->in, EVBUFFER_DATA(in), EVBUFFER_LENGTH(in));
+  e->in_len = EVBUFFER_LENGTH(in);
+  memcpy(e->data, EVBUFFER_DATA(out), EVBUFFER_LENGTH(out));
+  e->len = EVBUFFER_LENGTH(out);
+  e->hash = hash;
+
+  pthread_mutex_lock(&gzip_cache_lck);
+
+  e->next = gzip_cache;
+  gzip_cache = e;
+  gzip_cache_size += e->in_len + e->len;
+  gzip_cache_entries++;
+
+  /* Evict from the tail until within limits; the new entry is always
+   * smaller than the budget, so it is never evicted here
+   */
+  while ((gzip_cache_size > GZIP_CACHE_SIZE) || (gzip_cache_entries > GZIP_CACHE_ENTRIES))
+    {
+      prev = gzip_cache;
+      for (e = gzip_cache; e->next; e = e->next)
+	prev = e;
+
+      prev->next = NULL;
+      gzip_cache_size -= e->in_len + e->len;
+      gzip_cache_entries--;
+
+      gzip_cache_entry_free(e);
+    }
+
+  pthread_mutex_unlock(&gzip_cache_lck);
+}
+
+static void
+gzip_cache_clear(void)
+{
+  struct gzip_cache_entry *e;
+
+  pthread_mutex_lock(&gzip_cache_lck);
+
+  for (e = gzip_cache; gzip_cache; e = gzip_cache)
+    {
+      gzip_cache = e->next;
+
+      gzip_cache_entry_free(e);
+    }
+
+  gzip_cache_size = 0;
+  gzip_cache_entries = 0;
+
+  pthread_mutex_unlock(&gzip_cache_lck);
+}
+
+
+/* Thread: gzip worker */
+static void *
+gzip_worker(void *arg)
+{
+  struct gzip_job *job;
+  uint64_t hash;
+  size_t len;
+  int ret;
+
+  for (;;)
+    {
+      pthread_mutex_lock(&gzip_lck);
+
+      while (!gzip_queue && !gzip_exit)
+	pthread_cond_wait(&gzip_cond, &gzip_lck);
+
+      if (gzip_exit)
+	{
+	  pthread_mutex_unlock(&gzip_lck);
+	  break;
+	}
+
+      job = gzip_queue;
+      gzip_queue = job->next;
+      gzip_pending--;
+
+      pthread_mutex_unlock(&gzip_lck);
+
+      len = EVBUFFER_LENGTH(job->in);
+      hash = murmur_hash64(EVBUFFER_DATA(job->in), len, 0);
+
+      ret = gzip_cache_get(hash, job->in, job->out);
+      if (ret == 0)
+	DPRINTF(E_DBG, L_HTTPD, "Using cached gzipped reply (%zu bytes)\n", len);
+      else
+	{
+	  DPRINTF(E_DBG, L_HTTPD, "Gzipping %zu bytes at level %d\n", len, job->level);
+
+	  ret = httpd_gzip(job->in, job->out, job->level);
+	  if (ret == 0)
+	    gzip_cache_add(hash, job->in, job->out);
+	}
+
+      job->ret = ret;
+
+      ret = write(job->done_fd, &job, sizeof(job));
+      if (ret != sizeof(job))
+	DPRINTF(E_LOG, L_HTTPD, "Could not write to gzip completion fd: %s\n", strerror(errno));
+    }
+
+  pthread_exit(NULL);
+}
+
+static void
+gzip_job_free(struct gzip_job *job)
+{
+  if (job->req && job->req->evcon)
+    evhttp_connection_set_closecb(job->req->evcon, NULL, NULL);
+
+  evbuffer_free(job->in);
+  evbuffer_free(job->out);
+  free(job->reason);
+  free(job);
+}
+
+/* Thread: httpd */
+static void
+gzip_job_fail_cb(struct evhttp_connection *evcon, void *arg)
+{
+  struct gzip_job *job;
+
+  job = (struct gzip_job *)arg;
+
+  DPRINTF(E_DBG, L_HTTPD, "Connection closed while gzipping reply\n");
+
+  /* The request goes away with the connection; the job is freed on completion */
+  job->req = NULL;
+}
+
+/* Thread: httpd */
+static void
+gzip_done_cb(int fd, short event, void *arg)
+{
+  struct httpd_thread *t;
+  struct gzip_job *job;
+  int ret;
+
+  t = (struct httpd_thread *)arg;
+
+  ret = read(fd, &job, sizeof(job));
+  if (ret != sizeof(job))
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not read gzip job! (read %d): %s\n", ret, (ret < 0) ? strerror(errno) : "-no error-");
+
+      goto readd;
+    }
+
+  if (!job->req)
+    goto out;
+
+  if (job->req->evcon)
+    evhttp_connection_set_closecb(job->req->evcon, NULL, NULL);
+
+  if (job->ret == 0)
+    {
+      evhttp_add_header(job->req->output_headers, "Content-Encoding", "gzip");
+      evhttp_send_reply(job->req, job->code, job->reason, job->out);
+    }
+  else
+    evhttp_send_reply(job->req, job->code, job->reason, job->in);
+
+  job->req = NULL;
+
+ out:
+  gzip_job_free(job);
+
+ readd:
+  event_add(&t->gzipev, NULL);
+}
+
+/* Thread: httpd */
+static int
+gzip_job_submit(struct evhttp_request *req, int code, const char *reason, struct evbuffer *evbuf)
+{
+  struct gzip_job *job;
+  struct gzip_job *j;
+  int ret;
+
+  job = (struct gzip_job *)malloc(sizeof(struct gzip_job));
+  if (!job)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Out of memory for gzip job\n");
+
+      return -1;
+    }
+
+  memset(job, 0, sizeof(struct gzip_job));
+
+  job->in = evbuffer_new();
+  job->out = evbuffer_new();
+  job->reason = strdup(reason);
+  if (!job->in || !job->out || !job->reason)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Out of memory for gzip job\n");
+
+      goto out_fail;
+    }
+
+  /* Moves the data, draining evbuf as would evhttp_send_reply() */
+  ret = evbuffer_add_buffer(job->in, evbuf);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not move reply to gzip job\n");
+
+      goto out_fail;
+    }
+
+  job->req = req;
+  job->done_fd = httpd_self->gzip_pipe[1];
+  job->code = code;
+
+  if (req->evcon)
+    evhttp_connection_set_closecb(req->evcon, gzip_job_fail_cb, job);
+
+  pthread_mutex_lock(&gzip_lck);
+
+  job->level = gzip_level(EVBUFFER_LENGTH(job->in), gzip_pending);
+
+  if (!gzip_queue)
+    gzip_queue = job;
+  else
+    {
+      for (j = gzip_queue; j->next; j = j->next)
+	; /* EMPTY */
+
+      j->next = job;
+    }
+
+  gzip_pending++;
+
+  pthread_cond_signal(&gzip_cond);
+  pthread_mutex_unlock(&gzip_lck);
+
+  return 0;
+
+ out_fail:
+  /* Put back whatever was moved */
+  if (job->in)
+    evbuffer_add_buffer(evbuf, job->in);
+
+  job->req = NULL;
+  if (job->in)
+    evbuffer_free(job->in);
+  if (job->out)
+    evbuffer_free(job->out);
+  if (job->reason)
+    free(job->reason);
+  free(job);
+
+  return -1;
+}
+
+/* Thread: main */
+static int
+gzip_init(void)
+{
+  long ncpu;
+  int i;
+  int ret;
+
+  gzip_queue = NULL;
+  gzip_pending = 0;
+  gzip_exit = 0;
+
+  ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpu < 1)
+    ncpu = 1;
+
+  gzip_nworkers = (ncpu > GZIP_MAX_WORKERS) ? GZIP_MAX_WORKERS : ncpu;
+
+  for (i = 0; i < gzip_nworkers; i++)
+    {
+      ret = pthread_create(&tid_gzip[i], NULL, gzip_worker, NULL);
+      if (ret != 0)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Could not spawn gzip worker thread: %s\n", strerror(ret));
+
+	  break;
+	}
+    }
+
+  gzip_nworkers = i;
+  if (gzip_nworkers == 0)
+    return -1;
+
+  DPRINTF(E_DBG, L_HTTPD, "Started %d gzip worker threads\n", gzip_nworkers);
+
+  return 0;
+}
+
+/* Thread: main */
+static void
+gzip_deinit(void)
+{
+  struct gzip_job *job;
+  int i;
+  int ret;
+
+  pthread_mutex_lock(&gzip_lck);
+
+  gzip_exit = 1;
+  pthread_cond_broadcast(&gzip_cond);
+
+  pthread_mutex_unlock(&gzip_lck);
+
+  for (i = 0; i < gzip_nworkers; i++)
+    {
+      ret = pthread_join(tid_gzip[i], NULL);
+      if (ret != 0)
+	DPRINTF(E_LOG, L_HTTPD, "Could not join gzip worker thread: %s\n", strerror(ret));
+    }
+
+  gzip_nworkers = 0;
+
+  /* Jobs never started */
+  while (gzip_queue)
+    {
+      job = gzip_queue;
+      gzip_queue = job->next;
+
+      gzip_job_free(job);
+    }
+
+  gzip_cache_clear();
+}
+
+/* Thread: main, once the workers are stopped */
+static void
+gzip_drain(struct httpd_thread *t)
+{
+  struct gzip_job *job;
+
+  /* Jobs completed but not picked up by the httpd thread */
+  close(t->gzip_pipe[1]);
+
+  while (read(t->gzip_pipe[0], &job, sizeof(job)) == sizeof(job))
+    gzip_job_free(job);
+
+  close(t->gzip_pipe[0]);
+}
+
+/* Thread: main, once the workers are stopped */
+static void
+xcode_drain(struct httpd_thread *t)
+{
+  struct transcode_stream *ts;
+
+  close(t->xcode_pipe[1]);
+
+  while (read(t->xcode_pipe[0], &ts, sizeof(ts)) == sizeof(ts))
+    transcode_pool_notified(ts);
+
+  close(t->xcode_pipe[0]);
+}
+
 /* Thread: httpd */
 void
 httpd_send_reply(struct evhttp_request *req, int code, const char *reason, struct evbuffer *evbuf)
 {
-  unsigned char outbuf[128 * 1024];
-  z_stream strm;
   struct evbuffer *gzbuf;
   const char *param;
-  int flush;
-  int zret;
   int ret;
 
   if (!evbuf || (EVBUFFER_LENGTH(evbuf) == 0))
@@ -637,73 +1648,32 @@ httpd_send_reply(struct evhttp_request *req, int code, const char *reason, struc
       goto no_gzip;
     }
 
-  gzbuf = evbuffer_new();
-  if (!gzbuf)
-    {
-      DPRINTF(E_LOG, L_HTTPD, "Could not allocate evbuffer for gzipped reply\n");
-
-      goto no_gzip;
-    }
-
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
-
-  /* Set up a gzip stream (the "+ 16" in 15 + 16), instead of a zlib stream (default) */
-  zret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
-  if (zret != Z_OK)
+  /* Big replies are compressed by the workers, off the event loop */
+  if ((EVBUFFER_LENGTH(evbuf) >= GZIP_INLINE_MAX) && (gzip_nworkers > 0))
     {
-      DPRINTF(E_DBG, L_HTTPD, "zlib setup failed: %s\n", zError(zret));
+      ret = gzip_job_submit(req, code, reason, evbuf);
+      if (ret == 0)
+	return;
 
-      goto out_fail_init;
+      DPRINTF(E_WARN, L_HTTPD, "Could not hand reply over to gzip workers, compressing inline\n");
     }
 
-  strm.next_in = EVBUFFER_DATA(evbuf);
-  strm.avail_in = EVBUFFER_LENGTH(evbuf);
-
-  flush = Z_NO_FLUSH;
-
-  /* 2 iterations: Z_NO_FLUSH until input is consumed, then Z_FINISH */
-  for (;;)
+  gzbuf = evbuffer_new();
+  if (!gzbuf)
     {
-      do
-	{
-	  strm.next_out = outbuf;
-	  strm.avail_out = sizeof(outbuf);
-
-	  zret = deflate(&strm, flush);
-	  if (zret == Z_STREAM_ERROR)
-	    {
-	      DPRINTF(E_LOG, L_HTTPD, "Could not deflate data: %s\n", strm.msg);
-
-	      goto out_fail_gz;
-	    }
-
-	  ret = evbuffer_add(gzbuf, outbuf, sizeof(outbuf) - strm.avail_out);
-	  if (ret < 0)
-	    {
-	      DPRINTF(E_LOG, L_HTTPD, "Out of memory adding gzipped data to evbuffer\n");
-
-	      goto out_fail_gz;
-	    }
-	}
-      while (strm.avail_out == 0);
-
-      if (flush == Z_FINISH)
-	break;
+      DPRINTF(E_LOG, L_HTTPD, "Could not allocate evbuffer for gzipped reply\n");
 
-      flush = Z_FINISH;
+      goto no_gzip;
     }
 
-  if (zret != Z_STREAM_END)
+  ret = httpd_gzip(evbuf, gzbuf, Z_DEFAULT_COMPRESSION);
+  if (ret < 0)
     {
-      DPRINTF(E_LOG, L_HTTPD, "Compressed data not finalized!\n");
+      evbuffer_free(gzbuf);
 
-      goto out_fail_gz;
+      goto no_gzip;
     }
 
-  deflateEnd(&strm);
-
   evhttp_add_header(req->output_headers, "Content-Encoding", "gzip");
   evhttp_send_reply(req, code, reason, gzbuf);
 
@@ -714,10 +1684,6 @@ httpd_send_reply(struct evhttp_request *req, int code, const char *reason, struc
 
   return;
 
- out_fail_gz:
-  deflateEnd(&strm);
- out_fail_init:
-  evbuffer_free(gzbuf);
  no_gzip:
   evhttp_send_reply(req, code, reason, evbuf);
 }
@@ -958,12 +1924,14 @@ httpd_gen_cb(struct evhttp_request *req, void *arg)
   else if (daap_is_request(req, uri))
     {
       daap_request(req);
+      daap_session_release();
 
       goto out;
     }
   else if (dacp_is_request(req, uri))
     {
       dacp_request(req);
+      daap_session_release();
 
       goto out;
     }
@@ -981,8 +1949,14 @@ httpd_gen_cb(struct evhttp_request *req, void *arg)
 static void *
 httpd(void *arg)
 {
+  struct httpd_thread *t;
   int ret;
 
+  t = (struct httpd_thread *)arg;
+
+  httpd_self = t;
+  evbase_httpd = t->evbase;
+
   ret = db_perthread_init();
   if (ret < 0)
     {
@@ -991,11 +1965,22 @@ httpd(void *arg)
       pthread_exit(NULL);
     }
 
+  ret = dacp_thread_init();
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Error: DACP thread init failed\n");
+
+      db_perthread_deinit();
+      pthread_exit(NULL);
+    }
+
   event_base_dispatch(evbase_httpd);
 
-  if (!httpd_exit)
+  if (!t->exit)
     DPRINTF(E_FATAL, L_HTTPD, "HTTPd event loop terminated ahead of time!\n");
 
+  dacp_thread_deinit();
+
   db_perthread_deinit();
 
   pthread_exit(NULL);
@@ -1005,9 +1990,13 @@ httpd(void *arg)
 static void
 exit_cb(int fd, short event, void *arg)
 {
-  event_base_loopbreak(evbase_httpd);
+  struct httpd_thread *t;
+
+  t = (struct httpd_thread *)arg;
 
-  httpd_exit = 1;
+  event_base_loopbreak(t->evbase);
+
+  t->exit = 1;
 }
 
 char *
@@ -1196,138 +2185,314 @@ httpd_basic_auth(struct evhttp_request *req, char *user, char *passwd, char *rea
 }
 
 /* Thread: main */
-int
-httpd_init(void)
+static int
+httpd_thread_setup(struct httpd_thread *t)
 {
-  unsigned short port;
-  int v6enabled;
   int ret;
 
-  httpd_exit = 0;
-
-  v6enabled = cfg_getbool(cfg_getsec(cfg, "general"), "ipv6");
+  memset(t, 0, sizeof(struct httpd_thread));
 
-  evbase_httpd = event_base_new();
-  if (!evbase_httpd)
+  t->evbase = event_base_new();
+  if (!t->evbase)
     {
       DPRINTF(E_FATAL, L_HTTPD, "Could not create an event base\n");
 
       return -1;
     }
 
-  ret = rsp_init();
-  if (ret < 0)
+#ifdef USE_EVENTFD
+  t->exit_efd = eventfd(0, EFD_CLOEXEC);
+  if (t->exit_efd < 0)
     {
-      DPRINTF(E_FATAL, L_HTTPD, "RSP protocol init failed\n");
+      DPRINTF(E_FATAL, L_HTTPD, "Could not create eventfd: %s\n", strerror(errno));
 
-      goto rsp_fail;
+      goto exit_fail;
     }
-
-  ret = daap_init();
+#else
+# if defined(__linux__)
+  ret = pipe2(t->exit_pipe, O_CLOEXEC);
+# else
+  ret = pipe(t->exit_pipe);
+# endif
   if (ret < 0)
     {
-      DPRINTF(E_FATAL, L_HTTPD, "DAAP protocol init failed\n");
+      DPRINTF(E_FATAL, L_HTTPD, "Could not create pipe: %s\n", strerror(errno));
 
-      goto daap_fail;
+      goto exit_fail;
     }
+#endif /* USE_EVENTFD */
 
-  ret = dacp_init();
+# if defined(__linux__)
+  ret = pipe2(t->gzip_pipe, O_CLOEXEC);
+# else
+  ret = pipe(t->gzip_pipe);
+# endif
   if (ret < 0)
     {
-      DPRINTF(E_FATAL, L_HTTPD, "DACP protocol init failed\n");
+      DPRINTF(E_FATAL, L_HTTPD, "Could not create gzip pipe: %s\n", strerror(errno));
 
-      goto dacp_fail;
+      goto gzip_fail;
     }
 
-#ifdef USE_EVENTFD
-  exit_efd = eventfd(0, EFD_CLOEXEC);
-  if (exit_efd < 0)
-    {
-      DPRINTF(E_FATAL, L_HTTPD, "Could not create eventfd: %s\n", strerror(errno));
-
-      goto pipe_fail;
-    }
-#else
 # if defined(__linux__)
-  ret = pipe2(exit_pipe, O_CLOEXEC);
+  ret = pipe2(t->xcode_pipe, O_CLOEXEC);
 # else
-  ret = pipe(exit_pipe);
+  ret = pipe(t->xcode_pipe);
 # endif
   if (ret < 0)
     {
-      DPRINTF(E_FATAL, L_HTTPD, "Could not create pipe: %s\n", strerror(errno));
+      DPRINTF(E_FATAL, L_HTTPD, "Could not create transcode pipe: %s\n", strerror(errno));
 
-      goto pipe_fail;
+      goto xcode_fail;
     }
-#endif /* USE_EVENTFD */
 
 #ifdef USE_EVENTFD
-  event_set(&exitev, exit_efd, EV_READ, exit_cb, NULL);
+  event_set(&t->exitev, t->exit_efd, EV_READ, exit_cb, t);
 #else
-  event_set(&exitev, exit_pipe[0], EV_READ, exit_cb, NULL);
+  event_set(&t->exitev, t->exit_pipe[0], EV_READ, exit_cb, t);
 #endif
-  event_base_set(evbase_httpd, &exitev);
-  event_add(&exitev, NULL);
+  event_base_set(t->evbase, &t->exitev);
+  event_add(&t->exitev, NULL);
+
+  event_set(&t->gzipev, t->gzip_pipe[0], EV_READ, gzip_done_cb, t);
+  event_base_set(t->evbase, &t->gzipev);
+  event_add(&t->gzipev, NULL);
 
-  evhttpd = evhttp_new(evbase_httpd);
-  if (!evhttpd)
+  event_set(&t->xcodeev, t->xcode_pipe[0], EV_READ, xcode_notify_cb, t);
+  event_base_set(t->evbase, &t->xcodeev);
+  event_add(&t->xcodeev, NULL);
+
+  t->evhttp = evhttp_new(t->evbase);
+  if (!t->evhttp)
     {
       DPRINTF(E_FATAL, L_HTTPD, "Could not create HTTP server\n");
 
       goto evhttp_fail;
     }
 
+  evhttp_set_gencb(t->evhttp, httpd_gen_cb, NULL);
+
+  return 0;
+
+ evhttp_fail:
+  close(t->xcode_pipe[0]);
+  close(t->xcode_pipe[1]);
+ xcode_fail:
+  close(t->gzip_pipe[0]);
+  close(t->gzip_pipe[1]);
+ gzip_fail:
+#ifdef USE_EVENTFD
+  close(t->exit_efd);
+#else
+  close(t->exit_pipe[0]);
+  close(t->exit_pipe[1]);
+#endif
+ exit_fail:
+  event_base_free(t->evbase);
+
+  return -1;
+}
+
+/* Thread: main */
+static void
+httpd_thread_teardown(struct httpd_thread *t)
+{
+  evhttp_free(t->evhttp);
+
+#ifdef USE_EVENTFD
+  close(t->exit_efd);
+#else
+  close(t->exit_pipe[0]);
+  close(t->exit_pipe[1]);
+#endif
+  event_base_free(t->evbase);
+}
+
+/* Thread: main */
+static int
+httpd_thread_stop(struct httpd_thread *t)
+{
+  int ret;
+
+#ifdef USE_EVENTFD
+  ret = eventfd_write(t->exit_efd, 1);
+  if (ret < 0)
+    {
+      DPRINTF(E_FATAL, L_HTTPD, "Could not send exit event: %s\n", strerror(errno));
+
+      return -1;
+    }
+#else
+  int dummy = 42;
+
+  ret = write(t->exit_pipe[1], &dummy, sizeof(dummy));
+  if (ret != sizeof(dummy))
+    {
+      DPRINTF(E_FATAL, L_HTTPD, "Could not write to exit fd: %s\n", strerror(errno));
+
+      return -1;
+    }
+#endif
+
+  ret = pthread_join(t->tid, NULL);
+  if (ret != 0)
+    {
+      DPRINTF(E_FATAL, L_HTTPD, "Could not join HTTPd thread: %s\n", strerror(ret));
+
+      return -1;
+    }
+
+  return 0;
+}
+
+/* Thread: main */
+int
+httpd_init(void)
+{
+  struct httpd_thread *t;
+  unsigned short port;
+  long ncpu;
+  int v6enabled;
+  int nsetup;
+  int nstarted;
+  int i;
+  int ret;
+
+  v6enabled = cfg_getbool(cfg_getsec(cfg, "general"), "ipv6");
+
+  stream_lowat = cfg_getint(cfg_getsec(cfg, "library"), "stream_lowat") * 1024;
+  stream_hiwat = cfg_getint(cfg_getsec(cfg, "library"), "stream_hiwat") * 1024;
+  if (stream_hiwat < stream_lowat + STREAM_CHUNK_SIZE)
+    {
+      DPRINTF(E_WARN, L_HTTPD, "stream_hiwat too low, raising to %zu KB\n", (stream_lowat + STREAM_CHUNK_SIZE) / 1024);
+
+      stream_hiwat = stream_lowat + STREAM_CHUNK_SIZE;
+    }
+
+  /* One thread per CPU, each with its own event base and DB connection */
+  ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpu < 1)
+    ncpu = 1;
+
+  httpd_nthreads = (ncpu > HTTPD_MAX_THREADS) ? HTTPD_MAX_THREADS : ncpu;
+
+  ret = rsp_init();
+  if (ret < 0)
+    {
+      DPRINTF(E_FATAL, L_HTTPD, "RSP protocol init failed\n");
+
+      return -1;
+    }
+
+  ret = daap_init();
+  if (ret < 0)
+    {
+      DPRINTF(E_FATAL, L_HTTPD, "DAAP protocol init failed\n");
+
+      goto daap_fail;
+    }
+
+  ret = dacp_init();
+  if (ret < 0)
+    {
+      DPRINTF(E_FATAL, L_HTTPD, "DACP protocol init failed\n");
+
+      goto dacp_fail;
+    }
+
+  for (nsetup = 0; nsetup < httpd_nthreads; nsetup++)
+    {
+      ret = httpd_thread_setup(&httpd_threads[nsetup]);
+      if (ret < 0)
+	goto setup_fail;
+    }
+
   port = cfg_getint(cfg_getsec(cfg, "library"), "port");
 
   /* We are binding v6 and v4 separately, and we allow v6 to fail
    * as IPv6 might not be supported on the system.
    * We still warn about the failure, in case there's another issue.
    */
-  ret = evhttp_bind_socket(evhttpd, "0.0.0.0", port);
+  ret = evhttp_bind_socket(httpd_threads[0].evhttp, "0.0.0.0", port);
   if (ret < 0)
     {
       DPRINTF(E_FATAL, L_HTTPD, "Could not bind INADDR_ANY:%d\n", port);
 
-      goto bind_fail;
+      goto setup_fail;
     }
 
   if (v6enabled)
     {
-      ret = evhttp_bind_socket(evhttpd, "::", port);
+      ret = evhttp_bind_socket(httpd_threads[0].evhttp, "::", port);
       if (ret < 0)
 	DPRINTF(E_WARN, L_HTTPD, "Could not bind IN6ADDR_ANY:%d (that's OK)\n", port);
     }
 
-  evhttp_set_gencb(evhttpd, httpd_gen_cb, NULL);
+  /* The other threads accept on the same listening sockets; whichever
+   * thread wins the accept() serves the connection
+   */
+  for (i = 1; i < httpd_nthreads; i++)
+    {
+      ret = evhttp_accept_sockets_of(httpd_threads[i].evhttp, httpd_threads[0].evhttp);
+      if (ret < 0)
+	{
+	  DPRINTF(E_FATAL, L_HTTPD, "Could not share listening sockets with HTTPd thread %d\n", i);
+
+	  goto setup_fail;
+	}
+    }
+
+  ret = gzip_init();
+  if (ret < 0)
+    DPRINTF(E_WARN, L_HTTPD, "Could not start gzip workers, replies will be compressed inline\n");
 
-  ret = pthread_create(&tid_httpd, NULL, httpd, NULL);
-  if (ret != 0)
+  ret = transcode_cache_init();
+  if (ret < 0)
+    DPRINTF(E_WARN, L_HTTPD, "Transcode cache unavailable, transcoded streams won't be cached\n");
+
+  ret = transcode_pool_init();
+  if (ret < 0)
+    DPRINTF(E_WARN, L_HTTPD, "Could not start transcode workers, will transcode in the HTTPd threads\n");
+
+  for (nstarted = 0; nstarted < httpd_nthreads; nstarted++)
     {
-      DPRINTF(E_FATAL, L_HTTPD, "Could not spawn HTTPd thread: %s\n", strerror(errno));
+      t = &httpd_threads[nstarted];
+
+      ret = pthread_create(&t->tid, NULL, httpd, t);
+      if (ret != 0)
+	{
+	  DPRINTF(E_FATAL, L_HTTPD, "Could not spawn HTTPd thread: %s\n", strerror(ret));
 
-      goto thread_fail;
+	  goto thread_fail;
+	}
     }
 
+  DPRINTF(E_INFO, L_HTTPD, "HTTPd running with %d threads\n", httpd_nthreads);
+
   return 0;
 
  thread_fail:
- bind_fail:
-  evhttp_free(evhttpd);
- evhttp_fail:
-#ifdef USE_EVENTFD
-  close(exit_efd);
-#else
-  close(exit_pipe[0]);
-  close(exit_pipe[1]);
-#endif
- pipe_fail:
+  for (i = 0; i < nstarted; i++)
+    httpd_thread_stop(&httpd_threads[i]);
+
+  transcode_pool_deinit();
+  transcode_cache_deinit();
+
+  if (gzip_nworkers > 0)
+    gzip_deinit();
+ setup_fail:
+  for (i = nsetup - 1; i >= 0; i--)
+    {
+      gzip_drain(&httpd_threads[i]);
+      xcode_drain(&httpd_threads[i]);
+      httpd_thread_teardown(&httpd_threads[i]);
+    }
+
   dacp_deinit();
  dacp_fail:
   daap_deinit();
  daap_fail:
   rsp_deinit();
- rsp_fail:
-  event_base_free(evbase_httpd);
 
   return -1;
 }
@@ -1336,46 +2501,32 @@ httpd_init(void)
 void
 httpd_deinit(void)
 {
+  int i;
   int ret;
 
-#ifdef USE_EVENTFD
-  ret = eventfd_write(exit_efd, 1);
-  if (ret < 0)
+  for (i = 0; i < httpd_nthreads; i++)
     {
-      DPRINTF(E_FATAL, L_HTTPD, "Could not send exit event: %s\n", strerror(errno));
-
-      return;
+      ret = httpd_thread_stop(&httpd_threads[i]);
+      if (ret < 0)
+	return;
     }
-#else
-  int dummy = 42;
-
-  ret = write(exit_pipe[1], &dummy, sizeof(dummy));
-  if (ret != sizeof(dummy))
-    {
-      DPRINTF(E_FATAL, L_HTTPD, "Could not write to exit fd: %s\n", strerror(errno));
 
-      return;
-    }
-#endif
+  gzip_deinit();
+  transcode_pool_deinit();
 
-  ret = pthread_join(tid_httpd, NULL);
-  if (ret != 0)
+  for (i = 0; i < httpd_nthreads; i++)
     {
-      DPRINTF(E_FATAL, L_HTTPD, "Could not join HTTPd thread: %s\n", strerror(errno));
-
-      return;
+      gzip_drain(&httpd_threads[i]);
+      xcode_drain(&httpd_threads[i]);
     }
 
   rsp_deinit();
   dacp_deinit();
   daap_deinit();
 
-#ifdef USE_EVENTFD
-  close(exit_efd);
-#else
-  close(exit_pipe[0]);
-  close(exit_pipe[1]);
-#endif
-  evhttp_free(evhttpd);
-  event_base_free(evbase_httpd);
+  /* Thread 0 owns the listening sockets, free it last */
+  for (i = httpd_nthreads - 1; i >= 0; i--)
+    httpd_thread_teardown(&httpd_threads[i]);
+
+  transcode_cache_deinit();
 }
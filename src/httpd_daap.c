@@ -35,6 +35,8 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <uninorm.h>
 
@@ -54,7 +56,7 @@
 #include "dmap_common.h"
 
 /* httpd event base, from httpd.c */
-extern struct event_base *evbase_httpd;
+extern __thread struct event_base *evbase_httpd;
 
 
 /* Session timeout in seconds */
@@ -63,6 +65,8 @@ extern struct event_base *evbase_httpd;
 #define DAAP_SESSION_TIMEOUT_CAPABILITY 1800 
 /* Update requests refresh interval in seconds */
 #define DAAP_UPDATE_REFRESH  0
+/* Number of parsed meta parameters remembered per session */
+#define DAAP_SESSION_META_SETS 4
 
 
 struct uri_map {
@@ -71,10 +75,26 @@ struct uri_map {
   void (*handler)(struct evhttp_request *req, struct evbuffer *evbuf, char **uri, struct evkeyvalq *query);
 };
 
+struct daap_meta_set {
+  char *param;
+  const struct dmap_field **meta;
+  int nmeta;
+};
+
 struct daap_session {
   int id;
 
-  struct event timeout;
+  /* One reference held by the sessions tree, one per request in flight */
+  int refcount;
+  time_t last_used;
+
+  /* Client profile, computed at login */
+  struct transcode_profile xcode;
+
+  /* Protects the meta sets */
+  pthread_mutex_t lck;
+  struct daap_meta_set meta_sets[DAAP_SESSION_META_SETS];
+  int meta_next;
 };
 
 struct daap_update_request {
@@ -101,11 +121,16 @@ static char *default_meta_pl = "dmap.itemid,dmap.itemname,dmap.persistentid,com.
 static char *default_meta_group = "dmap.itemname,dmap.persistentid,daap.songalbumartist";
 
 /* DAAP session tracking */
+static pthread_mutex_t sessions_lck = PTHREAD_MUTEX_INITIALIZER;
 static avl_tree_t *daap_sessions;
 static int next_session_id;
 
+/* Session used by the request being served by this httpd thread */
+static __thread struct daap_session *cur_session;
+
 /* Update requests */
 static int current_rev;
+static pthread_mutex_t update_lck = PTHREAD_MUTEX_INITIALIZER;
 static struct daap_update_request *update_requests;
 
 
@@ -126,38 +151,77 @@ daap_session_compare(const void *aa, const void *bb)
 }
 
 static void
-daap_session_free(void *item)
+daap_meta_set_clear(struct daap_meta_set *ms)
 {
-  struct daap_session *s;
+  if (ms->param)
+    free(ms->param);
+  if (ms->meta)
+    free(ms->meta);
 
-  s = (struct daap_session *)item;
+  memset(ms, 0, sizeof(struct daap_meta_set));
+}
+
+static void
+daap_session_unref(struct daap_session *s)
+{
+  int i;
+
+  if (__sync_sub_and_fetch(&s->refcount, 1) > 0)
+    return;
+
+  transcode_profile_clear(&s->xcode);
+
+  for (i = 0; i < DAAP_SESSION_META_SETS; i++)
+    daap_meta_set_clear(&s->meta_sets[i]);
+
+  pthread_mutex_destroy(&s->lck);
 
-  if (event_initialized(&s->timeout)) evtimer_del(&s->timeout);
   free(s);
 }
 
+/* Called by the avl tree when a session is removed from the tree */
+static void
+daap_session_free(void *item)
+{
+  daap_session_unref((struct daap_session *)item);
+}
+
 static void
 daap_session_kill(struct daap_session *s)
 {
+  /* Drops the reference held by the tree; requests in flight keep theirs */
+  pthread_mutex_lock(&sessions_lck);
+
   avl_delete(daap_sessions, s);
+
+  pthread_mutex_unlock(&sessions_lck);
 }
 
+/* Must be called with sessions_lck held */
 static void
-daap_session_timeout_cb(int fd, short what, void *arg)
+daap_session_purge(time_t now)
 {
   struct daap_session *s;
+  avl_node_t *node;
+  avl_node_t *next;
 
-  s = (struct daap_session *)arg;
+  for (node = daap_sessions->head; node; node = next)
+    {
+      next = node->next;
+      s = (struct daap_session *)node->item;
 
-  DPRINTF(E_DBG, L_DAAP, "Session %d timed out\n", s->id);
+      if (now - s->last_used > DAAP_SESSION_TIMEOUT)
+	{
+	  DPRINTF(E_DBG, L_DAAP, "Session %d timed out\n", s->id);
 
-  daap_session_kill(s);
+	  avl_delete_node(daap_sessions, node);
+	}
+    }
 }
 
 static struct daap_session *
-daap_session_register(void)
+daap_session_register(struct evhttp_request *req)
 {
-  struct timeval tv;
   struct daap_session *s;
   avl_node_t *node;
   int ret;
@@ -171,44 +235,55 @@ daap_session_register(void)
 
   memset(s, 0, sizeof(struct daap_session));
 
+  ret = transcode_profile_init(&s->xcode, req->input_headers);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not build client profile for DAAP session\n");
+
+      free(s);
+      return NULL;
+    }
+
+  pthread_mutex_init(&s->lck, NULL);
+
+  s->refcount = 1;
+  s->last_used = time(NULL);
+
+  pthread_mutex_lock(&sessions_lck);
+
+  if (DAAP_SESSION_TIMEOUT > 0)
+    daap_session_purge(s->last_used);
+
   s->id = next_session_id;
 
   next_session_id++;
 
-  if (DAAP_SESSION_TIMEOUT > 0) {
-    evtimer_set(&s->timeout, daap_session_timeout_cb, s);
-    event_base_set(evbase_httpd, &s->timeout);
-  }
-
   node = avl_insert(daap_sessions, s);
+
+  pthread_mutex_unlock(&sessions_lck);
+
   if (!node)
     {
       DPRINTF(E_LOG, L_DAAP, "Could not register DAAP session: %s\n", strerror(errno));
 
-      free(s);
+      daap_session_unref(s);
       return NULL;
     }
 
-  if (DAAP_SESSION_TIMEOUT > 0) {
-    evutil_timerclear(&tv);
-    tv.tv_sec = DAAP_SESSION_TIMEOUT;
-    
-    ret = evtimer_add(&s->timeout, &tv);
-    if (ret < 0)
-      DPRINTF(E_LOG, L_DAAP, "Could not add session timeout event for session %d\n", s->id);
-  }
-
   return s;
 }
 
+/* The session returned is referenced until daap_session_release() is called
+ * once the request has been served.
+ */
 struct daap_session *
 daap_session_find(struct evhttp_request *req, struct evkeyvalq *query, struct evbuffer *evbuf)
 {
   struct daap_session needle;
-  struct timeval tv;
   struct daap_session *s;
   avl_node_t *node;
   const char *param;
+  time_t now;
   int ret;
 
   param = evhttp_find_header(query, "session-id");
@@ -222,27 +297,42 @@ daap_session_find(struct evhttp_request *req, struct evkeyvalq *query, struct ev
   if (ret < 0)
     goto invalid;
 
+  now = time(NULL);
+
+  pthread_mutex_lock(&sessions_lck);
+
   node = avl_search(daap_sessions, &needle);
   if (!node)
     {
+      pthread_mutex_unlock(&sessions_lck);
+
       DPRINTF(E_WARN, L_DAAP, "DAAP session id %d not found\n", needle.id);
       goto invalid;
     }
 
   s = (struct daap_session *)node->item;
 
-  if (DAAP_SESSION_TIMEOUT > 0) {
-    event_del(&s->timeout);
-  }
+  if ((DAAP_SESSION_TIMEOUT > 0) && (now - s->last_used > DAAP_SESSION_TIMEOUT))
+    {
+      DPRINTF(E_DBG, L_DAAP, "Session %d timed out\n", s->id);
 
-  evutil_timerclear(&tv);
-  tv.tv_sec = DAAP_SESSION_TIMEOUT;
+      avl_delete_node(daap_sessions, node);
 
-  if (DAAP_SESSION_TIMEOUT > 0) {
-    ret = evtimer_add(&s->timeout, &tv);
-    if (ret < 0)
-      DPRINTF(E_LOG, L_DAAP, "Could not add session timeout event for session %d\n", s->id);
-  }
+      pthread_mutex_unlock(&sessions_lck);
+      goto invalid;
+    }
+
+  s->last_used = now;
+
+  __sync_add_and_fetch(&s->refcount, 1);
+
+  pthread_mutex_unlock(&sessions_lck);
+
+  /* Handlers may look the session up more than once */
+  if (cur_session)
+    daap_session_unref(cur_session);
+
+  cur_session = s;
 
   return s;
 
@@ -251,6 +341,17 @@ daap_session_find(struct evhttp_request *req, struct evkeyvalq *query, struct ev
   return NULL;
 }
 
+/* Thread: httpd */
+void
+daap_session_release(void)
+{
+  if (!cur_session)
+    return;
+
+  daap_session_unref(cur_session);
+  cur_session = NULL;
+}
+
 
 /* Update requests helpers */
 static void
@@ -258,6 +359,8 @@ update_remove(struct daap_update_request *ur)
 {
   struct daap_update_request *p;
 
+  pthread_mutex_lock(&update_lck);
+
   if (ur == update_requests)
     update_requests = ur->next;
   else
@@ -267,12 +370,16 @@ update_remove(struct daap_update_request *ur)
 
       if (!p)
 	{
+	  pthread_mutex_unlock(&update_lck);
+
 	  DPRINTF(E_LOG, L_DAAP, "WARNING: struct daap_update_request not found in list; BUG!\n");
 	  return;
 	}
 
       p->next = ur->next;
     }
+
+  pthread_mutex_unlock(&update_lck);
 }
 
 static void
@@ -386,6 +493,37 @@ daap_sort_context_free(struct sort_ctx *ctx)
   free(ctx);
 }
 
+static void
+daap_sort_add(struct sort_ctx *ctx, char fl, uint32_t count)
+{
+  if (fl == 0)
+    {
+      /* Non-ASCII, goes to misc category */
+      ctx->misc_mshn += count;
+      return;
+    }
+
+  /* Init */
+  if (ctx->mshc == -1)
+    ctx->mshc = fl;
+
+  if (fl == ctx->mshc)
+    ctx->mshn += count;
+  else
+    {
+      dmap_add_container(ctx->headerlist, "mlit", 34);
+      dmap_add_short(ctx->headerlist, "mshc", ctx->mshc); /* 10 */
+      dmap_add_int(ctx->headerlist, "mshi", ctx->mshi);   /* 12 */
+      dmap_add_int(ctx->headerlist, "mshn", ctx->mshn);   /* 12 */
+
+      DPRINTF(E_DBG, L_DAAP, "Added sort header: mshc = %c, mshi = %u, mshn = %u fl %c\n", ctx->mshc, ctx->mshi, ctx->mshn, fl);
+
+      ctx->mshi = ctx->mshi + ctx->mshn;
+      ctx->mshn = count;
+      ctx->mshc = fl;
+    }
+}
+
 static int
 daap_sort_build(struct sort_ctx *ctx, char *str)
 {
@@ -393,49 +531,45 @@ daap_sort_build(struct sort_ctx *ctx, char *str)
   size_t len;
   char fl;
 
-  len = strlen(str);
-  ret = u8_normalize(UNINORM_NFD, (uint8_t *)str, len, NULL, &len);
-  if (!ret)
+  /* Only non-ASCII first characters need normalizing */
+  if (isascii(str[0]))
+    fl = str[0];
+  else
     {
-      DPRINTF(E_LOG, L_DAAP, "Could not normalize string for sort header\n");
+      len = strlen(str);
+      ret = u8_normalize(UNINORM_NFD, (uint8_t *)str, len, NULL, &len);
+      if (!ret)
+	{
+	  DPRINTF(E_LOG, L_DAAP, "Could not normalize string for sort header\n");
 
-      return -1;
-    }
+	  return -1;
+	}
 
-  fl = ret[0];
-  free(ret);
+      fl = ret[0];
+      free(ret);
+    }
 
   if (isascii(fl) && isalpha(fl))
-    {
-      fl = toupper(fl);
-
-      /* Init */
-      if (ctx->mshc == -1)
-	ctx->mshc = fl;
+    daap_sort_add(ctx, toupper(fl), 1);
+  else
+    daap_sort_add(ctx, 0, 1);
 
-      if (fl == ctx->mshc)
-	ctx->mshn++;
-      else
-        {
-	  dmap_add_container(ctx->headerlist, "mlit", 34);
-	  dmap_add_short(ctx->headerlist, "mshc", ctx->mshc); /* 10 */
-	  dmap_add_int(ctx->headerlist, "mshi", ctx->mshi);   /* 12 */
-	  dmap_add_int(ctx->headerlist, "mshn", ctx->mshn);   /* 12 */
+  return 0;
+}
 
-	  DPRINTF(E_DBG, L_DAAP, "Added sort header: mshc = %c, mshi = %u, mshn = %u fl %c\n", ctx->mshc, ctx->mshi, ctx->mshn, fl);
+/* Buckets as returned by db_query_sort_headers() */
+static void
+daap_sort_build_buckets(struct sort_ctx *ctx, uint32_t *buckets)
+{
+  int i;
 
-	  ctx->mshi = ctx->mshi + ctx->mshn;
-	  ctx->mshn = 1;
-	  ctx->mshc = fl;
-	}
-    }
-  else
+  for (i = 1; i < DB_SORT_BUCKETS; i++)
     {
-      /* Non-ASCII, goes to misc category */
-      ctx->misc_mshn++;
+      if (buckets[i] > 0)
+	daap_sort_add(ctx, 'A' + i - 1, buckets[i]);
     }
 
-  return 0;
+  daap_sort_add(ctx, 0, buckets[0]);
 }
 
 static int
@@ -572,10 +706,15 @@ get_query_params(struct evkeyvalq *query, int *sort_headers, struct query_params
     }
 }
 
+/* Returns a copy of the cached meta array, to be freed by the caller;
+ * the session can be used by several httpd threads at once.
+ */
 static int
-parse_meta(struct evhttp_request *req, char *tag, const char *param, const struct dmap_field ***out_meta)
+parse_meta(struct daap_session *s, struct evhttp_request *req, char *tag, const char *param, const struct dmap_field ***out_meta)
 {
+  struct daap_meta_set *ms;
   const struct dmap_field **meta;
+  const struct dmap_field **cached;
   char *ptr;
   char *field;
   char *metastr;
@@ -583,6 +722,39 @@ parse_meta(struct evhttp_request *req, char *tag, const char *param, const struc
   int nmeta;
   int i;
 
+  pthread_mutex_lock(&s->lck);
+
+  for (i = 0; i < DAAP_SESSION_META_SETS; i++)
+    {
+      ms = &s->meta_sets[i];
+
+      if (ms->param && (strcmp(ms->param, param) == 0))
+	{
+	  DPRINTF(E_DBG, L_DAAP, "Using cached meta set, %d meta tags\n", ms->nmeta);
+
+	  nmeta = ms->nmeta;
+
+	  meta = (const struct dmap_field **)malloc((nmeta + 1) * sizeof(const struct dmap_field *));
+	  if (meta)
+	    memcpy(meta, ms->meta, nmeta * sizeof(const struct dmap_field *));
+
+	  pthread_mutex_unlock(&s->lck);
+
+	  if (!meta)
+	    {
+	      DPRINTF(E_LOG, L_DAAP, "Could not allocate meta array; out of memory\n");
+
+	      dmap_send_error(req, tag, "Out of memory");
+	      return -1;
+	    }
+
+	  *out_meta = meta;
+	  return nmeta;
+	}
+    }
+
+  pthread_mutex_unlock(&s->lck);
+
   metastr = strdup(param);
   if (!metastr)
     {
@@ -631,6 +803,33 @@ parse_meta(struct evhttp_request *req, char *tag, const char *param, const struc
 
   DPRINTF(E_DBG, L_DAAP, "Found %d meta tags\n", nmeta);
 
+  /* Remember this meta set, replacing the oldest one; not fatal if
+   * we can't, the next request will just parse it again
+   */
+  cached = (const struct dmap_field **)malloc((nmeta + 1) * sizeof(const struct dmap_field *));
+  if (cached)
+    {
+      memcpy(cached, meta, nmeta * sizeof(const struct dmap_field *));
+
+      pthread_mutex_lock(&s->lck);
+
+      ms = &s->meta_sets[s->meta_next];
+      daap_meta_set_clear(ms);
+
+      ms->param = strdup(param);
+      if (ms->param)
+	{
+	  ms->meta = cached;
+	  ms->nmeta = nmeta;
+
+	  s->meta_next = (s->meta_next + 1) % DAAP_SESSION_META_SETS;
+	}
+      else
+	free(cached);
+
+      pthread_mutex_unlock(&s->lck);
+    }
+
   *out_meta = meta;
 
  out:
@@ -803,7 +1002,7 @@ daap_reply_login(struct evhttp_request *req, struct evbuffer *evbuf, char **uri,
       free_pi(&pi, 1);
     }
 
-  s = daap_session_register();
+  s = daap_session_register(req);
   if (!s)
     {
       dmap_send_error(req, "mlog", "Could not start session");
@@ -917,9 +1116,13 @@ daap_reply_update(struct evhttp_request *req, struct evbuffer *evbuf, char **uri
   /* NOTE: we may need to keep reqd_rev in there too */
   ur->req = req;
 
+  pthread_mutex_lock(&update_lck);
+
   ur->next = update_requests;
   update_requests = ur;
 
+  pthread_mutex_unlock(&update_lck);
+
   /* If the connection fails before we have an update to push out
    * to the client, we need to know.
    */
@@ -981,7 +1184,7 @@ daap_reply_dblist(struct evhttp_request *req, struct evbuffer *evbuf, char **uri
 }
 
 static void
-daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf, int playlist, struct evkeyvalq *query)
+daap_reply_songlist_generic(struct daap_session *s, struct evhttp_request *req, struct evbuffer *evbuf, int playlist, struct evkeyvalq *query)
 {
   struct query_params qp;
   struct db_media_file_info dbmfi;
@@ -991,8 +1194,10 @@ daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf,
   struct sort_ctx *sctx;
   const char *param;
   char *tag;
+  uint32_t buckets[DB_SORT_BUCKETS];
   int nmeta;
   int sort_headers;
+  int have_buckets;
   int nsongs;
   int transcode;
   int ret;
@@ -1062,7 +1267,7 @@ daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf,
 
   if (param)
     {
-      nmeta = parse_meta(req, tag, param, &meta);
+      nmeta = parse_meta(s, req, tag, param, &meta);
       if (nmeta < 0)
 	{
 	  DPRINTF(E_LOG, L_DAAP, "Failed to parse meta parameter in DAAP query\n");
@@ -1100,6 +1305,18 @@ daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf,
   else
     qp.type = Q_ITEMS;
 
+  /* Sort headers from aggregated counts if possible, else built per row */
+  have_buckets = 0;
+  if (sort_headers)
+    {
+      ret = db_query_sort_headers(&qp, buckets);
+      if (ret == 0)
+	{
+	  daap_sort_build_buckets(sctx, buckets);
+	  have_buckets = 1;
+	}
+    }
+
   ret = db_query_start(&qp);
   if (ret < 0)
     {
@@ -1118,7 +1335,7 @@ daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf,
     {
       nsongs++;
 
-      transcode = transcode_needed(req->input_headers, dbmfi.codectype);
+      transcode = transcode_profile_needed(&s->xcode, dbmfi.codectype);
 
       ret = dmap_encode_file_metadata(songlist, song, &dbmfi, meta, nmeta, 1, transcode);
       if (ret < 0)
@@ -1129,7 +1346,7 @@ daap_reply_songlist_generic(struct evhttp_request *req, struct evbuffer *evbuf,
 	  break;
 	}
 
-      if (sort_headers)
+      if (sort_headers && !have_buckets)
 	{
 	  ret = daap_sort_build(sctx, dbmfi.title_sort);
 	  if (ret < 0)
@@ -1240,7 +1457,7 @@ daap_reply_dbsonglist(struct evhttp_request *req, struct evbuffer *evbuf, char *
   if (!s)
     return;
 
-  daap_reply_songlist_generic(req, evbuf, -1, query);
+  daap_reply_songlist_generic(s, req, evbuf, -1, query);
 }
 
 static void
@@ -1262,7 +1479,7 @@ daap_reply_plsonglist(struct evhttp_request *req, struct evbuffer *evbuf, char *
       return;
     }
 
-  daap_reply_songlist_generic(req, evbuf, playlist, query);
+  daap_reply_songlist_generic(s, req, evbuf, playlist, query);
 }
 
 static void
@@ -1343,7 +1560,7 @@ daap_reply_playlists(struct evhttp_request *req, struct evbuffer *evbuf, char **
       param = default_meta_pl;
     }
 
-  nmeta = parse_meta(req, "aply", param, &meta);
+  nmeta = parse_meta(s, req, "aply", param, &meta);
   if (nmeta < 0)
     {
       DPRINTF(E_LOG, L_DAAP, "Failed to parse meta parameter in DAAP query\n");
@@ -1595,7 +1812,7 @@ daap_reply_groups(struct evhttp_request *req, struct evbuffer *evbuf, char **uri
       param = default_meta_group;
     }
 
-  nmeta = parse_meta(req, tag, param, &meta);
+  nmeta = parse_meta(s, req, tag, param, &meta);
   if (nmeta < 0)
     {
       DPRINTF(E_LOG, L_DAAP, "Failed to parse meta parameter in DAAP query\n");
@@ -2556,6 +2773,8 @@ daap_deinit(void)
 
   avl_free_tree(daap_sessions);
 
+  daap_query_deinit();
+
   for (ur = update_requests; update_requests; ur = update_requests)
     {
       update_requests = ur->next;
@@ -17,4 +17,7 @@ daap_request(struct evhttp_request *req);
 int
 daap_is_request(struct evhttp_request *req, char *uri);
 
+void
+daap_session_release(void);
+
 #endif /* !__HTTPD_DAAP_H__ */
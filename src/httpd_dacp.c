@@ -31,6 +31,8 @@
 #include <regex.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
 
 #if defined(HAVE_SYS_EVENTFD_H) && defined(HAVE_EVENTFD)
 # define USE_EVENTFD
@@ -49,10 +51,11 @@
 #include "dmap_common.h"
 #include "db.h"
 #include "player.h"
+#include "nowplaying.h"
 
 
 /* httpd event base, from httpd.c */
-extern struct event_base *evbase_httpd;
+extern __thread struct event_base *evbase_httpd;
 
 /* From httpd_daap.c */
 struct daap_session;
@@ -73,7 +76,20 @@ struct dacp_update_request {
   struct dacp_update_request *next;
 };
 
-typedef void (*dacp_propget)(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi);
+/* Play status update for a revision, shared by every request waiting for it
+ * when the revision is bumped
+ */
+struct dacp_update {
+  int rev;
+
+  uint8_t *data;
+  size_t len;
+
+  /* One for update_cur, one per user and per evbuffer holding the data */
+  int refcount;
+};
+
+typedef void (*dacp_propget)(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np);
 typedef void (*dacp_propset)(const char *value, struct evkeyvalq *query);
 
 struct dacp_prop_map {
@@ -85,36 +101,36 @@ struct dacp_prop_map {
 
 /* Forward - properties getters */
 static void
-dacp_propget_volume(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi);
+dacp_propget_volume(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np);
 static void
-dacp_propget_volumecontrollable(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi);
+dacp_propget_volumecontrollable(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np);
 static void
-dacp_propget_playerstate(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi);
+dacp_propget_playerstate(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np);
 static void
-dacp_propget_shufflestate(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi);
+dacp_propget_shufflestate(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np);
 static void
-dacp_propget_availableshufflestates(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi);
+dacp_propget_availableshufflestates(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np);
 static void
-dacp_propget_repeatstate(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi);
+dacp_propget_repeatstate(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np);
 static void
-dacp_propget_availablerepeatstates(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi);
+dacp_propget_availablerepeatstates(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np);
 static void
-dacp_propget_nowplaying(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi);
+dacp_propget_nowplaying(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np);
 static void
-dacp_propget_playingtime(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi);
+dacp_propget_playingtime(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np);
 
 static void
-dacp_propget_fullscreenenabled(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi);
+dacp_propget_fullscreenenabled(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np);
 static void
-dacp_propget_fullscreen(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi);
+dacp_propget_fullscreen(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np);
 static void
-dacp_propget_visualizerenabled(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi);
+dacp_propget_visualizerenabled(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np);
 static void
-dacp_propget_visualizer(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi);
+dacp_propget_visualizer(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np);
 static void
-dacp_propget_itms_songid(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi);
+dacp_propget_itms_songid(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np);
 static void
-dacp_propget_haschapterdata(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi);
+dacp_propget_haschapterdata(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np);
 
 /* Forward - properties setters */
 static void
@@ -133,30 +149,47 @@ dacp_propset_userrating(const char *value, struct evkeyvalq *query);
 #include "dacp_prop_hash.c"
 
 
-/* Play status update */
+/* Play status update, per httpd thread */
+struct dacp_thread {
 #ifdef USE_EVENTFD
-static int update_efd;
+  int update_efd;
 #else
-static int update_pipe[2];
+  int update_pipe[2];
 #endif
-static struct event updateev;
+  struct event updateev;
+
+  /* Play status update requests served by this thread */
+  struct dacp_update_request *update_requests;
+
+  struct dacp_thread *next;
+};
+
+static pthread_mutex_t threads_lck = PTHREAD_MUTEX_INITIALIZER;
+static struct dacp_thread *dacp_threads;
+static __thread struct dacp_thread *dacp_self;
 static int current_rev;
 
-/* Play status update requests */
-static struct dacp_update_request *update_requests;
+/* Latest play status update; builds are serialized so each revision is
+ * only built once, whichever thread gets to it first
+ */
+static pthread_mutex_t update_lck = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t update_build_lck = PTHREAD_MUTEX_INITIALIZER;
+static struct dacp_update *update_cur;
 
-/* Seek timer */
-static struct event seek_timer;
+/* Seek timer; the last seek request wins, whichever thread it came in on */
+static __thread struct event seek_timer;
+static pthread_mutex_t seek_lck = PTHREAD_MUTEX_INITIALIZER;
 static int seek_target;
+static int seek_seq;
 
 
 /* DACP helpers */
 static void
-dacp_nowplaying(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi)
+dacp_nowplaying(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np)
 {
   char canp[16];
 
-  if ((status->status == PLAY_STOPPED) || !mfi)
+  if ((status->status == PLAY_STOPPED) || !np)
     return;
 
   memset(canp, 0, sizeof(canp));
@@ -180,32 +213,33 @@ dacp_nowplaying(struct evbuffer *evbuf, struct player_status *status, struct med
 
   dmap_add_literal(evbuf, "canp", canp, sizeof(canp));
 
-  dmap_add_string(evbuf, "cann", mfi->title);
-  dmap_add_string(evbuf, "cana", mfi->artist);
-  dmap_add_string(evbuf, "canl", mfi->album);
-  dmap_add_string(evbuf, "cang", mfi->genre);
-  dmap_add_long(evbuf, "asai", mfi->songalbumid);
+  /* cann, cana, canl, cang, asai */
+  nowplaying_add_dmap(np, evbuf);
 
   dmap_add_int(evbuf, "cmmk", 1);
 }
 
 static void
-dacp_playingtime(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi)
+dacp_playingtime(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np)
 {
-  if ((status->status == PLAY_STOPPED) || !mfi)
+  uint32_t song_length;
+
+  if ((status->status == PLAY_STOPPED) || !np)
     return;
 
-  dmap_add_int(evbuf, "cant", mfi->song_length - status->pos_ms); /* Remaining time in ms */
-  dmap_add_int(evbuf, "cast", mfi->song_length); /* Song length in ms */
+  song_length = nowplaying_song_length(np);
+
+  dmap_add_int(evbuf, "cant", song_length - status->pos_ms); /* Remaining time in ms */
+  dmap_add_int(evbuf, "cast", song_length); /* Song length in ms */
 }
 
 
 /* Update requests helpers */
 static int
-make_playstatusupdate(struct evbuffer *evbuf)
+make_playstatusupdate(struct evbuffer *evbuf, int rev)
 {
   struct player_status status;
-  struct media_file_info *mfi;
+  struct nowplaying *np;
   struct evbuffer *psu;
   int ret;
 
@@ -221,20 +255,20 @@ make_playstatusupdate(struct evbuffer *evbuf)
 
   if (status.status != PLAY_STOPPED)
     {
-      mfi = db_file_fetch_byid(status.id);
-      if (!mfi)
+      np = nowplaying_get(status.id);
+      if (!np)
 	{
-	  DPRINTF(E_LOG, L_DACP, "Could not fetch file id %d\n", status.id);
+	  evbuffer_free(psu);
 
 	  return -1;
 	}
     }
   else
-    mfi = NULL;
+    np = NULL;
 
   dmap_add_int(psu, "mstt", 200);         /* 12 */
 
-  dmap_add_int(psu, "cmsr", current_rev); /* 12 */
+  dmap_add_int(psu, "cmsr", rev);         /* 12 */
 
   dmap_add_char(psu, "cavc", 1);              /* 9 */ /* volume controllable */
   dmap_add_char(psu, "caps", status.status);  /* 9 */ /* play status, 2 = stopped, 3 = paused, 4 = playing */
@@ -244,12 +278,12 @@ make_playstatusupdate(struct evbuffer *evbuf)
   dmap_add_int(psu, "caas", 2);           /* 12 */ /* available shuffle states */
   dmap_add_int(psu, "caar", 6);           /* 12 */ /* available repeat states */
 
-  if (mfi)
+  if (np)
     {
-      dacp_nowplaying(psu, &status, mfi);
-      dacp_playingtime(psu, &status, mfi);
+      dacp_nowplaying(psu, &status, np);
+      dacp_playingtime(psu, &status, np);
 
-      free_mfi(mfi, 0);
+      nowplaying_release(np);
     }
 
   dmap_add_container(evbuf, "cmst", EVBUFFER_LENGTH(psu));    /* 8 + len */
@@ -266,18 +300,172 @@ make_playstatusupdate(struct evbuffer *evbuf)
   return 0;
 }
 
+static void
+update_unref(struct dacp_update *u)
+{
+  int refcount;
+
+  pthread_mutex_lock(&update_lck);
+
+  u->refcount--;
+  refcount = u->refcount;
+
+  pthread_mutex_unlock(&update_lck);
+
+  if (refcount > 0)
+    return;
+
+  free(u->data);
+  free(u);
+}
+
+/* Thread: httpd (whoever frees the evbuffer) */
+static void
+update_cleanup_cb(const void *data, size_t datalen, void *extra)
+{
+  update_unref((struct dacp_update *)extra);
+}
+
+/* Lock held; returns a reference on the update if it's still current */
+static struct dacp_update *
+update_lookup(int rev)
+{
+  if (!update_cur || (update_cur->rev != rev))
+    return NULL;
+
+  update_cur->refcount++;
+
+  return update_cur;
+}
+
+/* Thread: httpd */
+static struct dacp_update *
+update_get(void)
+{
+  struct dacp_update *u;
+  struct dacp_update *old;
+  struct evbuffer *evbuf;
+  int rev;
+  int ret;
+
+  rev = __sync_add_and_fetch(&current_rev, 0);
+
+  pthread_mutex_lock(&update_lck);
+  u = update_lookup(rev);
+  pthread_mutex_unlock(&update_lck);
+
+  if (u)
+    return u;
+
+  pthread_mutex_lock(&update_build_lck);
+
+  /* Built by another thread while we waited */
+  pthread_mutex_lock(&update_lck);
+  u = update_lookup(rev);
+  pthread_mutex_unlock(&update_lck);
+
+  if (u)
+    goto out_unlock;
+
+  evbuf = evbuffer_new();
+  if (!evbuf)
+    {
+      DPRINTF(E_LOG, L_DACP, "Could not allocate evbuffer for playstatusupdate data\n");
+
+      goto out_unlock;
+    }
+
+  ret = make_playstatusupdate(evbuf, rev);
+  if (ret < 0)
+    goto out_free_evbuf;
+
+  u = (struct dacp_update *)malloc(sizeof(struct dacp_update));
+  if (!u)
+    {
+      DPRINTF(E_LOG, L_DACP, "Out of memory for playstatusupdate\n");
+
+      goto out_free_evbuf;
+    }
+
+  u->len = EVBUFFER_LENGTH(evbuf);
+  u->data = (uint8_t *)malloc(u->len);
+  if (!u->data)
+    {
+      DPRINTF(E_LOG, L_DACP, "Out of memory for playstatusupdate data\n");
+
+      free(u);
+      u = NULL;
+      goto out_free_evbuf;
+    }
+
+  evbuffer_remove(evbuf, u->data, u->len);
+
+  u->rev = rev;
+  u->refcount = 2;
+
+  pthread_mutex_lock(&update_lck);
+
+  old = update_cur;
+  update_cur = u;
+
+  pthread_mutex_unlock(&update_lck);
+
+  if (old)
+    update_unref(old);
+
+ out_free_evbuf:
+  evbuffer_free(evbuf);
+ out_unlock:
+  pthread_mutex_unlock(&update_build_lck);
+
+  return u;
+}
+
+/* Thread: httpd */
+static int
+update_send(struct evhttp_request *req, struct dacp_update *u, struct evbuffer *evbuf)
+{
+  int ret;
+
+  pthread_mutex_lock(&update_lck);
+  u->refcount++;
+  pthread_mutex_unlock(&update_lck);
+
+  ret = evbuffer_add_reference(evbuf, u->data, u->len, update_cleanup_cb, u);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DACP, "Could not add playstatusupdate to reply\n");
+
+      update_unref(u);
+      return -1;
+    }
+
+  /* A few hundred bytes; not worth compressing once per waiter */
+  evhttp_send_reply(req, HTTP_OK, "OK", evbuf);
+
+  return 0;
+}
+
+/* Thread: httpd */
 static void
 playstatusupdate_cb(int fd, short what, void *arg)
 {
+  struct timespec start;
+  struct timespec end;
+  struct dacp_thread *t;
   struct dacp_update_request *ur;
+  struct dacp_update *u;
   struct evbuffer *evbuf;
-  struct evbuffer *update;
+  long us;
+  int nreqs;
   int ret;
 
+  t = (struct dacp_thread *)arg;
+
 #ifdef USE_EVENTFD
   eventfd_t count;
 
-  ret = eventfd_read(update_efd, &count);
+  ret = eventfd_read(t->update_efd, &count);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_DACP, "Could not read playstatusupdate event counter: %s\n", strerror(errno));
@@ -287,10 +475,10 @@ playstatusupdate_cb(int fd, short what, void *arg)
 #else
   int dummy;
 
-  read(update_pipe[0], &dummy, sizeof(dummy));
+  read(t->update_pipe[0], &dummy, sizeof(dummy));
 #endif
 
-  if (!update_requests)
+  if (!t->update_requests)
     goto readd;
 
   evbuf = evbuffer_new();
@@ -301,39 +489,40 @@ playstatusupdate_cb(int fd, short what, void *arg)
       goto readd;
     }
 
-  update = evbuffer_new();
-  if (!update)
-    {
-      DPRINTF(E_LOG, L_DACP, "Could not allocate evbuffer for playstatusupdate data\n");
-
-      goto out_free_evbuf;
-    }
+  u = update_get();
+  if (!u)
+    goto out_free_evbuf;
 
-  ret = make_playstatusupdate(update);
-  if (ret < 0)
-    goto out_free_update;
+  clock_gettime(CLOCK_MONOTONIC, &start);
 
-  for (ur = update_requests; update_requests; ur = update_requests)
+  nreqs = 0;
+  for (ur = t->update_requests; t->update_requests; ur = t->update_requests)
     {
-      update_requests = ur->next;
+      t->update_requests = ur->next;
 
       evhttp_connection_set_closecb(ur->req->evcon, NULL, NULL);
 
-      evbuffer_add(evbuf, EVBUFFER_DATA(update), EVBUFFER_LENGTH(update));
-
-      httpd_send_reply(ur->req, HTTP_OK, "OK", evbuf);
+      ret = update_send(ur->req, u, evbuf);
+      if (ret < 0)
+	evhttp_send_error(ur->req, 500, "Internal Server Error");
 
       free(ur);
+      nreqs++;
     }
 
-  current_rev++;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+
+  DPRINTF(E_DBG, L_DACP, "Play status update rev %d sent to %d clients in %ld us (%ld us per client)\n",
+	  u->rev, nreqs, us, us / nreqs);
+
+  update_unref(u);
 
- out_free_update:
-  evbuffer_free(update);
  out_free_evbuf:
   evbuffer_free(evbuf);
  readd:
-  ret = event_add(&updateev, NULL);
+  ret = event_add(&t->updateev, NULL);
   if (ret < 0)
     DPRINTF(E_LOG, L_DACP, "Couldn't re-add event for playstatusupdate\n");
 }
@@ -342,19 +531,29 @@ playstatusupdate_cb(int fd, short what, void *arg)
 static void
 dacp_playstatus_update_handler(void)
 {
+  struct dacp_thread *t;
   int ret;
 
+  __sync_add_and_fetch(&current_rev, 1);
+
+  pthread_mutex_lock(&threads_lck);
+
+  for (t = dacp_threads; t; t = t->next)
+    {
 #ifdef USE_EVENTFD
-  ret = eventfd_write(update_efd, 1);
-  if (ret < 0)
-    DPRINTF(E_LOG, L_DACP, "Could not send status update event: %s\n", strerror(errno));
+      ret = eventfd_write(t->update_efd, 1);
+      if (ret < 0)
+	DPRINTF(E_LOG, L_DACP, "Could not send status update event: %s\n", strerror(errno));
 #else
-  int dummy = 42;
+      int dummy = 42;
 
-  ret = write(update_pipe[1], &dummy, sizeof(dummy));
-  if (ret != sizeof(dummy))
-    DPRINTF(E_LOG, L_DACP, "Could not write to status update fd: %s\n", strerror(errno));
+      ret = write(t->update_pipe[1], &dummy, sizeof(dummy));
+      if (ret != sizeof(dummy))
+	DPRINTF(E_LOG, L_DACP, "Could not write to status update fd: %s\n", strerror(errno));
 #endif
+    }
+
+  pthread_mutex_unlock(&threads_lck);
 }
 
 static void
@@ -370,11 +569,11 @@ update_fail_cb(struct evhttp_connection *evcon, void *arg)
   if (ur->req->evcon)
     evhttp_connection_set_closecb(ur->req->evcon, NULL, NULL);
 
-  if (ur == update_requests)
-    update_requests = ur->next;
+  if (ur == dacp_self->update_requests)
+    dacp_self->update_requests = ur->next;
   else
     {
-      for (p = update_requests; p && (p->next != ur); p = p->next)
+      for (p = dacp_self->update_requests; p && (p->next != ur); p = p->next)
 	;
 
       if (!p)
@@ -392,91 +591,91 @@ update_fail_cb(struct evhttp_connection *evcon, void *arg)
 
 /* Properties getters */
 static void
-dacp_propget_volume(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi)
+dacp_propget_volume(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np)
 {
   dmap_add_int(evbuf, "cmvo", status->volume);
 }
 
 static void
-dacp_propget_volumecontrollable(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi)
+dacp_propget_volumecontrollable(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np)
 {
   dmap_add_char(evbuf, "cavc", 1);
 }
 
 static void
-dacp_propget_playerstate(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi)
+dacp_propget_playerstate(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np)
 {
   dmap_add_char(evbuf, "caps", status->status);
 }
 
 static void
-dacp_propget_shufflestate(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi)
+dacp_propget_shufflestate(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np)
 {
   dmap_add_char(evbuf, "cash", status->shuffle);
 }
 
 static void
-dacp_propget_availableshufflestates(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi)
+dacp_propget_availableshufflestates(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np)
 {
   dmap_add_int(evbuf, "caas", 2);
 }
 
 static void
-dacp_propget_repeatstate(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi)
+dacp_propget_repeatstate(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np)
 {
   dmap_add_char(evbuf, "carp", status->repeat);
 }
 
 static void
-dacp_propget_availablerepeatstates(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi)
+dacp_propget_availablerepeatstates(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np)
 {
   dmap_add_int(evbuf, "caar", 6);
 }
 
 static void
-dacp_propget_nowplaying(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi)
+dacp_propget_nowplaying(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np)
 {
-  dacp_nowplaying(evbuf, status, mfi);
+  dacp_nowplaying(evbuf, status, np);
 }
 
 static void
-dacp_propget_playingtime(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi)
+dacp_propget_playingtime(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np)
 {
-  dacp_playingtime(evbuf, status, mfi);
+  dacp_playingtime(evbuf, status, np);
 }
 
 static void
-dacp_propget_fullscreenenabled(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi)
+dacp_propget_fullscreenenabled(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np)
 {
 	// TODO
 }
 
 static void
-dacp_propget_fullscreen(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi)
+dacp_propget_fullscreen(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np)
 {
 	// TODO
 }
 
 static void
-dacp_propget_visualizerenabled(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi)
+dacp_propget_visualizerenabled(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np)
 {
 	// TODO
 }
 
 static void
-dacp_propget_visualizer(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi)
+dacp_propget_visualizer(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np)
 {
 	// TODO
 }
 
 static void
-dacp_propget_itms_songid(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi)
+dacp_propget_itms_songid(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np)
 {
 	// TODO
 }
 
 static void
-dacp_propget_haschapterdata(struct evbuffer *evbuf, struct player_status *status, struct media_file_info *mfi)
+dacp_propget_haschapterdata(struct evbuffer *evbuf, struct player_status *status, struct nowplaying *np)
 {
 	// TODO
 }
@@ -535,14 +734,32 @@ dacp_propset_volume(const char *value, struct evkeyvalq *query)
 static void
 seek_timer_cb(int fd, short what, void *arg)
 {
+  int target;
+  int seq;
   int ret;
 
-  DPRINTF(E_DBG, L_DACP, "Seek timer expired, target %d ms\n", seek_target);
+  seq = (int)(intptr_t)arg;
+
+  pthread_mutex_lock(&seek_lck);
+
+  target = seek_target;
+  ret = (seq == seek_seq);
+
+  pthread_mutex_unlock(&seek_lck);
+
+  if (!ret)
+    {
+      DPRINTF(E_DBG, L_DACP, "Seek timer expired, superseded by a later seek\n");
+
+      return;
+    }
 
-  ret = player_playback_seek(seek_target);
+  DPRINTF(E_DBG, L_DACP, "Seek timer expired, target %d ms\n", target);
+
+  ret = player_playback_seek(target);
   if (ret < 0)
     {
-      DPRINTF(E_LOG, L_DACP, "Player failed to seek to %d ms\n", seek_target);
+      DPRINTF(E_LOG, L_DACP, "Player failed to seek to %d ms\n", target);
 
       return;
     }
@@ -556,12 +773,14 @@ static void
 dacp_propset_playingtime(const char *value, struct evkeyvalq *query)
 {
   struct timeval tv;
+  int target;
+  int seq;
   int ret;
 
   if (event_initialized(&seek_timer))
     event_del(&seek_timer);
 
-  ret = safe_atoi32(value, &seek_target);
+  ret = safe_atoi32(value, &target);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_DACP, "dacp.playingtime argument doesn't convert to integer: %s\n", value);
@@ -569,7 +788,14 @@ dacp_propset_playingtime(const char *value, struct evkeyvalq *query)
       return;
     }
 
-  evtimer_set(&seek_timer, seek_timer_cb, NULL);
+  pthread_mutex_lock(&seek_lck);
+
+  seek_target = target;
+  seq = ++seek_seq;
+
+  pthread_mutex_unlock(&seek_lck);
+
+  evtimer_set(&seek_timer, seek_timer_cb, (void *)(intptr_t)seq);
   event_base_set(evbase_httpd, &seek_timer);
   evutil_timerclear(&tv);
   tv.tv_usec = 200 * 1000;
@@ -1140,9 +1366,12 @@ dacp_reply_playstatusupdate(struct evhttp_request *req, struct evbuffer *evbuf,
       return;
     }
 
+  /* Built fresh: the shared update has the remaining time of when the
+   * revision was bumped, which may be long ago
+   */
   if (reqd_rev == 1)
     {
-      ret = make_playstatusupdate(evbuf);
+      ret = make_playstatusupdate(evbuf, __sync_add_and_fetch(&current_rev, 0));
       if (ret < 0)
 	evhttp_send_error(req, 500, "Internal Server Error");
       else
@@ -1163,8 +1392,8 @@ dacp_reply_playstatusupdate(struct evhttp_request *req, struct evbuffer *evbuf,
 
   ur->req = req;
 
-  ur->next = update_requests;
-  update_requests = ur;
+  ur->next = dacp_self->update_requests;
+  dacp_self->update_requests = ur;
 
   /* If the connection fails before we have an update to push out
    * to the client, we need to know.
@@ -1177,6 +1406,7 @@ dacp_reply_nowplayingartwork(struct evhttp_request *req, struct evbuffer *evbuf,
 {
   char clen[32];
   struct daap_session *s;
+  struct nowplaying *np;
   const char *param;
   char *ctype;
   uint32_t id;
@@ -1228,7 +1458,13 @@ dacp_reply_nowplayingartwork(struct evhttp_request *req, struct evbuffer *evbuf,
   if (ret < 0)
     goto no_artwork;
 
-  ret = artwork_get_item(id, max_w, max_h, ART_CAN_PNG | ART_CAN_JPEG, evbuf);
+  np = nowplaying_get(id);
+  if (!np)
+    goto no_artwork;
+
+  ret = nowplaying_artwork(np, max_w, max_h, ART_CAN_PNG | ART_CAN_JPEG, evbuf);
+  nowplaying_release(np);
+
   switch (ret)
     {
       case ART_FMT_PNG:
@@ -1265,7 +1501,7 @@ dacp_reply_getproperty(struct evhttp_request *req, struct evbuffer *evbuf, char
   struct player_status status;
   struct daap_session *s;
   const struct dacp_prop_map *dpm;
-  struct media_file_info *mfi;
+  struct nowplaying *np;
   struct evbuffer *proplist;
   const char *param;
   char *ptr;
@@ -1308,17 +1544,15 @@ dacp_reply_getproperty(struct evhttp_request *req, struct evbuffer *evbuf, char
 
   if (status.status != PLAY_STOPPED)
     {
-      mfi = db_file_fetch_byid(status.id);
-      if (!mfi)
+      np = nowplaying_get(status.id);
+      if (!np)
 	{
-	  DPRINTF(E_LOG, L_DACP, "Could not fetch file id %d\n", status.id);
-
 	  dmap_send_error(req, "cmgt", "Server error");
 	  goto out_free_proplist;
 	}
     }
   else
-    mfi = NULL;
+    np = NULL;
 
   prop = strtok_r(propstr, ",", &ptr);
   while (prop)
@@ -1327,7 +1561,7 @@ dacp_reply_getproperty(struct evhttp_request *req, struct evbuffer *evbuf, char
       if (dpm)
 	{
 	  if (dpm->propget)
-	    dpm->propget(proplist, &status, mfi);
+	    dpm->propget(proplist, &status, np);
 	  else
 	    DPRINTF(E_WARN, L_DACP, "No getter method for DACP property %s\n", prop);
 	}
@@ -1339,8 +1573,8 @@ dacp_reply_getproperty(struct evhttp_request *req, struct evbuffer *evbuf, char
 
   free(propstr);
 
-  if (mfi)
-    free_mfi(mfi, 0);
+  if (np)
+    nowplaying_release(np);
 
   dmap_add_container(evbuf, "cmgt", 12 + EVBUFFER_LENGTH(proplist)); /* 8 + len */
   dmap_add_int(evbuf, "mstt", 200);      /* 12 */
@@ -1759,38 +1993,134 @@ dacp_is_request(struct evhttp_request *req, char *uri)
 }
 
 
+/* Thread: httpd */
 int
-dacp_init(void)
+dacp_thread_init(void)
 {
-  char buf[64];
-  int i;
+  struct dacp_thread *t;
   int ret;
 
-  current_rev = 2;
-  update_requests = NULL;
+  t = (struct dacp_thread *)malloc(sizeof(struct dacp_thread));
+  if (!t)
+    {
+      DPRINTF(E_LOG, L_DACP, "Out of memory for DACP thread context\n");
+
+      return -1;
+    }
+
+  memset(t, 0, sizeof(struct dacp_thread));
 
 #ifdef USE_EVENTFD
-  update_efd = eventfd(0, EFD_CLOEXEC);
-  if (update_efd < 0)
+  t->update_efd = eventfd(0, EFD_CLOEXEC);
+  if (t->update_efd < 0)
     {
       DPRINTF(E_LOG, L_DACP, "Could not create update eventfd: %s\n", strerror(errno));
 
+      free(t);
       return -1;
     }
+
+  event_set(&t->updateev, t->update_efd, EV_READ, playstatusupdate_cb, t);
 #else
 # if defined(__linux__)
-  ret = pipe2(update_pipe, O_CLOEXEC);
+  ret = pipe2(t->update_pipe, O_CLOEXEC);
 # else
-  ret = pipe(update_pipe);
+  ret = pipe(t->update_pipe);
 # endif
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_DACP, "Could not create update pipe: %s\n", strerror(errno));
 
+      free(t);
       return -1;
     }
+
+  event_set(&t->updateev, t->update_pipe[0], EV_READ, playstatusupdate_cb, t);
 #endif /* USE_EVENTFD */
 
+  event_base_set(evbase_httpd, &t->updateev);
+  ret = event_add(&t->updateev, NULL);
+  if (ret < 0)
+    DPRINTF(E_LOG, L_DACP, "Couldn't add event for playstatusupdate\n");
+
+  pthread_mutex_lock(&threads_lck);
+
+  t->next = dacp_threads;
+  dacp_threads = t;
+
+  pthread_mutex_unlock(&threads_lck);
+
+  dacp_self = t;
+
+  return 0;
+}
+
+/* Thread: httpd */
+void
+dacp_thread_deinit(void)
+{
+  struct dacp_thread *t;
+  struct dacp_thread *p;
+  struct dacp_update_request *ur;
+
+  t = dacp_self;
+  if (!t)
+    return;
+
+  pthread_mutex_lock(&threads_lck);
+
+  if (t == dacp_threads)
+    dacp_threads = t->next;
+  else
+    {
+      for (p = dacp_threads; p && (p->next != t); p = p->next)
+	;
+
+      if (p)
+	p->next = t->next;
+    }
+
+  pthread_mutex_unlock(&threads_lck);
+
+  for (ur = t->update_requests; t->update_requests; ur = t->update_requests)
+    {
+      t->update_requests = ur->next;
+
+      if (ur->req->evcon)
+	{
+	  evhttp_connection_set_closecb(ur->req->evcon, NULL, NULL);
+	  evhttp_connection_free(ur->req->evcon);
+	}
+
+      free(ur);
+    }
+
+  if (event_initialized(&seek_timer))
+    event_del(&seek_timer);
+
+  event_del(&t->updateev);
+
+#ifdef USE_EVENTFD
+  close(t->update_efd);
+#else
+  close(t->update_pipe[0]);
+  close(t->update_pipe[1]);
+#endif
+
+  free(t);
+  dacp_self = NULL;
+}
+
+int
+dacp_init(void)
+{
+  char buf[64];
+  int i;
+  int ret;
+
+  current_rev = 2;
+  seek_seq = 0;
+
   for (i = 0; dacp_handlers[i].handler; i++)
     {
       ret = regcomp(&dacp_handlers[i].preg, dacp_handlers[i].regexp, REG_EXTENDED | REG_NOSUB);
@@ -1803,32 +2133,20 @@ dacp_init(void)
         }
     }
 
-#ifdef USE_EVENTFD
-  event_set(&updateev, update_efd, EV_READ, playstatusupdate_cb, NULL);
-#else
-  event_set(&updateev, update_pipe[0], EV_READ, playstatusupdate_cb, NULL);
-#endif
-  event_base_set(evbase_httpd, &updateev);
-  event_add(&updateev, NULL);
-
   player_set_update_handler(dacp_playstatus_update_handler);
 
   return 0;
 
  regexp_fail:
-#ifdef USE_EVENTFD
-  close(update_efd);
-#else
-  close(update_pipe[0]);
-  close(update_pipe[1]);
-#endif
+  for (i--; i >= 0; i--)
+    regfree(&dacp_handlers[i].preg);
+
   return -1;
 }
 
 void
 dacp_deinit(void)
 {
-  struct dacp_update_request *ur;
   int i;
 
   player_set_update_handler(NULL);
@@ -1836,25 +2154,9 @@ dacp_deinit(void)
   for (i = 0; dacp_handlers[i].handler; i++)
     regfree(&dacp_handlers[i].preg);
 
-  for (ur = update_requests; update_requests; ur = update_requests)
+  if (update_cur)
     {
-      update_requests = ur->next;
-
-      if (ur->req->evcon)
-	{
-	  evhttp_connection_set_closecb(ur->req->evcon, NULL, NULL);
-	  evhttp_connection_free(ur->req->evcon);
-	}
-
-      free(ur);
+      update_unref(update_cur);
+      update_cur = NULL;
     }
-
-  event_del(&updateev);
-
-#ifdef USE_EVENTFD
-  close(update_efd);
-#else
-  close(update_pipe[0]);
-  close(update_pipe[1]);
-#endif
 }
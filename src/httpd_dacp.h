@@ -17,4 +17,10 @@ dacp_request(struct evhttp_request *req);
 int
 dacp_is_request(struct evhttp_request *req, char *uri);
 
+int
+dacp_thread_init(void);
+
+void
+dacp_thread_deinit(void);
+
 #endif /* !__HTTPD_DACP_H__ */
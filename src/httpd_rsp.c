@@ -437,6 +437,7 @@ rsp_reply_playlist(struct evhttp_request *req, char **uri, struct evkeyvalq *que
 {
   struct query_params qp;
   struct db_media_file_info dbmfi;
+  struct transcode_profile xcode;
   const char *param;
   char **strval;
   mxml_node_t *reply;
@@ -485,6 +486,18 @@ rsp_reply_playlist(struct evhttp_request *req, char **uri, struct evkeyvalq *que
   if (ret < 0)
     return;
 
+  ret = transcode_profile_init(&xcode, req->input_headers);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_RSP, "Could not build client profile\n");
+
+      rsp_send_error(req, "Out of memory");
+
+      if (qp.filter)
+	free(qp.filter);
+      return;
+    }
+
   ret = db_query_start(&qp);
   if (ret < 0)
     {
@@ -492,6 +505,7 @@ rsp_reply_playlist(struct evhttp_request *req, char **uri, struct evkeyvalq *que
 
       rsp_send_error(req, "Could not start query");
 
+      transcode_profile_clear(&xcode);
       if (qp.filter)
 	free(qp.filter);
       return;
@@ -529,7 +543,7 @@ rsp_reply_playlist(struct evhttp_request *req, char **uri, struct evkeyvalq *que
   /* Items block (all items) */
   while (((ret = db_query_fetch_file(&qp, &dbmfi)) == 0) && (dbmfi.id))
     {
-      transcode = transcode_needed(req->input_headers, dbmfi.codectype);
+      transcode = transcode_profile_needed(&xcode, dbmfi.codectype);
 
       /* Item block (one item) */
       item = mxmlNewElement(items, "item");
@@ -553,7 +567,7 @@ rsp_reply_playlist(struct evhttp_request *req, char **uri, struct evkeyvalq *que
 	      switch (rsp_fields[i].offset)
 		{
 		  case dbmfi_offsetof(type):
-		    mxmlNewText(node, 0, "wav");
+		    mxmlNewText(node, 0, (transcode == XCODE_ALAC) ? "m4a" : "wav");
 		    break;
 
 		  case dbmfi_offsetof(bitrate):
@@ -568,11 +582,11 @@ rsp_reply_playlist(struct evhttp_request *req, char **uri, struct evkeyvalq *que
 		    break;
 
 		  case dbmfi_offsetof(description):
-		    mxmlNewText(node, 0, "wav audio file");
+		    mxmlNewText(node, 0, (transcode == XCODE_ALAC) ? "Apple Lossless audio file" : "wav audio file");
 		    break;
 
 		  case dbmfi_offsetof(codectype):
-		    mxmlNewText(node, 0, "wav");
+		    mxmlNewText(node, 0, (transcode == XCODE_ALAC) ? "alac" : "wav");
 
 		    node = mxmlNewElement(item, "original_codec");
 		    mxmlNewText(node, 0, *strval);
@@ -586,6 +600,8 @@ rsp_reply_playlist(struct evhttp_request *req, char **uri, struct evkeyvalq *que
 	}
     }
 
+  transcode_profile_clear(&xcode);
+
   if (qp.filter)
     free(qp.filter);
 
@@ -925,4 +941,6 @@ rsp_deinit(void)
 
   for (i = 0; rsp_handlers[i].handler; i++)
     regfree(&rsp_handlers[i].preg);
+
+  rsp_query_deinit();
 }
@@ -63,6 +63,9 @@ GCRY_THREAD_OPTION_PTHREAD_IMPL;
 #include "mdns.h"
 #include "remote_pairing.h"
 #include "player.h"
+#include "prefetch.h"
+#include "artwork_cache.h"
+#include "transcode.h"
 #if LIBAVFORMAT_VERSION_MAJOR < 53
 # include "ffmpeg_url_evbuffer.h"
 #endif
@@ -585,6 +588,8 @@ main(int argc, char **argv)
   register_ffmpeg_evbuffer_url_protocol();
 #endif
 
+  transcode_init();
+
   /* Initialize libgcrypt */
   gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
 
@@ -666,6 +671,10 @@ main(int argc, char **argv)
       goto db_fail;
     }
 
+  ret = artwork_cache_init();
+  if (ret < 0)
+    DPRINTF(E_WARN, L_MAIN, "Artwork cache unavailable, artwork will be rendered for every request\n");
+
   /* Spawn file scanner thread */
   ret = filescanner_init();
   if (ret != 0)
@@ -676,6 +685,16 @@ main(int argc, char **argv)
       goto filescanner_fail;
     }
 
+  /* Spawn prefetch thread */
+  ret = prefetch_init();
+  if (ret != 0)
+    {
+      DPRINTF(E_FATAL, L_MAIN, "Prefetch thread failed to start\n");
+
+      ret = EXIT_FAILURE;
+      goto prefetch_fail;
+    }
+
   /* Spawn player thread */
   ret = player_init();
   if (ret != 0)
@@ -784,10 +803,16 @@ main(int argc, char **argv)
   player_deinit();
 
  player_fail:
+  DPRINTF(E_LOG, L_MAIN, "Prefetch deinit\n");
+  prefetch_deinit();
+
+ prefetch_fail:
   DPRINTF(E_LOG, L_MAIN, "File scanner deinit\n");
   filescanner_deinit();
 
  filescanner_fail:
+  artwork_cache_deinit();
+
   DPRINTF(E_LOG, L_MAIN, "Database deinit\n");
   db_perthread_deinit();
   db_deinit();
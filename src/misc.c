@@ -32,6 +32,7 @@
 #include <stdint.h>
 #include <limits.h>
 #include <sys/param.h>
+#include <pthread.h>
 
 #include <unistr.h>
 #include <uniconv.h>
@@ -389,6 +390,169 @@ keyval_clear(struct keyval *kv)
 }
 
 
+/* LRU string cache */
+static void
+lru_cache_unlink(struct lru_cache *lc, struct lru_entry *le)
+{
+  if (le->prev)
+    le->prev->next = le->next;
+  else
+    lc->head = le->next;
+
+  if (le->next)
+    le->next->prev = le->prev;
+  else
+    lc->tail = le->prev;
+
+  le->prev = NULL;
+  le->next = NULL;
+}
+
+static void
+lru_cache_push(struct lru_cache *lc, struct lru_entry *le)
+{
+  le->prev = NULL;
+  le->next = lc->head;
+
+  if (lc->head)
+    lc->head->prev = le;
+  else
+    lc->tail = le;
+
+  lc->head = le;
+}
+
+static void
+lru_entry_free(struct lru_entry *le)
+{
+  free(le->key);
+  free(le->value);
+  free(le);
+}
+
+char *
+lru_cache_get(struct lru_cache *lc, const char *key)
+{
+  struct lru_entry *le;
+  uint32_t hash;
+  char *ret;
+
+  hash = djb_hash((void *)key, strlen(key));
+  ret = NULL;
+
+  pthread_mutex_lock(&lc->lck);
+
+  for (le = lc->head; le; le = le->next)
+    {
+      if ((le->hash == hash) && (strcmp(le->key, key) == 0))
+	break;
+    }
+
+  if (le)
+    {
+      /* Move to front, most recently used */
+      if (le != lc->head)
+	{
+	  lru_cache_unlink(lc, le);
+	  lru_cache_push(lc, le);
+	}
+
+      ret = strdup(le->value);
+      if (!ret)
+	DPRINTF(E_LOG, L_MISC, "Out of memory for cached value\n");
+    }
+
+  pthread_mutex_unlock(&lc->lck);
+
+  return ret;
+}
+
+int
+lru_cache_add(struct lru_cache *lc, const char *key, const char *value)
+{
+  struct lru_entry *le;
+  struct lru_entry *old;
+
+  le = (struct lru_entry *)malloc(sizeof(struct lru_entry));
+  if (!le)
+    {
+      DPRINTF(E_LOG, L_MISC, "Out of memory for LRU cache entry\n");
+
+      return -1;
+    }
+  memset(le, 0, sizeof(struct lru_entry));
+
+  le->key = strdup(key);
+  le->value = strdup(value);
+  if (!le->key || !le->value)
+    {
+      DPRINTF(E_LOG, L_MISC, "Out of memory for LRU cache entry\n");
+
+      if (le->key)
+	free(le->key);
+      if (le->value)
+	free(le->value);
+      free(le);
+      return -1;
+    }
+
+  le->hash = djb_hash(le->key, strlen(le->key));
+
+  pthread_mutex_lock(&lc->lck);
+
+  /* Another thread may have beaten us to it */
+  for (old = lc->head; old; old = old->next)
+    {
+      if ((old->hash == le->hash) && (strcmp(old->key, le->key) == 0))
+	break;
+    }
+
+  if (old)
+    {
+      lru_cache_unlink(lc, old);
+      lru_entry_free(old);
+      lc->nentries--;
+    }
+
+  lru_cache_push(lc, le);
+  lc->nentries++;
+
+  /* Evict least recently used entries */
+  while (lc->nentries > lc->max_entries)
+    {
+      old = lc->tail;
+
+      lru_cache_unlink(lc, old);
+      lru_entry_free(old);
+      lc->nentries--;
+    }
+
+  pthread_mutex_unlock(&lc->lck);
+
+  return 0;
+}
+
+void
+lru_cache_clear(struct lru_cache *lc)
+{
+  struct lru_entry *le;
+
+  pthread_mutex_lock(&lc->lck);
+
+  for (le = lc->head; lc->head; le = lc->head)
+    {
+      lc->head = le->next;
+
+      lru_entry_free(le);
+    }
+
+  lc->tail = NULL;
+  lc->nentries = 0;
+
+  pthread_mutex_unlock(&lc->lck);
+}
+
+
 char *
 m_realpath(const char *pathname)
 {
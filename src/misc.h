@@ -3,6 +3,7 @@
 #define __MISC_H__
 
 #include <stdint.h>
+#include <pthread.h>
 
 
 struct onekeyval {
@@ -17,6 +18,26 @@ struct keyval {
   struct onekeyval *tail;
 };
 
+struct lru_entry {
+  uint32_t hash;
+  char *key;
+  char *value;
+
+  struct lru_entry *prev;
+  struct lru_entry *next;
+};
+
+struct lru_cache {
+  pthread_mutex_t lck;
+  int max_entries;
+  int nentries;
+
+  struct lru_entry *head;
+  struct lru_entry *tail;
+};
+
+#define LRU_CACHE_INITIALIZER(max) { PTHREAD_MUTEX_INITIALIZER, (max), 0, NULL, NULL }
+
 
 int
 safe_atoi32(const char *str, int32_t *val);
@@ -54,6 +75,17 @@ void
 keyval_clear(struct keyval *kv);
 
 
+/* LRU string cache functions */
+char *
+lru_cache_get(struct lru_cache *lc, const char *key);
+
+int
+lru_cache_add(struct lru_cache *lc, const char *key, const char *value);
+
+void
+lru_cache_clear(struct lru_cache *lc);
+
+
 char *
 m_realpath(const char *pathname);
 
@@ -0,0 +1,441 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Snapshot of the item being played, for DACP
+ *
+ * The player publishes the id of the item in its status whenever it
+ * changes, without touching the DB. The first status reply for that item
+ * builds the snapshot: the DMAP fields Remote displays for it (cann, cana,
+ * canl, cang, asai), already encoded, and its length. Later replies append
+ * the fields from the snapshot instead of fetching the item from the DB for
+ * every poll.
+ *
+ * Artwork is rendered the first time a given size is asked for and kept
+ * with the snapshot, so all the Remotes polling nowplayingartwork get the
+ * same bytes without going through the artwork code again.
+ *
+ * Snapshots are reference counted; a replaced snapshot lives on until the
+ * last reply using it has been sent.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <event.h>
+
+#include "logger.h"
+#include "db.h"
+#include "dmap_common.h"
+#include "artwork.h"
+#include "nowplaying.h"
+
+
+/* Artwork sizes kept per snapshot; Remote asks for one or two */
+#define NOWPLAYING_ART_MAX  4
+
+struct nowplaying_art {
+  int max_w;
+  int max_h;
+  int format;
+
+  /* ART_FMT_*, -1 if the item has no artwork */
+  int fmt;
+  uint8_t *data;
+  size_t len;
+
+  struct nowplaying_art *next;
+};
+
+struct nowplaying {
+  uint32_t id;
+  uint32_t song_length;
+
+  /* Encoded DMAP fields */
+  uint8_t *dmap;
+  size_t dmap_len;
+
+  /* Protects the artwork list and serializes rendering */
+  pthread_mutex_t art_lck;
+  struct nowplaying_art *art;
+  int nart;
+
+  /* One for np_cur, one per user and per evbuffer holding artwork */
+  int refcount;
+};
+
+
+static pthread_mutex_t np_lck = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t np_id;
+/* Snapshot of np_id, once built */
+static struct nowplaying *np_cur;
+
+
+static void
+np_free(struct nowplaying *np)
+{
+  struct nowplaying_art *a;
+
+  while (np->art)
+    {
+      a = np->art;
+      np->art = a->next;
+
+      if (a->data)
+	free(a->data);
+      free(a);
+    }
+
+  pthread_mutex_destroy(&np->art_lck);
+
+  free(np->dmap);
+  free(np);
+}
+
+static void
+np_unref(struct nowplaying *np)
+{
+  int refcount;
+
+  pthread_mutex_lock(&np_lck);
+
+  np->refcount--;
+  refcount = np->refcount;
+
+  pthread_mutex_unlock(&np_lck);
+
+  if (refcount == 0)
+    np_free(np);
+}
+
+/* Thread: any (whoever frees the evbuffer) */
+static void
+np_cleanup_cb(const void *data, size_t datalen, void *extra)
+{
+  np_unref((struct nowplaying *)extra);
+}
+
+/* Builds a snapshot of item id from the DB, with one reference */
+static struct nowplaying *
+np_new(uint32_t id)
+{
+  struct media_file_info *mfi;
+  struct nowplaying *np;
+  struct evbuffer *evbuf;
+
+  mfi = db_file_fetch_byid(id);
+  if (!mfi)
+    {
+      DPRINTF(E_LOG, L_DACP, "Could not fetch file id %d\n", id);
+
+      return NULL;
+    }
+
+  evbuf = evbuffer_new();
+  if (!evbuf)
+    {
+      DPRINTF(E_LOG, L_DACP, "Could not allocate evbuffer for now playing data\n");
+
+      goto out_free_mfi;
+    }
+
+  dmap_add_string(evbuf, "cann", mfi->title);
+  dmap_add_string(evbuf, "cana", mfi->artist);
+  dmap_add_string(evbuf, "canl", mfi->album);
+  dmap_add_string(evbuf, "cang", mfi->genre);
+  dmap_add_long(evbuf, "asai", mfi->songalbumid);
+
+  np = (struct nowplaying *)malloc(sizeof(struct nowplaying));
+  if (!np)
+    {
+      DPRINTF(E_LOG, L_DACP, "Out of memory for now playing snapshot\n");
+
+      goto out_free_evbuf;
+    }
+
+  memset(np, 0, sizeof(struct nowplaying));
+
+  np->dmap_len = EVBUFFER_LENGTH(evbuf);
+  np->dmap = (uint8_t *)malloc(np->dmap_len);
+  if (!np->dmap)
+    {
+      DPRINTF(E_LOG, L_DACP, "Out of memory for now playing data\n");
+
+      free(np);
+      goto out_free_evbuf;
+    }
+
+  evbuffer_remove(evbuf, np->dmap, np->dmap_len);
+
+  np->id = id;
+  np->song_length = mfi->song_length;
+
+  pthread_mutex_init(&np->art_lck, NULL);
+
+  np->refcount = 1;
+
+  evbuffer_free(evbuf);
+  free_mfi(mfi, 0);
+
+  return np;
+
+ out_free_evbuf:
+  evbuffer_free(evbuf);
+ out_free_mfi:
+  free_mfi(mfi, 0);
+
+  return NULL;
+}
+
+/* Art lock held */
+static struct nowplaying_art *
+np_art_render(struct nowplaying *np, int max_w, int max_h, int format)
+{
+  struct nowplaying_art *a;
+  struct evbuffer *evbuf;
+  int ret;
+
+  a = (struct nowplaying_art *)malloc(sizeof(struct nowplaying_art));
+  evbuf = evbuffer_new();
+  if (!a || !evbuf)
+    {
+      DPRINTF(E_LOG, L_DACP, "Out of memory for now playing artwork\n");
+
+      goto out_fail;
+    }
+
+  memset(a, 0, sizeof(struct nowplaying_art));
+
+  a->max_w = max_w;
+  a->max_h = max_h;
+  a->format = format;
+  a->fmt = -1;
+
+  ret = artwork_get_item(np->id, max_w, max_h, format, evbuf);
+  if ((ret > 0) && (EVBUFFER_LENGTH(evbuf) > 0))
+    {
+      a->len = EVBUFFER_LENGTH(evbuf);
+      a->data = (uint8_t *)malloc(a->len);
+      if (!a->data)
+	{
+	  DPRINTF(E_LOG, L_DACP, "Out of memory for now playing artwork data\n");
+
+	  goto out_fail;
+	}
+
+      evbuffer_remove(evbuf, a->data, a->len);
+      a->fmt = ret;
+    }
+
+  evbuffer_free(evbuf);
+
+  return a;
+
+ out_fail:
+  if (evbuf)
+    evbuffer_free(evbuf);
+  if (a)
+    free(a);
+
+  return NULL;
+}
+
+
+/* Thread: player */
+void
+nowplaying_publish(uint32_t id)
+{
+  struct nowplaying *old;
+
+  pthread_mutex_lock(&np_lck);
+
+  np_id = id;
+
+  old = NULL;
+  if (np_cur && (np_cur->id != id))
+    {
+      old = np_cur;
+      np_cur = NULL;
+    }
+
+  pthread_mutex_unlock(&np_lck);
+
+  if (old)
+    np_unref(old);
+}
+
+/* Returns a reference on the snapshot of item id, building it from the DB
+ * if needed; it is kept for the next callers if id is the published item
+ */
+/* Thread: httpd (DACP) */
+struct nowplaying *
+nowplaying_get(uint32_t id)
+{
+  struct nowplaying *np;
+  struct nowplaying *drop;
+
+  pthread_mutex_lock(&np_lck);
+
+  np = np_cur;
+  if (np && (np->id == id))
+    np->refcount++;
+  else
+    np = NULL;
+
+  pthread_mutex_unlock(&np_lck);
+
+  if (np)
+    return np;
+
+  np = np_new(id);
+  if (!np)
+    return NULL;
+
+  drop = NULL;
+
+  pthread_mutex_lock(&np_lck);
+
+  if (id == np_id)
+    {
+      if (np_cur && (np_cur->id == id))
+	{
+	  /* Built by another reply meanwhile, use that one */
+	  drop = np;
+	  np = np_cur;
+	}
+      else
+	{
+	  drop = np_cur;
+	  np_cur = np;
+	}
+
+      np->refcount++;
+    }
+
+  pthread_mutex_unlock(&np_lck);
+
+  if (drop)
+    np_unref(drop);
+
+  return np;
+}
+
+void
+nowplaying_release(struct nowplaying *np)
+{
+  np_unref(np);
+}
+
+int
+nowplaying_add_dmap(struct nowplaying *np, struct evbuffer *evbuf)
+{
+  return evbuffer_add(evbuf, np->dmap, np->dmap_len);
+}
+
+uint32_t
+nowplaying_song_length(struct nowplaying *np)
+{
+  return np->song_length;
+}
+
+/* Adds the artwork of the snapshot's item to evbuf, rendering it on first
+ * use; returns ART_FMT_* or -1
+ */
+int
+nowplaying_artwork(struct nowplaying *np, int max_w, int max_h, int format, struct evbuffer *evbuf)
+{
+  struct nowplaying_art *a;
+  int ret;
+
+  pthread_mutex_lock(&np->art_lck);
+
+  for (a = np->art; a; a = a->next)
+    {
+      if ((a->max_w == max_w) && (a->max_h == max_h) && (a->format == format))
+	break;
+    }
+
+  if (!a)
+    {
+      /* Odd sizes, don't keep them around */
+      if (np->nart >= NOWPLAYING_ART_MAX)
+	{
+	  pthread_mutex_unlock(&np->art_lck);
+
+	  return artwork_get_item(np->id, max_w, max_h, format, evbuf);
+	}
+
+      a = np_art_render(np, max_w, max_h, format);
+      if (!a)
+	{
+	  pthread_mutex_unlock(&np->art_lck);
+
+	  return -1;
+	}
+
+      a->next = np->art;
+      np->art = a;
+      np->nart++;
+    }
+
+  pthread_mutex_unlock(&np->art_lck);
+
+  if (a->fmt < 0)
+    return -1;
+
+  /* Artwork stays with the snapshot; evbuf holds a reference until sent */
+  pthread_mutex_lock(&np_lck);
+
+  np->refcount++;
+
+  pthread_mutex_unlock(&np_lck);
+
+  ret = evbuffer_add_reference(evbuf, a->data, a->len, np_cleanup_cb, np);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DACP, "Could not add now playing artwork to evbuffer\n");
+
+      np_unref(np);
+      return -1;
+    }
+
+  return a->fmt;
+}
+
+/* Thread: main */
+void
+nowplaying_deinit(void)
+{
+  struct nowplaying *np;
+
+  pthread_mutex_lock(&np_lck);
+
+  np = np_cur;
+  np_cur = NULL;
+  np_id = 0;
+
+  pthread_mutex_unlock(&np_lck);
+
+  if (np)
+    np_unref(np);
+}
@@ -0,0 +1,31 @@
+
+#ifndef __NOWPLAYING_H__
+#define __NOWPLAYING_H__
+
+#include <stdint.h>
+#include <event.h>
+
+struct nowplaying;
+
+void
+nowplaying_publish(uint32_t id);
+
+struct nowplaying *
+nowplaying_get(uint32_t id);
+
+void
+nowplaying_release(struct nowplaying *np);
+
+int
+nowplaying_add_dmap(struct nowplaying *np, struct evbuffer *evbuf);
+
+uint32_t
+nowplaying_song_length(struct nowplaying *np);
+
+int
+nowplaying_artwork(struct nowplaying *np, int max_w, int max_h, int format, struct evbuffer *evbuf);
+
+void
+nowplaying_deinit(void);
+
+#endif /* !__NOWPLAYING_H__ */
@@ -0,0 +1,853 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+
+#if defined(__linux__) || defined(__GLIBC__)
+# include <endian.h>
+# include <byteswap.h>
+#elif defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
+# include <sys/endian.h>
+#endif
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+#include <libavcodec/avcodec.h>
+
+#include "logger.h"
+#include "pcm_convert.h"
+
+
+/* Conversion from decoded frames (any of s16, s32 and float, planar or
+ * packed, mono or stereo) to interleaved 16-bit stereo at 44.1 kHz.
+ *
+ * 16-bit input at 44.1 kHz is only interleaved. Anything else goes through
+ * float: 24/32-bit and float input is requantized to 16 bits with TPDF
+ * dither, and other sample rates are resampled by a polyphase windowed-sinc
+ * filter first. The inner loops have SSE2 versions; the scalar versions are
+ * used everywhere else and for the tails.
+ */
+
+#if LIBAVCODEC_VERSION_MAJOR >= 54 || (LIBAVCODEC_VERSION_MAJOR == 53 && LIBAVCODEC_VERSION_MINOR >= 35)
+
+#define PCM_OUT_RATE     44100
+
+/* Resampling limits: the number of filter phases is the upsampling factor,
+ * 147 for 48 and 96 kHz. Rates needing more phases (32 kHz needs 441) are
+ * left to the libav resampler.
+ */
+#define PCM_MAX_PHASES   160
+#define PCM_BASE_TAPS    64
+#define PCM_MAX_TAPS     256
+#define PCM_KAISER_BETA  8.0
+
+#define PCM_DITHER_SIZE  4096
+#define PCM_DITHER_MASK  (PCM_DITHER_SIZE - 1)
+
+
+struct pcm_converter {
+  enum AVSampleFormat fmt;
+  int channels;
+  int rate;
+
+  /* Position in the dither table */
+  unsigned int dpos;
+
+  /* Resampling, rate * up = 44100 * down; up is 0 at 44.1 kHz */
+  int up;
+  int down;
+  int taps;
+  float *coefs;  /* up phases of taps coefficients, 16-byte aligned */
+
+  /* Input history and new input, in 16-bit units, xlen samples per channel */
+  float *x[2];
+  int xlen;
+  int xsize;
+  /* Position of the next output sample, in upsampled input samples from x[][0] */
+  int t;
+  /* Samples in and out since the last reset, to size the tail at EOF */
+  int64_t nin;
+  int64_t nout;
+
+  /* Set if the history couldn't be set up; the converter is unusable */
+  int failed;
+
+  /* Scratch for converted or resampled samples */
+  float *y[2];
+  int ysize;
+};
+
+
+/* Triangular dither spanning +/- 1 LSB; padded so vector loads from any
+ * position stay within the table
+ */
+static float dither_table[PCM_DITHER_SIZE + 8];
+static pthread_once_t dither_once = PTHREAD_ONCE_INIT;
+
+
+#if BYTE_ORDER == BIG_ENDIAN
+# define PCM_STORE(dst, v, le) (dst) = (le) ? bswap_16(v) : (v)
+#else
+# define PCM_STORE(dst, v, le) (dst) = (v)
+#endif
+
+
+static void
+dither_init(void)
+{
+  uint32_t seed;
+  float u1;
+  float u2;
+  int i;
+
+  seed = 0x2545f491;
+  for (i = 0; i < PCM_DITHER_SIZE; i++)
+    {
+      seed = seed * 1664525 + 1013904223;
+      u1 = (float)(seed >> 8) / 16777216.0f;
+      seed = seed * 1664525 + 1013904223;
+      u2 = (float)(seed >> 8) / 16777216.0f;
+
+      dither_table[i] = u1 - u2;
+    }
+
+  memcpy(dither_table + PCM_DITHER_SIZE, dither_table, 8 * sizeof(float));
+}
+
+static inline int16_t
+pcm_s16(float f)
+{
+  f += (f < 0.0f) ? -0.5f : 0.5f;
+
+  if (f > 32767.0f)
+    return 32767;
+  if (f < -32768.0f)
+    return -32768;
+
+  return (int16_t)f;
+}
+
+static inline float
+pcm_dither(struct pcm_converter *pc)
+{
+  float d;
+
+  d = dither_table[pc->dpos];
+  pc->dpos = (pc->dpos + 1) & PCM_DITHER_MASK;
+
+  return d;
+}
+
+
+/* Kernels */
+
+/* Planar float, already scaled by scale to 16-bit units, to interleaved
+ * 16-bit; mono passes the same pointer for l and r
+ */
+static void
+pcm_float_planar(struct pcm_converter *pc, int16_t *restrict dst, const float *l, const float *r, int n, float scale, int le)
+{
+  int i;
+#ifdef __SSE2__
+  __m128 vs;
+  __m128 vmin;
+  __m128 vmax;
+  __m128i li;
+  __m128i ri;
+  const float *d;
+#endif
+
+  i = 0;
+
+#ifdef __SSE2__
+  vs = _mm_set1_ps(scale);
+  vmin = _mm_set1_ps(-32768.0f);
+  vmax = _mm_set1_ps(32767.0f);
+
+  for (; i + 4 <= n; i += 4)
+    {
+      d = dither_table + pc->dpos;
+      pc->dpos = (pc->dpos + 8) & PCM_DITHER_MASK;
+
+      li = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(l + i), vs), _mm_loadu_ps(d)), vmin), vmax));
+      ri = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(r + i), vs), _mm_loadu_ps(d + 4)), vmin), vmax));
+
+      /* L0 R0 L1 R1 | L2 R2 L3 R3, saturated to 16 bits */
+      _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_packs_epi32(_mm_unpacklo_epi32(li, ri), _mm_unpackhi_epi32(li, ri)));
+    }
+#endif
+
+  for (; i < n; i++)
+    {
+      PCM_STORE(dst[2 * i], pcm_s16(l[i] * scale + pcm_dither(pc)), le);
+      PCM_STORE(dst[2 * i + 1], pcm_s16(r[i] * scale + pcm_dither(pc)), le);
+    }
+}
+
+/* Packed float stereo to 16-bit; n counts values, not frames */
+static void
+pcm_float_packed(struct pcm_converter *pc, int16_t *restrict dst, const float *src, int n, float scale, int le)
+{
+  int i;
+#ifdef __SSE2__
+  __m128 vs;
+  __m128 vmin;
+  __m128 vmax;
+  __m128i a;
+  __m128i b;
+  const float *d;
+#endif
+
+  i = 0;
+
+#ifdef __SSE2__
+  vs = _mm_set1_ps(scale);
+  vmin = _mm_set1_ps(-32768.0f);
+  vmax = _mm_set1_ps(32767.0f);
+
+  for (; i + 8 <= n; i += 8)
+    {
+      d = dither_table + pc->dpos;
+      pc->dpos = (pc->dpos + 8) & PCM_DITHER_MASK;
+
+      a = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + i), vs), _mm_loadu_ps(d)), vmin), vmax));
+      b = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + i + 4), vs), _mm_loadu_ps(d + 4)), vmin), vmax));
+
+      _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(a, b));
+    }
+#endif
+
+  for (; i < n; i++)
+    PCM_STORE(dst[i], pcm_s16(src[i] * scale + pcm_dither(pc)), le);
+}
+
+/* 32-bit integer to float in 16-bit units */
+static void
+pcm_s32_float(float *restrict dst, const int32_t *src, int n)
+{
+  int i;
+#ifdef __SSE2__
+  __m128 vs;
+#endif
+
+  i = 0;
+
+#ifdef __SSE2__
+  vs = _mm_set1_ps(1.0f / 65536.0f);
+
+  for (; i + 4 <= n; i += 4)
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(src + i))), vs));
+#endif
+
+  for (; i < n; i++)
+    dst[i] = (float)src[i] * (1.0f / 65536.0f);
+}
+
+/* One output sample of the resampler; n is a multiple of 8 and c is aligned */
+static inline float
+pcm_dot(const float *x, const float *c, int n)
+{
+  int i;
+#ifdef __SSE2__
+  __m128 a0;
+  __m128 a1;
+
+  a0 = _mm_setzero_ps();
+  a1 = _mm_setzero_ps();
+
+  for (i = 0; i < n; i += 8)
+    {
+      a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_load_ps(c + i)));
+      a1 = _mm_add_ps(a1, _mm_mul_ps(_mm_loadu_ps(x + i + 4), _mm_load_ps(c + i + 4)));
+    }
+
+  a0 = _mm_add_ps(a0, a1);
+  a0 = _mm_add_ps(a0, _mm_movehl_ps(a0, a0));
+  a0 = _mm_add_ss(a0, _mm_shuffle_ps(a0, a0, 1));
+
+  return _mm_cvtss_f32(a0);
+#else
+  float s[4];
+
+  s[0] = s[1] = s[2] = s[3] = 0.0f;
+
+  for (i = 0; i < n; i += 4)
+    {
+      s[0] += x[i] * c[i];
+      s[1] += x[i + 1] * c[i + 1];
+      s[2] += x[i + 2] * c[i + 2];
+      s[3] += x[i + 3] * c[i + 3];
+    }
+
+  return (s[0] + s[1]) + (s[2] + s[3]);
+#endif
+}
+
+
+/* Input handling */
+
+static int
+pcm_grow(float **buf, int nbufs, int *size, int wanted)
+{
+  float *tmp;
+  int i;
+
+  if (wanted <= *size)
+    return 0;
+
+  wanted += wanted / 2;
+
+  for (i = 0; i < nbufs; i++)
+    {
+      tmp = (float *)realloc(buf[i], wanted * sizeof(float));
+      if (!tmp)
+	{
+	  DPRINTF(E_LOG, L_XCODE, "Out of memory for conversion buffer\n");
+
+	  return -1;
+	}
+
+      buf[i] = tmp;
+    }
+
+  *size = wanted;
+
+  return 0;
+}
+
+/* 16-bit interleaving, no conversion */
+static void
+pcm_s16_interleave(struct pcm_converter *pc, uint8_t **planes, int n, int16_t *restrict dst, int le)
+{
+  const int16_t *l;
+  const int16_t *r;
+  int stride;
+  int i;
+
+  l = (const int16_t *)planes[0];
+
+  if (pc->channels == 1)
+    {
+      r = l;
+      stride = 1;
+    }
+  else if (av_sample_fmt_is_planar(pc->fmt))
+    {
+      r = (const int16_t *)planes[1];
+      stride = 1;
+    }
+  else
+    {
+#if BYTE_ORDER != BIG_ENDIAN
+      memcpy(dst, l, n * 2 * 2);
+      return;
+#endif
+      r = l + 1;
+      stride = 2;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      PCM_STORE(dst[2 * i], l[i * stride], le);
+      PCM_STORE(dst[2 * i + 1], r[i * stride], le);
+    }
+}
+
+/* Deinterleaves input to float in 16-bit units, for the resampler */
+static void
+pcm_load(struct pcm_converter *pc, uint8_t **planes, int n, float *restrict l, float *restrict r)
+{
+  int planar;
+  int stride;
+  int ch;
+  int i;
+
+  planar = av_sample_fmt_is_planar(pc->fmt);
+  stride = (planar) ? 1 : pc->channels;
+
+  for (ch = 0; ch < pc->channels; ch++)
+    {
+      float *restrict dst = (ch == 0) ? l : r;
+      int off = (planar) ? 0 : ch;
+      uint8_t *src = (planar) ? planes[ch] : planes[0];
+
+      switch (pc->fmt)
+	{
+	  case AV_SAMPLE_FMT_S16:
+	  case AV_SAMPLE_FMT_S16P:
+	    for (i = 0; i < n; i++)
+	      dst[i] = (float)((const int16_t *)src)[i * stride + off];
+	    break;
+
+	  case AV_SAMPLE_FMT_S32:
+	  case AV_SAMPLE_FMT_S32P:
+	    if (stride == 1)
+	      {
+		pcm_s32_float(dst, (const int32_t *)src, n);
+		break;
+	      }
+
+	    for (i = 0; i < n; i++)
+	      dst[i] = (float)((const int32_t *)src)[i * stride + off] * (1.0f / 65536.0f);
+	    break;
+
+	  case AV_SAMPLE_FMT_FLT:
+	  case AV_SAMPLE_FMT_FLTP:
+	    for (i = 0; i < n; i++)
+	      dst[i] = ((const float *)src)[i * stride + off] * 32768.0f;
+	    break;
+
+	  default:
+	    break;
+	}
+    }
+}
+
+
+/* Resampler */
+
+static int
+pcm_gcd(int a, int b)
+{
+  int t;
+
+  while (b)
+    {
+      t = a % b;
+      a = b;
+      b = t;
+    }
+
+  return a;
+}
+
+static double
+pcm_bessel_i0(double x)
+{
+  double sum;
+  double term;
+  int k;
+
+  sum = 1.0;
+  term = 1.0;
+  for (k = 1; k < 30; k++)
+    {
+      term *= (x / (2.0 * k)) * (x / (2.0 * k));
+      sum += term;
+
+      if (term < sum * 1e-12)
+	break;
+    }
+
+  return sum;
+}
+
+/* Designs the Kaiser-windowed sinc lowpass at the upsampled rate and
+ * splits it into phases, each reversed so one output sample is a plain
+ * dot product over the input history
+ */
+static int
+resample_setup(struct pcm_converter *pc)
+{
+  double fc;
+  double center;
+  double pos;
+  double w;
+  double h;
+  double i0beta;
+  double sum;
+  int len;
+  int g;
+  int p;
+  int m;
+  int j;
+
+  g = pcm_gcd(PCM_OUT_RATE, pc->rate);
+  pc->up = PCM_OUT_RATE / g;
+  pc->down = pc->rate / g;
+
+  if (pc->up > PCM_MAX_PHASES)
+    return -1;
+
+  /* Same transition width in Hz whatever the input rate */
+  pc->taps = PCM_BASE_TAPS * ((pc->rate + 47999) / 48000);
+  if (pc->taps > PCM_MAX_TAPS)
+    return -1;
+
+  pc->coefs = (float *)av_malloc(pc->up * pc->taps * sizeof(float));
+  if (!pc->coefs)
+    return -1;
+
+  /* Cutoff just under the lower of the two Nyquist frequencies, as a
+   * fraction of the upsampled rate
+   */
+  fc = 0.5 * 0.91 * ((pc->rate < PCM_OUT_RATE) ? pc->rate : PCM_OUT_RATE);
+  fc /= (double)pc->rate * pc->up;
+
+  len = pc->up * pc->taps;
+  center = (len - 1) / 2.0;
+  i0beta = pcm_bessel_i0(PCM_KAISER_BETA);
+
+  for (p = 0; p < pc->up; p++)
+    {
+      sum = 0.0;
+      for (m = 0; m < pc->taps; m++)
+	{
+	  j = p + (pc->taps - 1 - m) * pc->up;
+	  pos = j - center;
+
+	  if (pos == 0.0)
+	    h = 2.0 * fc;
+	  else
+	    h = sin(2.0 * M_PI * fc * pos) / (M_PI * pos);
+
+	  w = pos / center;
+	  w = pcm_bessel_i0(PCM_KAISER_BETA * sqrt(1.0 - w * w)) / i0beta;
+
+	  pc->coefs[p * pc->taps + m] = h * w;
+	  sum += h * w;
+	}
+
+      /* Unity gain for every phase */
+      for (m = 0; m < pc->taps; m++)
+	pc->coefs[p * pc->taps + m] /= sum;
+    }
+
+  return pcm_converter_reset(pc);
+}
+
+/* Computes the output samples the history in x[] allows, up to max */
+static int
+resample_filter(struct pcm_converter *pc, int64_t max)
+{
+  const float *c;
+  int first;
+  int i0;
+  int ch;
+  int n;
+
+  n = 0;
+  while (((i0 = pc->t / pc->up) < pc->xlen) && (n < max))
+    {
+      c = pc->coefs + (pc->t % pc->up) * pc->taps;
+
+      for (ch = 0; ch < pc->channels; ch++)
+	pc->y[ch][n] = pcm_dot(pc->x[ch] + i0 - (pc->taps - 1), c, pc->taps);
+
+      n++;
+      pc->t += pc->down;
+    }
+
+  /* Keep the history the next output sample needs */
+  first = pc->t / pc->up - (pc->taps - 1);
+  if (first > pc->xlen)
+    first = pc->xlen;
+
+  for (ch = 0; ch < pc->channels; ch++)
+    memmove(pc->x[ch], pc->x[ch] + first, (pc->xlen - first) * sizeof(float));
+
+  pc->xlen -= first;
+  pc->t -= first * pc->up;
+
+  pc->nout += n;
+
+  return n;
+}
+
+static int
+resample_run(struct pcm_converter *pc, uint8_t **planes, int nsamples, int16_t *dst, int le)
+{
+  int n;
+  int ret;
+
+  ret = pcm_grow(pc->x, pc->channels, &pc->xsize, pc->xlen + nsamples);
+  if (ret < 0)
+    return -1;
+
+  ret = pcm_grow(pc->y, pc->channels, &pc->ysize, pcm_converter_max_samples(pc, nsamples));
+  if (ret < 0)
+    return -1;
+
+  pcm_load(pc, planes, nsamples, pc->x[0] + pc->xlen, (pc->channels == 2) ? pc->x[1] + pc->xlen : NULL);
+  pc->xlen += nsamples;
+  pc->nin += nsamples;
+
+  n = resample_filter(pc, INT32_MAX);
+
+  pcm_float_planar(pc, dst, pc->y[0], pc->y[pc->channels - 1], n, 1.0f, le);
+
+  return n;
+}
+
+/* Pads the input with silence to get the samples still held back by the
+ * filter delay, stopping at the input length at the output rate
+ */
+static int
+resample_flush(struct pcm_converter *pc, int16_t *dst, int le)
+{
+  int64_t total;
+  int ch;
+  int n;
+  int ret;
+
+  total = (pc->nin * pc->up + pc->down - 1) / pc->down;
+  if (pc->nout >= total)
+    return 0;
+
+  ret = pcm_grow(pc->x, pc->channels, &pc->xsize, pc->xlen + pc->taps);
+  if (ret < 0)
+    return -1;
+
+  ret = pcm_grow(pc->y, pc->channels, &pc->ysize, pcm_converter_max_samples(pc, 0));
+  if (ret < 0)
+    return -1;
+
+  for (ch = 0; ch < pc->channels; ch++)
+    memset(pc->x[ch] + pc->xlen, 0, pc->taps * sizeof(float));
+  pc->xlen += pc->taps;
+
+  n = resample_filter(pc, total - pc->nout);
+
+  pcm_float_planar(pc, dst, pc->y[0], pc->y[pc->channels - 1], n, 1.0f, le);
+
+  return n;
+}
+
+
+/* API */
+
+struct pcm_converter *
+pcm_converter_new(enum AVSampleFormat fmt, int channels, int rate)
+{
+  struct pcm_converter *pc;
+  int ret;
+
+  if ((channels < 1) || (channels > 2) || (rate <= 0))
+    return NULL;
+
+  switch (fmt)
+    {
+      case AV_SAMPLE_FMT_S16:
+      case AV_SAMPLE_FMT_S16P:
+      case AV_SAMPLE_FMT_S32:
+      case AV_SAMPLE_FMT_S32P:
+      case AV_SAMPLE_FMT_FLT:
+      case AV_SAMPLE_FMT_FLTP:
+	break;
+
+      default:
+	return NULL;
+    }
+
+  pthread_once(&dither_once, dither_init);
+
+  pc = (struct pcm_converter *)malloc(sizeof(struct pcm_converter));
+  if (!pc)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Out of memory for PCM converter\n");
+
+      return NULL;
+    }
+  memset(pc, 0, sizeof(struct pcm_converter));
+
+  pc->fmt = fmt;
+  pc->channels = channels;
+  pc->rate = rate;
+
+  if (rate != PCM_OUT_RATE)
+    {
+      ret = resample_setup(pc);
+      if (ret < 0)
+	{
+	  DPRINTF(E_DBG, L_XCODE, "No resampling filter for %d Hz\n", rate);
+
+	  pcm_converter_free(pc);
+	  return NULL;
+	}
+    }
+
+  return pc;
+}
+
+void
+pcm_converter_free(struct pcm_converter *pc)
+{
+  if (pc->coefs)
+    av_free(pc->coefs);
+
+  free(pc->x[0]);
+  free(pc->x[1]);
+  free(pc->y[0]);
+  free(pc->y[1]);
+
+  free(pc);
+}
+
+/* Whether pc converts from fmt, channels and rate */
+int
+pcm_converter_matches(struct pcm_converter *pc, enum AVSampleFormat fmt, int channels, int rate)
+{
+  return ((pc->fmt == fmt) && (pc->channels == channels) && (pc->rate == rate));
+}
+
+/* Drops the resampler history, after a seek; if that fails the converter
+ * can't be used anymore and pcm_converter_run() will return -1
+ */
+int
+pcm_converter_reset(struct pcm_converter *pc)
+{
+  int ch;
+
+  if (!pc->up)
+    return 0;
+
+  pc->xlen = 0;
+  pc->t = 0;
+  pc->nin = 0;
+  pc->nout = 0;
+
+  /* Zero history so the first output sample can be computed */
+  if (pcm_grow(pc->x, pc->channels, &pc->xsize, pc->taps - 1) < 0)
+    {
+      pc->failed = 1;
+      return -1;
+    }
+
+  for (ch = 0; ch < pc->channels; ch++)
+    memset(pc->x[ch], 0, (pc->taps - 1) * sizeof(float));
+
+  pc->xlen = pc->taps - 1;
+
+  /* Center the filter on the first input sample, so the output isn't
+   * delayed and its length matches the input's
+   */
+  pc->t = (pc->taps - 1) * pc->up + (pc->up * pc->taps - 1) / 2;
+
+  pc->failed = 0;
+
+  return 0;
+}
+
+int
+pcm_converter_resamples(struct pcm_converter *pc)
+{
+  return (pc->up != 0);
+}
+
+/* Upper bound of the number of output samples for nsamples of input,
+ * with room for what pcm_converter_flush() adds
+ */
+int
+pcm_converter_max_samples(struct pcm_converter *pc, int nsamples)
+{
+  if (!pc->up)
+    return nsamples;
+
+  return ((int64_t)(pc->xlen + nsamples + pc->taps) * pc->up) / pc->down + 1;
+}
+
+/* Converts nsamples of input from planes into dst, which must hold
+ * pcm_converter_max_samples() stereo samples; little endian if le is set,
+ * native endian otherwise. Returns the number of stereo samples written.
+ */
+int
+pcm_converter_run(struct pcm_converter *pc, uint8_t **planes, int nsamples, int16_t *dst, int le)
+{
+  int ret;
+
+  if (pc->failed)
+    return -1;
+
+  if (pc->up)
+    return resample_run(pc, planes, nsamples, dst, le);
+
+  switch (pc->fmt)
+    {
+      case AV_SAMPLE_FMT_S16:
+      case AV_SAMPLE_FMT_S16P:
+	pcm_s16_interleave(pc, planes, nsamples, dst, le);
+	break;
+
+      case AV_SAMPLE_FMT_S32:
+	ret = pcm_grow(pc->y, 1, &pc->ysize, nsamples * pc->channels);
+	if (ret < 0)
+	  return -1;
+
+	pcm_s32_float(pc->y[0], (const int32_t *)planes[0], nsamples * pc->channels);
+
+	if (pc->channels == 2)
+	  pcm_float_packed(pc, dst, pc->y[0], nsamples * 2, 1.0f, le);
+	else
+	  pcm_float_planar(pc, dst, pc->y[0], pc->y[0], nsamples, 1.0f, le);
+	break;
+
+      case AV_SAMPLE_FMT_S32P:
+	ret = pcm_grow(pc->y, pc->channels, &pc->ysize, nsamples);
+	if (ret < 0)
+	  return -1;
+
+	pcm_s32_float(pc->y[0], (const int32_t *)planes[0], nsamples);
+	if (pc->channels == 2)
+	  pcm_s32_float(pc->y[1], (const int32_t *)planes[1], nsamples);
+
+	pcm_float_planar(pc, dst, pc->y[0], pc->y[pc->channels - 1], nsamples, 1.0f, le);
+	break;
+
+      case AV_SAMPLE_FMT_FLT:
+	if (pc->channels == 2)
+	  pcm_float_packed(pc, dst, (const float *)planes[0], nsamples * 2, 32768.0f, le);
+	else
+	  pcm_float_planar(pc, dst, (const float *)planes[0], (const float *)planes[0], nsamples, 32768.0f, le);
+	break;
+
+      case AV_SAMPLE_FMT_FLTP:
+	pcm_float_planar(pc, dst, (const float *)planes[0], (const float *)planes[pc->channels - 1], nsamples, 32768.0f, le);
+	break;
+
+      default:
+	return -1;
+    }
+
+  return nsamples;
+}
+
+/* End of input: writes the samples the resampler still holds to dst, which
+ * must hold pcm_converter_max_samples(pc, 0) stereo samples. Returns the
+ * number of stereo samples written; reset before feeding more input.
+ */
+int
+pcm_converter_flush(struct pcm_converter *pc, int16_t *dst, int le)
+{
+  if (pc->failed)
+    return -1;
+
+  if (!pc->up)
+    return 0;
+
+  return resample_flush(pc, dst, le);
+}
+
+#endif /* LIBAVCODEC_VERSION */
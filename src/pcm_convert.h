@@ -0,0 +1,35 @@
+
+#ifndef __PCM_CONVERT_H__
+#define __PCM_CONVERT_H__
+
+#include <stdint.h>
+
+#include <libavcodec/avcodec.h>
+
+struct pcm_converter;
+
+struct pcm_converter *
+pcm_converter_new(enum AVSampleFormat fmt, int channels, int rate);
+
+void
+pcm_converter_free(struct pcm_converter *pc);
+
+int
+pcm_converter_matches(struct pcm_converter *pc, enum AVSampleFormat fmt, int channels, int rate);
+
+int
+pcm_converter_reset(struct pcm_converter *pc);
+
+int
+pcm_converter_resamples(struct pcm_converter *pc);
+
+int
+pcm_converter_max_samples(struct pcm_converter *pc, int nsamples);
+
+int
+pcm_converter_run(struct pcm_converter *pc, uint8_t **planes, int nsamples, int16_t *dst, int le);
+
+int
+pcm_converter_flush(struct pcm_converter *pc, int16_t *dst, int le);
+
+#endif /* !__PCM_CONVERT_H__ */
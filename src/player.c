@@ -55,7 +55,9 @@
 #include "misc.h"
 #include "rng.h"
 #include "transcode.h"
+#include "prefetch.h"
 #include "player.h"
+#include "nowplaying.h"
 #include "raop.h"
 #include "laudio.h"
 
@@ -99,7 +101,6 @@ struct player_command
     void *noarg;
     struct spk_enum *spk_enum;
     struct raop_device *rd;
-    struct player_status *status;
     struct player_source *ps;
     player_status_handler status_handler;
     uint32_t *id_ptr;
@@ -112,6 +113,12 @@ struct player_command
   int ret;
 
   int raop_pending;
+
+  /* Command queue */
+  struct timespec queued;
+  uint64_t wait_us;
+
+  struct player_command *next;
 };
 
 struct player_source
@@ -133,6 +140,29 @@ struct player_source
   struct player_source *play_next;
 };
 
+/* Status snapshot, published by the player thread for readers in other
+ * threads; seqlock, snapshot_seq is odd while it's being written
+ */
+struct player_snapshot {
+  enum play_status status;
+  enum repeat_mode repeat;
+  char shuffle;
+
+  int volume;
+
+  uint32_t plid;
+  uint32_t id;
+  int pos_pl;
+
+  /* Item being played or streamed, 0 if none */
+  uint32_t now_playing;
+
+  /* Position at stamp; advances with the clock if running */
+  int64_t pos_ms;
+  struct timespec stamp;
+  int running;
+};
+
 
 /* Keep in sync with enum raop_devtype */
 static const char *raop_devtype[] =
@@ -148,10 +178,11 @@ struct event_base *evbase_player;
 
 #ifdef USE_EVENTFD
 static int exit_efd;
+static int cmd_efd;
 #else
 static int exit_pipe[2];
-#endif
 static int cmd_pipe[2];
+#endif
 static int player_exit;
 static struct event exitev;
 static struct event cmdev;
@@ -165,6 +196,9 @@ static char shuffle;
 /* Status updates (for DACP) */
 static player_status_handler update_handler;
 
+static volatile unsigned int snapshot_seq;
+static struct player_snapshot snapshot;
+
 /* Playback timer */
 static int pb_timer_fd;
 static struct event pb_timer_ev;
@@ -193,8 +227,13 @@ static int laudio_volume;
 static int laudio_relvol;
 static int raop_sessions;
 
-/* Commands */
+/* Commands; producers push onto cmd_stack, the player thread takes the
+ * whole stack at once and runs commands from cmd_pending in order
+ */
 static struct player_command *cur_cmd;
+static struct player_command *cmd_stack;
+static struct player_command *cmd_pending;
+static struct player_command *cmd_pending_tail;
 
 /* Last commanded volume */
 static int master_volume;
@@ -211,15 +250,31 @@ static uint32_t cur_plid;
 static struct evbuffer *audio_buf;
 
 
+/* Forward */
+static void
+status_publish(void);
+static void
+command_stats_add(struct player_command *cmd, int coalesced);
+static void
+command_wakeup(void);
+
 /* Command helpers */
 static void
 command_async_end(struct player_command *cmd)
 {
+  status_publish();
+
+  command_stats_add(cmd, 0);
+
   cur_cmd = NULL;
 
   pthread_cond_signal(&cmd->cond);
   pthread_mutex_unlock(&cmd->lck);
 
+  /* Commands queued up behind this one run from a fresh callback */
+  if (cmd_pending)
+    command_wakeup();
+
   /* Process commands again */
   event_add(&cmdev, NULL);
 }
@@ -246,6 +301,8 @@ status_update(enum play_status status)
 {
   player_state = status;
 
+  status_publish();
+
   if (update_handler)
     update_handler();
 
@@ -289,6 +346,8 @@ volume_master_update(int newvol)
 
   master_volume = newvol;
 
+  status_publish();
+
   if (laudio_selected)
     laudio_relvol = vol_to_rel(laudio_volume);
 
@@ -828,6 +887,19 @@ source_reshuffle(void)
     shuffle_head = ps;
 }
 
+/* Get the beginning of the track after ps off the disk while ps plays */
+static void
+source_prefetch_next(struct player_source *ps)
+{
+  struct player_source *next;
+
+  next = (shuffle) ? ps->shuffle_next : ps->pl_next;
+  if (!next || (next == ps))
+    return;
+
+  prefetch_hint(next->id);
+}
+
 /* Helper */
 static int
 source_open(struct player_source *ps, int no_md)
@@ -857,7 +929,7 @@ source_open(struct player_source *ps, int no_md)
 
   DPRINTF(E_DBG, L_PLAYER, "Opening %s\n", mfi->path);
 
-  ps->ctx = transcode_setup(mfi, NULL, 0);
+  ps->ctx = transcode_setup(mfi, NULL, XCODE_PCM16_NOHEADER);
 
   free_mfi(mfi, 0);
 
@@ -871,6 +943,8 @@ source_open(struct player_source *ps, int no_md)
   if (!no_md)
     metadata_send(ps, (player_state == PLAY_PLAYING) ? 0 : 1);
 
+  source_prefetch_next(ps);
+
   return 0;
 }
 
@@ -1861,61 +1935,71 @@ playback_abort(void)
 }
 
 
-/* Actual commands, executed in the player thread */
-static int
-get_status(struct player_command *cmd)
+/* Status snapshot */
+/* Thread: player */
+static void
+status_publish(void)
 {
-  struct timespec ts;
+  struct player_snapshot *snap;
   struct player_source *ps;
-  struct player_status *status;
+  struct timespec ts;
   uint64_t pos;
   int ret;
 
-  status = cmd->arg.status;
+  snap = &snapshot;
 
-  status->shuffle = shuffle;
-  status->repeat = repeat;
+  snapshot_seq++;
+  __sync_synchronize();
 
-  status->volume = master_volume;
+  snap->shuffle = shuffle;
+  snap->repeat = repeat;
 
-  status->plid = cur_plid;
+  snap->volume = master_volume;
 
-  switch (player_state)
+  snap->plid = cur_plid;
+
+  snap->running = 0;
+
+  if (cur_playing)
+    snap->now_playing = cur_playing->id;
+  else if (cur_streaming)
+    snap->now_playing = cur_streaming->id;
+  else
+    snap->now_playing = 0;
+
+  /* Published from the middle of state changes too */
+  switch ((cur_streaming) ? player_state : PLAY_STOPPED)
     {
       case PLAY_STOPPED:
-	DPRINTF(E_DBG, L_PLAYER, "Player status: stopped\n");
-
-	status->status = PLAY_STOPPED;
+	snap->status = PLAY_STOPPED;
+	snap->id = 0;
+	snap->pos_ms = 0;
+	snap->pos_pl = 0;
 	break;
 
       case PLAY_PAUSED:
-	DPRINTF(E_DBG, L_PLAYER, "Player status: paused\n");
-
-	status->status = PLAY_PAUSED;
-	status->id = cur_streaming->id;
+	snap->status = PLAY_PAUSED;
+	snap->id = cur_streaming->id;
 
 	pos = last_rtptime + AIRTUNES_V2_PACKET_SAMPLES - cur_streaming->stream_start;
-	status->pos_ms = (pos * 1000) / 44100;
+	snap->pos_ms = (pos * 1000) / 44100;
 
-	status->pos_pl = source_position(cur_streaming);
+	snap->pos_pl = source_position(cur_streaming);
 	break;
 
       case PLAY_PLAYING:
 	if (!cur_playing)
 	  {
-	    DPRINTF(E_DBG, L_PLAYER, "Player status: playing (buffering)\n");
-
-	    status->status = PLAY_PAUSED;
+	    snap->status = PLAY_PAUSED;
 	    ps = cur_streaming;
 
 	    /* Avoid a visible 2-second jump backward for the client */
 	    pos = ps->output_start - ps->stream_start;
+	    snap->pos_ms = (pos * 1000) / 44100;
 	  }
 	else
 	  {
-	    DPRINTF(E_DBG, L_PLAYER, "Player status: playing\n");
-
-	    status->status = PLAY_PLAYING;
+	    snap->status = PLAY_PLAYING;
 	    ps = cur_playing;
 
 	    ret = player_get_current_pos(&pos, &ts, 0);
@@ -1923,42 +2007,55 @@ get_status(struct player_command *cmd)
 	      {
 		DPRINTF(E_LOG, L_PLAYER, "Could not get current stream position for playstatus\n");
 
-		pos = 0;
+		snap->pos_ms = 0;
 	      }
-
-	    if (pos < ps->stream_start)
-	      pos = 0;
 	    else
-	      pos -= ps->stream_start;
+	      {
+		/* Readers add the time elapsed since the stamp; the item may
+		 * not have started yet, hence signed
+		 */
+		snap->pos_ms = (((int64_t)pos - (int64_t)ps->stream_start) * 1000) / 44100;
+		snap->stamp = ts;
+		snap->running = 1;
+	      }
 	  }
 
-	status->pos_ms = (pos * 1000) / 44100;
-
-	status->id = ps->id;
-	status->pos_pl = source_position(ps);
+	snap->id = ps->id;
+	snap->pos_pl = source_position(ps);
 	break;
     }
 
-  return 0;
+  __sync_synchronize();
+  snapshot_seq++;
+
+  /* Same item as the status, before update_handler tells DACP */
+  nowplaying_publish(snap->id);
 }
 
-static int
-now_playing(struct player_command *cmd)
+/* Thread: any */
+static void
+status_snapshot(struct player_snapshot *snap)
 {
-  uint32_t *id;
+  unsigned int seq;
 
-  id = cmd->arg.id_ptr;
+  for (;;)
+    {
+      seq = snapshot_seq;
+      __sync_synchronize();
 
-  if (cur_playing)
-    *id = cur_playing->id;
-  else if (cur_streaming)
-    *id = cur_streaming->id;
-  else
-    return -1;
+      if (seq & 1)
+	continue;
 
-  return 0;
+      memcpy(snap, &snapshot, sizeof(struct player_snapshot));
+
+      __sync_synchronize();
+      if (snapshot_seq == seq)
+	break;
+    }
 }
 
+
+/* Actual commands, executed in the player thread */
 static int
 playback_stop(struct player_command *cmd)
 {
@@ -3048,28 +3145,188 @@ set_update_handler(struct player_command *cmd)
   return 0;
 }
 
+/* Command statistics */
+struct command_stat {
+  cmd_func func;
+  const char *name;
+
+  unsigned int count;
+  unsigned int coalesced;
+  uint64_t wait_us;
+  uint64_t max_wait_us;
+  uint64_t total_us;
+};
+
+static struct command_stat command_stats[] =
+  {
+    { playback_start,        "playback_start" },
+    { playback_stop,         "playback_stop" },
+    { playback_pause,        "playback_pause" },
+    { speaker_enumerate,     "speaker_enumerate" },
+    { speaker_set,           "speaker_set" },
+    { volume_set,            "volume_set" },
+    { volume_setrel_speaker, "volume_setrel_speaker" },
+    { volume_setabs_speaker, "volume_setabs_speaker" },
+    { repeat_set,            "repeat_set" },
+    { shuffle_set,           "shuffle_set" },
+    { queue_add,             "queue_add" },
+    { queue_clear,           "queue_clear" },
+    { queue_plid,            "queue_plid" },
+    { set_update_handler,    "set_update_handler" },
+    { device_add,            "device_add" },
+    { device_remove_family,  "device_remove_family" },
+  };
+
+static uint64_t
+command_elapsed_us(struct timespec *since)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (ts.tv_sec - since->tv_sec) * 1000000 + (ts.tv_nsec - since->tv_nsec) / 1000;
+}
+
+/* Thread: player */
+static void
+command_stats_add(struct player_command *cmd, int coalesced)
+{
+  struct command_stat *cs;
+  uint64_t total_us;
+  int i;
+
+  total_us = command_elapsed_us(&cmd->queued);
+
+  cs = NULL;
+  for (i = 0; i < (sizeof(command_stats) / sizeof(command_stats[0])); i++)
+    {
+      if (command_stats[i].func == cmd->func)
+	{
+	  cs = &command_stats[i];
+	  break;
+	}
+    }
+
+  DPRINTF(E_SPAM, L_PLAYER, "Command %s %s: queued %" PRIu64 " us, done after %" PRIu64 " us\n",
+	  (cs) ? cs->name : "(unknown)", (coalesced) ? "coalesced" : "run", cmd->wait_us, total_us);
+
+  if (!cs)
+    return;
+
+  if (coalesced)
+    {
+      cs->coalesced++;
+      return;
+    }
+
+  cs->count++;
+  cs->wait_us += cmd->wait_us;
+  cs->total_us += total_us;
+  if (cmd->wait_us > cs->max_wait_us)
+    cs->max_wait_us = cmd->wait_us;
+}
+
+static void
+command_stats_log(void)
+{
+  struct command_stat *cs;
+  int i;
+
+  for (i = 0; i < (sizeof(command_stats) / sizeof(command_stats[0])); i++)
+    {
+      cs = &command_stats[i];
+      if ((cs->count == 0) && (cs->coalesced == 0))
+	continue;
+
+      DPRINTF(E_INFO, L_PLAYER, "Command %s: %u run, %u coalesced, avg wait %" PRIu64 " us, max wait %" PRIu64 " us, avg latency %" PRIu64 " us\n",
+	      cs->name, cs->count, cs->coalesced,
+	      (cs->count) ? cs->wait_us / cs->count : 0, cs->max_wait_us,
+	      (cs->count) ? cs->total_us / cs->count : 0);
+    }
+}
+
+
 /* Command processing */
+/* Whether cmd makes prev, queued right before it, redundant */
+static int
+command_supersedes(struct player_command *cmd, struct player_command *prev)
+{
+  if ((cmd->func != prev->func) || cmd->func_bh || prev->func_bh || cmd->nonblock || prev->nonblock)
+    return 0;
+
+  if ((cmd->func == volume_set) || (cmd->func == repeat_set) || (cmd->func == shuffle_set))
+    return 1;
+
+  if ((cmd->func == volume_setrel_speaker) || (cmd->func == volume_setabs_speaker))
+    return (cmd->arg.vol_param.spk_id == prev->arg.vol_param.spk_id);
+
+  return 0;
+}
+
 /* Thread: player */
 static void
-command_cb(int fd, short what, void *arg)
+command_queue(struct player_command *cmd)
 {
-  struct player_command *cmd;
-  int ret;
+  struct player_command *prev;
+  struct player_command *p;
+
+  cmd->next = NULL;
 
-  ret = read(cmd_pipe[0], &cmd, sizeof(cmd));
-  if (ret != sizeof(cmd))
+  prev = cmd_pending_tail;
+  if (prev && command_supersedes(cmd, prev))
     {
-      DPRINTF(E_LOG, L_PLAYER, "Could not read command! (read %d): %s\n", ret, (ret < 0) ? strerror(errno) : "-no error-");
+      if (prev == cmd_pending)
+	{
+	  cmd_pending = NULL;
+	  cmd_pending_tail = NULL;
+	}
+      else
+	{
+	  for (p = cmd_pending; p->next != prev; p = p->next)
+	    ;
 
-      goto readd;
+	  p->next = NULL;
+	  cmd_pending_tail = p;
+	}
+
+      /* Never run; its caller gets the result it would have had */
+      prev->wait_us = command_elapsed_us(&prev->queued);
+      command_stats_add(prev, 1);
+
+      pthread_mutex_lock(&prev->lck);
+
+      prev->ret = 0;
+
+      pthread_cond_signal(&prev->cond);
+      pthread_mutex_unlock(&prev->lck);
     }
 
+  if (cmd_pending_tail)
+    cmd_pending_tail->next = cmd;
+  else
+    cmd_pending = cmd;
+
+  cmd_pending_tail = cmd;
+}
+
+/* Thread: player */
+static void
+command_run(struct player_command *cmd)
+{
+  int ret;
+
+  cmd->wait_us = command_elapsed_us(&cmd->queued);
+
   if (cmd->nonblock)
     {
       cmd->func(cmd);
 
+      status_publish();
+
+      command_stats_add(cmd, 0);
+
       free(cmd);
-      goto readd;
+      return;
     }
 
   pthread_mutex_lock(&cmd->lck);
@@ -3080,6 +3337,10 @@ command_cb(int fd, short what, void *arg)
 
   if (ret <= 0)
     {
+      status_publish();
+
+      command_stats_add(cmd, 0);
+
       cmd->ret = ret;
 
       cur_cmd = NULL;
@@ -3087,25 +3348,97 @@ command_cb(int fd, short what, void *arg)
       pthread_cond_signal(&cmd->cond);
       pthread_mutex_unlock(&cmd->lck);
     }
-  else
+
+  /* Else the command is asynchronous, we don't want to process another
+   * command before we're done with this one. See command_async_end().
+   */
+}
+
+/* Thread: player */
+static void
+command_cb(int fd, short what, void *arg)
+{
+  struct player_command *batch;
+  struct player_command *cmd;
+  struct player_command *rev;
+  int ret;
+
+#ifdef USE_EVENTFD
+  eventfd_t count;
+
+  ret = eventfd_read(cmd_efd, &count);
+  if (ret < 0)
+    DPRINTF(E_LOG, L_PLAYER, "Could not read command event counter: %s\n", strerror(errno));
+#else
+  int dummy[16];
+
+  ret = read(cmd_pipe[0], dummy, sizeof(dummy));
+  if (ret < 0)
+    DPRINTF(E_LOG, L_PLAYER, "Could not read command wakeup: %s\n", strerror(errno));
+#endif
+
+  /* Take everything queued so far; it comes newest first */
+  batch = __sync_lock_test_and_set(&cmd_stack, NULL);
+
+  rev = NULL;
+  while (batch)
     {
-      /* Command is asynchronous, we don't want to process another command
-       * before we're done with this one. See command_async_end().
-       */
+      cmd = batch;
+      batch = cmd->next;
 
-      return;
+      cmd->next = rev;
+      rev = cmd;
     }
 
- readd:
-  event_add(&cmdev, NULL);
+  while (rev)
+    {
+      cmd = rev;
+      rev = cmd->next;
+
+      command_queue(cmd);
+    }
+
+  while (cmd_pending && !cur_cmd)
+    {
+      cmd = cmd_pending;
+
+      cmd_pending = cmd->next;
+      if (!cmd_pending)
+	cmd_pending_tail = NULL;
+
+      command_run(cmd);
+    }
+
+  /* Not while an asynchronous command is in progress */
+  if (!cur_cmd)
+    event_add(&cmdev, NULL);
 }
 
 
+/* Thread: httpd (DACP) - mDNS - player */
+static void
+command_wakeup(void)
+{
+  int ret;
+
+#ifdef USE_EVENTFD
+  ret = eventfd_write(cmd_efd, 1);
+  if (ret < 0)
+    DPRINTF(E_LOG, L_PLAYER, "Could not send command event: %s\n", strerror(errno));
+#else
+  int dummy = 42;
+
+  ret = write(cmd_pipe[1], &dummy, sizeof(dummy));
+  if (ret != sizeof(dummy))
+    DPRINTF(E_LOG, L_PLAYER, "Could not write to command fd: %s\n", strerror(errno));
+#endif
+}
+
 /* Thread: httpd (DACP) - mDNS */
 static int
 send_command(struct player_command *cmd)
 {
-  int ret;
+  struct player_command *head;
 
   if (!cmd->func)
     {
@@ -3114,13 +3447,21 @@ send_command(struct player_command *cmd)
       return -1;
     }
 
-  ret = write(cmd_pipe[1], &cmd, sizeof(cmd));
-  if (ret != sizeof(cmd))
-    {
-      DPRINTF(E_LOG, L_PLAYER, "Could not send command: %s\n", strerror(errno));
+  clock_gettime(CLOCK_MONOTONIC, &cmd->queued);
 
-      return -1;
+  do
+    {
+      head = cmd_stack;
+      cmd->next = head;
     }
+  while (!__sync_bool_compare_and_swap(&cmd_stack, head, cmd));
+
+  /* The player thread takes the whole stack at once, only the first
+   * command pushed since then needs to wake it up. The command is queued
+   * whatever happens to the wakeup, so don't report an error.
+   */
+  if (!head)
+    command_wakeup();
 
   return 0;
 }
@@ -3165,42 +3506,53 @@ sync_command(struct player_command *cmd)
 
 
 /* Player API executed in the httpd (DACP) thread */
+/* Status reads are served from the snapshot, without waking the player */
 int
 player_get_status(struct player_status *status)
 {
-  struct player_command cmd;
+  struct player_snapshot snap;
+  struct timespec ts;
+  int64_t pos_ms;
   int ret;
 
-  command_init(&cmd);
+  status_snapshot(&snap);
 
-  cmd.func = get_status;
-  cmd.func_bh = NULL;
-  cmd.arg.status = status;
+  status->status = snap.status;
+  status->repeat = snap.repeat;
+  status->shuffle = snap.shuffle;
 
-  ret = sync_command(&cmd);
+  status->volume = snap.volume;
 
-  command_deinit(&cmd);
+  status->plid = snap.plid;
+  status->id = snap.id;
+  status->pos_pl = snap.pos_pl;
 
-  return ret;
+  pos_ms = snap.pos_ms;
+  if (snap.running)
+    {
+      ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+      if (ret == 0)
+	pos_ms += (ts.tv_sec - snap.stamp.tv_sec) * 1000 + (ts.tv_nsec - snap.stamp.tv_nsec) / 1000000;
+    }
+
+  status->pos_ms = (pos_ms > 0) ? pos_ms : 0;
+
+  return 0;
 }
 
 int
 player_now_playing(uint32_t *id)
 {
-  struct player_command cmd;
-  int ret;
+  struct player_snapshot snap;
 
-  command_init(&cmd);
-
-  cmd.func = now_playing;
-  cmd.func_bh = NULL;
-  cmd.arg.id_ptr = id;
+  status_snapshot(&snap);
 
-  ret = sync_command(&cmd);
+  if (snap.now_playing == 0)
+    return -1;
 
-  command_deinit(&cmd);
+  *id = snap.now_playing;
 
-  return ret;
+  return 0;
 }
 
 int
@@ -3829,6 +4181,9 @@ player_init(void)
   raop_sessions = 0;
 
   cur_cmd = NULL;
+  cmd_stack = NULL;
+  cmd_pending = NULL;
+  cmd_pending_tail = NULL;
 
   pb_timer_fd = -1;
 
@@ -3844,6 +4199,9 @@ player_init(void)
 
   update_handler = NULL;
 
+  snapshot_seq = 0;
+  status_publish();
+
   /* Random RTP time start */
   gcry_randomize(&rnd, sizeof(rnd), GCRY_STRONG_RANDOM);
   last_rtptime = ((uint64_t)1 << 32) | rnd;
@@ -3889,6 +4247,15 @@ player_init(void)
     }
 #endif /* USE_EVENTFD */
 
+#ifdef USE_EVENTFD
+  cmd_efd = eventfd(0, EFD_CLOEXEC);
+  if (cmd_efd < 0)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Could not create command eventfd: %s\n", strerror(errno));
+
+      goto cmd_fail;
+    }
+#else
 # if defined(__linux__)
   ret = pipe2(cmd_pipe, O_CLOEXEC);
 # else
@@ -3900,6 +4267,7 @@ player_init(void)
 
       goto cmd_fail;
     }
+#endif /* USE_EVENTFD */
 
   evbase_player = event_base_new();
   if (!evbase_player)
@@ -3917,7 +4285,11 @@ player_init(void)
   event_base_set(evbase_player, &exitev);
   event_add(&exitev, NULL);
 
+#ifdef USE_EVENTFD
+  event_set(&cmdev, cmd_efd, EV_READ, command_cb, NULL);
+#else
   event_set(&cmdev, cmd_pipe[0], EV_READ, command_cb, NULL);
+#endif
   event_base_set(evbase_player, &cmdev);
   event_add(&cmdev, NULL);
 
@@ -3968,8 +4340,12 @@ player_init(void)
  laudio_fail:
   event_base_free(evbase_player);
  evbase_fail:
+#ifdef USE_EVENTFD
+  close(cmd_efd);
+#else
   close(cmd_pipe[0]);
   close(cmd_pipe[1]);
+#endif
  cmd_fail:
 #ifdef USE_EVENTFD
   close(exit_efd);
@@ -4020,6 +4396,8 @@ player_deinit(void)
   if (source_head)
     queue_clear(NULL);
 
+  nowplaying_deinit();
+
   evbuffer_free(audio_buf);
 
   laudio_deinit();
@@ -4036,9 +4414,16 @@ player_deinit(void)
   close(exit_pipe[0]);
   close(exit_pipe[1]);
 #endif
+#ifdef USE_EVENTFD
+  close(cmd_efd);
+  cmd_efd = -1;
+#else
   close(cmd_pipe[0]);
   close(cmd_pipe[1]);
   cmd_pipe[0] = -1;
   cmd_pipe[1] = -1;
+#endif
   event_base_free(evbase_player);
+
+  command_stats_log();
 }
@@ -0,0 +1,578 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Background prefetcher
+ *
+ * Keeps the next prefetch_seconds of every file being streamed or played
+ * resident in the page cache, plus the beginning of the next track in the
+ * player queue. The disk seeks happen in the prefetch thread instead of
+ * the httpd or player threads, which matters a lot with spun-down disks
+ * and network storage.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "logger.h"
+#include "conffile.h"
+#include "db.h"
+#include "prefetch.h"
+
+
+/* Amount of data read ahead in one go */
+#define PREFETCH_STEP (1024 * 1024)
+/* Bytes per second assumed when the bitrate is unknown (2 Mbps) */
+#define PREFETCH_DEFAULT_RATE (256 * 1024)
+
+struct prefetch_entry {
+  int id;
+
+  /* NULL until the prefetch thread has looked up dbid */
+  char *path;
+  uint32_t dbid;
+  int fd;
+  off_t size;
+
+  /* Position of the consumer */
+  off_t offset;
+  /* Data known to be resident from offset up to here */
+  off_t done;
+  /* How far ahead of offset to keep resident */
+  off_t window;
+  /* Bumped when the consumer seeks */
+  int seq;
+
+  /* Next track in the queue; dropped once its window is resident */
+  int oneshot;
+
+  /* Being worked on by the prefetch thread, outside the lock */
+  int busy;
+  int stopped;
+
+  struct prefetch_entry *next;
+};
+
+
+static int prefetch_seconds;
+
+static pthread_t tid_prefetch;
+static pthread_mutex_t prefetch_lck = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+static struct prefetch_entry *prefetch_list;
+static int prefetch_next_id;
+static int prefetch_exit;
+
+
+static void
+prefetch_free(struct prefetch_entry *e)
+{
+  if (e->fd >= 0)
+    close(e->fd);
+
+  if (e->path)
+    free(e->path);
+  free(e);
+}
+
+/* Must be called with prefetch_lck held */
+static void
+prefetch_remove(struct prefetch_entry *e)
+{
+  struct prefetch_entry *p;
+
+  if (e == prefetch_list)
+    prefetch_list = e->next;
+  else
+    {
+      for (p = prefetch_list; p && (p->next != e); p = p->next)
+	;
+
+      if (!p)
+	{
+	  DPRINTF(E_LOG, L_MISC, "WARNING: struct prefetch_entry not found in list; BUG!\n");
+	  return;
+	}
+
+      p->next = e->next;
+    }
+}
+
+/* Must be called with prefetch_lck held */
+static struct prefetch_entry *
+prefetch_find(int id)
+{
+  struct prefetch_entry *e;
+
+  for (e = prefetch_list; e; e = e->next)
+    {
+      if (e->id == id)
+	return e;
+    }
+
+  return NULL;
+}
+
+/* Must be called with prefetch_lck held */
+static struct prefetch_entry *
+prefetch_next_work(void)
+{
+  struct prefetch_entry *e;
+
+  for (e = prefetch_list; e; e = e->next)
+    {
+      if (e->busy || e->stopped)
+	continue;
+
+      /* Not opened yet */
+      if (e->fd < 0)
+	return e;
+
+      if ((e->done < e->offset + e->window) && (e->done < e->size))
+	return e;
+    }
+
+  return NULL;
+}
+
+static off_t
+prefetch_window(int bitrate)
+{
+  off_t rate;
+
+  if (bitrate > 0)
+    rate = ((off_t)bitrate * 1000) / 8;
+  else
+    rate = PREFETCH_DEFAULT_RATE;
+
+  return rate * prefetch_seconds;
+}
+
+/* Fills in the path of a hint given by file id; returns -1 if there is
+ * nothing to prefetch
+ */
+static int
+prefetch_resolve(struct prefetch_entry *e)
+{
+  struct media_file_info *mfi;
+  char *path;
+  off_t window;
+
+  mfi = db_file_fetch_byid(e->dbid);
+  if (!mfi)
+    return -1;
+
+  /* Only local files */
+  if (mfi->disabled || (mfi->data_kind != 0) || !mfi->path)
+    {
+      free_mfi(mfi, 0);
+      return -1;
+    }
+
+  path = strdup(mfi->path);
+  window = prefetch_window(mfi->bitrate);
+
+  free_mfi(mfi, 0);
+
+  if (!path)
+    {
+      DPRINTF(E_LOG, L_MISC, "Out of memory for prefetch path\n");
+
+      return -1;
+    }
+
+  pthread_mutex_lock(&prefetch_lck);
+
+  e->path = path;
+  e->window = window;
+
+  pthread_mutex_unlock(&prefetch_lck);
+
+  return 0;
+}
+
+static int
+prefetch_open(struct prefetch_entry *e)
+{
+  struct stat sb;
+  int fd;
+  int ret;
+
+  if (!e->path)
+    {
+      ret = prefetch_resolve(e);
+      if (ret < 0)
+	return -1;
+    }
+
+  fd = open(e->path, O_RDONLY);
+  if (fd < 0)
+    {
+      DPRINTF(E_LOG, L_MISC, "Could not open %s for prefetching: %s\n", e->path, strerror(errno));
+
+      return -1;
+    }
+
+  ret = fstat(fd, &sb);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_MISC, "Could not stat() %s: %s\n", e->path, strerror(errno));
+
+      close(fd);
+      return -1;
+    }
+
+#ifdef HAVE_POSIX_FADVISE
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  pthread_mutex_lock(&prefetch_lck);
+
+  e->fd = fd;
+  e->size = sb.st_size;
+
+  pthread_mutex_unlock(&prefetch_lck);
+
+  return 0;
+}
+
+/* Bring [offset, offset + len) into the page cache; blocks until it's there */
+static int
+prefetch_read(int fd, off_t offset, size_t len)
+{
+#if defined(__linux__)
+  return readahead(fd, offset, len);
+#else
+  uint8_t buf[65536];
+  ssize_t ret;
+
+  while (len > 0)
+    {
+      ret = pread(fd, buf, (len > sizeof(buf)) ? sizeof(buf) : len, offset);
+      if (ret <= 0)
+	return ret;
+
+      offset += ret;
+      len -= ret;
+    }
+
+  return 0;
+#endif
+}
+
+/* Thread: prefetch */
+static void *
+prefetch(void *arg)
+{
+  struct prefetch_entry *e;
+  off_t from;
+  off_t to;
+  int seq;
+  int fd;
+  int ret;
+
+  /* Hints come in as file ids, resolved here rather than on the player thread */
+  ret = db_perthread_init();
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_MISC, "Error: DB init failed (prefetch)\n");
+
+      pthread_exit(NULL);
+    }
+
+  pthread_mutex_lock(&prefetch_lck);
+
+  while (!prefetch_exit)
+    {
+      e = prefetch_next_work();
+      if (!e)
+	{
+	  pthread_cond_wait(&prefetch_cond, &prefetch_lck);
+	  continue;
+	}
+
+      e->busy = 1;
+
+      if (e->fd < 0)
+	{
+	  pthread_mutex_unlock(&prefetch_lck);
+
+	  ret = prefetch_open(e);
+
+	  pthread_mutex_lock(&prefetch_lck);
+
+	  e->busy = 0;
+
+	  if (ret < 0)
+	    e->stopped = 1;
+	}
+      else
+	{
+	  from = (e->done > e->offset) ? e->done : e->offset;
+
+	  to = e->offset + e->window;
+	  if (to > from + PREFETCH_STEP)
+	    to = from + PREFETCH_STEP;
+	  if (to > e->size)
+	    to = e->size;
+
+	  fd = e->fd;
+	  seq = e->seq;
+
+	  pthread_mutex_unlock(&prefetch_lck);
+
+	  ret = prefetch_read(fd, from, to - from);
+	  if (ret < 0)
+	    DPRINTF(E_DBG, L_MISC, "Prefetch of %s failed: %s\n", e->path, strerror(errno));
+
+	  pthread_mutex_lock(&prefetch_lck);
+
+	  e->busy = 0;
+
+	  /* The consumer may have seeked in the meantime */
+	  if (e->seq == seq)
+	    e->done = to;
+
+	  if (ret < 0)
+	    e->stopped = 1;
+	  else if (e->oneshot && ((e->done >= e->window) || (e->done >= e->size)))
+	    e->stopped = 1;
+	}
+
+      if (e->stopped)
+	{
+	  prefetch_remove(e);
+	  prefetch_free(e);
+	}
+    }
+
+  pthread_mutex_unlock(&prefetch_lck);
+
+  db_perthread_deinit();
+
+  pthread_exit(NULL);
+}
+
+static int
+prefetch_add(const char *path, uint32_t dbid, off_t offset, int bitrate, int oneshot)
+{
+  struct prefetch_entry *e;
+  int id;
+
+  e = (struct prefetch_entry *)malloc(sizeof(struct prefetch_entry));
+  if (!e)
+    {
+      DPRINTF(E_LOG, L_MISC, "Out of memory for prefetch entry\n");
+
+      return 0;
+    }
+
+  memset(e, 0, sizeof(struct prefetch_entry));
+
+  if (path)
+    {
+      e->path = strdup(path);
+      if (!e->path)
+	{
+	  DPRINTF(E_LOG, L_MISC, "Out of memory for prefetch path\n");
+
+	  free(e);
+	  return 0;
+	}
+    }
+
+  e->dbid = dbid;
+  e->fd = -1;
+  e->offset = offset;
+  e->done = offset;
+  e->window = prefetch_window(bitrate);
+  e->oneshot = oneshot;
+
+  pthread_mutex_lock(&prefetch_lck);
+
+  /* 0 means no prefetching */
+  prefetch_next_id++;
+  if (prefetch_next_id <= 0)
+    prefetch_next_id = 1;
+
+  id = prefetch_next_id;
+  e->id = id;
+
+  e->next = prefetch_list;
+  prefetch_list = e;
+
+  pthread_cond_signal(&prefetch_cond);
+
+  pthread_mutex_unlock(&prefetch_lck);
+
+  return id;
+}
+
+
+/* Start keeping the data ahead of offset resident; returns 0 if prefetching
+ * is disabled or could not be set up, an id for prefetch_update() and
+ * prefetch_stop() otherwise
+ */
+int
+prefetch_start(const char *path, off_t offset, int bitrate)
+{
+  if (prefetch_seconds <= 0)
+    return 0;
+
+  return prefetch_add(path, 0, offset, bitrate, 0);
+}
+
+void
+prefetch_update(int id, off_t offset)
+{
+  struct prefetch_entry *e;
+
+  if (id <= 0)
+    return;
+
+  pthread_mutex_lock(&prefetch_lck);
+
+  e = prefetch_find(id);
+  if (!e)
+    goto out;
+
+  /* Seek outside of what we already have */
+  if ((offset < e->offset) || (offset > e->done))
+    {
+      e->done = offset;
+      e->seq++;
+    }
+
+  e->offset = offset;
+
+  /* Only wake up the prefetcher once there's a worthwhile amount to read */
+  if ((e->done < e->offset + e->window - PREFETCH_STEP) && (e->done < e->size))
+    pthread_cond_signal(&prefetch_cond);
+
+ out:
+  pthread_mutex_unlock(&prefetch_lck);
+}
+
+void
+prefetch_stop(int id)
+{
+  struct prefetch_entry *e;
+
+  if (id <= 0)
+    return;
+
+  pthread_mutex_lock(&prefetch_lck);
+
+  e = prefetch_find(id);
+  if (!e)
+    goto out;
+
+  /* The prefetch thread frees it when done with it */
+  if (e->busy)
+    e->stopped = 1;
+  else
+    {
+      prefetch_remove(e);
+      prefetch_free(e);
+    }
+
+ out:
+  pthread_mutex_unlock(&prefetch_lck);
+}
+
+/* Bring the beginning of file id, which we're about to need, into the page
+ * cache; the DB lookup happens in the prefetch thread
+ */
+void
+prefetch_hint(uint32_t dbid)
+{
+  if (prefetch_seconds <= 0)
+    return;
+
+  prefetch_add(NULL, dbid, 0, 0, 1);
+}
+
+int
+prefetch_init(void)
+{
+  int ret;
+
+  prefetch_list = NULL;
+  prefetch_next_id = 0;
+  prefetch_exit = 0;
+
+  prefetch_seconds = cfg_getint(cfg_getsec(cfg, "library"), "prefetch_seconds");
+  if (prefetch_seconds <= 0)
+    {
+      DPRINTF(E_INFO, L_MISC, "Prefetching disabled\n");
+
+      prefetch_seconds = 0;
+      return 0;
+    }
+
+  ret = pthread_create(&tid_prefetch, NULL, prefetch, NULL);
+  if (ret != 0)
+    {
+      DPRINTF(E_LOG, L_MISC, "Could not spawn prefetch thread: %s\n", strerror(ret));
+
+      prefetch_seconds = 0;
+      return -1;
+    }
+
+  return 0;
+}
+
+void
+prefetch_deinit(void)
+{
+  struct prefetch_entry *e;
+  int ret;
+
+  if (prefetch_seconds <= 0)
+    return;
+
+  pthread_mutex_lock(&prefetch_lck);
+
+  prefetch_exit = 1;
+  pthread_cond_signal(&prefetch_cond);
+
+  pthread_mutex_unlock(&prefetch_lck);
+
+  ret = pthread_join(tid_prefetch, NULL);
+  if (ret != 0)
+    DPRINTF(E_LOG, L_MISC, "Could not join prefetch thread: %s\n", strerror(ret));
+
+  prefetch_seconds = 0;
+
+  for (e = prefetch_list; prefetch_list; e = prefetch_list)
+    {
+      prefetch_list = e->next;
+
+      prefetch_free(e);
+    }
+}
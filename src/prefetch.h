@@ -0,0 +1,26 @@
+
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+int
+prefetch_start(const char *path, off_t offset, int bitrate);
+
+void
+prefetch_update(int id, off_t offset);
+
+void
+prefetch_stop(int id);
+
+void
+prefetch_hint(uint32_t dbid);
+
+int
+prefetch_init(void);
+
+void
+prefetch_deinit(void);
+
+#endif /* !__PREFETCH_H__ */
@@ -34,8 +34,14 @@
 #include "RSP2SQL.h"
 
 
-char *
-rsp_query_parse_sql(const char *rsp_query)
+/* Number of query to SQL translations to keep around */
+#define RSP_QUERY_CACHE_SIZE 64
+
+static struct lru_cache rsp_query_cache = LRU_CACHE_INITIALIZER(RSP_QUERY_CACHE_SIZE);
+
+
+static char *
+rsp_query_antlr(const char *rsp_query)
 {
   /* Input RSP query, fed to the lexer */
   pANTLR3_INPUT_STREAM query;
@@ -149,3 +155,36 @@ rsp_query_parse_sql(const char *rsp_query)
 
   return ret;
 }
+
+char *
+rsp_query_parse_sql(const char *rsp_query)
+{
+  char *ret;
+  int cacheable;
+
+  /* Queries relative to today are resolved to a date at translation time */
+  cacheable = !strstr(rsp_query, "today");
+
+  if (cacheable)
+    {
+      ret = lru_cache_get(&rsp_query_cache, rsp_query);
+      if (ret)
+	{
+	  DPRINTF(E_DBG, L_RSP, "RSP query cache hit -%s-\n", rsp_query);
+
+	  return ret;
+	}
+    }
+
+  ret = rsp_query_antlr(rsp_query);
+  if (ret && cacheable)
+    lru_cache_add(&rsp_query_cache, rsp_query, ret);
+
+  return ret;
+}
+
+void
+rsp_query_deinit(void)
+{
+  lru_cache_clear(&rsp_query_cache);
+}
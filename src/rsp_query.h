@@ -6,4 +6,7 @@
 char *
 rsp_query_parse_sql(const char *rsp_query);
 
+void
+rsp_query_deinit(void);
+
 #endif /* !__RSP_QUERY_H__ */
@@ -24,12 +24,15 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
 
 #if defined(__linux__) || defined(__GLIBC__)
 # include <endian.h>
@@ -49,21 +52,68 @@
 #include "conffile.h"
 #include "db.h"
 #include "transcode.h"
+#include "prefetch.h"
+#include "pcm_convert.h"
+
+/* ALAC encoding needs the AVFrame encoding API and fragmented MP4 muxing */
+#if LIBAVCODEC_VERSION_MAJOR >= 54 && LIBAVFORMAT_VERSION_MAJOR >= 54
+# define XCODE_HAVE_ALAC 1
+# include "avio_evbuffer.h"
+#endif
+
+
+/* Decoders are opened on a context of our own, and kept around for the
+ * next file with the same stream parameters
+ */
+#if LIBAVCODEC_VERSION_MAJOR >= 54 || (LIBAVCODEC_VERSION_MAJOR == 53 && LIBAVCODEC_VERSION_MINOR >= 35)
+# define XCODE_HAVE_DECODER_POOL 1
+#endif
 
 
 #define XCODE_BUFFER_SIZE ((AVCODEC_MAX_AUDIO_FRAME_SIZE * 3) / 2)
 
+/* Idle decoders kept for reuse */
+#define XCODE_IDLE_DECODERS 4
+
+
+#ifdef XCODE_HAVE_DECODER_POOL
+struct transcode_decoder {
+  /* Stream parameters the decoder was opened for */
+  enum CodecID codec_id;
+  int sample_rate;
+  int channels;
+  int block_align;
+  int bits_per_coded_sample;
+  uint8_t *extradata;
+  int extradata_size;
+
+  /* Only set while idle */
+  AVCodecContext *acodec;
+  int16_t *abuffer;
+  struct pcm_converter *pcm;
+
+  struct transcode_decoder *next;
+};
+#endif
+
 
 struct transcode_ctx {
   AVFormatContext *fmtctx;
   /* Audio stream */
   int astream;
   AVCodecContext *acodec; /* pCodecCtx */
-  AVCodec *adecoder; /* pCodec */
+#ifdef XCODE_HAVE_DECODER_POOL
+  struct transcode_decoder *dec;
+#endif
   AVPacket apacket;
   AVPacket apacket2;
   int16_t *abuffer;
 
+  /* Converting straight from the decoded frame */
+  struct pcm_converter *pcm;
+  /* The resampler tail has been output, at EOF */
+  int pcm_flushed;
+
   /* Resampling */
   int need_resample;
   int input_size;
@@ -72,19 +122,48 @@ struct transcode_ctx {
 
   off_t offset;
 
+  /* Keeps the source file ahead of us in the page cache */
+  int prefetch_id;
+
   uint32_t duration;
   uint64_t samples;
+  /* Exact output length from the scanner analysis, 0 if unknown */
+  int64_t exact_samples;
+
+  /* Output format */
+  enum transcode_format format;
 
   /* WAV header */
-  int wavhdr;
   uint8_t header[44];
+
+#ifdef XCODE_HAVE_ALAC
+  /* ALAC encoder and MP4 muxer */
+  AVFormatContext *ofmtctx;
+  AVCodecContext *ocodec;
+  AVFrame *oframe;
+  int oplanar;
+  int16_t *obuffer; /* One encoder frame of PCM */
+  int osamples;     /* Samples in obuffer */
+  int64_t opts;
+  int ofinished;
+  struct evbuffer *obuf;
+#endif
 };
 
 
+#ifdef XCODE_HAVE_DECODER_POOL
+static pthread_mutex_t decoders_lck = PTHREAD_MUTEX_INITIALIZER;
+static struct transcode_decoder *decoders;
+static int decoders_idle;
+#endif
+
 static char *default_codecs = "mpeg,wav";
 static char *roku_codecs = "mpeg,mp4a,wma,wav";
 static char *itunes_codecs = "mpeg,mp4a,mp4v,alac,wav";
 
+/* Set once by transcode_init(), read-only afterwards */
+static int alac_enabled;
+
 
 static inline void
 add_le16(uint8_t *dst, uint16_t val)
@@ -113,8 +192,10 @@ make_wav_header(struct transcode_ctx *ctx, off_t *est_size)
   else
     duration = 3 * 60 * 1000; /* 3 minutes, in ms */
 
-  if (ctx->samples && !ctx->need_resample)
-    wav_len = 2 * 2 * ctx->samples;
+  if (ctx->exact_samples > 0)
+    wav_len = 2 * 2 * ctx->exact_samples;
+  else if (ctx->samples && !ctx->need_resample)
+    wav_len = 2 * 2 * av_rescale(ctx->samples, 44100, ctx->acodec->sample_rate);
   else
     wav_len = 2 * 2 * 44100 * (duration / 1000);
 
@@ -134,6 +215,533 @@ make_wav_header(struct transcode_ctx *ctx, off_t *est_size)
   add_le32(ctx->header + 40, wav_len);
 }
 
+#ifdef XCODE_HAVE_ALAC
+/* Encodes the PCM in obuffer (or flushes the encoder if flush is set)
+ * and hands the packet to the muxer
+ */
+static int
+alac_write_frame(struct transcode_ctx *ctx, int flush)
+{
+  AVPacket pkt;
+  AVStream *ost;
+  int got_packet;
+  int ret;
+
+  av_init_packet(&pkt);
+  pkt.data = NULL;
+  pkt.size = 0;
+
+  if (flush)
+    ret = avcodec_encode_audio2(ctx->ocodec, &pkt, NULL, &got_packet);
+  else
+    {
+      avcodec_get_frame_defaults(ctx->oframe);
+
+      ctx->oframe->nb_samples = ctx->osamples;
+      ctx->oframe->pts = ctx->opts;
+      ctx->oframe->data[0] = (uint8_t *)ctx->obuffer;
+      if (ctx->oplanar)
+	{
+	  ctx->oframe->data[1] = (uint8_t *)(ctx->obuffer + ctx->ocodec->frame_size);
+	  ctx->oframe->linesize[0] = ctx->ocodec->frame_size * 2;
+	}
+      else
+	ctx->oframe->linesize[0] = ctx->ocodec->frame_size * 2 * 2;
+      ctx->oframe->extended_data = ctx->oframe->data;
+
+      ret = avcodec_encode_audio2(ctx->ocodec, &pkt, ctx->oframe, &got_packet);
+
+      ctx->opts += ctx->osamples;
+      ctx->osamples = 0;
+    }
+
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Could not encode ALAC frame\n");
+
+      return -1;
+    }
+
+  if (!got_packet)
+    return 0;
+
+  ost = ctx->ofmtctx->streams[0];
+
+  pkt.stream_index = 0;
+  if (pkt.pts != AV_NOPTS_VALUE)
+    pkt.pts = av_rescale_q(pkt.pts, ctx->ocodec->time_base, ost->time_base);
+  if (pkt.dts != AV_NOPTS_VALUE)
+    pkt.dts = av_rescale_q(pkt.dts, ctx->ocodec->time_base, ost->time_base);
+  if (pkt.duration > 0)
+    pkt.duration = av_rescale_q(pkt.duration, ctx->ocodec->time_base, ost->time_base);
+
+  ret = av_write_frame(ctx->ofmtctx, &pkt);
+  av_free_packet(&pkt);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Could not mux ALAC frame: %s\n", strerror(AVUNERROR(ret)));
+
+      return -1;
+    }
+
+  return 1;
+}
+
+/* Takes interleaved 16-bit stereo samples and encodes them one encoder
+ * frame at a time; the MP4 output accumulates in ctx->obuf
+ */
+static int
+alac_encode(struct transcode_ctx *ctx, int16_t *buf, int nsamples)
+{
+  int16_t *left;
+  int16_t *right;
+  int n;
+  int i;
+  int ret;
+
+  while (nsamples > 0)
+    {
+      n = ctx->ocodec->frame_size - ctx->osamples;
+      if (n > nsamples)
+	n = nsamples;
+
+      if (ctx->oplanar)
+	{
+	  left = ctx->obuffer + ctx->osamples;
+	  right = ctx->obuffer + ctx->ocodec->frame_size + ctx->osamples;
+
+	  for (i = 0; i < n; i++)
+	    {
+	      left[i] = buf[2 * i];
+	      right[i] = buf[2 * i + 1];
+	    }
+	}
+      else
+	memcpy(ctx->obuffer + 2 * ctx->osamples, buf, n * 2 * 2);
+
+      ctx->osamples += n;
+      buf += 2 * n;
+      nsamples -= n;
+
+      if (ctx->osamples < ctx->ocodec->frame_size)
+	break;
+
+      ret = alac_write_frame(ctx, 0);
+      if (ret < 0)
+	return -1;
+    }
+
+  return 0;
+}
+
+/* End of input: encode the last, short frame and close the MP4 stream */
+static int
+alac_finish(struct transcode_ctx *ctx)
+{
+  int ret;
+
+  if (ctx->ofinished)
+    return 0;
+
+  ctx->ofinished = 1;
+
+  if (ctx->osamples > 0)
+    {
+      ret = alac_write_frame(ctx, 0);
+      if (ret < 0)
+	return -1;
+    }
+
+  if (ctx->ocodec->codec->capabilities & CODEC_CAP_DELAY)
+    {
+      do
+	{
+	  ret = alac_write_frame(ctx, 1);
+	}
+      while (ret > 0);
+
+      if (ret < 0)
+	return -1;
+    }
+
+  ret = av_write_trailer(ctx->ofmtctx);
+  if (ret != 0)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Could not write MP4 trailer: %s\n", strerror(AVUNERROR(ret)));
+
+      return -1;
+    }
+
+  avio_flush(ctx->ofmtctx->pb);
+
+  return 0;
+}
+
+/* Moves the MP4 output produced so far to evbuf */
+static int
+alac_drain(struct transcode_ctx *ctx, struct evbuffer *evbuf)
+{
+  int len;
+  int ret;
+
+  len = EVBUFFER_LENGTH(ctx->obuf);
+  if (len == 0)
+    return 0;
+
+  ret = evbuffer_add_buffer(evbuf, ctx->obuf);
+  if (ret != 0)
+    {
+      DPRINTF(E_WARN, L_XCODE, "Could not copy MP4 data to buffer\n");
+
+      return -1;
+    }
+
+  return len;
+}
+
+static int
+alac_setup(struct transcode_ctx *ctx)
+{
+  AVOutputFormat *ofmt;
+  AVCodec *encoder;
+  AVStream *ost;
+  AVDictionary *opts;
+  int ret;
+
+  /* The ipod muxer writes .m4a files, which is what iTunes expects */
+  ofmt = av_guess_format("ipod", NULL, NULL);
+  if (!ofmt)
+    ofmt = av_guess_format("mp4", NULL, NULL);
+  if (!ofmt)
+    {
+      DPRINTF(E_LOG, L_XCODE, "No MP4 muxer available\n");
+
+      return -1;
+    }
+
+  encoder = avcodec_find_encoder(CODEC_ID_ALAC);
+  if (!encoder)
+    {
+      DPRINTF(E_LOG, L_XCODE, "No ALAC encoder available\n");
+
+      return -1;
+    }
+
+  ctx->obuf = evbuffer_new();
+  if (!ctx->obuf)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Out of memory for MP4 output buffer\n");
+
+      return -1;
+    }
+
+  ctx->ofmtctx = avformat_alloc_context();
+  if (!ctx->ofmtctx)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Out of memory for output format context\n");
+
+      goto out_free_obuf;
+    }
+
+  ctx->ofmtctx->oformat = ofmt;
+
+  ost = avformat_new_stream(ctx->ofmtctx, encoder);
+  if (!ost)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Out of memory for output stream\n");
+
+      goto out_free_fmtctx;
+    }
+
+  ctx->ocodec = ost->codec;
+
+  if (encoder->sample_fmts && (encoder->sample_fmts[0] == AV_SAMPLE_FMT_S16P))
+    ctx->oplanar = 1;
+  else if (encoder->sample_fmts && (encoder->sample_fmts[0] != AV_SAMPLE_FMT_S16))
+    {
+      DPRINTF(E_LOG, L_XCODE, "ALAC encoder does not take 16-bit samples\n");
+
+      goto out_free_fmtctx;
+    }
+
+  ctx->ocodec->sample_fmt = (ctx->oplanar) ? AV_SAMPLE_FMT_S16P : AV_SAMPLE_FMT_S16;
+  ctx->ocodec->sample_rate = 44100;
+  ctx->ocodec->channels = 2;
+  ctx->ocodec->channel_layout = AV_CH_LAYOUT_STEREO;
+  ctx->ocodec->time_base.num = 1;
+  ctx->ocodec->time_base.den = 44100;
+  ost->time_base = ctx->ocodec->time_base;
+
+  if (ofmt->flags & AVFMT_GLOBALHEADER)
+    ctx->ocodec->flags |= CODEC_FLAG_GLOBAL_HEADER;
+
+  ret = avcodec_open2(ctx->ocodec, encoder, NULL);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Could not open ALAC encoder: %s\n", strerror(AVUNERROR(ret)));
+
+      goto out_free_fmtctx;
+    }
+
+  ctx->oframe = avcodec_alloc_frame();
+  ctx->obuffer = (int16_t *)av_malloc(ctx->ocodec->frame_size * 2 * 2);
+  if (!ctx->oframe || !ctx->obuffer)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Out of memory for ALAC frame\n");
+
+      goto out_close_codec;
+    }
+
+  ctx->ofmtctx->pb = avio_evbuffer_open(ctx->obuf);
+  if (!ctx->ofmtctx->pb)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Could not open MP4 output buffer\n");
+
+      goto out_close_codec;
+    }
+
+  /* The output is not seekable: write an empty moov up front and
+   * the samples in fragments of about one second
+   */
+  opts = NULL;
+  av_dict_set(&opts, "movflags", "empty_moov", 0);
+  av_dict_set(&opts, "frag_duration", "1000000", 0);
+
+  ret = avformat_write_header(ctx->ofmtctx, &opts);
+  av_dict_free(&opts);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Could not write MP4 header: %s\n", strerror(AVUNERROR(ret)));
+
+      goto out_close_pb;
+    }
+
+  return 0;
+
+ out_close_pb:
+  avio_evbuffer_close(ctx->ofmtctx->pb);
+ out_close_codec:
+  if (ctx->obuffer)
+    av_free(ctx->obuffer);
+  if (ctx->oframe)
+    av_free(ctx->oframe);
+  avcodec_close(ctx->ocodec);
+ out_free_fmtctx:
+  avformat_free_context(ctx->ofmtctx);
+ out_free_obuf:
+  evbuffer_free(ctx->obuf);
+
+  ctx->ofmtctx = NULL;
+  ctx->obuffer = NULL;
+  ctx->oframe = NULL;
+  ctx->obuf = NULL;
+
+  return -1;
+}
+
+static void
+alac_cleanup(struct transcode_ctx *ctx)
+{
+  avio_evbuffer_close(ctx->ofmtctx->pb);
+  av_free(ctx->obuffer);
+  av_free(ctx->oframe);
+  avcodec_close(ctx->ocodec);
+  avformat_free_context(ctx->ofmtctx);
+  evbuffer_free(ctx->obuf);
+}
+#endif /* XCODE_HAVE_ALAC */
+
+
+
+#if LIBAVCODEC_VERSION_MAJOR >= 54 || (LIBAVCODEC_VERSION_MAJOR == 53 && LIBAVCODEC_VERSION_MINOR >= 35)
+/* The converter is set up from the stream headers, or was left by the
+ * previous file on a reused decoder; the decoder only knows for sure once
+ * it has decoded something (HE-AAC doubles the rate of the headers), so
+ * check every frame and start over with a new converter if needed
+ */
+static int
+transcode_pcm_check(struct transcode_ctx *ctx)
+{
+  struct pcm_converter *pcm;
+
+  if (pcm_converter_matches(ctx->pcm, ctx->acodec->sample_fmt, ctx->acodec->channels, ctx->acodec->sample_rate))
+    return 0;
+
+  DPRINTF(E_DBG, L_XCODE, "Decoded format changed, converting %d@%d now\n", ctx->acodec->channels, ctx->acodec->sample_rate);
+
+  pcm = pcm_converter_new(ctx->acodec->sample_fmt, ctx->acodec->channels, ctx->acodec->sample_rate);
+  if (!pcm)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Cannot convert decoded %d@%d\n", ctx->acodec->channels, ctx->acodec->sample_rate);
+
+      return -1;
+    }
+
+  pcm_converter_free(ctx->pcm);
+  ctx->pcm = pcm;
+
+  return 0;
+}
+
+/* Converts a decoded frame right into evbuf space, without going
+ * through abuffer; returns the number of bytes added to evbuf
+ */
+static int
+transcode_direct(struct transcode_ctx *ctx, AVFrame *frame, struct evbuffer *evbuf)
+{
+  struct evbuffer_iovec iov;
+#ifdef XCODE_HAVE_ALAC
+  uint8_t *planes[2];
+  int chunk;
+  int done;
+  int bps;
+  int planar;
+  int nplanes;
+  int n;
+  int i;
+#endif
+  int samples;
+  int len;
+  int ret;
+
+  len = pcm_converter_max_samples(ctx->pcm, frame->nb_samples) * 2 * 2;
+
+#ifdef XCODE_HAVE_ALAC
+  /* The encoder takes native endian samples, converted through abuffer;
+   * frames that don't fit (long or upsampled ones) go in several runs
+   */
+  if (ctx->format == XCODE_ALAC)
+    {
+      chunk = frame->nb_samples;
+      while ((chunk > 1) && (pcm_converter_max_samples(ctx->pcm, chunk) * 2 * 2 > XCODE_BUFFER_SIZE))
+	chunk /= 2;
+
+      if (pcm_converter_max_samples(ctx->pcm, chunk) * 2 * 2 > XCODE_BUFFER_SIZE)
+	{
+	  DPRINTF(E_LOG, L_XCODE, "Output buffer too small for frame (%d < %d)\n", XCODE_BUFFER_SIZE, len);
+
+	  return -1;
+	}
+
+      bps = av_get_bytes_per_sample(ctx->acodec->sample_fmt);
+      planar = av_sample_fmt_is_planar(ctx->acodec->sample_fmt);
+      nplanes = (planar) ? ctx->acodec->channels : 1;
+      if (nplanes > 2)
+	return -1;
+
+      for (done = 0; done < frame->nb_samples; done += n)
+	{
+	  n = frame->nb_samples - done;
+	  if (n > chunk)
+	    n = chunk;
+
+	  for (i = 0; i < nplanes; i++)
+	    planes[i] = frame->extended_data[i] + done * bps * ((planar) ? 1 : ctx->acodec->channels);
+
+	  samples = pcm_converter_run(ctx->pcm, planes, n, ctx->abuffer, 0);
+	  if (samples < 0)
+	    return -1;
+
+	  ret = alac_encode(ctx, ctx->abuffer, samples);
+	  if (ret < 0)
+	    return -1;
+	}
+
+      return alac_drain(ctx, evbuf);
+    }
+#endif
+
+  ret = evbuffer_reserve_space(evbuf, len, &iov, 1);
+  if ((ret != 1) || (iov.iov_len < len))
+    {
+      DPRINTF(E_WARN, L_XCODE, "Could not reserve space for WAV data\n");
+
+      return -1;
+    }
+
+  samples = pcm_converter_run(ctx->pcm, frame->extended_data, frame->nb_samples, (int16_t *)iov.iov_base, 1);
+  if (samples < 0)
+    return -1;
+
+  len = samples * 2 * 2;
+
+  iov.iov_len = len;
+  ret = evbuffer_commit_space(evbuf, &iov, 1);
+  if (ret < 0)
+    {
+      DPRINTF(E_WARN, L_XCODE, "Could not commit WAV data to buffer\n");
+
+      return -1;
+    }
+
+  return len;
+}
+
+/* End of input: outputs what the resampler still holds back */
+static int
+transcode_flush(struct transcode_ctx *ctx, struct evbuffer *evbuf)
+{
+  struct evbuffer_iovec iov;
+  int samples;
+  int len;
+  int ret;
+
+  ctx->pcm_flushed = 1;
+
+  if (!pcm_converter_resamples(ctx->pcm))
+    return 0;
+
+  len = pcm_converter_max_samples(ctx->pcm, 0) * 2 * 2;
+
+#ifdef XCODE_HAVE_ALAC
+  if (ctx->format == XCODE_ALAC)
+    {
+      if (len > XCODE_BUFFER_SIZE)
+	{
+	  DPRINTF(E_LOG, L_XCODE, "Output buffer too small for resampler tail (%d < %d)\n", XCODE_BUFFER_SIZE, len);
+
+	  return -1;
+	}
+
+      samples = pcm_converter_flush(ctx->pcm, ctx->abuffer, 0);
+      if (samples < 0)
+	return -1;
+
+      /* Drained along with the end of the MP4 stream */
+      ret = alac_encode(ctx, ctx->abuffer, samples);
+      if (ret < 0)
+	return -1;
+
+      return 0;
+    }
+#endif
+
+  ret = evbuffer_reserve_space(evbuf, len, &iov, 1);
+  if ((ret != 1) || (iov.iov_len < len))
+    {
+      DPRINTF(E_WARN, L_XCODE, "Could not reserve space for WAV data\n");
+
+      return -1;
+    }
+
+  samples = pcm_converter_flush(ctx->pcm, (int16_t *)iov.iov_base, 1);
+  if (samples < 0)
+    return -1;
+
+  len = samples * 2 * 2;
+
+  iov.iov_len = len;
+  ret = evbuffer_commit_space(evbuf, &iov, 1);
+  if (ret < 0)
+    {
+      DPRINTF(E_WARN, L_XCODE, "Could not commit WAV data to buffer\n");
+
+      return -1;
+    }
+
+  return len;
+}
+#endif
 
 int
 transcode(struct transcode_ctx *ctx, struct evbuffer *evbuf, int wanted)
@@ -154,7 +762,7 @@ transcode(struct transcode_ctx *ctx, struct evbuffer *evbuf, int wanted)
 
   processed = 0;
 
-  if (ctx->wavhdr && (ctx->offset == 0))
+  if ((ctx->format == XCODE_PCM16_HEADER) && (ctx->offset == 0))
     {
       evbuffer_add(evbuf, ctx->header, sizeof(ctx->header));
       processed += sizeof(ctx->header);
@@ -196,6 +804,20 @@ transcode(struct transcode_ctx *ctx, struct evbuffer *evbuf, int wanted)
 	  ctx->apacket2.size -= used;
 
 #if LIBAVCODEC_VERSION_MAJOR >= 54 || (LIBAVCODEC_VERSION_MAJOR == 53 && LIBAVCODEC_VERSION_MINOR >= 35)
+	  if (got_frame && ctx->pcm)
+	    {
+	      ret = transcode_pcm_check(ctx);
+	      if (ret < 0)
+		return -1;
+
+	      ret = transcode_direct(ctx, &frame, evbuf);
+	      if (ret < 0)
+		return -1;
+
+	      processed += ret;
+	      continue;
+	    }
+
 	  /* This part is from the libav wrapper for avcodec_decode_audio3 - it may be useless in this context */
 	  if (got_frame != 0)
 	    {
@@ -248,6 +870,20 @@ transcode(struct transcode_ctx *ctx, struct evbuffer *evbuf, int wanted)
 	  else
 	    buf = ctx->abuffer;
 
+#ifdef XCODE_HAVE_ALAC
+	  if (ctx->format == XCODE_ALAC)
+	    {
+	      ret = alac_encode(ctx, buf, buflen / (2 * 2));
+	      if (ret == 0)
+		ret = alac_drain(ctx, evbuf);
+	      if (ret < 0)
+		return -1;
+
+	      processed += ret;
+	      continue;
+	    }
+#endif
+
 #if BYTE_ORDER == BIG_ENDIAN
 	  /* swap buffer, LE16 */
 	  for (i = 0; i < (buflen / 2); i++)
@@ -288,26 +924,57 @@ transcode(struct transcode_ctx *ctx, struct evbuffer *evbuf, int wanted)
       ctx->apacket2 = ctx->apacket;
     }
 
+#if LIBAVCODEC_VERSION_MAJOR >= 54 || (LIBAVCODEC_VERSION_MAJOR == 53 && LIBAVCODEC_VERSION_MINOR >= 35)
+  if (stop && ctx->pcm && !ctx->pcm_flushed)
+    {
+      ret = transcode_flush(ctx, evbuf);
+      if (ret < 0)
+	return -1;
+
+      processed += ret;
+    }
+#endif
+
+#ifdef XCODE_HAVE_ALAC
+  if ((ctx->format == XCODE_ALAC) && stop)
+    {
+      ret = alac_finish(ctx);
+      if (ret == 0)
+	ret = alac_drain(ctx, evbuf);
+      if (ret < 0)
+	return -1;
+
+      processed += ret;
+    }
+#endif
+
   ctx->offset += processed;
 
+  if (ctx->prefetch_id && ctx->fmtctx->pb)
+#if LIBAVFORMAT_VERSION_MAJOR >= 53
+    prefetch_update(ctx->prefetch_id, avio_tell(ctx->fmtctx->pb));
+#else
+    prefetch_update(ctx->prefetch_id, url_ftell(ctx->fmtctx->pb));
+#endif
+
   return processed;
 }
 
-int
-transcode_seek(struct transcode_ctx *ctx, int ms)
+/* Seeks to target, in AV_TIME_BASE units; returns the position reached,
+ * in AV_TIME_BASE units, or -1 on error
+ */
+static int64_t
+transcode_seek_internal(struct transcode_ctx *ctx, int64_t target)
 {
   int64_t start_time;
   int64_t target_pts;
   int64_t got_pts;
-  int got_ms;
   int flags;
   int ret;
 
   start_time = ctx->fmtctx->streams[ctx->astream]->start_time;
 
-  target_pts = ms;
-  target_pts = target_pts * AV_TIME_BASE / 1000;
-  target_pts = av_rescale_q(target_pts, AV_TIME_BASE_Q, ctx->fmtctx->streams[ctx->astream]->time_base);
+  target_pts = av_rescale_q(target, AV_TIME_BASE_Q, ctx->fmtctx->streams[ctx->astream]->time_base);
 
   if ((start_time != AV_NOPTS_VALUE) && (start_time > 0))
     target_pts += start_time;
@@ -322,6 +989,21 @@ transcode_seek(struct transcode_ctx *ctx, int ms)
 
   avcodec_flush_buffers(ctx->acodec);
 
+#if LIBAVCODEC_VERSION_MAJOR >= 54 || (LIBAVCODEC_VERSION_MAJOR == 53 && LIBAVCODEC_VERSION_MINOR >= 35)
+  if (ctx->pcm)
+    {
+      ret = pcm_converter_reset(ctx->pcm);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_XCODE, "Could not reset PCM converter after seeking\n");
+
+	  return -1;
+	}
+
+      ctx->pcm_flushed = 0;
+    }
+#endif
+
 #if LIBAVCODEC_VERSION_MAJOR >= 53
   ctx->acodec->skip_frame = AVDISCARD_NONREF;
 #else
@@ -366,107 +1048,418 @@ transcode_seek(struct transcode_ctx *ctx, int ms)
   /* Copy apacket and do not mess with it */
   ctx->apacket2 = ctx->apacket;
 
-  /* Compute position in ms from pts */
+  /* Compute position from pts */
   got_pts = ctx->apacket.pts;
 
   if ((start_time != AV_NOPTS_VALUE) && (start_time > 0))
     got_pts -= start_time;
 
-  got_pts = av_rescale_q(got_pts, ctx->fmtctx->streams[ctx->astream]->time_base, AV_TIME_BASE_Q);
-  got_ms = got_pts / (AV_TIME_BASE / 1000);
+  return av_rescale_q(got_pts, ctx->fmtctx->streams[ctx->astream]->time_base, AV_TIME_BASE_Q);
+}
+
+int
+transcode_seek(struct transcode_ctx *ctx, int ms)
+{
+  int64_t got;
+  int got_ms;
+
+  got = transcode_seek_internal(ctx, (int64_t)ms * (AV_TIME_BASE / 1000));
+  if (got < 0)
+    return -1;
+
+  got_ms = got / (AV_TIME_BASE / 1000);
 
   DPRINTF(E_DBG, L_XCODE, "Seek wanted %d ms, got %d ms\n", ms, got_ms);
 
   return got_ms;
 }
 
+/* Seeks a WAV transcoding to a byte offset in the output. Returns the output
+ * offset actually reached, at or before the requested offset; the caller
+ * discards the difference to start exactly at the requested byte.
+ */
+off_t
+transcode_seek_bytes(struct transcode_ctx *ctx, off_t offset)
+{
+  int64_t sample;
+  int64_t target;
+  int64_t got;
+  off_t hdrlen;
+  int i;
+
+  /* Only PCM maps bytes to samples */
+  if (ctx->format == XCODE_ALAC)
+    return -1;
 
-struct transcode_ctx *
-transcode_setup(struct media_file_info *mfi, off_t *est_size, int wavhdr)
+  hdrlen = (ctx->format == XCODE_PCM16_HEADER) ? sizeof(ctx->header) : 0;
+
+  /* Within the header, nothing to seek */
+  if (offset <= hdrlen)
+    return 0;
+
+  sample = (offset - hdrlen) / 4;
+  target = av_rescale(sample, AV_TIME_BASE, 44100);
+
+  /* The demuxer may land past the target; back off until it doesn't */
+  for (i = 0; i < 3; i++)
+    {
+      got = transcode_seek_internal(ctx, target);
+      if (got < 0)
+	return -1;
+
+      got = av_rescale_rnd(got, 44100, AV_TIME_BASE, AV_ROUND_NEAR_INF);
+      if (got <= sample)
+	break;
+
+      target -= av_rescale(got - sample, AV_TIME_BASE, 44100) + AV_TIME_BASE;
+      if (target < 0)
+	target = 0;
+    }
+
+  if (got > sample)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Could not seek at or before sample %" PRIi64 "\n", sample);
+
+      /* Back to the start, the caller will decode from there */
+      transcode_seek_internal(ctx, 0);
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_XCODE, "Seek wanted sample %" PRIi64 ", got sample %" PRIi64 "\n", sample, got);
+
+  /* Past the header, don't emit it */
+  ctx->offset = hdrlen + got * 4;
+
+  return ctx->offset;
+}
+
+/* Decoders */
+
+static int
+audio_stream(AVFormatContext *fmtctx)
 {
-  struct transcode_ctx *ctx;
   int i;
-  int ret;
 
-  ctx = (struct transcode_ctx *)malloc(sizeof(struct transcode_ctx));
-  if (!ctx)
+  for (i = 0; i < fmtctx->nb_streams; i++)
     {
-      DPRINTF(E_WARN, L_XCODE, "Could not allocate transcode context\n");
+#if LIBAVCODEC_VERSION_MAJOR >= 53 || (LIBAVCODEC_VERSION_MAJOR == 52 && LIBAVCODEC_VERSION_MINOR >= 64)
+      if (fmtctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO)
+#else
+      if (fmtctx->streams[i]->codec->codec_type == CODEC_TYPE_AUDIO)
+#endif
+	return i;
+    }
 
-      return NULL;
+  return -1;
+}
+
+#ifdef XCODE_HAVE_DECODER_POOL
+/* Length of the extradata that matters to the decoder. FLAC's STREAMINFO
+ * ends with the total number of samples (36 bits, from the second half of
+ * byte 13) and the MD5 of the audio, which the decoder doesn't use and
+ * which differ from file to file; the bytes before are compared, and the
+ * top half of byte 13 separately.
+ */
+static int
+decoder_extradata_len(enum CodecID codec_id, const uint8_t *extradata, int size)
+{
+  if (codec_id != CODEC_ID_FLAC)
+    return size;
+
+  /* Bare STREAMINFO, or with the fLaC marker and block header before it */
+  if (size == 34)
+    return 13;
+  if ((size == 8 + 34) && (memcmp(extradata, "fLaC", 4) == 0))
+    return 8 + 13;
+
+  return size;
+}
+
+/* The sample format isn't compared, it's only known after probing and it
+ * follows from the rest anyway; the converter is checked for every frame
+ * in case the decoder disagrees with the headers
+ */
+static int
+decoder_match(struct transcode_decoder *dec, AVCodecContext *codec)
+{
+  int len;
+
+  if ((dec->codec_id != codec->codec_id)
+      || (dec->sample_rate != codec->sample_rate)
+      || (dec->channels != codec->channels)
+      || (dec->block_align != codec->block_align)
+      || (dec->bits_per_coded_sample != codec->bits_per_coded_sample)
+      || (dec->extradata_size != codec->extradata_size))
+    return 0;
+
+  if (dec->extradata_size == 0)
+    return 1;
+
+  len = decoder_extradata_len(dec->codec_id, dec->extradata, dec->extradata_size);
+
+  if (memcmp(dec->extradata, codec->extradata, len) != 0)
+    return 0;
+
+  if (len == dec->extradata_size)
+    return 1;
+
+  /* FLAC: bits per sample ends in the top half of the next byte */
+  return ((dec->extradata[len] & 0xf0) == (codec->extradata[len] & 0xf0));
+}
+
+static void
+decoder_free(struct transcode_decoder *dec)
+{
+  if (dec->acodec)
+    {
+      avcodec_close(dec->acodec);
+      av_free(dec->acodec);
     }
-  memset(ctx, 0, sizeof(struct transcode_ctx));
 
-#if LIBAVFORMAT_VERSION_MAJOR >= 53 || (LIBAVFORMAT_VERSION_MAJOR == 53 && LIBAVFORMAT_VERSION_MINOR >= 3)
-  ret = avformat_open_input(&ctx->fmtctx, mfi->path, NULL, NULL);
+  if (dec->abuffer)
+    av_free(dec->abuffer);
+
+  if (dec->pcm)
+    pcm_converter_free(dec->pcm);
+
+  free(dec->extradata);
+  free(dec);
+}
+
+/* Takes an idle decoder opened for the stream parameters of ctx->astream */
+static int
+decoder_reuse(struct transcode_ctx *ctx)
+{
+  struct transcode_decoder *dec;
+  struct transcode_decoder *prev;
+  AVCodecContext *codec;
+
+  codec = ctx->fmtctx->streams[ctx->astream]->codec;
+
+  /* Not enough in the headers */
+  if ((codec->codec_id == CODEC_ID_NONE) || (codec->sample_rate <= 0) || (codec->channels <= 0))
+    return -1;
+
+  pthread_mutex_lock(&decoders_lck);
+
+  prev = NULL;
+  for (dec = decoders; dec; dec = dec->next)
+    {
+      if (decoder_match(dec, codec))
+	break;
+
+      prev = dec;
+    }
+
+  if (dec)
+    {
+      if (prev)
+	prev->next = dec->next;
+      else
+	decoders = dec->next;
+
+      decoders_idle--;
+    }
+
+  pthread_mutex_unlock(&decoders_lck);
+
+  if (!dec)
+    return -1;
+
+  ctx->dec = dec;
+  ctx->acodec = dec->acodec;
+  ctx->abuffer = dec->abuffer;
+  ctx->pcm = dec->pcm;
+
+  dec->acodec = NULL;
+  dec->abuffer = NULL;
+  dec->pcm = NULL;
+  dec->next = NULL;
+
+  return 0;
+}
+#endif /* XCODE_HAVE_DECODER_POOL */
+
+/* Tears down the decoder and buffers of ctx */
+static void
+decoder_close(struct transcode_ctx *ctx)
+{
+  if (ctx->need_resample)
+    {
+      audio_resample_close(ctx->resample_ctx);
+      av_free(ctx->re_abuffer);
+
+      ctx->need_resample = 0;
+    }
+
+#if LIBAVCODEC_VERSION_MAJOR >= 54 || (LIBAVCODEC_VERSION_MAJOR == 53 && LIBAVCODEC_VERSION_MINOR >= 35)
+  if (ctx->pcm)
+    pcm_converter_free(ctx->pcm);
+#endif
+  ctx->pcm = NULL;
+
+  if (ctx->abuffer)
+    av_free(ctx->abuffer);
+  ctx->abuffer = NULL;
+
+  if (ctx->acodec)
+    {
+      avcodec_close(ctx->acodec);
+#ifdef XCODE_HAVE_DECODER_POOL
+      av_free(ctx->acodec);
+#endif
+    }
+  ctx->acodec = NULL;
+
+#ifdef XCODE_HAVE_DECODER_POOL
+  if (ctx->dec)
+    decoder_free(ctx->dec);
+  ctx->dec = NULL;
+#endif
+}
+
+/* Hands the decoder of ctx over to the idle pool, or closes it */
+static void
+decoder_release(struct transcode_ctx *ctx)
+{
+#ifdef XCODE_HAVE_DECODER_POOL
+  struct transcode_decoder *dec;
+  struct transcode_decoder *evict;
+  struct transcode_decoder *prev;
+
+  /* The libav resampler can't be reset, don't keep those */
+  if (!ctx->dec || ctx->need_resample)
+    {
+      decoder_close(ctx);
+      return;
+    }
+
+  avcodec_flush_buffers(ctx->acodec);
+  if (ctx->pcm && (pcm_converter_reset(ctx->pcm) < 0))
+    {
+      decoder_close(ctx);
+      return;
+    }
+
+  dec = ctx->dec;
+  dec->acodec = ctx->acodec;
+  dec->abuffer = ctx->abuffer;
+  dec->pcm = ctx->pcm;
+
+  ctx->dec = NULL;
+  ctx->acodec = NULL;
+  ctx->abuffer = NULL;
+  ctx->pcm = NULL;
+
+  evict = NULL;
+
+  pthread_mutex_lock(&decoders_lck);
+
+  dec->next = decoders;
+  decoders = dec;
+  decoders_idle++;
+
+  /* Drop the least recently used one */
+  if (decoders_idle > XCODE_IDLE_DECODERS)
+    {
+      prev = NULL;
+      for (evict = decoders; evict->next; evict = evict->next)
+	prev = evict;
+
+      prev->next = NULL;
+      decoders_idle--;
+    }
+
+  pthread_mutex_unlock(&decoders_lck);
+
+  if (evict)
+    decoder_free(evict);
 #else
-  ret = av_open_input_file(&ctx->fmtctx, mfi->path, NULL, 0, NULL);
+  decoder_close(ctx);
 #endif
-  if (ret != 0)
+}
+
+/* Opens a decoder for ctx->astream, with its buffers and sample conversion */
+static int
+decoder_open(struct transcode_ctx *ctx)
+{
+  AVCodecContext *codec;
+  AVCodec *decoder;
+  int ret;
+
+  codec = ctx->fmtctx->streams[ctx->astream]->codec;
+
+  decoder = avcodec_find_decoder(codec->codec_id);
+  if (!decoder)
     {
-      DPRINTF(E_WARN, L_XCODE, "Could not open file %s: %s\n", mfi->fname, strerror(AVUNERROR(ret)));
+      DPRINTF(E_WARN, L_XCODE, "No suitable decoder found for codec\n");
 
-      free(ctx);
-      return NULL;
+      return -1;
     }
 
-#if LIBAVFORMAT_VERSION_MAJOR >= 53 || (LIBAVFORMAT_VERSION_MAJOR == 53 && LIBAVFORMAT_VERSION_MINOR >= 3)
-  ret = avformat_find_stream_info(ctx->fmtctx, NULL);
-#else
-  ret = av_find_stream_info(ctx->fmtctx);
-#endif
-  if (ret < 0)
+#ifdef XCODE_HAVE_DECODER_POOL
+  ctx->dec = (struct transcode_decoder *)malloc(sizeof(struct transcode_decoder));
+  if (!ctx->dec)
     {
-      DPRINTF(E_WARN, L_XCODE, "Could not find stream info: %s\n", strerror(AVUNERROR(ret)));
+      DPRINTF(E_WARN, L_XCODE, "Out of memory for decoder\n");
 
-      goto setup_fail;
+      return -1;
     }
+  memset(ctx->dec, 0, sizeof(struct transcode_decoder));
 
-  ctx->astream = -1;
-  for (i = 0; i < ctx->fmtctx->nb_streams; i++)
+  ctx->dec->codec_id = codec->codec_id;
+  ctx->dec->sample_rate = codec->sample_rate;
+  ctx->dec->channels = codec->channels;
+  ctx->dec->block_align = codec->block_align;
+  ctx->dec->bits_per_coded_sample = codec->bits_per_coded_sample;
+
+  if (codec->extradata_size > 0)
     {
-#if LIBAVCODEC_VERSION_MAJOR >= 53 || (LIBAVCODEC_VERSION_MAJOR == 52 && LIBAVCODEC_VERSION_MINOR >= 64)
-      if (ctx->fmtctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO)
-#else
-      if (ctx->fmtctx->streams[i]->codec->codec_type == CODEC_TYPE_AUDIO)
-#endif
+      ctx->dec->extradata = (uint8_t *)malloc(codec->extradata_size);
+      if (!ctx->dec->extradata)
 	{
-	  ctx->astream = i;
+	  DPRINTF(E_WARN, L_XCODE, "Out of memory for decoder\n");
 
-	  break;
+	  goto fail;
 	}
+
+      memcpy(ctx->dec->extradata, codec->extradata, codec->extradata_size);
+      ctx->dec->extradata_size = codec->extradata_size;
     }
 
-  if (ctx->astream < 0)
+  /* A context of our own, it outlives the file */
+  ctx->acodec = avcodec_alloc_context3(decoder);
+  if (!ctx->acodec)
     {
-      DPRINTF(E_WARN, L_XCODE, "No audio stream found in file %s\n", mfi->fname);
+      DPRINTF(E_WARN, L_XCODE, "Could not allocate decoder context\n");
 
-      goto setup_fail;
+      goto fail;
     }
 
-  ctx->acodec = ctx->fmtctx->streams[ctx->astream]->codec;
-
-  ctx->adecoder = avcodec_find_decoder(ctx->acodec->codec_id);
-  if (!ctx->adecoder)
+  ret = avcodec_copy_context(ctx->acodec, codec);
+  if (ret < 0)
     {
-      DPRINTF(E_WARN, L_XCODE, "No suitable decoder found for codec\n");
+      DPRINTF(E_WARN, L_XCODE, "Could not copy decoder context\n");
 
-      goto setup_fail;
+      goto fail;
     }
+#else
+  ctx->acodec = codec;
+#endif
 
-  if (ctx->adecoder->capabilities & CODEC_CAP_TRUNCATED)
+  if (decoder->capabilities & CODEC_CAP_TRUNCATED)
     ctx->acodec->flags |= CODEC_FLAG_TRUNCATED;
 
 #if LIBAVCODEC_VERSION_MAJOR >= 54 || (LIBAVCODEC_VERSION_MAJOR == 53 && LIBAVCODEC_VERSION_MINOR >= 6)
-  ret = avcodec_open2(ctx->acodec, ctx->adecoder, NULL);
+  ret = avcodec_open2(ctx->acodec, decoder, NULL);
 #else
-  ret = avcodec_open(ctx->acodec, ctx->adecoder);
+  ret = avcodec_open(ctx->acodec, decoder);
 #endif
   if (ret != 0)
     {
       DPRINTF(E_WARN, L_XCODE, "Could not open codec: %s\n", strerror(AVUNERROR(ret)));
 
-      goto setup_fail;
+      goto fail;
     }
 
   ctx->abuffer = (int16_t *)av_malloc(XCODE_BUFFER_SIZE);
@@ -474,9 +1467,15 @@ transcode_setup(struct media_file_info *mfi, off_t *est_size, int wavhdr)
     {
       DPRINTF(E_WARN, L_XCODE, "Could not allocate transcode buffer\n");
 
-      goto setup_fail_codec;
+      goto fail;
     }
 
+#if LIBAVCODEC_VERSION_MAJOR >= 54 || (LIBAVCODEC_VERSION_MAJOR == 53 && LIBAVCODEC_VERSION_MINOR >= 35)
+  ctx->pcm = pcm_converter_new(ctx->acodec->sample_fmt, ctx->acodec->channels, ctx->acodec->sample_rate);
+  if (ctx->pcm)
+    DPRINTF(E_DBG, L_XCODE, "Converting %d@%d from decoded frames\n", ctx->acodec->channels, ctx->acodec->sample_rate);
+  else
+#endif
   if ((ctx->acodec->sample_fmt != AV_SAMPLE_FMT_S16)
       || (ctx->acodec->channels != 2)
       || (ctx->acodec->sample_rate != 44100))
@@ -492,7 +1491,7 @@ transcode_setup(struct media_file_info *mfi, off_t *est_size, int wavhdr)
 	{
 	  DPRINTF(E_WARN, L_XCODE, "Could not init resample from %d@%d to 2@44100\n", ctx->acodec->channels, ctx->acodec->sample_rate);
 
-	  goto setup_fail_codec;
+	  goto fail;
 	}
 
       ctx->re_abuffer = (int16_t *)av_malloc(XCODE_BUFFER_SIZE * 2);
@@ -501,7 +1500,7 @@ transcode_setup(struct media_file_info *mfi, off_t *est_size, int wavhdr)
 	  DPRINTF(E_WARN, L_XCODE, "Could not allocate resample buffer\n");
 
 	  audio_resample_close(ctx->resample_ctx);
-	  goto setup_fail_codec;
+	  goto fail;
 	}
 
       ctx->need_resample = 1;
@@ -514,17 +1513,120 @@ transcode_setup(struct media_file_info *mfi, off_t *est_size, int wavhdr)
 #endif
     }
 
+  return 0;
+
+ fail:
+  decoder_close(ctx);
+
+  return -1;
+}
+
+
+struct transcode_ctx *
+transcode_setup(struct media_file_info *mfi, off_t *est_size, enum transcode_format format)
+{
+  struct transcode_ctx *ctx;
+  int ret;
+
+  ctx = (struct transcode_ctx *)malloc(sizeof(struct transcode_ctx));
+  if (!ctx)
+    {
+      DPRINTF(E_WARN, L_XCODE, "Could not allocate transcode context\n");
+
+      return NULL;
+    }
+  memset(ctx, 0, sizeof(struct transcode_ctx));
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 53 || (LIBAVFORMAT_VERSION_MAJOR == 53 && LIBAVFORMAT_VERSION_MINOR >= 3)
+  ret = avformat_open_input(&ctx->fmtctx, mfi->path, NULL, NULL);
+#else
+  ret = av_open_input_file(&ctx->fmtctx, mfi->path, NULL, 0, NULL);
+#endif
+  if (ret != 0)
+    {
+      DPRINTF(E_WARN, L_XCODE, "Could not open file %s: %s\n", mfi->fname, strerror(AVUNERROR(ret)));
+
+      free(ctx);
+      return NULL;
+    }
+
+#ifdef XCODE_HAVE_DECODER_POOL
+  /* Tracks of an album share their stream parameters; with an idle decoder
+   * for them, the container headers are enough and probing is skipped
+   */
+  ctx->astream = audio_stream(ctx->fmtctx);
+  if ((ctx->astream >= 0) && (decoder_reuse(ctx) == 0))
+    DPRINTF(E_DBG, L_XCODE, "Reusing idle decoder for %s\n", mfi->fname);
+  else
+#endif
+    {
+#if LIBAVFORMAT_VERSION_MAJOR >= 53 || (LIBAVFORMAT_VERSION_MAJOR == 53 && LIBAVFORMAT_VERSION_MINOR >= 3)
+      ret = avformat_find_stream_info(ctx->fmtctx, NULL);
+#else
+      ret = av_find_stream_info(ctx->fmtctx);
+#endif
+      if (ret < 0)
+	{
+	  DPRINTF(E_WARN, L_XCODE, "Could not find stream info: %s\n", strerror(AVUNERROR(ret)));
+
+	  goto setup_fail;
+	}
+
+      ctx->astream = audio_stream(ctx->fmtctx);
+      if (ctx->astream < 0)
+	{
+	  DPRINTF(E_WARN, L_XCODE, "No audio stream found in file %s\n", mfi->fname);
+
+	  goto setup_fail;
+	}
+
+      ret = decoder_open(ctx);
+      if (ret < 0)
+	goto setup_fail;
+    }
+
   ctx->duration = mfi->song_length;
   ctx->samples = mfi->sample_count;
-  ctx->wavhdr = wavhdr;
+  ctx->format = format;
+
+  /* Only needed for the size estimate */
+  if (format != XCODE_PCM16_NOHEADER)
+    {
+      ret = db_pcm_samples_get(mfi->id, mfi->time_modified, mfi->file_size, &ctx->exact_samples);
+      if (ret < 0)
+	ctx->exact_samples = 0;
+    }
+
+  switch (format)
+    {
+      case XCODE_PCM16_HEADER:
+	make_wav_header(ctx, est_size);
+	break;
+
+#ifdef XCODE_HAVE_ALAC
+      case XCODE_ALAC:
+	ret = alac_setup(ctx);
+	if (ret < 0)
+	  goto setup_fail_decoder;
+
+	/* Lossless compression usually lands around 60% of the PCM size */
+	make_wav_header(ctx, est_size);
+	*est_size = (*est_size * 6) / 10;
+	break;
+#endif
+
+      default:
+	break;
+    }
 
-  if (wavhdr)
-    make_wav_header(ctx, est_size);
+  ctx->prefetch_id = prefetch_start(mfi->path, 0, mfi->bitrate);
 
   return ctx;
 
- setup_fail_codec:
-  avcodec_close(ctx->acodec);
+#ifdef XCODE_HAVE_ALAC
+ setup_fail_decoder:
+  decoder_close(ctx);
+#endif
 
  setup_fail:
 #if LIBAVFORMAT_VERSION_MAJOR >= 54 || (LIBAVFORMAT_VERSION_MAJOR == 53 && LIBAVFORMAT_VERSION_MINOR >= 21)
@@ -537,76 +1639,58 @@ transcode_setup(struct media_file_info *mfi, off_t *est_size, int wavhdr)
   return NULL;
 }
 
+/* Size of the WAV transcoding of mfi if it is known exactly, from the
+ * scanner analysis; -1 otherwise
+ */
+off_t
+transcode_exact_size(struct media_file_info *mfi, enum transcode_format format)
+{
+  int64_t samples;
+  int ret;
+
+  if (format != XCODE_PCM16_HEADER)
+    return -1;
+
+  ret = db_pcm_samples_get(mfi->id, mfi->time_modified, mfi->file_size, &samples);
+  if (ret < 0)
+    return -1;
+
+  return 2 * 2 * samples + 44; /* WAV header */
+}
+
 void
 transcode_cleanup(struct transcode_ctx *ctx)
 {
+  prefetch_stop(ctx->prefetch_id);
+
   if (ctx->apacket.data)
     av_free_packet(&ctx->apacket);
 
-  avcodec_close(ctx->acodec);
+  decoder_release(ctx);
+
 #if LIBAVFORMAT_VERSION_MAJOR >= 54 || (LIBAVFORMAT_VERSION_MAJOR == 53 && LIBAVFORMAT_VERSION_MINOR >= 21)
   avformat_close_input(&ctx->fmtctx);
 #else
   av_close_input_file(ctx->fmtctx);
 #endif
 
-  av_free(ctx->abuffer);
-
-  if (ctx->need_resample)
-    {
-      audio_resample_close(ctx->resample_ctx);
-      av_free(ctx->re_abuffer);
-    }
+#ifdef XCODE_HAVE_ALAC
+  if (ctx->format == XCODE_ALAC)
+    alac_cleanup(ctx);
+#endif
 
   free(ctx);
 }
 
 
-int
-transcode_needed(struct evkeyvalq *headers, char *file_codectype)
+/* Codecs the client can play, from Accept-Codecs or guessed from the User-Agent.
+ * Returns NULL if the client must never be sent a transcoded stream.
+ */
+static const char *
+transcode_client_codecs(struct evkeyvalq *headers)
 {
   const char *client_codecs;
   const char *user_agent;
-  char *codectype;
-  cfg_t *lib;
-  int size;
-  int i;
-
-  DPRINTF(E_DBG, L_XCODE, "Determining transcoding status for codectype %s\n", file_codectype);
-
-  lib = cfg_getsec(cfg, "library");
-
-  size = cfg_size(lib, "no_transcode");
-  if (size > 0)
-    {
-      for (i = 0; i < size; i++)
-	{
-	  codectype = cfg_getnstr(lib, "no_transcode", i);
-
-	  if (strcmp(file_codectype, codectype) == 0)
-	    {
-	      DPRINTF(E_DBG, L_XCODE, "Codectype is in no_transcode\n");
-
-	      return 0;
-	    }
-	}
-    }
-
-  size = cfg_size(lib, "force_transcode");
-  if (size > 0)
-    {
-      for (i = 0; i < size; i++)
-	{
-	  codectype = cfg_getnstr(lib, "force_transcode", i);
-
-	  if (strcmp(file_codectype, codectype) == 0)
-	    {
-	      DPRINTF(E_DBG, L_XCODE, "Codectype is in force_transcode\n");
-
-	      return 1;
-	    }
-	}
-    }
 
   client_codecs = evhttp_find_header(headers, "Accept-Codecs");
   if (!client_codecs)
@@ -654,7 +1738,7 @@ transcode_needed(struct evkeyvalq *headers, char *file_codectype)
 	       * HTTP implementation doesn't honour Connection: close.
 	       * At least, that's why mt-daapd didn't do it.
 	       */
-	      return 0;
+	      return NULL;
 	    }
 	}
     }
@@ -668,6 +1752,56 @@ transcode_needed(struct evkeyvalq *headers, char *file_codectype)
       client_codecs = default_codecs;
     }
 
+  return client_codecs;
+}
+
+static int
+transcode_decide(const char *client_codecs, const char *file_codectype)
+{
+  char *codectype;
+  cfg_t *lib;
+  int size;
+  int i;
+
+  DPRINTF(E_DBG, L_XCODE, "Determining transcoding status for codectype %s\n", file_codectype);
+
+  lib = cfg_getsec(cfg, "library");
+
+  size = cfg_size(lib, "no_transcode");
+  if (size > 0)
+    {
+      for (i = 0; i < size; i++)
+	{
+	  codectype = cfg_getnstr(lib, "no_transcode", i);
+
+	  if (strcmp(file_codectype, codectype) == 0)
+	    {
+	      DPRINTF(E_DBG, L_XCODE, "Codectype is in no_transcode\n");
+
+	      return 0;
+	    }
+	}
+    }
+
+  size = cfg_size(lib, "force_transcode");
+  if (size > 0)
+    {
+      for (i = 0; i < size; i++)
+	{
+	  codectype = cfg_getnstr(lib, "force_transcode", i);
+
+	  if (strcmp(file_codectype, codectype) == 0)
+	    {
+	      DPRINTF(E_DBG, L_XCODE, "Codectype is in force_transcode\n");
+
+	      return 1;
+	    }
+	}
+    }
+
+  if (!client_codecs)
+    return 0;
+
   if (strstr(client_codecs, file_codectype))
     {
       DPRINTF(E_DBG, L_XCODE, "Codectype supported by client, no transcoding needed\n");
@@ -678,3 +1812,121 @@ transcode_needed(struct evkeyvalq *headers, char *file_codectype)
 
   return 1;
 }
+
+/* Output format for a client: ALAC in MP4 is about half the size of WAV */
+static enum transcode_format
+transcode_target(const char *client_codecs)
+{
+  if (!alac_enabled)
+    return XCODE_PCM16_HEADER;
+
+  if (!client_codecs || !strstr(client_codecs, "alac"))
+    return XCODE_PCM16_HEADER;
+
+  return XCODE_ALAC;
+}
+
+int
+transcode_needed(struct evkeyvalq *headers, char *file_codectype)
+{
+  const char *client_codecs;
+
+  client_codecs = transcode_client_codecs(headers);
+
+  if (!transcode_decide(client_codecs, file_codectype))
+    return XCODE_NONE;
+
+  return transcode_target(client_codecs);
+}
+
+
+/* Client profiles: resolve the client codecs once, then remember
+ * the transcoding decision for each codectype we come across
+ */
+int
+transcode_profile_init(struct transcode_profile *xp, struct evkeyvalq *headers)
+{
+  const char *client_codecs;
+
+  memset(xp, 0, sizeof(struct transcode_profile));
+
+  client_codecs = transcode_client_codecs(headers);
+  if (client_codecs)
+    {
+      xp->client_codecs = strdup(client_codecs);
+      if (!xp->client_codecs)
+	{
+	  DPRINTF(E_LOG, L_XCODE, "Out of memory for client codecs\n");
+
+	  return -1;
+	}
+    }
+
+  pthread_mutex_init(&xp->lck, NULL);
+
+  return 0;
+}
+
+void
+transcode_profile_clear(struct transcode_profile *xp)
+{
+  if (xp->client_codecs)
+    free(xp->client_codecs);
+
+  pthread_mutex_destroy(&xp->lck);
+
+  memset(xp, 0, sizeof(struct transcode_profile));
+}
+
+int
+transcode_profile_needed(struct transcode_profile *xp, char *file_codectype)
+{
+  int ret;
+  int i;
+
+  pthread_mutex_lock(&xp->lck);
+
+  for (i = 0; i < xp->ndecisions; i++)
+    {
+      if (strcmp(xp->decisions[i].codectype, file_codectype) == 0)
+	{
+	  ret = xp->decisions[i].transcode;
+	  goto out;
+	}
+    }
+
+  ret = transcode_decide(xp->client_codecs, file_codectype);
+  if (ret)
+    ret = transcode_target(xp->client_codecs);
+
+  /* Codectypes are at most 4 characters */
+  if ((xp->ndecisions < XCODE_PROFILE_DECISIONS) && (strlen(file_codectype) < sizeof(xp->decisions[0].codectype)))
+    {
+      strcpy(xp->decisions[xp->ndecisions].codectype, file_codectype);
+      xp->decisions[xp->ndecisions].transcode = ret;
+      xp->ndecisions++;
+    }
+
+ out:
+  pthread_mutex_unlock(&xp->lck);
+
+  return ret;
+}
+
+/* Thread: main, after libav is set up and before any other thread runs */
+void
+transcode_init(void)
+{
+  alac_enabled = 0;
+
+#ifdef XCODE_HAVE_ALAC
+  if (!cfg_getbool(cfg_getsec(cfg, "library"), "transcode_alac"))
+    return;
+
+  alac_enabled = (avcodec_find_encoder(CODEC_ID_ALAC) != NULL)
+    && ((av_guess_format("ipod", NULL, NULL) != NULL) || (av_guess_format("mp4", NULL, NULL) != NULL));
+
+  if (!alac_enabled)
+    DPRINTF(E_LOG, L_XCODE, "ALAC encoder or MP4 muxer missing, transcoding to WAV only\n");
+#endif
+}
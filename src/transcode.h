@@ -2,23 +2,68 @@
 #ifndef __TRANSCODE_H__
 #define __TRANSCODE_H__
 
+#include <pthread.h>
+
 #include "evhttp/evhttp.h"
 
+#define XCODE_PROFILE_DECISIONS 16
+
 struct transcode_ctx;
 
+/* Transcoding output formats; transcode_needed() and transcode_profile_needed()
+ * return the format to transcode to, or XCODE_NONE
+ */
+enum transcode_format {
+  XCODE_NONE = 0,
+  XCODE_PCM16_NOHEADER,
+  XCODE_PCM16_HEADER,
+  XCODE_ALAC
+};
+
+struct transcode_profile {
+  /* NULL if the client must not be sent transcoded streams */
+  char *client_codecs;
+
+  /* Protects the decisions; DAAP sessions are shared by httpd threads */
+  pthread_mutex_t lck;
+  int ndecisions;
+  struct {
+    char codectype[5];
+    int transcode;
+  } decisions[XCODE_PROFILE_DECISIONS];
+};
+
 int
 transcode(struct transcode_ctx *ctx, struct evbuffer *evbuf, int wanted);
 
 int
 transcode_seek(struct transcode_ctx *ctx, int ms);
 
+off_t
+transcode_seek_bytes(struct transcode_ctx *ctx, off_t offset);
+
 struct transcode_ctx *
-transcode_setup(struct media_file_info *mfi, off_t *est_size, int wavhdr);
+transcode_setup(struct media_file_info *mfi, off_t *est_size, enum transcode_format format);
 
 void
 transcode_cleanup(struct transcode_ctx *ctx);
 
+off_t
+transcode_exact_size(struct media_file_info *mfi, enum transcode_format format);
+
 int
 transcode_needed(struct evkeyvalq *headers, char *file_codectype);
 
+int
+transcode_profile_init(struct transcode_profile *xp, struct evkeyvalq *headers);
+
+void
+transcode_profile_clear(struct transcode_profile *xp);
+
+int
+transcode_profile_needed(struct transcode_profile *xp, char *file_codectype);
+
+void
+transcode_init(void);
+
 #endif /* !__TRANSCODE_H__ */
@@ -0,0 +1,770 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * On-disk cache of transcoded output
+ *
+ * Complete WAV transcodings are kept in transcode_cache_dir, named after
+ * the file id and modification time of the source, so a rescanned file
+ * never hits a stale entry. Entries are written while streaming and
+ * committed once the transcoding reaches the end of the file; the cache
+ * is then trimmed to transcode_cache_size MB, least recently used first.
+ * Cached output is served like a regular file, with an exact
+ * Content-Length and zero-copy Range support.
+ *
+ * The writes, the commit and the trimming are queued to the cache writer
+ * thread so the httpd threads never wait on the disk. A writer the thread
+ * failed on, or that gets too far ahead of the disk, is reported as failed
+ * to the next transcode_cache_write() and the entry is dropped.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <event.h>
+
+#include "logger.h"
+#include "conffile.h"
+#include "db.h"
+#include "transcode_cache.h"
+
+
+/* Size of the WAV header written by transcode() */
+#define WAV_HEADER_SIZE 44
+/* Data queued to the writer thread before we give up on caching a stream */
+#define CACHE_QUEUE_MAX (16 * 1024 * 1024)
+
+enum cache_job_type {
+  CACHE_JOB_WRITE,
+  CACHE_JOB_COMMIT,
+  CACHE_JOB_ABORT,
+  CACHE_JOB_TRIM,
+};
+
+struct cache_job {
+  enum cache_job_type type;
+
+  struct transcode_cache_writer *cw;
+
+  uint8_t *data;
+  size_t len;
+
+  struct cache_job *next;
+};
+
+struct transcode_cache_writer {
+  char path[PATH_MAX];
+  char tmp_path[PATH_MAX];
+  int fd;
+  off_t len;
+
+  /* Set by the writer thread, under cache_lck */
+  int failed;
+
+  /* Allocated up front so committing or aborting can't fail */
+  struct cache_job *end;
+};
+
+struct cache_file {
+  char name[NAME_MAX + 1];
+  time_t mtime;
+  off_t size;
+};
+
+
+static char *cache_dir;
+static off_t cache_max_size;
+
+static pthread_t tid_cache;
+static pthread_mutex_t cache_lck = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+static struct cache_job *cache_jobs;
+static struct cache_job *cache_jobs_tail;
+static size_t cache_queued;
+static int cache_exit;
+
+
+static int
+cache_path(struct media_file_info *mfi, char *path, size_t len)
+{
+  uint32_t mtime;
+  int ret;
+
+  mtime = (mfi->time_modified) ? mfi->time_modified : mfi->db_timestamp;
+
+  ret = snprintf(path, len, "%s/%u-%u.wav", cache_dir, mfi->id, mtime);
+  if ((ret < 0) || (ret >= len))
+    {
+      DPRINTF(E_LOG, L_XCODE, "Transcode cache path exceeds PATH_MAX\n");
+
+      return -1;
+    }
+
+  return 0;
+}
+
+static int
+cache_file_compare(const void *aa, const void *bb)
+{
+  const struct cache_file *a = (const struct cache_file *)aa;
+  const struct cache_file *b = (const struct cache_file *)bb;
+
+  if (a->mtime < b->mtime)
+    return -1;
+
+  if (a->mtime > b->mtime)
+    return 1;
+
+  return 0;
+}
+
+/* Thread: transcode cache */
+/* Drop the least recently used entries until we're within budget */
+static void
+cache_trim(void)
+{
+  struct cache_file *files;
+  struct cache_file *tmp;
+  struct dirent *de;
+  struct stat sb;
+  DIR *dir;
+  char path[PATH_MAX];
+  off_t total;
+  size_t len;
+  int nfiles;
+  int maxfiles;
+  int i;
+  int ret;
+
+  dir = opendir(cache_dir);
+  if (!dir)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Could not open transcode cache directory %s: %s\n", cache_dir, strerror(errno));
+
+      return;
+    }
+
+  files = NULL;
+  nfiles = 0;
+  maxfiles = 0;
+  total = 0;
+
+  while ((de = readdir(dir)))
+    {
+      /* Committed entries only */
+      len = strlen(de->d_name);
+      if ((len < 4) || (strcmp(de->d_name + len - 4, ".wav") != 0))
+	continue;
+
+      ret = snprintf(path, sizeof(path), "%s/%s", cache_dir, de->d_name);
+      if ((ret < 0) || (ret >= sizeof(path)))
+	continue;
+
+      ret = stat(path, &sb);
+      if (ret < 0)
+	continue;
+
+      if (nfiles == maxfiles)
+	{
+	  maxfiles = (maxfiles) ? 2 * maxfiles : 64;
+
+	  tmp = (struct cache_file *)realloc(files, maxfiles * sizeof(struct cache_file));
+	  if (!tmp)
+	    {
+	      DPRINTF(E_LOG, L_XCODE, "Out of memory for transcode cache listing\n");
+
+	      goto out;
+	    }
+
+	  files = tmp;
+	}
+
+      strcpy(files[nfiles].name, de->d_name);
+      files[nfiles].mtime = sb.st_mtime;
+      files[nfiles].size = sb.st_size;
+
+      total += sb.st_size;
+      nfiles++;
+    }
+
+  if (total <= cache_max_size)
+    goto out;
+
+  qsort(files, nfiles, sizeof(struct cache_file), cache_file_compare);
+
+  for (i = 0; (i < nfiles) && (total > cache_max_size); i++)
+    {
+      ret = snprintf(path, sizeof(path), "%s/%s", cache_dir, files[i].name);
+      if ((ret < 0) || (ret >= sizeof(path)))
+	continue;
+
+      DPRINTF(E_DBG, L_XCODE, "Evicting %s from the transcode cache\n", files[i].name);
+
+      ret = unlink(path);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_XCODE, "Could not remove %s: %s\n", path, strerror(errno));
+
+	  continue;
+	}
+
+      total -= files[i].size;
+    }
+
+ out:
+  closedir(dir);
+
+  if (files)
+    free(files);
+}
+
+static void
+add_le32(uint8_t *dst, uint32_t val)
+{
+  dst[0] = val & 0xff;
+  dst[1] = (val >> 8) & 0xff;
+  dst[2] = (val >> 16) & 0xff;
+  dst[3] = (val >> 24) & 0xff;
+}
+
+
+static void
+cache_writer_free(struct transcode_cache_writer *cw)
+{
+  if (cw->fd >= 0)
+    close(cw->fd);
+
+  if (cw->end)
+    free(cw->end);
+
+  free(cw);
+}
+
+/* Thread: transcode cache */
+static int
+cache_do_write(struct transcode_cache_writer *cw, uint8_t *data, size_t len)
+{
+  ssize_t ret;
+
+  while (len > 0)
+    {
+      ret = write(cw->fd, data, len);
+      if (ret < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+
+	  DPRINTF(E_LOG, L_XCODE, "Could not write to %s: %s\n", cw->tmp_path, strerror(errno));
+
+	  return -1;
+	}
+
+      data += ret;
+      len -= ret;
+      cw->len += ret;
+    }
+
+  return 0;
+}
+
+/* Thread: transcode cache */
+static void
+cache_do_abort(struct transcode_cache_writer *cw)
+{
+  if (cw->fd >= 0)
+    {
+      close(cw->fd);
+      cw->fd = -1;
+    }
+
+  unlink(cw->tmp_path);
+}
+
+/* Thread: transcode cache */
+/* The transcoding is complete; fix up the WAV header and publish the entry */
+static int
+cache_do_commit(struct transcode_cache_writer *cw)
+{
+  uint8_t le32[4];
+  uint32_t wav_len;
+  int ret;
+
+  if (cw->failed || (cw->len <= WAV_HEADER_SIZE))
+    {
+      cache_do_abort(cw);
+      return -1;
+    }
+
+  /* The header was written with an estimate of the length */
+  wav_len = cw->len - WAV_HEADER_SIZE;
+
+  add_le32(le32, 36 + wav_len);
+  ret = pwrite(cw->fd, le32, sizeof(le32), 4);
+  if (ret != sizeof(le32))
+    goto fail;
+
+  add_le32(le32, wav_len);
+  ret = pwrite(cw->fd, le32, sizeof(le32), 40);
+  if (ret != sizeof(le32))
+    goto fail;
+
+  ret = close(cw->fd);
+  cw->fd = -1;
+  if (ret < 0)
+    goto fail;
+
+  ret = rename(cw->tmp_path, cw->path);
+  if (ret < 0)
+    goto fail;
+
+  DPRINTF(E_DBG, L_XCODE, "Added %s to the transcode cache\n", cw->path);
+
+  return 0;
+
+ fail:
+  DPRINTF(E_LOG, L_XCODE, "Could not commit %s to the transcode cache: %s\n", cw->path, strerror(errno));
+
+  cache_do_abort(cw);
+
+  return -1;
+}
+
+/* Thread: transcode cache */
+static void *
+cache_writer(void *arg)
+{
+  struct cache_job *job;
+  struct transcode_cache_writer *cw;
+  int ret;
+
+  pthread_mutex_lock(&cache_lck);
+
+  for (;;)
+    {
+      while (!cache_jobs && !cache_exit)
+	pthread_cond_wait(&cache_cond, &cache_lck);
+
+      /* Pending jobs are run before exiting so no writer is leaked */
+      job = cache_jobs;
+      if (!job)
+	break;
+
+      cache_jobs = job->next;
+      if (!cache_jobs)
+	cache_jobs_tail = NULL;
+
+      cache_queued -= job->len;
+
+      pthread_mutex_unlock(&cache_lck);
+
+      cw = job->cw;
+
+      switch (job->type)
+	{
+	  case CACHE_JOB_WRITE:
+	    /* Only this thread sets failed */
+	    if (cw->failed)
+	      break;
+
+	    ret = cache_do_write(cw, job->data, job->len);
+	    if (ret < 0)
+	      {
+		pthread_mutex_lock(&cache_lck);
+
+		cw->failed = 1;
+
+		pthread_mutex_unlock(&cache_lck);
+	      }
+	    break;
+
+	  case CACHE_JOB_COMMIT:
+	    ret = cache_do_commit(cw);
+	    if (ret == 0)
+	      cache_trim();
+
+	    /* job is cw->end */
+	    job = NULL;
+	    cache_writer_free(cw);
+	    break;
+
+	  case CACHE_JOB_ABORT:
+	    cache_do_abort(cw);
+
+	    job = NULL;
+	    cache_writer_free(cw);
+	    break;
+
+	  case CACHE_JOB_TRIM:
+	    cache_trim();
+	    break;
+	}
+
+      if (job)
+	{
+	  if (job->data)
+	    free(job->data);
+	  free(job);
+	}
+
+      pthread_mutex_lock(&cache_lck);
+    }
+
+  pthread_mutex_unlock(&cache_lck);
+
+  pthread_exit(NULL);
+}
+
+/* Must be called with cache_lck held */
+static void
+cache_job_add(struct cache_job *job)
+{
+  job->next = NULL;
+
+  if (cache_jobs_tail)
+    cache_jobs_tail->next = job;
+  else
+    cache_jobs = job;
+
+  cache_jobs_tail = job;
+  cache_queued += job->len;
+
+  pthread_cond_signal(&cache_cond);
+}
+
+static void
+cache_writer_end(struct transcode_cache_writer *cw, enum cache_job_type type)
+{
+  struct cache_job *job;
+
+  job = cw->end;
+  job->type = type;
+  job->cw = cw;
+
+  pthread_mutex_lock(&cache_lck);
+
+  cache_job_add(job);
+
+  pthread_mutex_unlock(&cache_lck);
+}
+
+
+/* Returns a file descriptor on the cached transcoding of mfi, or -1 */
+int
+transcode_cache_open(struct media_file_info *mfi, off_t *size)
+{
+  struct stat sb;
+  char path[PATH_MAX];
+  int fd;
+  int ret;
+
+  if (!cache_dir)
+    return -1;
+
+  ret = cache_path(mfi, path, sizeof(path));
+  if (ret < 0)
+    return -1;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  ret = fstat(fd, &sb);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Could not stat() %s: %s\n", path, strerror(errno));
+
+      close(fd);
+      return -1;
+    }
+
+  /* Mark as recently used */
+  utimes(path, NULL);
+
+  DPRINTF(E_DBG, L_XCODE, "Transcode cache hit for file id %d\n", mfi->id);
+
+  *size = sb.st_size;
+
+  return fd;
+}
+
+/* Returns NULL if caching is disabled or someone's already caching mfi */
+struct transcode_cache_writer *
+transcode_cache_writer_new(struct media_file_info *mfi)
+{
+  struct transcode_cache_writer *cw;
+  int ret;
+
+  if (!cache_dir)
+    return NULL;
+
+  cw = (struct transcode_cache_writer *)malloc(sizeof(struct transcode_cache_writer));
+  if (!cw)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Out of memory for transcode cache writer\n");
+
+      return NULL;
+    }
+
+  memset(cw, 0, sizeof(struct transcode_cache_writer));
+
+  cw->fd = -1;
+
+  cw->end = (struct cache_job *)malloc(sizeof(struct cache_job));
+  if (!cw->end)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Out of memory for transcode cache job\n");
+
+      goto out_free;
+    }
+
+  memset(cw->end, 0, sizeof(struct cache_job));
+
+  ret = cache_path(mfi, cw->path, sizeof(cw->path));
+  if (ret < 0)
+    goto out_free;
+
+  ret = snprintf(cw->tmp_path, sizeof(cw->tmp_path), "%s.tmp", cw->path);
+  if ((ret < 0) || (ret >= sizeof(cw->tmp_path)))
+    goto out_free;
+
+  cw->fd = open(cw->tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (cw->fd < 0)
+    {
+      if (errno != EEXIST)
+	DPRINTF(E_LOG, L_XCODE, "Could not create %s: %s\n", cw->tmp_path, strerror(errno));
+
+      goto out_free;
+    }
+
+  return cw;
+
+ out_free:
+  cache_writer_free(cw);
+
+  return NULL;
+}
+
+/* Queues the contents of evbuf, which is left untouched, for writing;
+ * returns -1 if the entry can't be completed and should be aborted
+ */
+int
+transcode_cache_write(struct transcode_cache_writer *cw, struct evbuffer *evbuf)
+{
+  struct cache_job *job;
+  size_t len;
+  int failed;
+
+  len = EVBUFFER_LENGTH(evbuf);
+  if (len == 0)
+    return 0;
+
+  job = (struct cache_job *)malloc(sizeof(struct cache_job));
+  if (!job)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Out of memory for transcode cache job\n");
+
+      return -1;
+    }
+
+  memset(job, 0, sizeof(struct cache_job));
+
+  job->data = (uint8_t *)malloc(len);
+  if (!job->data)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Out of memory for transcode cache data\n");
+
+      free(job);
+      return -1;
+    }
+
+  memcpy(job->data, EVBUFFER_DATA(evbuf), len);
+
+  job->type = CACHE_JOB_WRITE;
+  job->cw = cw;
+  job->len = len;
+
+  pthread_mutex_lock(&cache_lck);
+
+  failed = cw->failed;
+  if (!failed && (cache_queued + len > CACHE_QUEUE_MAX))
+    {
+      DPRINTF(E_WARN, L_XCODE, "Transcode cache disk can't keep up, not caching %s\n", cw->path);
+
+      failed = 1;
+    }
+
+  if (!failed)
+    cache_job_add(job);
+
+  pthread_mutex_unlock(&cache_lck);
+
+  if (failed)
+    {
+      free(job->data);
+      free(job);
+
+      return -1;
+    }
+
+  return 0;
+}
+
+/* The transcoding is complete; cw is committed and freed by the writer thread */
+void
+transcode_cache_writer_commit(struct transcode_cache_writer *cw)
+{
+  cache_writer_end(cw, CACHE_JOB_COMMIT);
+}
+
+/* cw is removed and freed by the writer thread */
+void
+transcode_cache_writer_abort(struct transcode_cache_writer *cw)
+{
+  cache_writer_end(cw, CACHE_JOB_ABORT);
+}
+
+int
+transcode_cache_init(void)
+{
+  struct cache_job *job;
+  cfg_t *lib;
+  char *dir;
+  struct dirent *de;
+  DIR *d;
+  char path[PATH_MAX];
+  size_t len;
+  int ret;
+
+  lib = cfg_getsec(cfg, "library");
+
+  cache_dir = NULL;
+  cache_max_size = (off_t)cfg_getint(lib, "transcode_cache_size") * 1024 * 1024;
+
+  dir = cfg_getstr(lib, "transcode_cache_dir");
+  if (!dir || (cache_max_size <= 0))
+    {
+      DPRINTF(E_INFO, L_XCODE, "Transcode cache disabled\n");
+
+      return 0;
+    }
+
+  ret = mkdir(dir, 0755);
+  if ((ret < 0) && (errno != EEXIST))
+    {
+      DPRINTF(E_LOG, L_XCODE, "Could not create transcode cache directory %s: %s\n", dir, strerror(errno));
+
+      return -1;
+    }
+
+  cache_dir = strdup(dir);
+  if (!cache_dir)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Out of memory for transcode cache directory\n");
+
+      return -1;
+    }
+
+  /* Leftovers from transcodings interrupted by a shutdown */
+  d = opendir(cache_dir);
+  if (d)
+    {
+      while ((de = readdir(d)))
+	{
+	  len = strlen(de->d_name);
+	  if ((len < 4) || (strcmp(de->d_name + len - 4, ".tmp") != 0))
+	    continue;
+
+	  ret = snprintf(path, sizeof(path), "%s/%s", cache_dir, de->d_name);
+	  if ((ret < 0) || (ret >= sizeof(path)))
+	    continue;
+
+	  unlink(path);
+	}
+
+      closedir(d);
+    }
+
+  cache_jobs = NULL;
+  cache_jobs_tail = NULL;
+  cache_queued = 0;
+  cache_exit = 0;
+
+  ret = pthread_create(&tid_cache, NULL, cache_writer, NULL);
+  if (ret != 0)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Could not spawn transcode cache thread: %s\n", strerror(ret));
+
+      free(cache_dir);
+      cache_dir = NULL;
+      return -1;
+    }
+
+  /* Trim in the background, the cache may have shrunk since last time */
+  job = (struct cache_job *)malloc(sizeof(struct cache_job));
+  if (job)
+    {
+      memset(job, 0, sizeof(struct cache_job));
+
+      job->type = CACHE_JOB_TRIM;
+
+      pthread_mutex_lock(&cache_lck);
+
+      cache_job_add(job);
+
+      pthread_mutex_unlock(&cache_lck);
+    }
+
+  return 0;
+}
+
+/* Thread: main, once the httpd threads are stopped */
+void
+transcode_cache_deinit(void)
+{
+  int ret;
+
+  if (!cache_dir)
+    return;
+
+  pthread_mutex_lock(&cache_lck);
+
+  cache_exit = 1;
+  pthread_cond_signal(&cache_cond);
+
+  pthread_mutex_unlock(&cache_lck);
+
+  ret = pthread_join(tid_cache, NULL);
+  if (ret != 0)
+    DPRINTF(E_LOG, L_XCODE, "Could not join transcode cache thread: %s\n", strerror(ret));
+
+  free(cache_dir);
+  cache_dir = NULL;
+}
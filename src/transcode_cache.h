@@ -0,0 +1,33 @@
+
+#ifndef __TRANSCODE_CACHE_H__
+#define __TRANSCODE_CACHE_H__
+
+#include <sys/types.h>
+#include <event.h>
+
+#include "db.h"
+
+struct transcode_cache_writer;
+
+int
+transcode_cache_open(struct media_file_info *mfi, off_t *size);
+
+struct transcode_cache_writer *
+transcode_cache_writer_new(struct media_file_info *mfi);
+
+int
+transcode_cache_write(struct transcode_cache_writer *cw, struct evbuffer *evbuf);
+
+void
+transcode_cache_writer_commit(struct transcode_cache_writer *cw);
+
+void
+transcode_cache_writer_abort(struct transcode_cache_writer *cw);
+
+int
+transcode_cache_init(void);
+
+void
+transcode_cache_deinit(void);
+
+#endif /* !__TRANSCODE_CACHE_H__ */
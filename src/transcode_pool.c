@@ -0,0 +1,767 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Transcoding worker pool
+ *
+ * HTTP streams are transcoded by a pool of worker threads, one chunk per
+ * turn in round-robin order, into a sliding window of output per decoding
+ * session. The httpd threads only move data out of the windows; when a
+ * stream has caught up with its session, the worker writes the stream to
+ * the notification fd of the httpd thread once data is available again.
+ *
+ * Streams of the same item and output format share a session as long as
+ * they stay within its window, so a party playing the same album on several
+ * clients decodes it once. The session keeps TRANSCODE_READAHEAD ahead of
+ * its fastest stream; a stream left behind the window gets
+ * TRANSCODE_POOL_BEHIND and moves to a decoder of its own.
+ *
+ * The workers run at a lower priority so the httpd threads, which also
+ * serve DAAP and DACP, keep their latency under load.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <event.h>
+
+#include "logger.h"
+#include "db.h"
+#include "transcode.h"
+#include "transcode_pool.h"
+#include "bgworker.h"
+
+
+#define TRANSCODE_POOL_MAX_WORKERS 8
+/* Output produced per turn */
+#define TRANSCODE_POOL_CHUNK (64 * 1024)
+/* Output kept ahead of the fastest reader; the session is rescheduled
+ * once the lead drops to half of this
+ */
+#define TRANSCODE_READAHEAD (512 * 1024)
+/* Output kept behind; readers further back than this fall out of a
+ * shared session (about 24 seconds of WAV)
+ */
+#define TRANSCODE_WINDOW_SHARED (4 * 1024 * 1024)
+#define TRANSCODE_WINDOW_PRIVATE (1024 * 1024)
+/* Niceness of the workers, relative to the httpd threads */
+#define TRANSCODE_POOL_NICE 5
+
+struct transcode_stream;
+
+/* One decoder and its output window, read by one or more streams */
+struct transcode_session {
+  struct transcode_ctx *ctx;
+
+  /* Item and output format, id 0 if the session can't be joined */
+  int id;
+  int format;
+  off_t est_size;
+
+  /* Sliding window of output, start is the output offset of window[head] */
+  uint8_t *window;
+  size_t size;
+  size_t head;
+  size_t len;
+  off_t start;
+
+  /* transcode() output before it goes into the window; worker only */
+  struct evbuffer *pending;
+
+  struct transcode_stream *readers;
+
+  /* One per reader, one while scheduled */
+  int refs;
+
+  /* Queued or being worked on */
+  int scheduled;
+  /* Transcoding over: 1 at end of file, -1 on error */
+  int eof;
+
+  /* Work queue */
+  struct transcode_session *next;
+  /* Joinable sessions */
+  struct transcode_session *next_shared;
+};
+
+struct transcode_stream {
+  struct transcode_session *session;
+
+  /* Output offset of the next byte to read */
+  off_t offset;
+
+  /* Consumer */
+  int notify_fd;
+  void *arg;
+
+  /* One for the consumer, one per notification */
+  int refs;
+
+  /* Consumer found nothing to read */
+  int waiting;
+  /* Notification in flight */
+  int notified;
+  /* Consumer is gone */
+  int closed;
+  /* A notification could not be sent; reads fail so the consumer ends */
+  int failed;
+
+  /* Readers of the session */
+  struct transcode_stream *next;
+  /* Notifications to send by the worker, stable while notified is set */
+  struct transcode_stream *notify_next;
+};
+
+
+static pthread_t tid_pool[TRANSCODE_POOL_MAX_WORKERS];
+static int pool_nworkers;
+static pthread_mutex_t pool_lck = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct transcode_session *pool_queue;
+static struct transcode_session *pool_queue_tail;
+static struct transcode_session *pool_shared;
+static int pool_exit;
+
+
+static void
+session_free(struct transcode_session *s)
+{
+  transcode_cleanup(s->ctx);
+
+  evbuffer_free(s->pending);
+  free(s->window);
+  free(s);
+}
+
+/* Must be called with pool_lck held */
+static void
+session_unshare(struct transcode_session *s)
+{
+  struct transcode_session *p;
+
+  if (s->id == 0)
+    return;
+
+  if (s == pool_shared)
+    pool_shared = s->next_shared;
+  else
+    {
+      for (p = pool_shared; p && (p->next_shared != s); p = p->next_shared)
+	;
+
+      if (p)
+	p->next_shared = s->next_shared;
+    }
+
+  s->id = 0;
+}
+
+/* Must be called with pool_lck held */
+static void
+session_enqueue(struct transcode_session *s)
+{
+  s->next = NULL;
+
+  if (pool_queue_tail)
+    pool_queue_tail->next = s;
+  else
+    pool_queue = s;
+
+  pool_queue_tail = s;
+
+  pthread_cond_signal(&pool_cond);
+}
+
+/* Output still to be read by the fastest reader.
+ * Must be called with pool_lck held
+ */
+static off_t
+session_lead(struct transcode_session *s)
+{
+  struct transcode_stream *r;
+  off_t offset;
+
+  offset = s->start;
+  for (r = s->readers; r; r = r->next)
+    {
+      if (r->offset > offset)
+	offset = r->offset;
+    }
+
+  return s->start + s->len - offset;
+}
+
+/* Must be called with pool_lck held */
+static void
+session_schedule(struct transcode_session *s)
+{
+  if (s->scheduled || s->eof || !s->readers)
+    return;
+
+  if (session_lead(s) > TRANSCODE_READAHEAD / 2)
+    return;
+
+  s->scheduled = 1;
+  s->refs++;
+
+  session_enqueue(s);
+}
+
+/* Appends evbuf to the window, sliding it forward if needed.
+ * Must be called with pool_lck held
+ */
+static void
+window_put(struct transcode_session *s, struct evbuffer *evbuf)
+{
+  uint8_t *data;
+  size_t tail;
+  size_t len;
+  size_t drop;
+  size_t n;
+
+  data = EVBUFFER_DATA(evbuf);
+  len = EVBUFFER_LENGTH(evbuf);
+
+  /* More than the window can hold, keep the end */
+  if (len > s->size)
+    {
+      drop = len - s->size;
+
+      s->head = 0;
+      s->start += s->len + drop;
+      s->len = 0;
+
+      data += drop;
+      len = s->size;
+    }
+  else if (len > s->size - s->len)
+    {
+      drop = len - (s->size - s->len);
+
+      s->head = (s->head + drop) % s->size;
+      s->start += drop;
+      s->len -= drop;
+    }
+
+  tail = (s->head + s->len) % s->size;
+
+  n = s->size - tail;
+  if (n > len)
+    n = len;
+
+  memcpy(s->window + tail, data, n);
+  if (n < len)
+    memcpy(s->window, data + n, len - n);
+
+  s->len += len;
+
+  evbuffer_drain(evbuf, EVBUFFER_LENGTH(evbuf));
+}
+
+/* Must be called with pool_lck held */
+static int
+window_get(struct transcode_session *s, off_t offset, struct evbuffer *evbuf, size_t max)
+{
+  size_t pos;
+  size_t len;
+  size_t n;
+  int ret;
+
+  len = s->start + s->len - offset;
+  if (len > max)
+    len = max;
+
+  pos = (s->head + (offset - s->start)) % s->size;
+
+  n = s->size - pos;
+  if (n > len)
+    n = len;
+
+  ret = evbuffer_add(evbuf, s->window + pos, n);
+  if ((ret == 0) && (n < len))
+    ret = evbuffer_add(evbuf, s->window, len - n);
+
+  if (ret != 0)
+    return -1;
+
+  return len;
+}
+
+
+/* Thread: transcode worker */
+static void
+worker_turn(struct transcode_session *s)
+{
+  struct transcode_stream *notify;
+  struct transcode_stream *r;
+  int readers;
+  int free_it;
+  int ret;
+
+  pthread_mutex_lock(&pool_lck);
+  readers = (s->readers != NULL);
+  pthread_mutex_unlock(&pool_lck);
+
+  ret = 1;
+  if (readers)
+    ret = transcode(s->ctx, s->pending, TRANSCODE_POOL_CHUNK);
+
+  pthread_mutex_lock(&pool_lck);
+
+  if (ret <= 0)
+    s->eof = (ret == 0) ? 1 : -1;
+
+  window_put(s, s->pending);
+
+  /* Readers waiting for what we just produced, or for the end */
+  notify = NULL;
+  for (r = s->readers; r; r = r->next)
+    {
+      if (r->waiting && !r->notified && (s->eof || (r->offset < s->start + s->len)))
+	{
+	  r->waiting = 0;
+	  r->notified = 1;
+	  r->refs++;
+
+	  r->notify_next = notify;
+	  notify = r;
+	}
+    }
+
+  if (s->readers && !s->eof && (session_lead(s) < TRANSCODE_READAHEAD))
+    session_enqueue(s);
+  else
+    {
+      /* Rescheduled by transcode_pool_read() as the readers catch up */
+      s->scheduled = 0;
+      s->refs--;
+    }
+
+  /* Readers hold a reference, so none can be waiting if this is the last */
+  free_it = (s->refs == 0);
+
+  pthread_mutex_unlock(&pool_lck);
+
+  if (free_it)
+    session_free(s);
+
+  /* The notification references keep the readers around */
+  while (notify)
+    {
+      r = notify;
+      notify = r->notify_next;
+
+      ret = write(r->notify_fd, &r, sizeof(r));
+      if (ret != sizeof(r))
+	{
+	  DPRINTF(E_LOG, L_XCODE, "Could not write to transcode notification fd, failing the stream: %s\n", strerror(errno));
+
+	  /* Never woken again otherwise; the next read ends the stream */
+	  pthread_mutex_lock(&pool_lck);
+	  r->failed = 1;
+	  pthread_mutex_unlock(&pool_lck);
+
+	  transcode_pool_notified(r);
+	}
+    }
+}
+
+/* Thread: transcode worker */
+static void *
+transcode_worker(void *arg)
+{
+  struct transcode_session *s;
+
+  bgworker_lower_priority(L_XCODE, TRANSCODE_POOL_NICE, "transcode worker");
+
+  for (;;)
+    {
+      pthread_mutex_lock(&pool_lck);
+
+      while (!pool_queue && !pool_exit)
+	pthread_cond_wait(&pool_cond, &pool_lck);
+
+      if (pool_exit)
+	{
+	  pthread_mutex_unlock(&pool_lck);
+	  break;
+	}
+
+      s = pool_queue;
+      pool_queue = s->next;
+      if (!pool_queue)
+	pool_queue_tail = NULL;
+
+      pthread_mutex_unlock(&pool_lck);
+
+      worker_turn(s);
+    }
+
+  pthread_exit(NULL);
+}
+
+
+/* Must be called with pool_lck held */
+static struct transcode_stream *
+reader_add(struct transcode_session *s, off_t offset, int notify_fd, void *arg)
+{
+  struct transcode_stream *r;
+
+  r = (struct transcode_stream *)malloc(sizeof(struct transcode_stream));
+  if (!r)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Out of memory for transcode stream\n");
+
+      return NULL;
+    }
+
+  memset(r, 0, sizeof(struct transcode_stream));
+
+  r->session = s;
+  r->offset = offset;
+  r->notify_fd = notify_fd;
+  r->arg = arg;
+  r->refs = 1;
+
+  r->next = s->readers;
+  s->readers = r;
+  s->refs++;
+
+  session_schedule(s);
+
+  return r;
+}
+
+/* Hands ctx, positioned at output offset, over to the pool; the workers
+ * start filling the window right away. Other streams of the same item
+ * and format can join the session if id is not 0.
+ * Returns NULL if there are no workers, in which case the caller keeps ctx.
+ */
+/* Thread: httpd */
+struct transcode_stream *
+transcode_pool_start(struct transcode_ctx *ctx, int id, int format, off_t offset, off_t est_size, int notify_fd, void *arg)
+{
+  struct transcode_session *s;
+  struct transcode_stream *r;
+
+  if (pool_nworkers == 0)
+    return NULL;
+
+  s = (struct transcode_session *)malloc(sizeof(struct transcode_session));
+  if (!s)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Out of memory for transcode session\n");
+
+      return NULL;
+    }
+
+  memset(s, 0, sizeof(struct transcode_session));
+
+  s->size = (id) ? TRANSCODE_WINDOW_SHARED : TRANSCODE_WINDOW_PRIVATE;
+  s->window = (uint8_t *)malloc(s->size);
+  s->pending = evbuffer_new();
+  if (!s->window || !s->pending)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Out of memory for transcode window\n");
+
+      goto out_fail;
+    }
+
+  s->ctx = ctx;
+  s->id = id;
+  s->format = format;
+  s->est_size = est_size;
+  s->start = offset;
+
+  pthread_mutex_lock(&pool_lck);
+
+  r = reader_add(s, offset, notify_fd, arg);
+  if (!r)
+    {
+      pthread_mutex_unlock(&pool_lck);
+
+      goto out_fail;
+    }
+
+  if (s->id)
+    {
+      s->next_shared = pool_shared;
+      pool_shared = s;
+    }
+
+  pthread_mutex_unlock(&pool_lck);
+
+  return r;
+
+ out_fail:
+  if (s->window)
+    free(s->window);
+  if (s->pending)
+    evbuffer_free(s->pending);
+  free(s);
+
+  return NULL;
+}
+
+/* Joins a session of the same item and format whose window holds the
+ * given output offset, sharing its decoder. Returns NULL if there is none.
+ */
+/* Thread: httpd */
+struct transcode_stream *
+transcode_pool_join(int id, int format, off_t offset, off_t *est_size, int notify_fd, void *arg)
+{
+  struct transcode_session *s;
+  struct transcode_stream *r;
+
+  r = NULL;
+
+  pthread_mutex_lock(&pool_lck);
+
+  for (s = pool_shared; s; s = s->next_shared)
+    {
+      if ((s->id != id) || (s->format != format) || (s->eof < 0))
+	continue;
+
+      if ((offset < s->start) || (offset > s->start + s->len))
+	continue;
+
+      r = reader_add(s, offset, notify_fd, arg);
+      if (r)
+	{
+	  *est_size = s->est_size;
+
+	  DPRINTF(E_DBG, L_XCODE, "Joined transcode session of item %d at offset %" PRIi64 "\n", id, (int64_t)offset);
+	}
+
+      break;
+    }
+
+  pthread_mutex_unlock(&pool_lck);
+
+  return r;
+}
+
+/* Moves up to max bytes to evbuf. Returns the number of bytes moved, 0 at
+ * the end of the stream, -1 on error, TRANSCODE_POOL_AGAIN if there is
+ * nothing to read yet, in which case the stream will be written to the
+ * notification fd, and TRANSCODE_POOL_BEHIND if the stream fell behind
+ * the window of its session.
+ */
+/* Thread: httpd */
+int
+transcode_pool_read(struct transcode_stream *r, struct evbuffer *evbuf, size_t max)
+{
+  struct transcode_session *s;
+  int ret;
+
+  pthread_mutex_lock(&pool_lck);
+
+  s = r->session;
+
+  if (r->failed)
+    ret = -1;
+  else if (r->offset < s->start)
+    ret = TRANSCODE_POOL_BEHIND;
+  else if (r->offset >= s->start + s->len)
+    {
+      if (s->eof && !s->scheduled)
+	ret = (s->eof > 0) ? 0 : -1;
+      else
+	{
+	  r->waiting = 1;
+	  session_schedule(s);
+
+	  ret = TRANSCODE_POOL_AGAIN;
+	}
+    }
+  else
+    {
+      ret = window_get(s, r->offset, evbuf, max);
+      if (ret < 0)
+	DPRINTF(E_LOG, L_XCODE, "Could not copy transcoded data to buffer\n");
+      else
+	r->offset += ret;
+
+      session_schedule(s);
+    }
+
+  pthread_mutex_unlock(&pool_lck);
+
+  return ret;
+}
+
+/* Called for every stream read from the notification fd. Returns the
+ * arg given when starting or joining, or NULL if the stream was stopped.
+ */
+/* Thread: httpd */
+void *
+transcode_pool_notified(struct transcode_stream *r)
+{
+  void *arg;
+  int refs;
+
+  pthread_mutex_lock(&pool_lck);
+
+  r->notified = 0;
+
+  r->refs--;
+  refs = r->refs;
+  arg = (r->closed) ? NULL : r->arg;
+
+  pthread_mutex_unlock(&pool_lck);
+
+  if (refs == 0)
+    free(r);
+
+  return arg;
+}
+
+/* Thread: httpd */
+void
+transcode_pool_stop(struct transcode_stream *r)
+{
+  struct transcode_session *s;
+  struct transcode_stream *p;
+  int free_session;
+  int refs;
+
+  pthread_mutex_lock(&pool_lck);
+
+  s = r->session;
+
+  if (r == s->readers)
+    s->readers = r->next;
+  else
+    {
+      for (p = s->readers; p && (p->next != r); p = p->next)
+	;
+
+      if (p)
+	p->next = r->next;
+    }
+
+  /* Last reader gone, stop decoding */
+  if (!s->readers)
+    session_unshare(s);
+
+  s->refs--;
+  free_session = (s->refs == 0);
+
+  r->session = NULL;
+  r->closed = 1;
+  r->waiting = 0;
+
+  r->refs--;
+  refs = r->refs;
+
+  pthread_mutex_unlock(&pool_lck);
+
+  if (refs == 0)
+    free(r);
+
+  if (free_session)
+    session_free(s);
+}
+
+
+/* Thread: main */
+int
+transcode_pool_init(void)
+{
+  long ncpu;
+  int i;
+  int ret;
+
+  pool_queue = NULL;
+  pool_queue_tail = NULL;
+  pool_shared = NULL;
+  pool_exit = 0;
+
+  ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpu < 1)
+    ncpu = 1;
+
+  pool_nworkers = (ncpu > TRANSCODE_POOL_MAX_WORKERS) ? TRANSCODE_POOL_MAX_WORKERS : ncpu;
+
+  for (i = 0; i < pool_nworkers; i++)
+    {
+      ret = pthread_create(&tid_pool[i], NULL, transcode_worker, NULL);
+      if (ret != 0)
+	{
+	  DPRINTF(E_LOG, L_XCODE, "Could not spawn transcode worker thread: %s\n", strerror(ret));
+
+	  break;
+	}
+    }
+
+  pool_nworkers = i;
+  if (pool_nworkers == 0)
+    return -1;
+
+  DPRINTF(E_DBG, L_XCODE, "Started %d transcode worker threads\n", pool_nworkers);
+
+  return 0;
+}
+
+/* Thread: main, once the httpd threads are stopped */
+void
+transcode_pool_deinit(void)
+{
+  struct transcode_session *s;
+  int i;
+  int ret;
+
+  pthread_mutex_lock(&pool_lck);
+
+  pool_exit = 1;
+  pthread_cond_broadcast(&pool_cond);
+
+  pthread_mutex_unlock(&pool_lck);
+
+  for (i = 0; i < pool_nworkers; i++)
+    {
+      ret = pthread_join(tid_pool[i], NULL);
+      if (ret != 0)
+	DPRINTF(E_LOG, L_XCODE, "Could not join transcode worker thread: %s\n", strerror(ret));
+    }
+
+  pool_nworkers = 0;
+
+  /* Drop the references of the sessions still queued */
+  while (pool_queue)
+    {
+      s = pool_queue;
+      pool_queue = s->next;
+
+      s->scheduled = 0;
+      s->refs--;
+      if (s->refs == 0)
+	session_free(s);
+    }
+
+  pool_queue_tail = NULL;
+}
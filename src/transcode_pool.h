@@ -0,0 +1,36 @@
+
+#ifndef __TRANSCODE_POOL_H__
+#define __TRANSCODE_POOL_H__
+
+#include <event.h>
+
+/* Nothing available yet, the notification fd will be written to */
+#define TRANSCODE_POOL_AGAIN  -2
+/* Fell out of the window of a shared session */
+#define TRANSCODE_POOL_BEHIND -3
+
+struct transcode_ctx;
+struct transcode_stream;
+
+struct transcode_stream *
+transcode_pool_start(struct transcode_ctx *ctx, int id, int format, off_t offset, off_t est_size, int notify_fd, void *arg);
+
+struct transcode_stream *
+transcode_pool_join(int id, int format, off_t offset, off_t *est_size, int notify_fd, void *arg);
+
+int
+transcode_pool_read(struct transcode_stream *r, struct evbuffer *evbuf, size_t max);
+
+void *
+transcode_pool_notified(struct transcode_stream *r);
+
+void
+transcode_pool_stop(struct transcode_stream *r);
+
+int
+transcode_pool_init(void);
+
+void
+transcode_pool_deinit(void);
+
+#endif /* !__TRANSCODE_POOL_H__ */